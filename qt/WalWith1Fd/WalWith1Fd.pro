@@ -18,11 +18,19 @@ SOURCES += \
     ../../src/test.cpp \
     ../../src/procvfs.cpp \
     ../../src/sqlite3.c \
-    ../../src/ProxyVfs.cpp
+    ../../src/ProxyVfs.cpp \
+    ../../src/vfs.c \
+    ../../src/vfspool.c \
+    ../../src/vfsprefetch.c \
+    ../../src/vfsstat.c
 
 HEADERS += \
     ../../src/sqlite3.h \
     ../../src/procvfs.h \
-    ../../src/ProxyVfs.h
+    ../../src/ProxyVfs.h \
+    ../../src/vfs.h \
+    ../../src/vfspool.h \
+    ../../src/vfsprefetch.h \
+    ../../src/vfsstat.h
 
-LIBS += -lgtest_main -lgtest -lgmock -ldl
+LIBS += -lgtest_main -lgtest -lgmock -ldl -lrt
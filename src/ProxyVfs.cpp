@@ -1,7 +1,9 @@
 #include "ProxyVfs.h"
+#include "vfsstat.h"
 
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 #include <functional>
 
 using namespace std::placeholders;
@@ -13,14 +15,17 @@ struct ProxyFile
   const struct sqlite3_io_methods* pMethods;
   const char* filename;
   sqlite3_file* underlyingFile;
+  VfsStat* stat;
 };
 
 sqlite3_file* underlyingFile(sqlite3_file* file) { return reinterpret_cast<ProxyFile*>(file)->underlyingFile; }
+VfsStat* fileStat(sqlite3_file* file) { return reinterpret_cast<ProxyFile*>(file)->stat; }
 }
 
-ProxyVfs::ProxyVfs() : iUnderlyingVfs(), iVfs(), iIoMethods()
+ProxyVfs::ProxyVfs() : iUnderlyingVfs(), iVfs(), iIoMethods(), iFilePool()
 {
   iUnderlyingVfs = sqlite3_vfs_find(nullptr);
+  vfspool_init(&iFilePool, "proxyvfs", iUnderlyingVfs->szOsFile);
 
   iVfs.iVersion = 3;
   assert(iUnderlyingVfs->iVersion == iVfs.iVersion);
@@ -34,9 +39,26 @@ ProxyVfs::ProxyVfs() : iUnderlyingVfs(), iVfs(), iIoMethods()
     printf("ProxyVfs.xOpen\n");
     f->pMethods = &reinterpret_cast<ProxyVfs*>(vfs->pAppData)->iIoMethods;
     f->filename = zName;
-    f->underlyingFile = (sqlite3_file*)calloc(1, vfs->pNext->szOsFile);
+    f->stat = nullptr;
+    f->underlyingFile =
+        (sqlite3_file*)vfspool_alloc(&reinterpret_cast<ProxyVfs*>(vfs->pAppData)->iFilePool, vfs->pNext->szOsFile);
+    if (f->underlyingFile == nullptr)
+    {
+      f->pMethods = nullptr;
+      return SQLITE_NOMEM;
+    }
+    memset(f->underlyingFile, 0, vfs->pNext->szOsFile);
     int ret = vfs->pNext->xOpen(vfs->pNext, zName, f->underlyingFile, flags, pOutFlags);
+    if (ret != SQLITE_OK)
+    {
+      /* SQLite does not close a file that failed to open */
+      vfspool_free(f->underlyingFile);
+      f->underlyingFile = nullptr;
+      f->pMethods = nullptr;
+      return ret;
+    }
     assert(f->underlyingFile->pMethods->iVersion == f->pMethods->iVersion);
+    f->stat = vfsstat_open(vfs->zName, zName, flags);
     return ret;
   };
 
@@ -93,16 +115,22 @@ ProxyVfs::ProxyVfs() : iUnderlyingVfs(), iVfs(), iIoMethods()
     {
       ret = uf->pMethods->xClose(uf);
     }
-    free(f->underlyingFile);
+    vfspool_free(f->underlyingFile);
     f->underlyingFile = nullptr;
+    vfsstat_close(f->stat);
+    f->stat = nullptr;
     return ret;
   };
   iIoMethods.xRead = [](sqlite3_file* file, void* p, int iAmt, sqlite3_int64 iOfst) {
     auto uf = underlyingFile(file);
+    vfsstatAdd(fileStat(file), VFSSTAT_READ, 1);
+    vfsstatAdd(fileStat(file), VFSSTAT_READ_BYTES, iAmt);
     return uf->pMethods->xRead(uf, p, iAmt, iOfst);
   };
   iIoMethods.xWrite = [](sqlite3_file* file, const void* p, int iAmt, sqlite3_int64 iOfst) {
     auto uf = underlyingFile(file);
+    vfsstatAdd(fileStat(file), VFSSTAT_WRITE, 1);
+    vfsstatAdd(fileStat(file), VFSSTAT_WRITE_BYTES, iAmt);
     return uf->pMethods->xWrite(uf, p, iAmt, iOfst);
   };
   iIoMethods.xTruncate = [](sqlite3_file* file, sqlite3_int64 size) {
@@ -111,6 +139,7 @@ ProxyVfs::ProxyVfs() : iUnderlyingVfs(), iVfs(), iIoMethods()
   };
   iIoMethods.xSync = [](sqlite3_file* file, int flags) {
     auto uf = underlyingFile(file);
+    vfsstatAdd(fileStat(file), VFSSTAT_SYNC, 1);
     return uf->pMethods->xSync(uf, flags);
   };
   iIoMethods.xFileSize = [](sqlite3_file* file, sqlite3_int64* pSize) {
@@ -119,7 +148,9 @@ ProxyVfs::ProxyVfs() : iUnderlyingVfs(), iVfs(), iIoMethods()
   };
   iIoMethods.xLock = [](sqlite3_file* file, int lock) {
     auto uf = underlyingFile(file);
-    return uf->pMethods->xLock(uf, lock);
+    int ret = uf->pMethods->xLock(uf, lock);
+    vfsstatAdd(fileStat(file), ret == SQLITE_OK ? VFSSTAT_LOCK : VFSSTAT_LOCK_FAIL, 1);
+    return ret;
   };
   iIoMethods.xUnlock = [](sqlite3_file* file, int lock) {
     auto uf = underlyingFile(file);
@@ -146,11 +177,17 @@ ProxyVfs::ProxyVfs() : iUnderlyingVfs(), iVfs(), iIoMethods()
   /* Methods above are valid for version 1 */
   iIoMethods.xShmMap = [](sqlite3_file* file, int iPg, int pgsz, int bExtend, void volatile** pp) {
     auto uf = underlyingFile(file);
+    vfsstatAdd(fileStat(file), VFSSTAT_SHM_MAP, 1);
     return uf->pMethods->xShmMap(uf, iPg, pgsz, bExtend, pp);
   };
   iIoMethods.xShmLock = [](sqlite3_file* file, int offset, int n, int flags) {
     auto uf = underlyingFile(file);
-    return uf->pMethods->xShmLock(uf, offset, n, flags);
+    int ret = uf->pMethods->xShmLock(uf, offset, n, flags);
+    if (flags & SQLITE_SHM_LOCK)
+    {
+      vfsstatAdd(fileStat(file), ret == SQLITE_OK ? VFSSTAT_LOCK : VFSSTAT_LOCK_FAIL, 1);
+    }
+    return ret;
   };
   iIoMethods.xShmBarrier = [](sqlite3_file* file) {
     auto uf = underlyingFile(file);
@@ -163,7 +200,12 @@ ProxyVfs::ProxyVfs() : iUnderlyingVfs(), iVfs(), iIoMethods()
   /* Methods above are valid for version 2 */
   iIoMethods.xFetch = [](sqlite3_file* file, sqlite3_int64 iOfst, int iAmt, void** pp) {
     auto uf = underlyingFile(file);
-    return uf->pMethods->xFetch(uf, iOfst, iAmt, pp);
+    int ret = uf->pMethods->xFetch(uf, iOfst, iAmt, pp);
+    if (*pp)
+    {
+      vfsstatAdd(fileStat(file), VFSSTAT_MMAP_HIT, 1);
+    }
+    return ret;
   };
   iIoMethods.xUnfetch = [](sqlite3_file* file, sqlite3_int64 iOfst, void* p) {
     auto uf = underlyingFile(file);
@@ -175,4 +217,11 @@ ProxyVfs::ProxyVfs() : iUnderlyingVfs(), iVfs(), iIoMethods()
   sqlite3_vfs_register(&iVfs, 1);
 }
 
-ProxyVfs::~ProxyVfs() { sqlite3_vfs_unregister(&iVfs); }
+ProxyVfs::~ProxyVfs()
+{
+  sqlite3_vfs_unregister(&iVfs);
+  if (vfspool_destroy(&iFilePool) != SQLITE_OK)
+  {
+    sqlite3_log(SQLITE_MISUSE, "proxyvfs destroyed with files still open");
+  }
+}
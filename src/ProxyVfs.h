@@ -2,6 +2,7 @@
 #define PROXYVFS_H
 
 #include "sqlite3.h"
+#include "vfspool.h"
 
 class ProxyVfs
 {
@@ -13,6 +14,7 @@ class ProxyVfs
   sqlite3_vfs* iUnderlyingVfs;
   sqlite3_vfs iVfs;
   sqlite3_io_methods iIoMethods;
+  VfsPool iFilePool; /* Underlying sqlite3_file objects */
 };
 
 #endif  // PROXYVFS_H
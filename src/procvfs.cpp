@@ -1,14 +1,39 @@
 #include "sqlite3.h"
+#include "vfspool.h"
+#include "vfsprefetch.h"
+#include "vfsstat.h"
 
+/* As in sqliteInt.h, a build without SQLITE_DEBUG has no assert()s */
+#if defined(PROCVFS_RELEASE) && !defined(PROCVFS_NDEBUG)
+#define PROCVFS_NDEBUG 1
+#endif
+#if defined(PROCVFS_NDEBUG) && !defined(NDEBUG)
+#define NDEBUG 1
+#endif
 #include <assert.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
 
 // Config
+/*
+** PROCVFS_RELEASE builds the VFS for production.  The debug-only checks
+** and trace output are compiled out, and the system calls are bound at
+** compile time: aSyscall[] becomes a constant table, so every osXXX()
+** call resolves to a direct call and xSetSystemCall() cannot change it.
+** Tests that interpose on system calls need the default build.
+**
+** PROCVFS_NDEBUG, which PROCVFS_RELEASE implies, compiles out only the
+** debug-only checks and trace output.  The system calls stay replaceable.
+*/
 #define SQLITE_OMIT_WSD
+#ifndef PROCVFS_NDEBUG
 #define SQLITE_DEBUG
+#endif
 #ifndef SQLITE_POWERSAFE_OVERWRITE
 #define SQLITE_POWERSAFE_OVERWRITE 1
 #endif
@@ -20,13 +45,27 @@
 #define ALWAYS(X) (X)
 #define NEVER(X) (X)
 #define ArraySize(X) ((int)(sizeof(X) / sizeof(X[0])))
+#ifndef PROCVFS_NDEBUG
 #define SQLITE_HAVE_OS_TRACE
 #define OSTRACE(X) printf X
+#else
+#define OSTRACE(X)
+#endif
+#ifndef PROCVFS_RELEASE
+#define PROCVFS_SYSCALL_CONST
+#else
+#define PROCVFS_SYSCALL_CONST const
+#endif
 #ifndef SQLITE_DEFAULT_SECTOR_SIZE
 #define SQLITE_DEFAULT_SECTOR_SIZE 4096
 #endif
 #define SQLITE_FCNTL_DB_UNCHANGED 0xca093fa0
+/* 64-bit builds map large files in windows.  See unixRemapWindows(). */
+#if defined(__LP64__)
+#define SQLITE_MAX_MMAP_SIZE 0x10000000000 /* 1TiB */
+#else
 #define SQLITE_MAX_MMAP_SIZE 0x7fff0000 /* 2147418112 */
+#endif
 #define UNUSED_PARAMETER(x) (void)(x)
 #define UNUSED_PARAMETER2(x, y) UNUSED_PARAMETER(x), UNUSED_PARAMETER(y)
 
@@ -136,6 +175,7 @@ void mutex_leave(std::mutex *mutex) { mutex->unlock(); }
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -144,6 +184,108 @@ void mutex_leave(std::mutex *mutex) { mutex->unlock(); }
 #if !defined(SQLITE_OMIT_WAL) || SQLITE_MAX_MMAP_SIZE > 0
 #include <sys/mman.h>
 #endif
+#if defined(__linux__)
+#include <linux/fs.h> /* FICLONE */
+#endif
+
+/*
+** copy_file_range() first appeared in glibc 2.27.
+*/
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE 1
+#else
+#define HAVE_COPY_FILE_RANGE 0
+#endif
+
+/*
+** So did memfd_create().  A memfd can hold the wal-index in place of the
+** -shm file.  See unixShmMemfdCreate().
+*/
+#if HAVE_COPY_FILE_RANGE && defined(MFD_CLOEXEC)
+#define HAVE_MEMFD_CREATE 1
+#else
+#define HAVE_MEMFD_CREATE 0
+#endif
+
+/*
+** sync_file_range() and syncfs() are Linux only.  They back the "range"
+** and "syncfs" sync strategies.  See unixSyncFd().
+*/
+#if defined(__linux__) && defined(SYNC_FILE_RANGE_WRITE)
+#define HAVE_SYNC_FILE_RANGE 1
+#else
+#define HAVE_SYNC_FILE_RANGE 0
+#endif
+
+/*
+** Linux fallocate() can reserve space past the end of a file without
+** changing its size.  See unixPreallocate().
+*/
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE) && defined(FALLOC_FL_PUNCH_HOLE)
+#define HAVE_LINUX_FALLOCATE 1
+#else
+#define HAVE_LINUX_FALLOCATE 0
+#endif
+
+/*
+** pwritev() writes the writes queued by "write_combine" in one call.  See
+** unixCombineFlush().
+*/
+#if defined(__linux__)
+#include <sys/uio.h>
+#define HAVE_PWRITEV 1
+#else
+#define HAVE_PWRITEV 0
+#endif
+
+/*
+** io_uring is used by the "proc-uring" VFS when the kernel headers
+** describe it.  There is no libc wrapper, so the system calls are made
+** directly.
+*/
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+#if defined(IORING_OFF_SQ_RING) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+/*
+** Lock waits with a deadline sleep on a futex for "shm_lock=atomic"
+** wal-index locks, and in F_OFD_SETLKW, cut short by a timer signal, for
+** the database locks of "proc-ofd".
+*/
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#endif
+#if defined(FUTEX_WAIT) && defined(SYS_futex)
+#define HAVE_FUTEX 1
+#else
+#define HAVE_FUTEX 0
+#endif
+
+/*
+** Write-lifetime hints and I/O priorities back "io_hints".  See
+** unixWriteHint() and unixCkptIoprio().
+*/
+#if defined(__linux__) && defined(F_SET_RW_HINT)
+#define HAVE_RW_HINT 1
+#else
+#define HAVE_RW_HINT 0
+#endif
+#if defined(__linux__) && defined(SYS_ioprio_get) && defined(SYS_ioprio_set)
+#define HAVE_IOPRIO 1
+#else
+#define HAVE_IOPRIO 0
+#endif
 
 #define HAVE_GETHOSTUUID 1
 
@@ -201,6 +343,12 @@ void mutex_leave(std::mutex *mutex) { mutex->unlock(); }
 typedef struct unixShm unixShm;             /* Connection shared memory */
 typedef struct unixShmNode unixShmNode;     /* Shared memory instance */
 typedef struct unixInodeInfo unixInodeInfo; /* An i-node */
+typedef struct unixInodeBucket unixInodeBucket; /* Hash bucket of i-nodes */
+typedef struct unixShipLog unixShipLog;     /* Committed WAL frame log */
+typedef struct unixUring unixUring;         /* io_uring for one -wal file */
+typedef struct unixDirectWal unixDirectWal; /* -wal file opened O_DIRECT */
+typedef struct unixCombine unixCombine;     /* Writes combined for pwritev() */
+typedef struct unixCkpt unixCkpt;           /* Background checkpoints of a database */
 typedef struct UnixUnusedFd UnixUnusedFd;   /* An unused file descriptor */
 
 /*
@@ -216,6 +364,18 @@ struct UnixUnusedFd
   UnixUnusedFd *pNext; /* Next unused file descriptor on same file */
 };
 
+/*
+** A byte range of a file written since its last xSync() and not yet
+** handed to sync_file_range().  See unixDirtyAdd().
+*/
+#define UNIX_DIRTY_NRANGE 8 /* Ranges kept per unixFile */
+typedef struct unixDirtyRange unixDirtyRange;
+struct unixDirtyRange
+{
+  i64 iOfst; /* First byte */
+  i64 nByte; /* Number of bytes */
+};
+
 /*
 ** The unixFile structure is subclass of sqlite3_file specific to the unix
 ** VFS implementations.
@@ -229,24 +389,47 @@ struct unixFile
   int h;                             /* The file descriptor */
   unsigned char eFileLock;           /* The type of lock held on this fd */
   unsigned short int ctrlFlags;      /* Behavioral bits.  UNIXFILE_* flags */
+  unsigned char eSync;               /* UNIX_SYNC_* strategy used by xSync() */
   int lastErrno;                     /* The unix errno from last I/O error */
   void *lockingContext;              /* Locking style specific state */
   UnixUnusedFd *pPreallocatedUnused; /* Pre-allocated UnixUnusedFd */
   const char *zPath;                 /* Name of the file */
+  char *zRedirectPath;               /* zPath if allocated by this VFS */
+  unixShipLog *pShip;                /* -wal file only: where to ship frames */
+  unixUring *pUring;                 /* -wal file only: ring queuing writes */
+  unixDirectWal *pDirectWal;         /* -wal file only: split O_DIRECT layout */
+  unixCombine *pCombine;             /* -wal file only: writes being combined */
+  int szCombine;                     /* -wal file only: "write_combine" size */
+  unixCkpt *pCkpt;                   /* -wal file only: background checkpoints */
   unixShm *pShm;                     /* Shared memory segment information */
+  VfsStat *pStat;                    /* Counters reported by vfs_stat */
   int szChunk;                       /* Configured by FCNTL_CHUNK_SIZE */
+  sqlite3_int64 mxPrealloc;          /* Most space to reserve past EOF, or 0 */
+  i64 *piPreallocEnd;                /* End of the space reserved so far, on the database's unixInodeInfo */
+  int iCkptIoprio;                   /* I/O priority to restore after a checkpoint */
+  int bCkptWait;                     /* Wait for a checkpoint at end of transaction */
+  i64 nDirty;                        /* Bytes written since the last xSync() */
+  i64 nDirtyQueued;                  /* Bytes of aDirty[] */
+  int nDirtyRange;                   /* Entries of aDirty[] in use */
+  unixDirtyRange aDirty[UNIX_DIRTY_NRANGE]; /* "range" files only: writes to flush */
 #if SQLITE_MAX_MMAP_SIZE > 0
-  int nFetchOut;                /* Number of outstanding xFetch refs */
-  sqlite3_int64 mmapSize;       /* Usable size of mapping at pMapRegion */
-  sqlite3_int64 mmapSizeActual; /* Actual size of mapping at pMapRegion */
-  sqlite3_int64 mmapSizeMax;    /* Configured FCNTL_MMAP_SIZE value */
-  void *pMapRegion;             /* Memory mapped region */
+  int nFetchOut;                  /* Number of outstanding xFetch refs */
+  sqlite3_int64 mmapSize;         /* Usable size of mapping at pMapRegion */
+  sqlite3_int64 mmapSizeActual;   /* Actual size of mapping at pMapRegion */
+  sqlite3_int64 mmapSizeMax;      /* Configured FCNTL_MMAP_SIZE value */
+  sqlite3_int64 mmapSizeReserved; /* Address space reserved at pMapRegion */
+  void *pMapRegion;               /* Memory mapped region */
+  int eMmapAdvice;                /* MADV_* last applied to the mapping */
+  int nMmapAccess;                /* Accesses in the current sample */
+  int nMmapSeq;                   /* Of those, ones following the previous */
+  int nMmapBackoff;               /* Accesses left to make with pread() */
+  long nMmapFault;                /* Major faults before the current sample */
+  sqlite3_int64 iMmapNext;        /* Offset just past the previous access */
+  sqlite3_int64 iMmapWillneed;    /* End of the last MADV_WILLNEED range */
 #endif
   int sectorSize;            /* Device sector size */
   int deviceCharacteristics; /* Precomputed device characteristics */
-#ifdef SQLITE_ENABLE_SETLK_TIMEOUT
-  unsigned iBusyTimeout; /* Wait this many millisec on locks */
-#endif
+  unsigned iBusyTimeout;     /* Wait this many millisec on locks */
 #ifdef SQLITE_DEBUG
   /* The next group of variables are used to track whether or not the
   ** transaction counter in bytes 24-27 of database files are updated
@@ -284,6 +467,30 @@ static pid_t randomnessPid = 0;
 #define UNIXFILE_DELETE 0x20 /* Delete on close */
 #define UNIXFILE_URI 0x40    /* Filename might have query parameters */
 #define UNIXFILE_NOLOCK 0x80 /* Do no file locking */
+#define UNIXFILE_POPULATE 0x100 /* MAP_POPULATE new mappings */
+#define UNIXFILE_DIRECT 0x200   /* File descriptor has O_DIRECT set */
+#define UNIXFILE_SYNC_PENDING 0x400 /* Size changed since the last xSync() */
+#define UNIXFILE_RECYCLE 0x800      /* -wal file kept by "wal_recycle" */
+#define UNIXFILE_IOHINTS 0x1000     /* Database opened with "io_hints" */
+#define UNIXFILE_WAL 0x2000         /* File is a -wal file */
+#define UNIXFILE_PREFETCH 0x4000    /* VFS_FCNTL_PREFETCH queued ranges on h */
+
+/*
+** Allowed values for unixFile.eSync.  See "Sync strategies" below.
+*/
+#define UNIX_SYNC_FSYNC 0     /* full_fsync() */
+#define UNIX_SYNC_FDATASYNC 1 /* fdatasync() */
+#define UNIX_SYNC_DSYNC 2     /* Opened O_DSYNC */
+#define UNIX_SYNC_RANGE 3     /* sync_file_range() after writes, fdatasync() */
+#define UNIX_SYNC_SYNCFS 4    /* syncfs(), shared between threads */
+#define UNIX_SYNC_AUTO 5      /* Measured by unixSyncResolve() */
+
+/*
+** Allowed values for unixInodeInfo.eWalLayout.  See "Direct I/O" below.
+*/
+#define UNIX_WAL_LAYOUT_UNKNOWN 0 /* No -wal file opened yet */
+#define UNIX_WAL_LAYOUT_USUAL 1   /* The -wal file as SQLite writes it */
+#define UNIX_WAL_LAYOUT_SPLIT 2   /* Page images apart from the -wal-hdr file */
 
 /*
 ** Include code that is common to all os_*.c files
@@ -328,6 +535,18 @@ static pid_t randomnessPid = 0;
 #endif
 #endif
 
+/*
+** HAVE_OFD_LOCKS is true if the system headers define open file
+** description locks.  It enables the "proc-ofd" VFS.
+*/
+#if !defined(HAVE_OFD_LOCKS)
+#ifdef F_OFD_SETLK
+#define HAVE_OFD_LOCKS 1
+#else
+#define HAVE_OFD_LOCKS 0
+#endif
+#endif
+
 /*
 ** Explicitly call the 64-bit version of lseek() on Android. Otherwise, lseek()
 ** is the 32-bit version, even if _FILE_OFFSET_BITS=64 is defined.
@@ -358,6 +577,43 @@ static pid_t randomnessPid = 0;
 ** which always has the same well-defined interface.
 */
 static int posixOpen(const char *zFile, int flags, int mode) { return open(zFile, flags, mode); }
+
+#if HAVE_IO_URING
+/*
+** Wrappers for the io_uring system calls, which libc does not provide.
+*/
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, (void *)0, (size_t)0);
+}
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+#endif
+
+#if HAVE_FUTEX
+/*
+** Wrapper for the futex system call, which libc does not provide.
+*/
+static int futex(u32 *uaddr, int op, u32 val, const struct timespec *timeout)
+{
+  return (int)syscall(SYS_futex, uaddr, op, val, timeout, (u32 *)0, 0);
+}
+#endif
+
+#if HAVE_IOPRIO
+/*
+** Wrappers for the ioprio system calls, which libc does not provide.
+*/
+static int ioprio_get(int which, int who) { return (int)syscall(SYS_ioprio_get, which, who); }
+static int ioprio_set(int which, int who, int ioprio) { return (int)syscall(SYS_ioprio_set, which, who, ioprio); }
+#endif
+
 /* Forward reference */
 static int openDirectory(const char *, int *);
 static int unixGetpagesize(void);
@@ -368,7 +624,7 @@ static int unixGetpagesize(void);
 ** testing and sandboxing.  The following array holds the names and pointers
 ** to all overrideable system calls.
 */
-static struct unix_syscall
+static PROCVFS_SYSCALL_CONST struct unix_syscall
 {
   const char *zName;            /* Name of the system call */
   sqlite3_syscall_ptr pCurrent; /* Current value of the system call */
@@ -510,15 +766,252 @@ static struct unix_syscall
 #endif
 #define osLstat ((int (*)(const char *, struct stat *))aSyscall[27].pCurrent)
 
-#if defined(__linux__) && defined(SQLITE_ENABLE_BATCH_ATOMIC_WRITE)
+#if defined(__linux__) && (defined(SQLITE_ENABLE_BATCH_ATOMIC_WRITE) || defined(FICLONE))
     {"ioctl", (sqlite3_syscall_ptr)ioctl, 0},
 #else
     {"ioctl", (sqlite3_syscall_ptr)0, 0},
 #endif
 #define osIoctl ((int (*)(int, int, ...))aSyscall[28].pCurrent)
 
+#if HAVE_COPY_FILE_RANGE
+    {"copy_file_range", (sqlite3_syscall_ptr)copy_file_range, 0},
+#else
+    {"copy_file_range", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osCopyFileRange ((ssize_t(*)(int, off_t *, int, off_t *, size_t, unsigned int))aSyscall[29].pCurrent)
+
+#if HAVE_IO_URING
+    {"io_uring_setup", (sqlite3_syscall_ptr)io_uring_setup, 0},
+#else
+    {"io_uring_setup", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osIoUringSetup ((int (*)(unsigned, struct io_uring_params *))aSyscall[30].pCurrent)
+
+#if HAVE_IO_URING
+    {"io_uring_enter", (sqlite3_syscall_ptr)io_uring_enter, 0},
+#else
+    {"io_uring_enter", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osIoUringEnter ((int (*)(int, unsigned, unsigned, unsigned))aSyscall[31].pCurrent)
+
+#if HAVE_IO_URING
+    {"io_uring_register", (sqlite3_syscall_ptr)io_uring_register, 0},
+#else
+    {"io_uring_register", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osIoUringRegister ((int (*)(int, unsigned, const void *, unsigned))aSyscall[32].pCurrent)
+
+#if HAVE_FUTEX
+    {"futex", (sqlite3_syscall_ptr)futex, 0},
+#else
+    {"futex", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osFutex ((int (*)(u32 *, int, u32, const struct timespec *))aSyscall[33].pCurrent)
+
+#if HAVE_MEMFD_CREATE
+    {"memfd_create", (sqlite3_syscall_ptr)memfd_create, 0},
+#else
+    {"memfd_create", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osMemfdCreate ((int (*)(const char *, unsigned int))aSyscall[34].pCurrent)
+
+#if !defined(SQLITE_OMIT_WAL) || SQLITE_MAX_MMAP_SIZE > 0
+    {"madvise", (sqlite3_syscall_ptr)madvise, 0},
+#else
+    {"madvise", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osMadvise ((int (*)(void *, size_t, int))aSyscall[35].pCurrent)
+
+    {"getrusage", (sqlite3_syscall_ptr)getrusage, 0},
+#define osGetrusage ((int (*)(int, struct rusage *))aSyscall[36].pCurrent)
+
+    {"fdatasync", (sqlite3_syscall_ptr)fdatasync, 0},
+#define osFdatasync ((int (*)(int))aSyscall[37].pCurrent)
+
+#if HAVE_SYNC_FILE_RANGE
+    {"sync_file_range", (sqlite3_syscall_ptr)sync_file_range, 0},
+#else
+    {"sync_file_range", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osSyncFileRange ((int (*)(int, off_t, off_t, unsigned int))aSyscall[38].pCurrent)
+
+#if HAVE_SYNC_FILE_RANGE
+    {"syncfs", (sqlite3_syscall_ptr)syncfs, 0},
+#else
+    {"syncfs", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osSyncfs ((int (*)(int))aSyscall[39].pCurrent)
+
+#if HAVE_LINUX_FALLOCATE
+    {"linux_fallocate", (sqlite3_syscall_ptr)fallocate, 0},
+#else
+    {"linux_fallocate", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osLinuxFallocate ((int (*)(int, int, off_t, off_t))aSyscall[40].pCurrent)
+
+#if HAVE_PWRITEV
+    {"pwritev", (sqlite3_syscall_ptr)pwritev, 0},
+#else
+    {"pwritev", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osPwritev ((ssize_t(*)(int, const struct iovec *, int, off_t))aSyscall[41].pCurrent)
+
+    {"fstatat", (sqlite3_syscall_ptr)fstatat, 0},
+#define osFstatat ((int (*)(int, const char *, struct stat *, int))aSyscall[42].pCurrent)
+
+#if HAVE_IOPRIO
+    {"ioprio_get", (sqlite3_syscall_ptr)ioprio_get, 0},
+#else
+    {"ioprio_get", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osIoprioGet ((int (*)(int, int))aSyscall[43].pCurrent)
+
+#if HAVE_IOPRIO
+    {"ioprio_set", (sqlite3_syscall_ptr)ioprio_set, 0},
+#else
+    {"ioprio_set", (sqlite3_syscall_ptr)0, 0},
+#endif
+#define osIoprioSet ((int (*)(int, int, int))aSyscall[44].pCurrent)
+
 }; /* End of the overrideable system calls */
 
+#define UNIX_NSYSCALL ((int)(sizeof(aSyscall) / sizeof(aSyscall[0])))
+
+#ifndef PROCVFS_RELEASE
+/*
+** System call accounting.
+**
+** procvfs_syscall_accounting(1) routes every entry of aSyscall[] through a
+** wrapper that counts the calls made and the time spent in them.  The
+** functions installed by xSetSystemCall(), before or after accounting is
+** turned on, are what the wrappers call, so fault injection and counting
+** hooks in tests keep working and are accounted for.
+**
+** Counters are kept per thread.  A statement or transaction runs on the
+** thread that calls sqlite3_step(), so the calls it causes can be measured
+** by resetting the counters of that thread with procvfs_syscall_reset()
+** before it and reading them with procvfs_syscall_count() after it.  Work
+** done on other threads, such as building a "wal_spare", is not charged.
+**
+** Like xSetSystemCall(), turning accounting on or off is not threadsafe.
+** It should be done while no database is open.
+*/
+struct unixAcctCounter
+{
+  u64 nCall; /* Calls made */
+  u64 nNano; /* Nanoseconds spent in them */
+};
+
+static int bSyscallAcct = 0;                       /* True while accounting */
+static sqlite3_syscall_ptr aAcctNext[UNIX_NSYSCALL]; /* Called by the wrappers */
+static thread_local unixAcctCounter aAcctCount[UNIX_NSYSCALL];
+
+/*
+** Charge the system call that runs while this object exists to entry I
+** of the calling thread's counters.
+*/
+class unixAcctTimer
+{
+  int iCall;
+  struct timespec t0;
+
+public:
+  explicit unixAcctTimer(int i) : iCall(i) { clock_gettime(CLOCK_MONOTONIC, &t0); }
+  ~unixAcctTimer()
+  {
+    int iErrno = errno;
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    aAcctCount[iCall].nCall++;
+    aAcctCount[iCall].nNano += (u64)(t1.tv_sec - t0.tv_sec) * 1000000000 + (t1.tv_nsec - t0.tv_nsec);
+    errno = iErrno;
+  }
+};
+
+/*
+** The wrapper installed in aSyscall[I] by accounting.  F is the type of the
+** system call, taken from its osXXX macro.
+*/
+template <int I, typename F> struct unixAcctCall;
+template <int I, typename R, typename... A> struct unixAcctCall<I, R (*)(A...)>
+{
+  static R call(A... a)
+  {
+    unixAcctTimer t(I);
+    return ((R(*)(A...))aAcctNext[I])(a...);
+  }
+};
+
+/* fcntl() and ioctl().  The optional argument is passed on as a pointer,
+** as glibc itself reads it. */
+template <int I> struct unixAcctCall<I, int (*)(int, int, ...)>
+{
+  static int call(int a, int b, ...)
+  {
+    unixAcctTimer t(I);
+    va_list ap;
+    void *p;
+    va_start(ap, b);
+    p = va_arg(ap, void *);
+    va_end(ap);
+    return ((int (*)(int, int, ...))aAcctNext[I])(a, b, p);
+  }
+};
+
+/* mremap(), whose optional argument is the new address. */
+template <int I> struct unixAcctCall<I, void *(*)(void *, size_t, size_t, int, ...)>
+{
+  static void *call(void *a, size_t b, size_t c, int d, ...)
+  {
+    unixAcctTimer t(I);
+    va_list ap;
+    void *p;
+    va_start(ap, d);
+#ifdef MREMAP_FIXED
+    p = (d & MREMAP_FIXED) ? va_arg(ap, void *) : 0;
+#else
+    p = 0;
+#endif
+    va_end(ap);
+    return ((void *(*)(void *, size_t, size_t, int, ...))aAcctNext[I])(a, b, c, d, p);
+  }
+};
+
+#define UNIX_ACCT(I, F) ((sqlite3_syscall_ptr)unixAcctCall<I, decltype(F)>::call)
+static const sqlite3_syscall_ptr aAcctWrapper[] = {
+    UNIX_ACCT(0, osOpen),           UNIX_ACCT(1, osClose),         UNIX_ACCT(2, osAccess),
+    UNIX_ACCT(3, osGetcwd),         UNIX_ACCT(4, osStat),          UNIX_ACCT(5, osFstat),
+    UNIX_ACCT(6, osFtruncate),      UNIX_ACCT(7, osFcntl),         UNIX_ACCT(8, osRead),
+    UNIX_ACCT(9, osPread),          UNIX_ACCT(10, osPread64),      UNIX_ACCT(11, osWrite),
+    UNIX_ACCT(12, osPwrite),        UNIX_ACCT(13, osPwrite64),     UNIX_ACCT(14, osFchmod),
+    UNIX_ACCT(15, osFallocate),     UNIX_ACCT(16, osUnlink),       UNIX_ACCT(17, osOpenDirectory),
+    UNIX_ACCT(18, osMkdir),         UNIX_ACCT(19, osRmdir),        UNIX_ACCT(20, osFchown),
+    UNIX_ACCT(21, osGeteuid),       UNIX_ACCT(22, osMmap),         UNIX_ACCT(23, osMunmap),
+    UNIX_ACCT(24, osMremap),        UNIX_ACCT(25, osGetpagesize),  UNIX_ACCT(26, osReadlink),
+    UNIX_ACCT(27, osLstat),         UNIX_ACCT(28, osIoctl),        UNIX_ACCT(29, osCopyFileRange),
+    UNIX_ACCT(30, osIoUringSetup),  UNIX_ACCT(31, osIoUringEnter), UNIX_ACCT(32, osIoUringRegister),
+    UNIX_ACCT(33, osFutex),         UNIX_ACCT(34, osMemfdCreate),  UNIX_ACCT(35, osMadvise),
+    UNIX_ACCT(36, osGetrusage),     UNIX_ACCT(37, osFdatasync),    UNIX_ACCT(38, osSyncFileRange),
+    UNIX_ACCT(39, osSyncfs),        UNIX_ACCT(40, osLinuxFallocate), UNIX_ACCT(41, osPwritev),
+    UNIX_ACCT(42, osFstatat),       UNIX_ACCT(43, osIoprioGet),    UNIX_ACCT(44, osIoprioSet),
+};
+static_assert(sizeof(aAcctWrapper) / sizeof(aAcctWrapper[0]) == sizeof(aSyscall) / sizeof(aSyscall[0]),
+              "every system call needs an accounting wrapper");
+
+/*
+** Return the slot holding the function that system call i resolves to.
+** That is aSyscall[i].pCurrent, unless accounting has put its wrapper
+** there.
+*/
+static sqlite3_syscall_ptr *unixSyscallSlot(int i)
+{
+  if (bSyscallAcct && aSyscall[i].pCurrent == aAcctWrapper[i]) return &aAcctNext[i];
+  return &aSyscall[i].pCurrent;
+}
+#else
+static const sqlite3_syscall_ptr *unixSyscallSlot(int i) { return &aSyscall[i].pCurrent; }
+#endif /* PROCVFS_RELEASE */
+
 /*
 ** On some systems, calls to fchown() will trigger a message in a security
 ** log if they come from non-root processes.  So avoid calling fchown() if
@@ -526,7 +1019,7 @@ static struct unix_syscall
 */
 static int robustFchown(int fd, uid_t uid, gid_t gid)
 {
-  printf("robustFchown(fd=%d ...)\n", fd);
+  OSTRACE(("robustFchown(fd=%d ...)\n", fd));
 #if defined(HAVE_FCHOWN)
   return osGeteuid() ? 0 : osFchown(fd, uid, gid);
 #else
@@ -538,13 +1031,18 @@ static int robustFchown(int fd, uid_t uid, gid_t gid)
 ** This is the xSetSystemCall() method of sqlite3_vfs for all of the
 ** "unix" VFSes.  Return SQLITE_OK opon successfully updating the
 ** system call pointer, or SQLITE_NOTFOUND if there is no configurable
-** system call named zName.
+** system call named zName.  No system call is configurable in a
+** PROCVFS_RELEASE build.
 */
 static int unixSetSystemCall(sqlite3_vfs *pNotUsed,       /* The VFS pointer.  Not used */
                              const char *zName,           /* Name of system call to override */
                              sqlite3_syscall_ptr pNewFunc /* Pointer to new system call value */
                              )
 {
+#ifdef PROCVFS_RELEASE
+  UNUSED_PARAMETER2(pNotUsed, pNewFunc);
+  return zName == 0 ? SQLITE_OK : SQLITE_NOTFOUND;
+#else
   unsigned int i;
   int rc = SQLITE_NOTFOUND;
 
@@ -559,7 +1057,7 @@ static int unixSetSystemCall(sqlite3_vfs *pNotUsed,       /* The VFS pointer.  N
     {
       if (aSyscall[i].pDefault)
       {
-        aSyscall[i].pCurrent = aSyscall[i].pDefault;
+        *unixSyscallSlot(i) = aSyscall[i].pDefault;
       }
     }
   }
@@ -572,18 +1070,20 @@ static int unixSetSystemCall(sqlite3_vfs *pNotUsed,       /* The VFS pointer.  N
     {
       if (strcmp(zName, aSyscall[i].zName) == 0)
       {
+        sqlite3_syscall_ptr *pSlot = unixSyscallSlot(i);
         if (aSyscall[i].pDefault == 0)
         {
-          aSyscall[i].pDefault = aSyscall[i].pCurrent;
+          aSyscall[i].pDefault = *pSlot;
         }
         rc = SQLITE_OK;
         if (pNewFunc == 0) pNewFunc = aSyscall[i].pDefault;
-        aSyscall[i].pCurrent = pNewFunc;
+        *pSlot = pNewFunc;
         break;
       }
     }
   }
   return rc;
+#endif
 }
 
 /*
@@ -598,7 +1098,7 @@ static sqlite3_syscall_ptr unixGetSystemCall(sqlite3_vfs *pNotUsed, const char *
   UNUSED_PARAMETER(pNotUsed);
   for (i = 0; i < sizeof(aSyscall) / sizeof(aSyscall[0]); i++)
   {
-    if (strcmp(zName, aSyscall[i].zName) == 0) return aSyscall[i].pCurrent;
+    if (strcmp(zName, aSyscall[i].zName) == 0) return *unixSyscallSlot(i);
   }
   return 0;
 }
@@ -656,7 +1156,7 @@ static const char *unixNextSystemCall(sqlite3_vfs *p, const char *zName)
 */
 static int robust_open(const char *z, int f, mode_t m)
 {
-  printf("robust_open('%s' f=%d m=0x%X)\n", z, f, m);
+  OSTRACE(("robust_open('%s' f=%d m=0x%X)\n", z, f, m));
   int fd;
   mode_t m2 = m ? m : SQLITE_DEFAULT_FILE_PERMISSIONS;
   while (1)
@@ -696,9 +1196,10 @@ static int robust_open(const char *z, int f, mode_t m)
 
 /*
 ** Helper functions to obtain and relinquish the global mutex. The
-** global mutex is used to protect the unixInodeInfo and
-** vxworksFileId objects used by this file, all of which may be
-** shared by multiple threads.
+** global mutex is used to protect the objects used by this file that
+** are shared by multiple threads but do not belong to a single inode.
+** unixInodeInfo objects are protected by the mutex of their hash bucket
+** instead.  See unixEnterInodeMutex().
 **
 ** Function unixMutexHeld() is used to assert() that the global mutex
 ** is held when required. This function is only used as part of assert()
@@ -1013,7 +1514,31 @@ struct unixInodeInfo
   unixShmNode *pShmNode;      /* Shared memory associated with this inode */
   int nLock;                  /* Number of outstanding file locks */
   UnixUnusedFd *pUnused;      /* Unused file descriptors to close */
-  unixInodeInfo *pNext;       /* List of all unixInodeInfo objects */
+  char *zWalDir;              /* Directory holding the -wal file, or NULL */
+  char *zShmDir;              /* Directory holding the -shm file, or NULL */
+  char *zRedirect;            /* Name of the -wal and -shm files there, but the suffix */
+  int hCbt;                   /* Open changed-block tracking file, or -1 */
+  unsigned char cbtFull;      /* Some writes went untracked.  See cbtAttach() */
+  unsigned char cbtProbe;     /* Look for the -cbt file before the next write */
+  i64 msCbtMiss;              /* unixMonotonicMs() when the -cbt file was last missing */
+  u8 *aCbtPending;            /* Blocks written since the last cbtFlush() */
+  int nCbtPending;            /* Allocated size of aCbtPending[] in bytes */
+  int iCbtLo, iCbtHi;         /* Bytes of aCbtPending[] that may be non-zero */
+  unixShipLog *pShip;         /* Log of committed WAL frames, or NULL */
+  unsigned char bDirectIo;    /* Database and -wal file use O_DIRECT */
+  unsigned char eWalLayout;   /* UNIX_WAL_LAYOUT_* of the -wal file */
+  unsigned char aSyncMode[3]; /* UNIX_SYNC_* for database, -wal and journal */
+  i64 mxPreallocDb;           /* "prealloc_db" of the first connection */
+  i64 mxPreallocWal;          /* "prealloc_wal" of the first connection */
+  i64 iPreallocEndDb;         /* End of the space reserved in the database.  Atomic */
+  i64 iPreallocEndWal;        /* And in its -wal file.  Atomic */
+  unsigned char bWalRecycle;  /* "wal_recycle" or "wal_spare" in effect */
+  int szCombine;              /* "write_combine" of the first connection */
+  i64 szWalSpare;             /* "wal_spare" of the first connection */
+  unsigned char bIoHints;     /* "io_hints" of the first connection */
+  unixCkpt *pCkpt;            /* Background checkpoints, or NULL */
+  unixInodeBucket *pBucket;   /* Hash bucket holding this object */
+  unixInodeInfo *pNext;       /* Next object in the same hash bucket */
   unixInodeInfo *pPrev;       /*    .... doubly linked */
 #if SQLITE_ENABLE_LOCKING_STYLE
   unsigned long long sharedByte; /* for AFP simulated shared lock */
@@ -1021,10 +1546,95 @@ struct unixInodeInfo
 };
 
 /*
-** A lists of all unixInodeInfo objects.
+** All unixInodeInfo objects, in a hash table keyed by device and inode
+** number.  Each bucket has its own mutex, which protects the chain of the
+** bucket and every field of the unixInodeInfo objects on it.  Threads
+** opening, closing and locking unrelated databases therefore do not wait
+** for each other, however many databases are open.
+**
+** A thread holding a bucket mutex may enter the global mutex, but not the
+** other way round, and a thread never holds two bucket mutexes at once.
+*/
+#define UNIX_INODE_NHASH 1024 /* Number of buckets.  A power of two */
+
+struct alignas(64) unixInodeBucket
+{
+  std::mutex mutex;     /* Protects pList and the objects on it */
+  unixInodeInfo *pList; /* unixInodeInfo objects that hash to this bucket */
+};
+static unixInodeBucket aInodeHash[UNIX_INODE_NHASH];
+
+/*
+** Totals over all unixInodeInfo objects.  They are updated atomically
+** under the bucket mutex of the object that changed, and read without a
+** lock to skip work that is only ever needed when they are non-zero.
+*/
+static unsigned int nUnusedFd = 0;      /* Total unused file descriptors */
+static unsigned int nRedirectInode = 0; /* unixInodeInfo objects with zWalDir set */
+static unsigned int nShipInode = 0;     /* unixInodeInfo objects with pShip set */
+static unsigned int nDirectInode = 0;   /* unixInodeInfo objects with bDirectIo set */
+static unsigned int nSplitInode = 0;    /* unixInodeInfo objects with a split -wal file */
+static unsigned int nSyncInode = 0;     /* unixInodeInfo objects with aSyncMode[] set */
+static unsigned int nPreallocInode = 0; /* unixInodeInfo objects with mxPreallocWal set */
+static unsigned int nRecycleInode = 0;  /* unixInodeInfo objects with bWalRecycle set */
+static unsigned int nCombineInode = 0;  /* unixInodeInfo objects with szCombine set */
+static unsigned int nHintInode = 0;     /* unixInodeInfo objects with bIoHints set */
+static unsigned int nCkptInode = 0;     /* unixInodeInfo objects with pCkpt set */
+
+/*
+** Return the hash bucket of the inode identified by pId.
+*/
+static unixInodeBucket *inodeBucket(const struct unixFileId *pId)
+{
+  u64 h = ((u64)pId->dev * 0x9e3779b97f4a7c15ULL) ^ pId->ino;
+  h *= 0xff51afd7ed558ccdULL;
+  return &aInodeHash[(h ^ (h >> 32)) & (UNIX_INODE_NHASH - 1)];
+}
+
+/*
+** Return the unixInodeInfo of the inode identified by pId, or NULL.  The
+** mutex of pBucket, the bucket of pId, must be held.
+*/
+static unixInodeInfo *inodeLookup(unixInodeBucket *pBucket, const struct unixFileId *pId)
+{
+  unixInodeInfo *pInode;
+  for (pInode = pBucket->pList; pInode; pInode = pInode->pNext)
+  {
+    if (pInode->fileId.dev == pId->dev && pInode->fileId.ino == pId->ino) break;
+  }
+  return pInode;
+}
+
+/*
+** Obtain and relinquish the mutex that protects pInode.  Function
+** unixInodeMutexHeld() is used in assert() statements, like
+** unixMutexHeld().
+*/
+static void unixEnterInodeMutex(unixInodeInfo *pInode) { pInode->pBucket->mutex.lock(); }
+static void unixLeaveInodeMutex(unixInodeInfo *pInode) { pInode->pBucket->mutex.unlock(); }
+#ifdef SQLITE_DEBUG
+static int unixInodeMutexHeld(unixInodeInfo *pInode)
+{
+  bool lockSucceeds = pInode->pBucket->mutex.try_lock();
+  if (lockSucceeds) pInode->pBucket->mutex.unlock();
+  return !lockSucceeds;
+}
+#endif
+
+/*
+** unixInodeInfo and UnixUnusedFd objects are allocated and freed every
+** time a database is opened and closed, so they come from pools.
+*/
+static VfsPool inodePool = VFSPOOL_INIT("unixInodeInfo", sizeof(unixInodeInfo));
+static VfsPool unusedFdPool = VFSPOOL_INIT("UnixUnusedFd", sizeof(UnixUnusedFd));
+
+/*
+** Process-wide defaults for the "wal_dir" and "shm_dir" URI parameters.
+** Set by procvfs_set_directories().  An empty string means "next to the
+** database file", which is the normal SQLite behavior.
 */
-static unixInodeInfo *inodeList = 0; /* All unixInodeInfo objects */
-static unsigned int nUnusedFd = 0;   /* Total unused file descriptors */
+static char zDefaultWalDir[MAX_PATHNAME + 1];
+static char zDefaultShmDir[MAX_PATHNAME + 1];
 
 /*
 **
@@ -1107,7 +1717,7 @@ static int unixLogErrorAtLine(int errcode,       /* SQLite error code */
 */
 static void robust_close(unixFile *pFile, int h, int lineno)
 {
-  printf("robust_close(pFile=%p pFile->'%s' h=%d lineno=%d)\n", pFile, pFile ? pFile->zPath : "", h, lineno);
+  OSTRACE(("robust_close(pFile=%p pFile->'%s' h=%d lineno=%d)\n", pFile, pFile ? pFile->zPath : "", h, lineno));
   if (osClose(h))
   {
     unixLogErrorAtLine(SQLITE_IOERR_CLOSE, "close", pFile ? pFile->zPath : 0, lineno);
@@ -1131,22 +1741,26 @@ static void closePendingFds(unixFile *pFile)
   {
     pNext = p->pNext;
     robust_close(pFile, p->fd, __LINE__);
-    sqlite3_free(p);
-    nUnusedFd--;
+    vfspool_free(p);
+    __atomic_fetch_sub(&nUnusedFd, 1, __ATOMIC_RELAXED);
   }
   pInode->pUnused = 0;
 }
 
+static void shipRelease(unixShipLog *p, unixFile *pFile);
+static void unixCkptRelease(unixCkpt *p);
+
 /*
 ** Release a unixInodeInfo structure previously allocated by findInodeInfo().
 **
-** The mutex entered using the unixEnterMutex() function must be held
-** when this function is called.
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.  It stays held even if the structure is
+** freed.
 */
 static void releaseInodeInfo(unixFile *pFile)
 {
   unixInodeInfo *pInode = pFile->pInode;
-  assert(unixMutexHeld());
+  assert(pInode == 0 || unixInodeMutexHeld(pInode));
   if (ALWAYS(pInode))
   {
     pInode->nRef--;
@@ -1161,18 +1775,43 @@ static void releaseInodeInfo(unixFile *pFile)
       }
       else
       {
-        assert(inodeList == pInode);
-        inodeList = pInode->pNext;
+        assert(pInode->pBucket->pList == pInode);
+        pInode->pBucket->pList = pInode->pNext;
       }
       if (pInode->pNext)
       {
         assert(pInode->pNext->pPrev == pInode);
         pInode->pNext->pPrev = pInode->pPrev;
       }
-      sqlite3_free(pInode);
+      if (pInode->zWalDir) __atomic_fetch_sub(&nRedirectInode, 1, __ATOMIC_RELAXED);
+      if (pInode->bDirectIo) __atomic_fetch_sub(&nDirectInode, 1, __ATOMIC_RELAXED);
+      if (pInode->eWalLayout == UNIX_WAL_LAYOUT_SPLIT) __atomic_fetch_sub(&nSplitInode, 1, __ATOMIC_RELAXED);
+      if (pInode->aSyncMode[0] | pInode->aSyncMode[1] | pInode->aSyncMode[2])
+      {
+        __atomic_fetch_sub(&nSyncInode, 1, __ATOMIC_RELAXED);
+      }
+      if (pInode->mxPreallocWal) __atomic_fetch_sub(&nPreallocInode, 1, __ATOMIC_RELAXED);
+      if (pInode->bWalRecycle) __atomic_fetch_sub(&nRecycleInode, 1, __ATOMIC_RELAXED);
+      if (pInode->szCombine) __atomic_fetch_sub(&nCombineInode, 1, __ATOMIC_RELAXED);
+      if (pInode->bIoHints) __atomic_fetch_sub(&nHintInode, 1, __ATOMIC_RELAXED);
+      if (pInode->pCkpt)
+      {
+        __atomic_fetch_sub(&nCkptInode, 1, __ATOMIC_RELAXED);
+        unixCkptRelease(pInode->pCkpt);
+      }
+      sqlite3_free(pInode->zWalDir);
+      sqlite3_free(pInode->zShmDir);
+      sqlite3_free(pInode->zRedirect);
+      if (pInode->hCbt >= 0) robust_close(pFile, pInode->hCbt, __LINE__);
+      sqlite3_free(pInode->aCbtPending);
+      if (pInode->pShip)
+      {
+        __atomic_fetch_sub(&nShipInode, 1, __ATOMIC_RELAXED);
+        shipRelease(pInode->pShip, 0);
+      }
+      vfspool_free(pInode);
     }
   }
-  assert(inodeList != 0 || nUnusedFd == 0);
 }
 
 /*
@@ -1180,28 +1819,27 @@ static void releaseInodeInfo(unixFile *pFile)
 ** describes that file descriptor.  Create a new one if necessary.  The
 ** return value might be uninitialized if an error occurs.
 **
-** The mutex entered using the unixEnterMutex() function must be held
-** when this function is called.
+** If SQLITE_OK is returned, the mutex of the unixInodeInfo object is held
+** by the caller, who must leave it with unixLeaveInodeMutex().
 **
 ** Return an appropriate error code.
 */
-static int findInodeInfo(unixFile *pFile,        /* Unix file with file desc used in the key */
-                         unixInodeInfo **ppInode /* Return the unixInodeInfo object here */
+static int findInodeInfo(unixFile *pFile,         /* Unix file with file desc used in the key */
+                         unixInodeInfo **ppInode, /* Return the unixInodeInfo object here */
+                         struct stat *pStat       /* OUT: fstat() of the file, for verifyDbFile() */
                          )
 {
   int rc;                    /* System call return code */
   int fd;                    /* The file descriptor for pFile */
   struct unixFileId fileId;  /* Lookup key for the unixInodeInfo */
-  struct stat statbuf;       /* Low-level file information */
   unixInodeInfo *pInode = 0; /* Candidate unixInodeInfo object */
-
-  assert(unixMutexHeld());
+  unixInodeBucket *pBucket;  /* Hash bucket of fileId */
 
   /* Get low-level information about the file that we can used to
   ** create a unique name for the file.
   */
   fd = pFile->h;
-  rc = osFstat(fd, &statbuf);
+  rc = osFstat(fd, pStat);
   if (rc != 0)
   {
     storeLastErrno(pFile, errno);
@@ -1212,28 +1850,28 @@ static int findInodeInfo(unixFile *pFile,        /* Unix file with file desc use
   }
 
   memset(&fileId, 0, sizeof(fileId));
-  fileId.dev = statbuf.st_dev;
-  fileId.ino = (u64)statbuf.st_ino;
-  assert(inodeList != 0 || nUnusedFd == 0);
-  pInode = inodeList;
-  while (pInode && memcmp(&fileId, &pInode->fileId, sizeof(fileId)))
-  {
-    pInode = pInode->pNext;
-  }
+  fileId.dev = pStat->st_dev;
+  fileId.ino = (u64)pStat->st_ino;
+  pBucket = inodeBucket(&fileId);
+  pBucket->mutex.lock();
+  pInode = inodeLookup(pBucket, &fileId);
   if (pInode == 0)
   {
-    pInode = (unixInodeInfo *)sqlite3_malloc64(sizeof(*pInode));
+    pInode = (unixInodeInfo *)vfspool_alloc(&inodePool, sizeof(*pInode));
     if (pInode == 0)
     {
+      pBucket->mutex.unlock();
       return SQLITE_NOMEM;
     }
     memset(pInode, 0, sizeof(*pInode));
     memcpy(&pInode->fileId, &fileId, sizeof(fileId));
+    pInode->hCbt = -1;
     pInode->nRef = 1;
-    pInode->pNext = inodeList;
+    pInode->pBucket = pBucket;
+    pInode->pNext = pBucket->pList;
     pInode->pPrev = 0;
-    if (inodeList) inodeList->pPrev = pInode;
-    inodeList = pInode;
+    if (pBucket->pList) pBucket->pList->pPrev = pInode;
+    pBucket->pList = pInode;
   }
   else
   {
@@ -1260,16 +1898,27 @@ static int fileHasMoved(unixFile *pFile)
 ** (3) The file has not been renamed or unlinked
 **
 ** Issue sqlite3_log(SQLITE_WARNING,...) messages if anything is not right.
+**
+** When the file has just been opened, pStat is the fstat() taken by
+** findInodeInfo().  Check (3) is skipped then, as the name was resolved
+** to the file a moment ago.  Otherwise pStat is NULL.
 */
-static void verifyDbFile(unixFile *pFile)
+static void verifyDbFile(unixFile *pFile, const struct stat *pStat)
 {
   struct stat buf;
-  int rc;
+  int rc = 0;
 
   /* These verifications occurs for the main database only */
   if (pFile->ctrlFlags & UNIXFILE_NOLOCK) return;
 
-  rc = osFstat(pFile->h, &buf);
+  if (pStat)
+  {
+    buf = *pStat;
+  }
+  else
+  {
+    rc = osFstat(pFile->h, &buf);
+  }
   if (rc != 0)
   {
     sqlite3_log(SQLITE_WARNING, "cannot fstat db file %s", pFile->zPath);
@@ -1285,7 +1934,7 @@ static void verifyDbFile(unixFile *pFile)
     sqlite3_log(SQLITE_WARNING, "multiple links to file: %s", pFile->zPath);
     return;
   }
-  if (fileHasMoved(pFile))
+  if (pStat == 0 && fileHasMoved(pFile))
   {
     sqlite3_log(SQLITE_WARNING, "file renamed while open: %s", pFile->zPath);
     return;
@@ -1293,22 +1942,627 @@ static void verifyDbFile(unixFile *pFile)
 }
 
 /*
-** This routine checks if there is a RESERVED lock held on the specified
-** file by this or any other process. If such a lock is held, set *pResOut
-** to a non-zero value otherwise *pResOut is set to zero.  The return value
-** is set to SQLITE_OK unless an I/O error occurs during lock checking.
+** Compose the name of a -wal or -shm file (zSuffix is "wal" or "shm")
+** that lives in directory zDir instead of next to its database, from the
+** unixInodeInfo.zRedirect of the database.  The result is double-nul
+** terminated and must be freed with sqlite3_free().
 */
-static int unixCheckReservedLock(sqlite3_file *id, int *pResOut)
+static char *unixRedirectName(const char *zDir, const char *zRedirect, const char *zSuffix)
 {
-  int rc = SQLITE_OK;
-  int reserved = 0;
-  unixFile *pFile = (unixFile *)id;
-
-  SimulateIOError(return SQLITE_IOERR_CHECKRESERVEDLOCK;);
+  return sqlite3_mprintf("%s/%s-%s%c", zDir, zRedirect, zSuffix, 0);
+}
 
-  assert(pFile);
-  assert(pFile->eFileLock <= SHARED_LOCK);
-  unixEnterMutex(); /* Because pFile->pInode is shared across threads */
+/*
+** Return the unixInodeInfo.zRedirect of database file zDb: its basename
+** followed by a hash of its canonical path, so that databases with the
+** same basename in different directories do not collide.  The canonical
+** path, unlike the device and inode numbers, survives reboots, device
+** renumbering and restores, and is the same whichever symbolic links a
+** connection opens the database through.  A database moved while its
+** redirected -wal file holds frames loses them, as it would without its
+** -wal file next to it.
+*/
+static char *unixRedirectBase(const char *zDb)
+{
+  char *zReal = realpath(zDb, 0);
+  const char *zPath = zReal ? zReal : zDb;
+  const char *zBase = strrchr(zPath, '/');
+  u64 h = 0xcbf29ce484222325ULL; /* FNV-1a */
+  const char *z;
+  char *zRet;
+
+  for (z = zPath; *z; z++) h = (h ^ (unsigned char)*z) * 0x100000001b3ULL;
+  zRet = sqlite3_mprintf("%s-%016llx", zBase ? zBase + 1 : zPath, h);
+  free(zReal);
+  return zRet;
+}
+
+/*
+** Record on the unixInodeInfo of main database file pFile the directories
+** that its -wal and -shm files live in.  They come from the "wal_dir" and
+** "shm_dir" URI parameters, or from procvfs_set_directories().
+**
+** Every connection to the database, in every process, must use the same
+** settings.  Otherwise connections would not see each other's WAL content,
+** which corrupts the database.  Within this process, the first connection
+** to open the inode decides, and later connections that disagree are
+** logged and follow the established setting.
+**
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
+*/
+static int setInodeDirectories(unixFile *pFile)
+{
+  unixInodeInfo *pInode = pFile->pInode;
+  const char *zUri = (pFile->ctrlFlags & UNIXFILE_URI) ? pFile->zPath : 0;
+  const char *zWalDir = sqlite3_uri_parameter(zUri, "wal_dir");
+  const char *zShmDir = sqlite3_uri_parameter(zUri, "shm_dir");
+  char zWalDefault[MAX_PATHNAME + 1]; /* Copy of zDefaultWalDir */
+  char zShmDefault[MAX_PATHNAME + 1]; /* Copy of zDefaultShmDir */
+
+  assert(unixInodeMutexHeld(pInode));
+  unixEnterMutex();
+  memcpy(zWalDefault, zDefaultWalDir, sizeof(zWalDefault));
+  memcpy(zShmDefault, zDefaultShmDir, sizeof(zShmDefault));
+  unixLeaveMutex();
+  if (zWalDir == 0 && zWalDefault[0]) zWalDir = zWalDefault;
+  if (zShmDir == 0 && zShmDefault[0]) zShmDir = zShmDefault;
+  if (zWalDir && zWalDir[0] == 0) zWalDir = 0;
+  if (zShmDir && zShmDir[0] == 0) zShmDir = 0;
+
+  if (pInode->nRef > 1)
+  {
+    if ((zWalDir == 0) != (pInode->zWalDir == 0) || (zWalDir && strcmp(zWalDir, pInode->zWalDir)) ||
+        (zShmDir == 0) != (pInode->zShmDir == 0) || (zShmDir && strcmp(zShmDir, pInode->zShmDir)))
+    {
+      sqlite3_log(SQLITE_WARNING, "conflicting wal_dir/shm_dir ignored: %s", pFile->zPath);
+    }
+    return SQLITE_OK;
+  }
+
+  /* This is the only unixFile open on the inode, so the caller may still
+  ** close the file descriptor if an error is returned below. */
+  assert(pInode->zWalDir == 0 && pInode->zShmDir == 0);
+  if ((zWalDir && zWalDir[0] != '/') || (zShmDir && zShmDir[0] != '/'))
+  {
+    sqlite3_log(SQLITE_CANTOPEN, "wal_dir and shm_dir must be absolute paths: %s", pFile->zPath);
+    return SQLITE_CANTOPEN;
+  }
+  if (zWalDir)
+  {
+    pInode->zWalDir = sqlite3_mprintf("%s", zWalDir);
+    if (pInode->zWalDir == 0) return SQLITE_NOMEM;
+    __atomic_fetch_add(&nRedirectInode, 1, __ATOMIC_RELAXED);
+  }
+  if (zShmDir)
+  {
+    pInode->zShmDir = sqlite3_mprintf("%s", zShmDir);
+    if (pInode->zShmDir == 0) return SQLITE_NOMEM;
+  }
+  if (zWalDir || zShmDir)
+  {
+    pInode->zRedirect = unixRedirectBase(pFile->zPath);
+    if (pInode->zRedirect == 0) return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** If zPath is the name of the database file that is open in this process
+** followed by zSuffix, such as "-wal", return the unixInodeInfo of the
+** database and write its name to zDb[], a buffer of MAX_PATHNAME+1 bytes.
+** Otherwise return NULL.
+**
+** If an object is returned, its mutex is held by the caller, who must
+** leave it with unixLeaveInodeMutex().
+*/
+static unixInodeInfo *unixSuffixDbInode(const char *zPath, const char *zSuffix, char *zDb)
+{
+  struct stat sStat; /* Results of stat() on zDb */
+  struct unixFileId fileId;
+  unixInodeBucket *pBucket;
+  unixInodeInfo *pInode;
+  int nSuffix = sqlite3Strlen30(zSuffix);
+  int nDb;
+
+  nDb = sqlite3Strlen30(zPath) - nSuffix;
+  if (nDb <= 0 || nDb > MAX_PATHNAME || memcmp(&zPath[nDb], zSuffix, nSuffix)) return 0;
+  memcpy(zDb, zPath, nDb);
+  zDb[nDb] = '\0';
+  if (osStat(zDb, &sStat)) return 0;
+  memset(&fileId, 0, sizeof(fileId));
+  fileId.dev = sStat.st_dev;
+  fileId.ino = (u64)sStat.st_ino;
+  pBucket = inodeBucket(&fileId);
+  pBucket->mutex.lock();
+  pInode = inodeLookup(pBucket, &fileId);
+  if (pInode == 0) pBucket->mutex.unlock();
+  return pInode;
+}
+
+/*
+** unixSuffixDbInode() for the -wal file zPath.
+*/
+static unixInodeInfo *unixWalDbInode(const char *zPath, char *zDb) { return unixSuffixDbInode(zPath, "-wal", zDb); }
+
+/*
+** If zPath is the name SQLite uses for the WAL file of an open database
+** whose unixInodeInfo has a redirected WAL directory, return the name of
+** the file actually used, in memory obtained from sqlite3_malloc().
+** Otherwise return NULL.
+**
+** SQLite always derives the WAL name as "<database>-wal" and passes it to
+** xOpen(), xAccess() and xDelete() while the database file itself is open,
+** so the inode of the database can be looked up from the name.
+*/
+static char *unixWalRedirect(const char *zPath)
+{
+  char zDb[MAX_PATHNAME + 1]; /* Database file path */
+  unixInodeInfo *pInode;
+  char *zRedirect = 0;
+
+  if (__atomic_load_n(&nRedirectInode, __ATOMIC_RELAXED) == 0 || zPath == 0) return 0;
+  pInode = unixWalDbInode(zPath, zDb);
+  if (pInode)
+  {
+    if (pInode->zWalDir) zRedirect = unixRedirectName(pInode->zWalDir, pInode->zRedirect, "wal");
+    unixLeaveInodeMutex(pInode);
+  }
+  return zRedirect;
+}
+
+/******************************************************************************
+****************************** WAL frame shipping *****************************
+**
+** If a database is opened with the "ship_log=PATH" URI parameter, every
+** transaction committed to its WAL is appended to the file PATH as a
+** sequence of ShipRecord headers, each followed by one page image.  The
+** last record of each transaction has a non-zero nTruncate.  Followers
+** replay the log into a replica with procvfs_ship_apply(), and the space
+** of the transactions they all have is released with procvfs_ship_truncate().
+**
+** The frames are captured by unixWrite() on the -wal file.  SQLite writes
+** each frame as a 24-byte header, whose first two big-endian words are the
+** page number and, for a commit frame, the database size in pages, followed
+** by the page image.  Frames are buffered until the commit frame arrives,
+** so rolled back transactions are never shipped.  The buffer is cleared
+** whenever a connection takes the WAL writer lock, see shipBegin().
+**
+** A committed transaction is shipped only once it is durable: when the
+** connection that wrote it next syncs its -wal file, see shipSynced().  If
+** SQLite does not sync the WAL at commit, as with PRAGMA synchronous=NORMAL,
+** the VFS syncs it before the writer lock is released, see shipEnd().  So
+** each write transaction costs a sync of the WAL and one of the log.  Since
+** the log is only appended to under the WAL writer lock, which is exclusive
+** across processes, appends from different processes never interleave.
+**
+** Each record also holds the number and salts of its WAL frame.  A process
+** that dies between writing a commit frame and shipping it leaves a
+** transaction in the WAL that is not in the log.  The next connection to
+** take the writer lock, in any process, compares the last transaction in
+** the log with the wal-index header and ships what is missing.  A
+** transaction left incomplete at the end of the log is cut off first.
+*/
+#define SHIP_MAGIC 0x53484950 /* "SHIP" */
+#define SHIP_SKIP 0x534b4950  /* "SKIP" */
+
+typedef struct ShipRecord ShipRecord;
+struct ShipRecord
+{
+  u32 magic;     /* SHIP_MAGIC */
+  u32 pgno;      /* Page number of the image that follows */
+  u32 nTruncate; /* Database size in pages for the last record of a commit */
+  u32 szPage;    /* Bytes in the page image that follows */
+  u32 iFrame;    /* Number of the WAL frame the image was shipped from */
+  u32 aSalt[2];  /* WAL salts of that frame, as stored in its header */
+};
+
+/*
+** Written over the start of the log by procvfs_ship_truncate().  Readers
+** of the log starting at offset 0 continue at offset iNext.
+*/
+typedef struct ShipSkip ShipSkip;
+struct ShipSkip
+{
+  u32 magic;  /* SHIP_SKIP */
+  u32 unused; /* Zero */
+  i64 iNext;  /* Offset of the first transaction still in the log */
+};
+
+/*
+** A log of committed WAL frames.  There is one per database inode that
+** has "ship_log" set, shared with the -wal file of every connection.
+** Except for pWal, it is only used by the holder of the WAL writer lock.
+*/
+struct unixShipLog
+{
+  int nRef;        /* unixInodeInfo and -wal unixFile objects using this */
+  int h;           /* Log file, opened O_APPEND, or -1 after an error */
+  char *zLog;      /* Name of the log file */
+  int szPage;      /* Size of the pages in aData[], or 0 */
+  int nFrame;      /* Frames buffered for the transaction being written */
+  int nAlloc;      /* Allocated size of aOfst[] and aPgno[] */
+  i64 nData;       /* Allocated size of aData[] in bytes */
+  i64 *aOfst;      /* WAL offset of each buffered frame, in ascending order */
+  u32 *aPgno;      /* Page number of each buffered frame */
+  u8 *aData;       /* Page image of each buffered frame */
+  i64 iHdrOfst;    /* Offset of the last frame header written */
+  u32 hdrPgno;     /* Page number from that header */
+  u32 hdrTruncate; /* Commit size from that header */
+  u32 aHdrSalt[2]; /* Salts from that header */
+  u32 nCommit;     /* Size in pages of the buffered commit, or 0 */
+  unixFile *pWal;  /* -wal file to sync before shipping nCommit.  Atomic */
+  i64 iScan;       /* End of the last complete transaction in the log */
+  u32 iFrame;      /* WAL frame of that transaction's commit record */
+  u32 aSalt[2];    /* And its salts */
+};
+
+static int unixSync(sqlite3_file *id, int flags);
+static int full_fsync(int fd, int fullSync, int dataOnly);
+static int seekAndReadFd(int fd, i64 iOff, void *pBuf, int nByte, int *piErrno);
+
+/*
+** Drop a reference to a unixShipLog, freeing it with the last one.
+** References are held by unixInodeInfo and unixFile objects that belong
+** to different inodes, so nRef is protected by the global mutex.  pFile
+** is the -wal file that held the reference, or NULL.
+*/
+static void shipRelease(unixShipLog *p, unixFile *pFile)
+{
+  int nRef;
+  unixEnterMutex();
+  if (pFile && __atomic_load_n(&p->pWal, __ATOMIC_ACQUIRE) == pFile)
+  {
+    __atomic_store_n(&p->pWal, (unixFile *)0, __ATOMIC_RELEASE);
+  }
+  nRef = --p->nRef;
+  unixLeaveMutex();
+  if (nRef == 0)
+  {
+    if (p->h >= 0) robust_close(0, p->h, __LINE__);
+    sqlite3_free(p->zLog);
+    sqlite3_free(p->aOfst);
+    sqlite3_free(p->aPgno);
+    sqlite3_free(p->aData);
+    sqlite3_free(p);
+  }
+}
+
+/*
+** Forget the frames buffered for an uncommitted transaction, or for one
+** that is not to be shipped after all.
+*/
+static void shipReset(unixShipLog *p)
+{
+  p->nFrame = 0;
+  p->hdrPgno = 0;
+  p->nCommit = 0;
+  __atomic_store_n(&p->pWal, (unixFile *)0, __ATOMIC_RELEASE);
+}
+
+/*
+** Stop shipping after an error.  The followers stay consistent but fall
+** further and further behind, rather than missing a transaction.
+*/
+static void shipFail(unixShipLog *p, int iErrno)
+{
+  errno = iErrno;
+  unixLogError(SQLITE_IOERR_WRITE, "shipping stopped", p->zLog);
+  if (p->h >= 0) robust_close(0, p->h, __LINE__);
+  p->h = -1;
+  shipReset(p);
+}
+
+/*
+** Scan the transactions in the log open on h, from offset iOfst up to
+** iSize, following a ShipSkip at offset 0.  Set *piEnd to the end of the
+** last complete one, or to where the scan started, and *pLast, if not
+** NULL, to its commit record.  Return SQLITE_CORRUPT if a record is not
+** valid.  An incomplete record at iSize is not an error.
+*/
+static int shipScan(int h, i64 iOfst, i64 iSize, i64 *piEnd, ShipRecord *pLast)
+{
+  ShipRecord rec;
+  int iErrno = 0;
+
+  *piEnd = iOfst;
+  while (iOfst + (i64)sizeof(rec) <= iSize)
+  {
+    if (seekAndReadFd(h, iOfst, &rec, sizeof(rec), &iErrno) != sizeof(rec)) return SQLITE_IOERR_READ;
+    if (rec.magic == SHIP_SKIP && iOfst == 0)
+    {
+      ShipSkip skip;
+      memcpy(&skip, &rec, sizeof(skip));
+      if (skip.iNext < (i64)sizeof(rec)) return SQLITE_CORRUPT;
+      iOfst = *piEnd = skip.iNext;
+      continue;
+    }
+    if (rec.magic != SHIP_MAGIC || rec.szPage < 512 || rec.szPage > 65536) return SQLITE_CORRUPT;
+    iOfst += sizeof(rec) + rec.szPage;
+    if (iOfst > iSize) break;
+    if (rec.nTruncate)
+    {
+      *piEnd = iOfst;
+      if (pLast) *pLast = rec;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Append the buffered frames, which make up a transaction of p->nCommit
+** pages that is durable in the WAL, to the log, and sync it.
+*/
+static void shipCommit(unixShipLog *p)
+{
+  int nRecord = (int)sizeof(ShipRecord) + p->szPage;
+  i64 nByte = (i64)nRecord * p->nFrame;
+  u8 *aBuf = (u8 *)sqlite3_malloc64(nByte);
+  i64 iDone = 0;
+  u32 iFrame = 0;
+  int i;
+
+  if (aBuf == 0)
+  {
+    shipFail(p, ENOMEM);
+    return;
+  }
+  for (i = 0; i < p->nFrame; i++)
+  {
+    ShipRecord rec;
+    iFrame = (u32)((p->aOfst[i] - 32) / (24 + p->szPage) + 1);
+    rec.magic = SHIP_MAGIC;
+    rec.pgno = p->aPgno[i];
+    rec.nTruncate = (i == p->nFrame - 1) ? p->nCommit : 0;
+    rec.szPage = p->szPage;
+    rec.iFrame = iFrame;
+    memcpy(rec.aSalt, p->aHdrSalt, sizeof(rec.aSalt));
+    memcpy(&aBuf[(i64)i * nRecord], &rec, sizeof(rec));
+    memcpy(&aBuf[(i64)i * nRecord + sizeof(rec)], &p->aData[(i64)i * p->szPage], p->szPage);
+  }
+  while (iDone < nByte)
+  {
+    ssize_t n = osWrite(p->h, &aBuf[iDone], (size_t)(nByte - iDone));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0)
+    {
+      shipFail(p, n < 0 ? errno : ENOSPC);
+      break;
+    }
+    iDone += n;
+  }
+  sqlite3_free(aBuf);
+  if (p->h >= 0 && full_fsync(p->h, 0, 1)) shipFail(p, errno);
+  if (p->h >= 0)
+  {
+    p->iScan += nByte;
+    p->iFrame = iFrame;
+    memcpy(p->aSalt, p->aHdrSalt, sizeof(p->aSalt));
+  }
+  shipReset(p);
+}
+
+/*
+** Called by unixSync() once -wal file pFile is synced.  Ship the
+** transaction pFile committed, if it is waiting for that.  A sync of the
+** same file by another connection may have started before the commit
+** frame was written, so it does not count.
+*/
+static void shipSynced(unixFile *pFile)
+{
+  unixShipLog *p = pFile->pShip;
+  if (__atomic_load_n(&p->pWal, __ATOMIC_ACQUIRE) == pFile) shipCommit(p);
+}
+
+/*
+** Sync the -wal file of the buffered commit, which ships it.  If the sync
+** fails, or that file was closed, drop the transaction.  It is shipped by
+** the next writer instead, see shipCatchUp().
+*/
+static void shipFlush(unixShipLog *p)
+{
+  unixFile *pWal = __atomic_load_n(&p->pWal, __ATOMIC_ACQUIRE);
+  if (pWal == 0 || unixSync((sqlite3_file *)pWal, SQLITE_SYNC_NORMAL) != SQLITE_OK) shipReset(p);
+}
+
+/*
+** Make room in the buffer of p for one more frame of amt bytes.  Return
+** 0 if out of memory.
+*/
+static int shipGrow(unixShipLog *p, int amt)
+{
+  if (p->nFrame == p->nAlloc)
+  {
+    int nNew = p->nAlloc ? p->nAlloc * 2 : 64;
+    i64 *aOfst = (i64 *)sqlite3_realloc64(p->aOfst, nNew * sizeof(i64));
+    u32 *aPgno = aOfst ? (u32 *)sqlite3_realloc64(p->aPgno, nNew * sizeof(u32)) : 0;
+    if (aOfst) p->aOfst = aOfst;
+    if (aPgno == 0) return 0;
+    p->aPgno = aPgno;
+    p->nAlloc = nNew;
+  }
+  if ((i64)(p->nFrame + 1) * amt > p->nData)
+  {
+    i64 nNew = (i64)p->nAlloc * amt;
+    u8 *aData = (u8 *)sqlite3_realloc64(p->aData, nNew);
+    if (aData == 0) return 0;
+    p->aData = aData;
+    p->nData = nNew;
+  }
+  return 1;
+}
+
+/*
+** Without powersafe overwrite, SQLite pads a commit it syncs out to a
+** sector boundary with copies of the commit frame, written after it and
+** before the sync.  Return 1 if the write of amt bytes at iOfst, following
+** the buffered commit, is part of such a copy.  It commits nothing new, so
+** the commit frame moves to the copy, which the wal-index then records as
+** the end of the transaction.  The copies have checksums of their own, and
+** the sync may split the last one.
+*/
+static int shipPadding(unixShipLog *p, const u8 *a, int amt, i64 iOfst)
+{
+  i64 iCommit = p->aOfst[p->nFrame - 1];
+  u32 pgno = p->aPgno[p->nFrame - 1];
+  u8 aHdr[16];
+
+  if (iOfst <= iCommit) return 0;
+  if ((iOfst - iCommit) % (24 + p->szPage) == 0)
+  {
+    aHdr[0] = (u8)(pgno >> 24);
+    aHdr[1] = (u8)(pgno >> 16);
+    aHdr[2] = (u8)(pgno >> 8);
+    aHdr[3] = (u8)pgno;
+    aHdr[4] = (u8)(p->nCommit >> 24);
+    aHdr[5] = (u8)(p->nCommit >> 16);
+    aHdr[6] = (u8)(p->nCommit >> 8);
+    aHdr[7] = (u8)p->nCommit;
+    memcpy(&aHdr[8], p->aHdrSalt, sizeof(p->aHdrSalt));
+    if (memcmp(a, aHdr, amt < 16 ? amt : 16)) return 0;
+    if (amt == 24)
+    {
+      p->iHdrOfst = iOfst;
+      p->hdrPgno = pgno;
+      p->hdrTruncate = p->nCommit;
+    }
+    return 1;
+  }
+  if (p->hdrPgno == 0 || iOfst != p->iHdrOfst + 24 || amt > p->szPage) return 0;
+  if (memcmp(a, &p->aData[(i64)(p->nFrame - 1) * p->szPage], amt)) return 0;
+  p->aOfst[p->nFrame - 1] = p->iHdrOfst;
+  p->hdrPgno = 0;
+  return 1;
+}
+
+/*
+** Called by unixWrite() for every write to -wal file pFile, which ships
+** frames.
+*/
+static void shipWrite(unixShipLog *p, unixFile *pFile, const void *pBuf, int amt, i64 iOfst)
+{
+  const u8 *a = (const u8 *)pBuf;
+  int i;
+
+  if (p->nCommit && shipPadding(p, a, amt, iOfst)) return;
+
+  /* Without a wal-index, as in locking_mode=EXCLUSIVE, shipEnd() is never
+  ** called, so a commit SQLite did not sync is shipped here at the latest:
+  ** when the next transaction is appended after it.  One overwritten
+  ** instead failed to commit.  The header of a frame that turned out not
+  ** to be padding is kept for the page that follows it. */
+  if (p->nCommit)
+  {
+    u32 hdrPgno = p->hdrPgno;
+    if (iOfst > p->aOfst[p->nFrame - 1]) shipFlush(p);
+    shipReset(p);
+    p->hdrPgno = hdrPgno;
+  }
+  if (p->h < 0 || iOfst < 32) return; /* Stopped, or the WAL header */
+  if (amt == 24)
+  {
+    p->iHdrOfst = iOfst;
+    p->hdrPgno = ((u32)a[0] << 24) | ((u32)a[1] << 16) | ((u32)a[2] << 8) | a[3];
+    p->hdrTruncate = ((u32)a[4] << 24) | ((u32)a[5] << 16) | ((u32)a[6] << 8) | a[7];
+    memcpy(p->aHdrSalt, &a[8], sizeof(p->aHdrSalt));
+    return;
+  }
+  if (p->hdrPgno == 0 || iOfst != p->iHdrOfst + 24) return;
+  if (p->nFrame && p->szPage != amt)
+  {
+    shipFail(p, EINVAL);
+    return;
+  }
+  p->szPage = amt;
+
+  /* A frame of the current transaction may be overwritten in place. */
+  for (i = p->nFrame; i > 0 && p->aOfst[i - 1] > p->iHdrOfst; i--)
+    ;
+  if (i == 0 || p->aOfst[i - 1] != p->iHdrOfst)
+  {
+    if (!shipGrow(p, amt))
+    {
+      shipFail(p, ENOMEM);
+      return;
+    }
+    memmove(&p->aOfst[i + 1], &p->aOfst[i], (p->nFrame - i) * sizeof(i64));
+    memmove(&p->aPgno[i + 1], &p->aPgno[i], (p->nFrame - i) * sizeof(u32));
+    memmove(&p->aData[(i64)(i + 1) * amt], &p->aData[(i64)i * amt], (i64)(p->nFrame - i) * amt);
+    p->nFrame++;
+    i++;
+  }
+  p->aOfst[i - 1] = p->iHdrOfst;
+  p->aPgno[i - 1] = p->hdrPgno;
+  memcpy(&p->aData[(i64)(i - 1) * amt], pBuf, amt);
+
+  if (p->hdrTruncate)
+  {
+    /* Frames after the commit frame belong to an abandoned transaction.
+    ** Hold the rest until the WAL is synced. */
+    p->nFrame = i;
+    p->nCommit = p->hdrTruncate;
+    __atomic_store_n(&p->pWal, pFile, __ATOMIC_RELEASE);
+  }
+  p->hdrPgno = 0;
+}
+
+/*
+** Open the log named by the "ship_log" URI parameter of main database
+** pFile, if any, when pFile is the first unixFile on its inode.
+**
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
+*/
+static int setInodeShipLog(unixFile *pFile)
+{
+  unixInodeInfo *pInode = pFile->pInode;
+  const char *zUri = (pFile->ctrlFlags & UNIXFILE_URI) ? pFile->zPath : 0;
+  const char *zLog = sqlite3_uri_parameter(zUri, "ship_log");
+  unixShipLog *p;
+
+  assert(unixInodeMutexHeld(pInode));
+  if (zLog == 0 || zLog[0] == 0 || pInode->nRef > 1) return SQLITE_OK;
+  if (zLog[0] != '/')
+  {
+    sqlite3_log(SQLITE_CANTOPEN, "ship_log must be an absolute path: %s", pFile->zPath);
+    return SQLITE_CANTOPEN;
+  }
+  p = (unixShipLog *)sqlite3_malloc64(sizeof(*p));
+  if (p == 0) return SQLITE_NOMEM;
+  memset(p, 0, sizeof(*p));
+  p->zLog = sqlite3_mprintf("%s", zLog);
+  p->h = robust_open(zLog, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0);
+  if (p->zLog == 0 || p->h < 0)
+  {
+    int rc = p->zLog ? unixLogError(SQLITE_CANTOPEN, "open", zLog) : SQLITE_NOMEM;
+    if (p->h >= 0) robust_close(pFile, p->h, __LINE__);
+    sqlite3_free(p->zLog);
+    sqlite3_free(p);
+    return rc;
+  }
+  p->nRef = 1;
+  pInode->pShip = p;
+  __atomic_fetch_add(&nShipInode, 1, __ATOMIC_RELAXED);
+  return SQLITE_OK;
+}
+
+/*
+** This routine checks if there is a RESERVED lock held on the specified
+** file by this or any other process. If such a lock is held, set *pResOut
+** to a non-zero value otherwise *pResOut is set to zero.  The return value
+** is set to SQLITE_OK unless an I/O error occurs during lock checking.
+*/
+static int unixCheckReservedLock(sqlite3_file *id, int *pResOut)
+{
+  int rc = SQLITE_OK;
+  int reserved = 0;
+  unixFile *pFile = (unixFile *)id;
+
+  SimulateIOError(return SQLITE_IOERR_CHECKRESERVEDLOCK;);
+
+  assert(pFile);
+  assert(pFile->eFileLock <= SHARED_LOCK);
+  unixEnterInodeMutex(pFile->pInode); /* Because pFile->pInode is shared across threads */
 
   /* Check if a thread in this process holds such a lock */
   if (pFile->pInode->eFileLock > SHARED_LOCK)
@@ -1338,7 +2592,7 @@ static int unixCheckReservedLock(sqlite3_file *id, int *pResOut)
   }
 #endif
 
-  unixLeaveMutex();
+  unixLeaveInodeMutex(pFile->pInode);
   OSTRACE(("TEST WR-LOCK %d %d %d (unix)\n", pFile->h, rc, reserved));
 
   *pResOut = reserved;
@@ -1346,41 +2600,26 @@ static int unixCheckReservedLock(sqlite3_file *id, int *pResOut)
 }
 
 /*
-** Set a posix-advisory-lock.
-**
-** There are two versions of this routine.  If compiled with
-** SQLITE_ENABLE_SETLK_TIMEOUT then the routine has an extra parameter
-** which is a pointer to a unixFile.  If the unixFile->iBusyTimeout
-** value is set, then it is the number of milliseconds to wait before
-** failing the lock.  The iBusyTimeout value is always reset back to
-** zero on each call.
+** Set a posix-advisory-lock.  This is always a non-blocking attempt.
 **
-** If SQLITE_ENABLE_SETLK_TIMEOUT is not defined, then do a non-blocking
-** attempt to set the lock.
+** POSIX locks are taken with the inode or shm node mutex held, so waiting
+** here would stall every other connection to the file in this process,
+** including one that might be about to release the lock.  The lock waits
+** governed by unixFile.iBusyTimeout are done by ofdFileLockWait() and
+** unixShmLock() instead, without holding any mutex.
 */
-#ifndef SQLITE_ENABLE_SETLK_TIMEOUT
 #define osSetPosixAdvisoryLock(h, x, t) osFcntl(h, F_SETLK, x)
-#else
-static int osSetPosixAdvisoryLock(int h,               /* The file descriptor on which to take the lock */
-                                  struct flock *pLock, /* The description of the lock */
-                                  unixFile *pFile      /* Structure holding timeout value */
-                                  )
-{
-  int rc = osFcntl(h, F_SETLK, pLock);
-  while (rc < 0 && pFile->iBusyTimeout > 0)
-  {
-    /* On systems that support some kind of blocking file lock with a timeout,
-    ** make appropriate changes here to invoke that blocking file lock.  On
-    ** generic posix, however, there is no such API.  So we simply try the
-    ** lock once every millisecond until either the timeout expires, or until
-    ** the lock is obtained. */
-    usleep(1000);
-    rc = osFcntl(h, F_SETLK, pLock);
-    pFile->iBusyTimeout--;
-  }
-  return rc;
+
+/*
+** Return the CLOCK_MONOTONIC time in milliseconds.  Used for the
+** deadlines of lock waits.
+*/
+static i64 unixMonotonicMs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (i64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
-#endif /* SQLITE_ENABLE_SETLK_TIMEOUT */
 
 /*
 ** Attempt to set a system-lock on the file pFile.  The lock is
@@ -1405,8 +2644,8 @@ static int unixFileLock(unixFile *pFile, struct flock *pLock)
 {
   int rc;
   unixInodeInfo *pInode = pFile->pInode;
-  assert(unixMutexHeld());
   assert(pInode != 0);
+  assert(unixInodeMutexHeld(pInode));
   if ((pFile->ctrlFlags & (UNIXFILE_EXCL | UNIXFILE_RDONLY)) == UNIXFILE_EXCL)
   {
     if (pInode->bProcessLock == 0)
@@ -1511,7 +2750,7 @@ static int unixLock(sqlite3_file *id, int eFileLock)
 
   /* If there is already a lock of this type or more restrictive on the
   ** unixFile, do nothing. Don't use the end_lock: exit path, as
-  ** unixEnterMutex() hasn't been called yet.
+  ** unixEnterInodeMutex() hasn't been called yet.
   */
   if (pFile->eFileLock >= eFileLock)
   {
@@ -1530,8 +2769,8 @@ static int unixLock(sqlite3_file *id, int eFileLock)
 
   /* This mutex is needed because pFile->pInode is shared across threads
   */
-  unixEnterMutex();
   pInode = pFile->pInode;
+  unixEnterInodeMutex(pInode);
 
   /* If some thread using this PID has a lock via a different unixFile*
   ** handle that precludes the requested lock, return BUSY.
@@ -1687,7 +2926,8 @@ static int unixLock(sqlite3_file *id, int eFileLock)
   }
 
 end_lock:
-  unixLeaveMutex();
+  unixLeaveInodeMutex(pInode);
+  vfsstatAdd(pFile->pStat, rc == SQLITE_OK ? VFSSTAT_LOCK : VFSSTAT_LOCK_FAIL, 1);
   OSTRACE(("LOCK    %d %s %s (unix)\n", pFile->h, azFileLock(eFileLock), rc == SQLITE_OK ? "ok" : "failed"));
   return rc;
 }
@@ -1704,7 +2944,7 @@ static void setPendingFd(unixFile *pFile)
   pInode->pUnused = p;
   pFile->h = -1;
   pFile->pPreallocatedUnused = 0;
-  nUnusedFd++;
+  __atomic_fetch_add(&nUnusedFd, 1, __ATOMIC_RELAXED);
 }
 
 /*
@@ -1736,8 +2976,8 @@ static int posixUnlock(sqlite3_file *id, int eFileLock, int handleNFSUnlock)
   {
     return SQLITE_OK;
   }
-  unixEnterMutex();
   pInode = pFile->pInode;
+  unixEnterInodeMutex(pInode);
   assert(pInode->nShared != 0);
   if (pFile->eFileLock > SHARED_LOCK)
   {
@@ -1888,7 +3128,7 @@ static int posixUnlock(sqlite3_file *id, int eFileLock, int handleNFSUnlock)
   }
 
 end_unlock:
-  unixLeaveMutex();
+  unixLeaveInodeMutex(pInode);
   if (rc == SQLITE_OK) pFile->eFileLock = eFileLock;
   return rc;
 }
@@ -1911,8 +3151,40 @@ static int unixUnlock(sqlite3_file *id, int eFileLock)
 #if SQLITE_MAX_MMAP_SIZE > 0
 static int unixMapfile(unixFile *pFd, i64 nByte);
 static void unixUnmapfile(unixFile *pFd);
+static int unixMmapBackoff(unixFile *pFd, i64 iOff, int nAmt);
 #endif
 
+static void unixDirectWalClose(unixFile *pFile);
+
+/* Forward references to the io_uring backend */
+#define URING_DEPTH 64           /* Submission queue entries per ring */
+#define URING_BUFSZ (256 * 1024) /* Size of the registered staging buffer */
+static void uringClose(unixUring *p);
+static int uringFlush(unixFile *pFile);
+static int uringWrite(unixFile *pFile, const void *pBuf, int amt, i64 iOfst);
+static int uringSync(unixFile *pFile);
+
+/* Forward reference to write combining */
+static int unixCombineSync(unixFile *pFile, i64 iOfst, int nAmt);
+
+/* Forward reference to sync strategies */
+static void unixDirtyAdd(unixFile *pFile, i64 iOfst, i64 nByte);
+
+/*
+** Stop the prefetch workers from using the file descriptor of pFile, which
+** is about to be closed or handed to setPendingFd().  They read ahead on
+** the descriptor itself rather than on a duplicate, as closing a duplicate
+** would drop the POSIX locks of every connection to the file.
+*/
+static void unixPrefetchCancel(unixFile *pFile)
+{
+  if (pFile->ctrlFlags & UNIXFILE_PREFETCH)
+  {
+    vfsprefetch_cancel(pFile->h);
+    pFile->ctrlFlags &= ~UNIXFILE_PREFETCH;
+  }
+}
+
 /*
 ** This function performs the parts of the "close file" operation
 ** common to all locking schemes. It closes the directory and file
@@ -1926,6 +3198,7 @@ static void unixUnmapfile(unixFile *pFd);
 static int closeUnixFile(sqlite3_file *id)
 {
   unixFile *pFile = (unixFile *)id;
+  unixPrefetchCancel(pFile);
 #if SQLITE_MAX_MMAP_SIZE > 0
   unixUnmapfile(pFile);
 #endif
@@ -1944,7 +3217,12 @@ static int closeUnixFile(sqlite3_file *id)
 #endif
   OSTRACE(("CLOSE   %-3d\n", pFile->h));
   OpenCounter(-1);
-  sqlite3_free(pFile->pPreallocatedUnused);
+  vfspool_free(pFile->pPreallocatedUnused);
+  sqlite3_free(pFile->zRedirectPath);
+  vfsstat_close(pFile->pStat);
+  uringClose(pFile->pUring);
+  sqlite3_free(pFile->pCombine);
+  unixDirectWalClose(pFile);
   memset(pFile, 0, sizeof(unixFile));
   return SQLITE_OK;
 }
@@ -1955,10 +3233,15 @@ static int closeUnixFile(sqlite3_file *id)
 static int unixClose(sqlite3_file *id)
 {
   int rc = SQLITE_OK;
+  int rc2;
   unixFile *pFile = (unixFile *)id;
-  verifyDbFile(pFile);
+  unixInodeBucket *pBucket = pFile->pInode->pBucket;
+  verifyDbFile(pFile, 0);
+  unixPrefetchCancel(pFile);
+  if (pFile->pUring) rc = uringFlush(pFile);
+  if (pFile->pCombine) rc = unixCombineSync(pFile, 0, 0);
   unixUnlock(id, NO_LOCK);
-  unixEnterMutex();
+  unixEnterInodeMutex(pFile->pInode);
 
   /* unixFile.pInode is always valid here. Otherwise, a different close
   ** routine (e.g. nolockClose()) would be called instead.
@@ -1973,65 +3256,455 @@ static int unixClose(sqlite3_file *id)
     */
     setPendingFd(pFile);
   }
+  if (pFile->pShip) shipRelease(pFile->pShip, pFile);
   releaseInodeInfo(pFile);
-  rc = closeUnixFile(id);
-  unixLeaveMutex();
-  return rc;
+  rc2 = closeUnixFile(id);
+  pBucket->mutex.unlock(); /* pFile->pInode may have been freed */
+  return rc == SQLITE_OK ? rc2 : rc;
 }
 
 /************** End of the posix advisory lock implementation *****************
 ******************************************************************************/
 
 /******************************************************************************
-**************** Non-locking sqlite3_file methods *****************************
+************************* Begin OFD Locking ***********************************
 **
-** The next division contains implementations for all methods of the
-** sqlite3_file object other than the locking methods.  The locking
-** methods were defined in divisions above (one locking method per
-** division).  Those methods that are common to all locking modes
-** are gather together into this division.
+** The "proc-ofd" VFS uses open file description locks (F_OFD_SETLK, Linux
+** 3.15 and later) on the same bytes as POSIX advisory locking.  OFD locks
+** belong to the open file description rather than to the process, so
+** two unixFile objects on one database conflict with each other exactly
+** as two processes do, and closing one of them never drops the locks of
+** another.  Each unixFile therefore takes and releases its own locks
+** directly: there is no shared lock state in unixInodeInfo, no inode
+** mutex around lock changes and no list of file descriptors whose close
+** is deferred.  The unixInodeInfo is still shared for the wal-index and
+** the other per-database state.
+**
+** OFD locks and POSIX advisory locks on the same file conflict with each
+** other, so connections using "proc" and "proc-ofd" may safely share a
+** database, in the same process or in different ones.  In the same
+** process, ofdClose() still defers the close while "proc" files hold
+** POSIX locks, since those would be dropped by closing any descriptor.
 */
+#if HAVE_OFD_LOCKS
 
 /*
-** Seek to the offset passed as the second argument, then read cnt
-** bytes into pBuf. Return the number of bytes actually read.
-**
-** NB:  If you define USE_PREAD or USE_PREAD64, then it might also
-** be necessary to define _XOPEN_SOURCE to be 500.  This varies from
-** one system to another.  Since SQLite does not define USE_PREAD
-** in any form by default, we will not attempt to define _XOPEN_SOURCE.
-** See tickets #2741 and #2681.
-**
-** To avoid stomping the errno value on a failed read the lastErrno value
-** is set before returning.
+** Set or clear an OFD lock on pFile.  Return 0 on success or -1 with
+** errno set, like fcntl().
 */
-static int seekAndRead(unixFile *id, sqlite3_int64 offset, void *pBuf, int cnt)
+static int ofdFileLock(unixFile *pFile, struct flock *pLock)
 {
-  int got;
-  int prior = 0;
+  pLock->l_whence = SEEK_SET;
+  pLock->l_pid = 0; /* Required by F_OFD_SETLK */
+  return osFcntl(pFile->h, F_OFD_SETLK, pLock);
+}
+
+/*
+** Signal that cuts short an F_OFD_SETLKW wait at its deadline.  It is only
+** used if nothing else in the process has a handler for it, and is only
+** ever sent to a thread while it waits in ofdFileLockWait().
+*/
+#ifndef PROCVFS_LOCK_SIGNAL
+#define PROCVFS_LOCK_SIGNAL (SIGRTMIN + 6)
+#endif
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static void ofdLockSignalHandler(int sig) { UNUSED_PARAMETER(sig); }
+
+/*
+** Return true if PROCVFS_LOCK_SIGNAL can interrupt a lock wait in the
+** calling thread.  The handler is installed, without SA_RESTART, the
+** first time this is called.
+*/
+static int ofdLockSignalReady(void)
+{
+  static int eReady = 0; /* 0: not yet checked, 1: usable, 2: not usable */
+  int e = __atomic_load_n(&eReady, __ATOMIC_ACQUIRE);
+  sigset_t mask;
+
+  if (e == 0)
+  {
+    unixEnterMutex();
+    e = eReady;
+    if (e == 0)
+    {
+      struct sigaction sa, old;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = ofdLockSignalHandler;
+      sigemptyset(&sa.sa_mask);
+      e = 2;
+      if (sigaction(PROCVFS_LOCK_SIGNAL, 0, &old) == 0 && (old.sa_flags & SA_SIGINFO) == 0 &&
+          old.sa_handler == SIG_DFL && sigaction(PROCVFS_LOCK_SIGNAL, &sa, 0) == 0)
+      {
+        e = 1;
+      }
+      __atomic_store_n(&eReady, e, __ATOMIC_RELEASE);
+    }
+    unixLeaveMutex();
+  }
+  if (e != 1) return 0;
+
+  /* A thread that blocks the signal could never be woken */
+  return pthread_sigmask(SIG_BLOCK, 0, &mask) == 0 && !sigismember(&mask, PROCVFS_LOCK_SIGNAL);
+}
+
+/*
+** Like ofdFileLock(), but if another open file description holds a
+** conflicting lock, wait up to ms milliseconds for it in F_OFD_SETLKW.
+** The waiter wakes as soon as the kernel grants the lock.  A timer signals
+** the thread at the deadline and then every millisecond after it, so the
+** wait ends even if the first signal arrives just before fcntl() starts.
+** A wait that times out fails with errno set to EAGAIN.
+*/
+static int ofdFileLockWait(unixFile *pFile, struct flock *pLock, unsigned ms)
+{
+  struct sigevent sev;
+  struct itimerspec its;
+  struct timespec zero = {0, 0};
+  sigset_t set, old;
+  timer_t timer;
+  i64 iDeadline;
+  int rc;
+  int e;
+
+  rc = ofdFileLock(pFile, pLock);
+  if (rc == 0 || ms == 0 || (errno != EAGAIN && errno != EACCES) || !ofdLockSignalReady()) return rc;
+
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = PROCVFS_LOCK_SIGNAL;
+  sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+  if (timer_create(CLOCK_MONOTONIC, &sev, &timer))
+  {
+    errno = EAGAIN;
+    return -1;
+  }
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  its.it_interval.tv_nsec = 1000000L;
+  iDeadline = unixMonotonicMs() + ms;
+  timer_settime(timer, 0, &its, 0);
+  do
+  {
+    rc = osFcntl(pFile->h, F_OFD_SETLKW, pLock);
+  } while (rc < 0 && errno == EINTR && unixMonotonicMs() < iDeadline);
+  e = (rc < 0 && errno == EINTR) ? EAGAIN : errno;
+
+  /* Delete the timer with its signal blocked, and consume a tick sent
+  ** before that, so that none can interrupt a system call of the caller
+  ** once the wait is over. */
+  sigemptyset(&set);
+  sigaddset(&set, PROCVFS_LOCK_SIGNAL);
+  pthread_sigmask(SIG_BLOCK, &set, &old);
+  timer_delete(timer);
+  while (sigtimedwait(&set, 0, &zero) == PROCVFS_LOCK_SIGNAL)
+    ;
+  pthread_sigmask(SIG_SETMASK, &old, 0);
+  errno = e;
+  return rc;
+}
+
+/*
+** This routine checks if there is a RESERVED lock held on the specified
+** file by any unixFile, in this or any other process.
+*/
+static int ofdCheckReservedLock(sqlite3_file *id, int *pResOut)
+{
+  unixFile *pFile = (unixFile *)id;
+  struct flock lock;
+  int rc = SQLITE_OK;
+  int reserved = 0;
+
+  SimulateIOError(return SQLITE_IOERR_CHECKRESERVEDLOCK;);
+  assert(pFile);
+  assert(pFile->eFileLock <= SHARED_LOCK);
+  memset(&lock, 0, sizeof(lock));
+  lock.l_whence = SEEK_SET;
+  lock.l_start = RESERVED_BYTE;
+  lock.l_len = 1;
+  lock.l_type = F_WRLCK;
+  if (osFcntl(pFile->h, F_OFD_GETLK, &lock))
+  {
+    rc = SQLITE_IOERR_CHECKRESERVEDLOCK;
+    storeLastErrno(pFile, errno);
+  }
+  else if (lock.l_type != F_UNLCK)
+  {
+    reserved = 1;
+  }
+  OSTRACE(("TEST WR-LOCK %d %d %d (ofd)\n", pFile->h, rc, reserved));
+  *pResOut = reserved;
+  return rc;
+}
+
+/*
+** Lock the file with the lock specified by parameter eFileLock.  See
+** unixLock() for the lock states and the bytes used for each.
+**
+** Up to unixFile.iBusyTimeout milliseconds are spent waiting for a lock
+** only where the wait cannot be part of a deadlock: going from no lock to
+** SHARED, and waiting for readers to clear once PENDING is held.  Taking
+** RESERVED or PENDING while holding SHARED never waits, as the holder may
+** itself be waiting for our SHARED lock to go away.
+*/
+static int ofdLock(sqlite3_file *id, int eFileLock)
+{
+  unixFile *pFile = (unixFile *)id;
+  struct flock lock;
+  int rc = SQLITE_OK;
+  int tErrno = 0;
+
+  assert(pFile);
+  OSTRACE(("LOCK    %d %s was %s (ofd)\n", pFile->h, azFileLock(eFileLock), azFileLock(pFile->eFileLock)));
+  if (pFile->eFileLock >= eFileLock) return SQLITE_OK;
+  assert(pFile->eFileLock != NO_LOCK || eFileLock == SHARED_LOCK);
+  assert(eFileLock != PENDING_LOCK);
+  assert(eFileLock != RESERVED_LOCK || pFile->eFileLock == SHARED_LOCK);
+
+  /* A PENDING lock is needed before acquiring a SHARED lock and before
+  ** acquiring an EXCLUSIVE lock.  For the SHARED lock, the PENDING will
+  ** be released.
+  */
+  memset(&lock, 0, sizeof(lock));
+  lock.l_len = 1L;
+  if (eFileLock == SHARED_LOCK || (eFileLock == EXCLUSIVE_LOCK && pFile->eFileLock < PENDING_LOCK))
+  {
+    lock.l_type = (eFileLock == SHARED_LOCK ? F_RDLCK : F_WRLCK);
+    lock.l_start = PENDING_BYTE;
+    if (ofdFileLockWait(pFile, &lock, eFileLock == SHARED_LOCK ? pFile->iBusyTimeout : 0))
+    {
+      tErrno = errno;
+      rc = sqliteErrorFromPosixError(tErrno, SQLITE_IOERR_LOCK);
+      goto end_ofd_lock;
+    }
+  }
+
+  if (eFileLock == SHARED_LOCK)
+  {
+    lock.l_start = SHARED_FIRST;
+    lock.l_len = SHARED_SIZE;
+    if (ofdFileLockWait(pFile, &lock, pFile->iBusyTimeout))
+    {
+      tErrno = errno;
+      rc = sqliteErrorFromPosixError(tErrno, SQLITE_IOERR_LOCK);
+    }
+
+    /* Drop the temporary PENDING lock */
+    lock.l_start = PENDING_BYTE;
+    lock.l_len = 1L;
+    lock.l_type = F_UNLCK;
+    if (ofdFileLock(pFile, &lock) && rc == SQLITE_OK)
+    {
+      tErrno = errno;
+      rc = SQLITE_IOERR_UNLOCK;
+    }
+  }
+  else
+  {
+    /* The request was for a RESERVED or EXCLUSIVE lock.  There is a SHARED
+    ** or greater lock on the file already.  */
+    assert(eFileLock == RESERVED_LOCK || eFileLock == EXCLUSIVE_LOCK);
+    lock.l_type = F_WRLCK;
+    lock.l_start = (eFileLock == RESERVED_LOCK ? RESERVED_BYTE : SHARED_FIRST);
+    lock.l_len = (eFileLock == RESERVED_LOCK ? 1L : SHARED_SIZE);
+    if (ofdFileLockWait(pFile, &lock, eFileLock == EXCLUSIVE_LOCK ? pFile->iBusyTimeout : 0))
+    {
+      tErrno = errno;
+      rc = sqliteErrorFromPosixError(tErrno, SQLITE_IOERR_LOCK);
+    }
+  }
+
+#ifdef SQLITE_DEBUG
+  if (rc == SQLITE_OK && pFile->eFileLock <= SHARED_LOCK && eFileLock == RESERVED_LOCK)
+  {
+    pFile->transCntrChng = 0;
+    pFile->dbUpdate = 0;
+    pFile->inNormalWrite = 1;
+  }
+#endif
+
+  if (rc == SQLITE_OK)
+  {
+    pFile->eFileLock = eFileLock;
+  }
+  else if (eFileLock == EXCLUSIVE_LOCK)
+  {
+    pFile->eFileLock = PENDING_LOCK;
+  }
+
+end_ofd_lock:
+  if (rc != SQLITE_OK && rc != SQLITE_BUSY) storeLastErrno(pFile, tErrno);
+  vfsstatAdd(pFile->pStat, rc == SQLITE_OK ? VFSSTAT_LOCK : VFSSTAT_LOCK_FAIL, 1);
+  OSTRACE(("LOCK    %d %s %s (ofd)\n", pFile->h, azFileLock(eFileLock), rc == SQLITE_OK ? "ok" : "failed"));
+  return rc;
+}
+
+/*
+** Lower the locking level on pFile to eFileLock, which must be either
+** NO_LOCK or SHARED_LOCK.
+*/
+static int ofdUnlock(sqlite3_file *id, int eFileLock)
+{
+  unixFile *pFile = (unixFile *)id;
+  struct flock lock;
+
+  assert(pFile);
+  assert(eFileLock <= SHARED_LOCK);
+#if SQLITE_MAX_MMAP_SIZE > 0
+  assert(eFileLock == SHARED_LOCK || pFile->nFetchOut == 0);
+#endif
+  OSTRACE(("UNLOCK  %d %d was %d (ofd)\n", pFile->h, eFileLock, pFile->eFileLock));
+  if (pFile->eFileLock <= eFileLock) return SQLITE_OK;
+
+  memset(&lock, 0, sizeof(lock));
+  if (pFile->eFileLock > SHARED_LOCK)
+  {
+#ifdef SQLITE_DEBUG
+    assert(pFile->inNormalWrite == 0 || pFile->dbUpdate == 0 || pFile->transCntrChng == 1);
+    pFile->inNormalWrite = 0;
+#endif
+    if (eFileLock == SHARED_LOCK)
+    {
+      lock.l_type = F_RDLCK;
+      lock.l_start = SHARED_FIRST;
+      lock.l_len = SHARED_SIZE;
+      if (ofdFileLock(pFile, &lock))
+      {
+        /* Another unixFile broke the locking protocol.  See posixUnlock() */
+        storeLastErrno(pFile, errno);
+        return SQLITE_IOERR_RDLOCK;
+      }
+    }
+    lock.l_type = F_UNLCK;
+    lock.l_start = PENDING_BYTE;
+    lock.l_len = 2L;
+    assert(PENDING_BYTE + 1 == RESERVED_BYTE);
+    if (ofdFileLock(pFile, &lock))
+    {
+      storeLastErrno(pFile, errno);
+      return SQLITE_IOERR_UNLOCK;
+    }
+    pFile->eFileLock = SHARED_LOCK;
+  }
+  if (eFileLock == NO_LOCK)
+  {
+    lock.l_type = F_UNLCK;
+    lock.l_start = lock.l_len = 0L;
+    if (ofdFileLock(pFile, &lock))
+    {
+      storeLastErrno(pFile, errno);
+      pFile->eFileLock = NO_LOCK;
+      return SQLITE_IOERR_UNLOCK;
+    }
+  }
+  pFile->eFileLock = eFileLock;
+  return SQLITE_OK;
+}
+
+/*
+** Close a file.  Its locks go with its open file description, so the file
+** descriptor is closed at once even if other OFD files on the same inode
+** hold locks.
+*/
+static int ofdClose(sqlite3_file *id)
+{
+  unixFile *pFile = (unixFile *)id;
+  unixInodeBucket *pBucket = pFile->pInode->pBucket;
+  int rc = SQLITE_OK;
+  int rc2;
+
+  verifyDbFile(pFile, 0);
+  unixPrefetchCancel(pFile);
+  if (pFile->pUring) rc = uringFlush(pFile);
+  if (pFile->pCombine) rc = unixCombineSync(pFile, 0, 0);
+  ofdUnlock(id, NO_LOCK);
+  if (pFile->pShip) shipRelease(pFile->pShip, pFile);
+  unixEnterInodeMutex(pFile->pInode);
+  if (pFile->pInode->nLock)
+  {
+    /* A "proc" file in this process holds POSIX locks on the inode, and
+    ** closing any descriptor would drop them.  Defer the close as
+    ** unixClose() does.  The flags of -1 keep findReusableFd() from
+    ** handing the descriptor out again.  */
+    UnixUnusedFd *p = (UnixUnusedFd *)vfspool_alloc(&unusedFdPool, sizeof(*p));
+    if (p)
+    {
+      p->fd = pFile->h;
+      p->flags = -1;
+      pFile->pPreallocatedUnused = p;
+      setPendingFd(pFile);
+    }
+  }
+  releaseInodeInfo(pFile);
+  pBucket->mutex.unlock(); /* pFile->pInode may have been freed */
+  pFile->pInode = 0;
+  rc2 = closeUnixFile(id);
+  return rc == SQLITE_OK ? rc2 : rc;
+}
+
+#endif /* HAVE_OFD_LOCKS */
+/*
+************************** End of the OFD lock implementation ****************
+******************************************************************************/
+
+/******************************************************************************
+**************** Non-locking sqlite3_file methods *****************************
+**
+** The next division contains implementations for all methods of the
+** sqlite3_file object other than the locking methods.  The locking
+** methods were defined in divisions above (one locking method per
+** division).  Those methods that are common to all locking modes
+** are gather together into this division.
+*/
+
+/*
+** Seek to the offset passed as the second argument, then read cnt
+** bytes into pBuf. Return the number of bytes actually read.
+**
+** NB:  If you define USE_PREAD or USE_PREAD64, then it might also
+** be necessary to define _XOPEN_SOURCE to be 500.  This varies from
+** one system to another.  Since SQLite does not define USE_PREAD
+** in any form by default, we will not attempt to define _XOPEN_SOURCE.
+** See tickets #2741 and #2681.
+**
+** To avoid stomping the errno value on a failed read the error number
+** is written to *piErrno before returning.
+*/
+static int seekAndReadFd(int fd,                 /* File descriptor to read from */
+                         sqlite3_int64 offset,   /* Offset to read from */
+                         void *pBuf,             /* Read data into this buffer */
+                         int cnt,                /* Bytes to read */
+                         int *piErrno            /* OUT: Error number if error occurs */
+                         )
+{
+  int got;
+  int prior = 0;
 #if (!defined(USE_PREAD) && !defined(USE_PREAD64))
   i64 newOffset;
 #endif
   TIMER_START;
   assert(cnt == (cnt & 0x1ffff));
-  assert(id->h > 2);
+  assert(fd > 2);
   do
   {
 #if defined(USE_PREAD)
-    got = osPread(id->h, pBuf, cnt, offset);
+    got = osPread(fd, pBuf, cnt, offset);
     SimulateIOError(got = -1);
 #elif defined(USE_PREAD64)
-    got = osPread64(id->h, pBuf, cnt, offset);
+    got = osPread64(fd, pBuf, cnt, offset);
     SimulateIOError(got = -1);
 #else
-    newOffset = lseek(id->h, offset, SEEK_SET);
+    newOffset = lseek(fd, offset, SEEK_SET);
     SimulateIOError(newOffset = -1);
     if (newOffset < 0)
     {
-      storeLastErrno((unixFile *)id, errno);
+      *piErrno = errno;
       return -1;
     }
-    got = osRead(id->h, pBuf, cnt);
+    got = osRead(fd, pBuf, cnt);
 #endif
     if (got == cnt) break;
     if (got < 0)
@@ -2042,7 +3715,7 @@ static int seekAndRead(unixFile *id, sqlite3_int64 offset, void *pBuf, int cnt)
         continue;
       }
       prior = 0;
-      storeLastErrno((unixFile *)id, errno);
+      *piErrno = errno;
       break;
     }
     else if (got > 0)
@@ -2054,10 +3727,25 @@ static int seekAndRead(unixFile *id, sqlite3_int64 offset, void *pBuf, int cnt)
     }
   } while (got > 0);
   TIMER_END;
-  OSTRACE(("READ    %-3d %5d %7lld %llu\n", id->h, got + prior, offset - prior, TIMER_ELAPSED));
+  OSTRACE(("READ    %-3d %5d %7lld %llu\n", fd, got + prior, offset - prior, TIMER_ELAPSED));
   return got + prior;
 }
 
+static int unixDirectIo(unixFile *pFile, int bWrite, u8 *pBuf, int cnt, i64 iOff);
+
+/*
+** Read cnt bytes at the given offset of file id into pBuf, setting the
+** lastErrno value of id on failure.
+*/
+static int seekAndRead(unixFile *id, sqlite3_int64 offset, void *pBuf, int cnt)
+{
+  if ((id->ctrlFlags & UNIXFILE_DIRECT) || id->pDirectWal)
+  {
+    return unixDirectIo(id, 0, (u8 *)pBuf, cnt, offset);
+  }
+  return seekAndReadFd(id->h, offset, pBuf, cnt, &id->lastErrno);
+}
+
 /*
 ** Read data from a file into a buffer.  Return SQLITE_OK if all
 ** bytes were read successfully and SQLITE_IOERR if anything goes
@@ -2070,6 +3758,18 @@ static int unixRead(sqlite3_file *id, void *pBuf, int amt, sqlite3_int64 offset)
   assert(id);
   assert(offset >= 0);
   assert(amt > 0);
+  vfsstatAdd(pFile->pStat, VFSSTAT_READ, 1);
+  vfsstatAdd(pFile->pStat, VFSSTAT_READ_BYTES, amt);
+  if (pFile->pUring)
+  {
+    int rc = uringFlush(pFile);
+    if (rc != SQLITE_OK) return rc;
+  }
+  if (pFile->pCombine)
+  {
+    int rc = unixCombineSync(pFile, offset, amt);
+    if (rc != SQLITE_OK) return rc;
+  }
 
 /* If this is a database file (not a journal, master-journal or temp
 ** file), the bytes in the locking range should never be read or written. */
@@ -2083,11 +3783,12 @@ static int unixRead(sqlite3_file *id, void *pBuf, int amt, sqlite3_int64 offset)
 #if SQLITE_MAX_MMAP_SIZE > 0
   /* Deal with as much of this read request as possible by transfering
   ** data from the memory mapping using memcpy().  */
-  if (offset < pFile->mmapSize)
+  if (offset < pFile->mmapSize && !unixMmapBackoff(pFile, offset, amt))
   {
     if (offset + amt <= pFile->mmapSize)
     {
       memcpy(pBuf, &((u8 *)(pFile->pMapRegion))[offset], amt);
+      vfsstatAdd(pFile->pStat, VFSSTAT_MMAP_HIT, 1);
       return SQLITE_OK;
     }
     else
@@ -2099,6 +3800,10 @@ static int unixRead(sqlite3_file *id, void *pBuf, int amt, sqlite3_int64 offset)
       offset += nCopy;
     }
   }
+  if (pFile->mmapSizeMax > 0)
+  {
+    vfsstatAdd(pFile->pStat, VFSSTAT_PREAD_FALLBACK, 1);
+  }
 #endif
 
   got = seekAndRead(pFile, offset, pBuf, amt);
@@ -2182,3159 +3887,8382 @@ static int seekAndWriteFd(int fd,           /* File descriptor to write to */
 */
 static int seekAndWrite(unixFile *id, i64 offset, const void *pBuf, int cnt)
 {
+  if ((id->ctrlFlags & UNIXFILE_DIRECT) || id->pDirectWal)
+  {
+    return unixDirectIo(id, 1, (u8 *)pBuf, cnt, offset);
+  }
   return seekAndWriteFd(id->h, offset, pBuf, cnt, &id->lastErrno);
 }
 
+/******************************************************************************
+********************************** Direct I/O *********************************
+**
+** A database opened with the "direct_io=1" URI parameter is read and
+** written with O_DIRECT, bypassing the page cache.  O_DIRECT transfers
+** must start and end on UNIX_DIRECT_ALIGN boundaries, from memory aligned
+** the same way.  SQLite makes no such promise, so a transfer that does not
+** qualify goes through a bounce buffer instead: a read fetches the covering
+** aligned range and copies out of it, and a write reads that range,
+** patches it and writes it back whole.  Bounce buffers come from a small
+** pool, so steady-state I/O does not allocate.
+**
+** Memory mapping is turned off for direct files, since page faults would
+** go through the page cache that O_DIRECT is meant to avoid.
+**
+** The -wal file gets its own layout.  SQLite writes it as a 32-byte header
+** followed by frames of a 24-byte header and one page, so only the first
+** frame would be aligned.  Instead, the -wal file proper holds the page
+** images, each in a slot of its own that starts on a UNIX_DIRECT_ALIGN
+** boundary, and the headers are kept in a buffered side file named
+** "<wal>-hdr":
+**
+**   -wal-hdr:  WAL header | frame header 0 | frame header 1 | ...
+**   -wal:      page 0 [padding] | page 1 [padding] | ...
+**
+** A page smaller than UNIX_DIRECT_ALIGN is written padded with zeros to
+** the size of its slot.  Appending a frame therefore never rewrites the
+** block of a frame already committed, which a torn write could damage,
+** and never leaves the file ending part way through a block.
+**
+** unixDirectWalIo() translates offsets in the WAL that SQLite sees to
+** offsets in the two files.  The layout is only understood by this VFS,
+** and the existence of the -wal-hdr file records it on disk.  The first
+** -wal file opened for the database in this process follows what is found
+** there, whatever "direct_io" says: the split layout if there is a -wal-hdr
+** file, and the usual one if there is a -wal file with content but no
+** -wal-hdr file.  So a log in one layout is never read as an empty log in
+** the other and reset.  Connections in different processes that open the
+** database at the same time must still agree on "direct_io".  Rollback
+** journals and temporary files stay buffered.
+*/
+#define UNIX_DIRECT_ALIGN 4096                               /* O_DIRECT alignment */
+#define UNIX_DIRECT_BUFSZ (65536 + 2 * UNIX_DIRECT_ALIGN)    /* Pooled buffer size */
+#define UNIX_DIRECT_NBUF 16                                  /* Pooled buffers kept */
+#define UNIX_WAL_HDRSIZE 32                                  /* Size of the WAL header */
+#define UNIX_WAL_FRAME_HDRSIZE 24                            /* Size of a frame header */
+
 /*
-** Write data from a buffer into a file.  Return SQLITE_OK on success
-** or some other error code on failure.
+** State of a -wal file using the split layout.
 */
-static int unixWrite(sqlite3_file *id, const void *pBuf, int amt, sqlite3_int64 offset)
+struct unixDirectWal
 {
-  unixFile *pFile = (unixFile *)id;
-  int wrote = 0;
-  assert(id);
-  assert(amt > 0);
+  int hHdr;   /* The -wal-hdr file */
+  int szPage; /* Page size from the WAL header, or 0 if not yet known */
+};
 
-/* If this is a database file (not a journal, master-journal or temp
-** file), the bytes in the locking range should never be read or written. */
-#if 0
-  assert( pFile->pPreallocatedUnused==0
-       || offset>=PENDING_BYTE+512
-       || offset+amt<=PENDING_BYTE 
-  );
-#endif
+static std::mutex directPoolMutex;              /* Protects the two below */
+static void *apDirectFree[UNIX_DIRECT_NBUF];    /* Free pooled buffers */
+static int nDirectFree = 0;                     /* Valid entries in apDirectFree[] */
 
-#ifdef SQLITE_DEBUG
-  /* If we are doing a normal write to a database file (as opposed to
-  ** doing a hot-journal rollback or a write to some file other than a
-  ** normal database file) then record the fact that the database
-  ** has changed.  If the transaction counter is modified, record that
-  ** fact too.
-  */
-  if (pFile->inNormalWrite)
+/*
+** Return a buffer of at least nByte bytes aligned to UNIX_DIRECT_ALIGN,
+** or NULL if out of memory.  Free it with directBufFree().
+*/
+static u8 *directBufAlloc(int nByte)
+{
+  void *p = 0;
+  if (nByte <= UNIX_DIRECT_BUFSZ)
   {
-    pFile->dbUpdate = 1; /* The database has been modified */
-    if (offset <= 24 && offset + amt >= 27)
-    {
-      int rc;
-      char oldCntr[4];
-      SimulateIOErrorBenign(1);
-      rc = seekAndRead(pFile, 24, oldCntr, 4);
-      SimulateIOErrorBenign(0);
-      if (rc != 4 || memcmp(oldCntr, &((char *)pBuf)[24 - offset], 4) != 0)
-      {
-        pFile->transCntrChng = 1; /* The transaction counter has changed */
-      }
-    }
+    directPoolMutex.lock();
+    if (nDirectFree > 0) p = apDirectFree[--nDirectFree];
+    directPoolMutex.unlock();
+    if (p) return (u8 *)p;
+    nByte = UNIX_DIRECT_BUFSZ;
   }
-#endif
+  if (posix_memalign(&p, UNIX_DIRECT_ALIGN, nByte)) return 0;
+  return (u8 *)p;
+}
 
-#if defined(SQLITE_MMAP_READWRITE) && SQLITE_MAX_MMAP_SIZE > 0
-  /* Deal with as much of this write request as possible by transfering
-  ** data from the memory mapping using memcpy().  */
-  if (offset < pFile->mmapSize)
+/*
+** Free a buffer of nByte bytes obtained from directBufAlloc().
+*/
+static void directBufFree(u8 *p, int nByte)
+{
+  if (nByte <= UNIX_DIRECT_BUFSZ)
   {
-    if (offset + amt <= pFile->mmapSize)
+    directPoolMutex.lock();
+    if (nDirectFree < UNIX_DIRECT_NBUF)
     {
-      memcpy(&((u8 *)(pFile->pMapRegion))[offset], pBuf, amt);
-      return SQLITE_OK;
+      apDirectFree[nDirectFree++] = p;
+      p = 0;
     }
-    else
+    directPoolMutex.unlock();
+  }
+  free(p);
+}
+
+/*
+** Read or write cnt bytes at offset iOff of O_DIRECT file descriptor fd,
+** going through a bounce buffer unless the transfer is aligned.  Return
+** the number of bytes transferred, or -1 with *piErrno set.
+*/
+static int unixDirectFdIo(int fd, int bWrite, u8 *pBuf, int cnt, i64 iOff, int *piErrno)
+{
+  i64 iStart = iOff & ~(i64)(UNIX_DIRECT_ALIGN - 1);
+  i64 iEnd = (iOff + cnt + UNIX_DIRECT_ALIGN - 1) & ~(i64)(UNIX_DIRECT_ALIGN - 1);
+  int nAligned = (int)(iEnd - iStart);
+  int bPartial = (iStart != iOff || iEnd != iOff + cnt);
+  int got = nAligned;
+  int rc;
+  u8 *aBuf;
+
+  if (!bPartial && ((uintptr_t)pBuf & (UNIX_DIRECT_ALIGN - 1)) == 0)
+  {
+    return bWrite ? seekAndWriteFd(fd, iOff, pBuf, cnt, piErrno) : seekAndReadFd(fd, iOff, pBuf, cnt, piErrno);
+  }
+  aBuf = directBufAlloc(nAligned);
+  if (aBuf == 0)
+  {
+    *piErrno = ENOMEM;
+    return -1;
+  }
+  if (!bWrite || bPartial)
+  {
+    got = seekAndReadFd(fd, iStart, aBuf, nAligned, piErrno);
+    if (got < 0)
     {
-      int nCopy = pFile->mmapSize - offset;
-      memcpy(&((u8 *)(pFile->pMapRegion))[offset], pBuf, nCopy);
-      pBuf = &((u8 *)pBuf)[nCopy];
-      amt -= nCopy;
-      offset += nCopy;
+      directBufFree(aBuf, nAligned);
+      return -1;
     }
   }
-#endif
 
-  while ((wrote = seekAndWrite(pFile, offset, pBuf, amt)) < amt && wrote > 0)
+  if (!bWrite)
   {
-    amt -= wrote;
-    offset += wrote;
-    pBuf = &((char *)pBuf)[wrote];
+    rc = got - (int)(iOff - iStart);
+    if (rc > cnt) rc = cnt;
+    if (rc < 0) rc = 0;
+    memcpy(pBuf, &aBuf[iOff - iStart], rc);
   }
-  SimulateIOError((wrote = (-1), amt = 1));
-  SimulateDiskfullError((wrote = 0, amt = 1));
-
-  if (amt > wrote)
+  else
   {
-    if (wrote < 0 && pFile->lastErrno != ENOSPC)
+    /* Blocks past the end of the file read short.  Write zeros there, then
+    ** cut the file back to where this write really ends, so that its size
+    ** is the same as it would be without O_DIRECT. */
+    if (got < nAligned) memset(&aBuf[got], 0, nAligned - got);
+    memcpy(&aBuf[iOff - iStart], pBuf, cnt);
+    rc = seekAndWriteFd(fd, iStart, aBuf, nAligned, piErrno);
+    if (rc == nAligned)
     {
-      /* lastErrno set by seekAndWrite */
-      return SQLITE_IOERR_WRITE;
+      rc = cnt;
+      if (iStart + got < iEnd && iOff + cnt < iEnd)
+      {
+        i64 nSize = iStart + got > iOff + cnt ? iStart + got : iOff + cnt;
+        if (robust_ftruncate(fd, nSize))
+        {
+          *piErrno = errno;
+          rc = -1;
+        }
+      }
     }
-    else
+    else if (rc >= 0)
     {
-      storeLastErrno(pFile, 0); /* not a system error */
-      return SQLITE_FULL;
+      rc -= (int)(iOff - iStart);
+      if (rc < 0) rc = 0;
     }
   }
-
-  return SQLITE_OK;
+  directBufFree(aBuf, nAligned);
+  return rc;
 }
 
 /*
-** We do not trust systems to provide a working fdatasync().  Some do.
-** Others do no.  To be safe, we will stick with the (slightly slower)
-** fsync(). If you know that your system does support fdatasync() correctly,
-** then simply compile with -Dfdatasync=fdatasync or -DHAVE_FDATASYNC
+** Return the size of the slot of a page of szPage bytes in the -wal file.
 */
-#if !defined(fdatasync) && !HAVE_FDATASYNC
-#define fdatasync fsync
-#endif
+static i64 unixDirectWalSlot(int szPage)
+{
+  return ((i64)szPage + UNIX_DIRECT_ALIGN - 1) & ~(i64)(UNIX_DIRECT_ALIGN - 1);
+}
 
 /*
-** Define HAVE_FULLFSYNC to 0 or 1 depending on whether or not
-** the F_FULLFSYNC macro is defined.  F_FULLFSYNC is currently
-** only available on Mac OS X.  But that could change.
+** Write page image pPage of szPage bytes, smaller than UNIX_DIRECT_ALIGN,
+** to slot iSlot of O_DIRECT file descriptor fd, padded with zeros.  Return
+** szPage, or -1 with *piErrno set.
 */
-#ifdef F_FULLFSYNC
-#define HAVE_FULLFSYNC 1
-#else
-#define HAVE_FULLFSYNC 0
-#endif
+static int unixDirectWalPad(int fd, const u8 *pPage, int szPage, i64 iSlot, int *piErrno)
+{
+  int nSlot = (int)unixDirectWalSlot(szPage);
+  u8 *aBuf = directBufAlloc(nSlot);
+  int rc;
+  if (aBuf == 0)
+  {
+    *piErrno = ENOMEM;
+    return -1;
+  }
+  memcpy(aBuf, pPage, szPage);
+  memset(&aBuf[szPage], 0, nSlot - szPage);
+  rc = seekAndWriteFd(fd, iSlot, aBuf, nSlot, piErrno);
+  directBufFree(aBuf, nSlot);
+  if (rc == nSlot) return szPage;
+  return rc < 0 ? -1 : (rc < szPage ? rc : szPage);
+}
 
 /*
-** The fsync() system call does not work as advertised on many
-** unix systems.  The following procedure is an attempt to make
-** it work better.
-**
-** The SQLITE_NO_SYNC macro disables all fsync()s.  This is useful
-** for testing when we want to run through the test suite quickly.
-** You are strongly advised *not* to deploy with SQLITE_NO_SYNC
-** enabled, however, since with SQLITE_NO_SYNC enabled, an OS crash
-** or power failure will likely corrupt the database file.
-**
-** SQLite sets the dataOnly flag if the size of the file is unchanged.
-** The idea behind dataOnly is that it should only write the file content
-** to disk, not the inode.  We only set dataOnly if the file size is
-** unchanged since the file size is part of the inode.  However,
-** Ted Ts'o tells us that fdatasync() will also write the inode if the
-** file size has changed.  The only real difference between fdatasync()
-** and fsync(), Ted tells us, is that fdatasync() will not flush the
-** inode if the mtime or owner or other inode attributes have changed.
-** We only care about the file size, not the other file attributes, so
-** as far as SQLite is concerned, an fdatasync() is always adequate.
-** So, we always use fdatasync() if it is available, regardless of
-** the value of the dataOnly flag.
+** Return the page size of the -wal file pFile, reading it from the WAL
+** header if it is not known yet.  Return 0 if there is no valid header.
 */
-static int full_fsync(int fd, int fullSync, int dataOnly)
+static int unixDirectWalPageSize(unixFile *pFile)
 {
-  int rc;
+  unixDirectWal *p = pFile->pDirectWal;
+  if (p->szPage == 0)
+  {
+    u8 a[4];
+    int iErrno;
+    if (seekAndReadFd(p->hHdr, 8, a, 4, &iErrno) == 4)
+    {
+      u32 sz = ((u32)a[0] << 24) | ((u32)a[1] << 16) | ((u32)a[2] << 8) | a[3];
+      if (sz >= 512 && sz <= 65536 && (sz & (sz - 1)) == 0) p->szPage = (int)sz;
+    }
+  }
+  return p->szPage;
+}
 
-/* The following "ifdef/elif/else/" block has the same structure as
-** the one below. It is replicated here solely to avoid cluttering
-** up the real code with the UNUSED_PARAMETER() macros.
+/*
+** Read or write cnt bytes at offset iOff of the -wal file pFile, as SQLite
+** sees it, in the split layout.  Each frame header and page image is a
+** separate transfer.  Return the number of bytes transferred, or -1 with
+** the lastErrno of pFile set.
 */
-#ifdef SQLITE_NO_SYNC
-  UNUSED_PARAMETER(fd);
-  UNUSED_PARAMETER(fullSync);
-  UNUSED_PARAMETER(dataOnly);
-#elif HAVE_FULLFSYNC
-  UNUSED_PARAMETER(dataOnly);
-#else
-  UNUSED_PARAMETER(fullSync);
-  UNUSED_PARAMETER(dataOnly);
-#endif
+static int unixDirectWalIo(unixFile *pFile, int bWrite, u8 *pBuf, int cnt, i64 iOff)
+{
+  unixDirectWal *p = pFile->pDirectWal;
+  int done = 0;
 
-/* Record the number of times that we do a normal fsync() and
-** FULLSYNC.  This is used during testing to verify that this procedure
-** gets called with the correct arguments.
+  while (done < cnt)
+  {
+    i64 iOfst = iOff + done;
+    int nAmt = cnt - done;
+    int bHdr = 1;
+    int bPad = 0; /* Write a whole page, padded to its slot */
+    i64 iPhys = iOfst;
+    int got;
+
+    if (iOfst < UNIX_WAL_HDRSIZE)
+    {
+      if (nAmt > UNIX_WAL_HDRSIZE - iOfst) nAmt = (int)(UNIX_WAL_HDRSIZE - iOfst);
+    }
+    else
+    {
+      int szPage = unixDirectWalPageSize(pFile);
+      i64 szFrame = UNIX_WAL_FRAME_HDRSIZE + szPage;
+      i64 iFrame;
+      int iRel;
+      if (szPage == 0) break; /* No header yet, so nothing beyond it */
+      iFrame = (iOfst - UNIX_WAL_HDRSIZE) / szFrame;
+      iRel = (int)((iOfst - UNIX_WAL_HDRSIZE) % szFrame);
+      if (iRel < UNIX_WAL_FRAME_HDRSIZE)
+      {
+        if (nAmt > UNIX_WAL_FRAME_HDRSIZE - iRel) nAmt = UNIX_WAL_FRAME_HDRSIZE - iRel;
+        iPhys = UNIX_WAL_HDRSIZE + iFrame * UNIX_WAL_FRAME_HDRSIZE + iRel;
+      }
+      else
+      {
+        if (nAmt > szFrame - iRel) nAmt = (int)(szFrame - iRel);
+        iPhys = iFrame * unixDirectWalSlot(szPage) + iRel - UNIX_WAL_FRAME_HDRSIZE;
+        bHdr = 0;
+        bPad = bWrite && nAmt == szPage && szPage < UNIX_DIRECT_ALIGN;
+      }
+    }
+
+    if (bHdr)
+    {
+      got = bWrite ? seekAndWriteFd(p->hHdr, iPhys, &pBuf[done], nAmt, &pFile->lastErrno)
+                   : seekAndReadFd(p->hHdr, iPhys, &pBuf[done], nAmt, &pFile->lastErrno);
+    }
+    else if (bPad)
+    {
+      got = unixDirectWalPad(pFile->h, &pBuf[done], nAmt, iPhys, &pFile->lastErrno);
+    }
+    else
+    {
+      got = unixDirectFdIo(pFile->h, bWrite, &pBuf[done], nAmt, iPhys, &pFile->lastErrno);
+    }
+    if (got < 0) return -1;
+    if (bHdr && iOfst <= 8 && iOfst + got >= 12)
+    {
+      /* The WAL header was written, or read, starting a new page size. */
+      const u8 *a = &pBuf[done + 8 - iOfst];
+      u32 sz = ((u32)a[0] << 24) | ((u32)a[1] << 16) | ((u32)a[2] << 8) | a[3];
+      if (sz >= 512 && sz <= 65536 && (sz & (sz - 1)) == 0) p->szPage = (int)sz;
+    }
+    done += got;
+    if (got < nAmt) break;
+  }
+  return done;
+}
+
+/*
+** Read or write through the direct I/O paths above.  Called by
+** seekAndRead() and seekAndWrite().
 */
-#ifdef SQLITE_TEST
-  if (fullSync) sqlite3_fullsync_count++;
-  sqlite3_sync_count++;
-#endif
+static int unixDirectIo(unixFile *pFile, int bWrite, u8 *pBuf, int cnt, i64 iOff)
+{
+  if (pFile->pDirectWal) return unixDirectWalIo(pFile, bWrite, pBuf, cnt, iOff);
+  return unixDirectFdIo(pFile->h, bWrite, pBuf, cnt, iOff, &pFile->lastErrno);
+}
 
-/* If we compiled with the SQLITE_NO_SYNC flag, then syncing is a
-** no-op.  But go ahead and call fstat() to validate the file
-** descriptor as we need a method to provoke a failure during
-** coverate testing.
+/*
+** Return the size of the -wal file pFile as SQLite sees it: the WAL header
+** and every frame whose header and page image are both present.
 */
-#ifdef SQLITE_NO_SYNC
+static int unixDirectWalSize(unixFile *pFile, i64 *pSize)
+{
+  unixDirectWal *p = pFile->pDirectWal;
+  struct stat sHdr;
+  struct stat sData;
+  int szPage;
+
+  if (osFstat(p->hHdr, &sHdr) || osFstat(pFile->h, &sData))
   {
-    struct stat buf;
-    rc = osFstat(fd, &buf);
+    storeLastErrno(pFile, errno);
+    return SQLITE_IOERR_FSTAT;
   }
-#elif HAVE_FULLFSYNC
-  if (fullSync)
+  szPage = unixDirectWalPageSize(pFile);
+  if (sHdr.st_size <= UNIX_WAL_HDRSIZE || szPage == 0)
   {
-    rc = osFcntl(fd, F_FULLFSYNC, 0);
+    *pSize = sHdr.st_size < UNIX_WAL_HDRSIZE ? sHdr.st_size : UNIX_WAL_HDRSIZE;
   }
   else
   {
-    rc = 1;
+    i64 nFrame = (sHdr.st_size - UNIX_WAL_HDRSIZE) / UNIX_WAL_FRAME_HDRSIZE;
+    i64 szSlot = unixDirectWalSlot(szPage);
+    i64 nPage = (sData.st_size + szSlot - szPage) / szSlot; /* Slots whose page is all there */
+    if (nPage < nFrame) nFrame = nPage;
+    *pSize = UNIX_WAL_HDRSIZE + nFrame * (UNIX_WAL_FRAME_HDRSIZE + szPage);
   }
-  /* If the FULLFSYNC failed, fall back to attempting an fsync().
-  ** It shouldn't be possible for fullfsync to fail on the local
-  ** file system (on OSX), so failure indicates that FULLFSYNC
-  ** isn't supported for this file system. So, attempt an fsync
-  ** and (for now) ignore the overhead of a superfluous fcntl call.
-  ** It'd be better to detect fullfsync support once and avoid
-  ** the fcntl call every time sync is called.
-  */
-  if (rc) rc = fsync(fd);
-
-#elif defined(__APPLE__)
-  /* fdatasync() on HFS+ doesn't yet flush the file size if it changed correctly
-  ** so currently we default to the macro that redefines fdatasync to fsync
-  */
-  rc = fsync(fd);
-#else
-  rc = fdatasync(fd);
-#endif /* ifdef SQLITE_NO_SYNC elif HAVE_FULLFSYNC */
-
-  return rc;
+  return SQLITE_OK;
 }
 
 /*
-** Open a file descriptor to the directory containing file zFilename.
-** If successful, *pFd is set to the opened file descriptor and
-** SQLITE_OK is returned. If an error occurs, either SQLITE_NOMEM
-** or SQLITE_CANTOPEN is returned and *pFd is set to an undefined
-** value.
-**
-** The directory file descriptor is used for only one thing - to
-** fsync() a directory to make sure file creation and deletion events
-** are flushed to disk.  Such fsyncs are not needed on newer
-** journaling filesystems, but are required on older filesystems.
-**
-** This routine can be overridden using the xSetSysCall interface.
-** The ability to override this routine was added in support of the
-** chromium sandbox.  Opening a directory is a security risk (we are
-** told) so making it overrideable allows the chromium sandbox to
-** replace this routine with a harmless no-op.  To make this routine
-** a no-op, replace it with a stub that returns SQLITE_OK but leaves
-** *pFd set to a negative number.
-**
-** If SQLITE_OK is returned, the caller is responsible for closing
-** the file descriptor *pFd using close().
+** Truncate the -wal file pFile to nByte bytes as SQLite sees it.
 */
-static int openDirectory(const char *zFilename, int *pFd)
+static int unixDirectWalTruncate(unixFile *pFile, i64 nByte)
 {
-  int ii;
-  int fd = -1;
-  char zDirname[MAX_PATHNAME + 1];
+  unixDirectWal *p = pFile->pDirectWal;
+  int szPage = unixDirectWalPageSize(pFile);
+  i64 nHdr = nByte;
+  i64 nData = 0;
 
-  sqlite3_snprintf(MAX_PATHNAME, zDirname, "%s", zFilename);
-  for (ii = (int)strlen(zDirname); ii > 0 && zDirname[ii] != '/'; ii--)
-    ;
-  if (ii > 0)
+  if (nByte > UNIX_WAL_HDRSIZE && szPage > 0)
   {
-    zDirname[ii] = '\0';
+    i64 szFrame = UNIX_WAL_FRAME_HDRSIZE + szPage;
+    i64 nFrame = (nByte - UNIX_WAL_HDRSIZE) / szFrame;
+    i64 iRel = (nByte - UNIX_WAL_HDRSIZE) % szFrame;
+    nHdr = UNIX_WAL_HDRSIZE + nFrame * UNIX_WAL_FRAME_HDRSIZE;
+    nHdr += iRel < UNIX_WAL_FRAME_HDRSIZE ? iRel : UNIX_WAL_FRAME_HDRSIZE;
+    nData = nFrame * unixDirectWalSlot(szPage) + (iRel > UNIX_WAL_FRAME_HDRSIZE ? iRel - UNIX_WAL_FRAME_HDRSIZE : 0);
   }
-  else
+  if (robust_ftruncate(p->hHdr, nHdr) || robust_ftruncate(pFile->h, nData))
   {
-    if (zDirname[0] != '/') zDirname[0] = '.';
-    zDirname[1] = 0;
-  }
-  fd = robust_open(zDirname, O_RDONLY | O_BINARY, 0);
-  if (fd >= 0)
-  {
-    OSTRACE(("OPENDIR %-3d %s\n", fd, zDirname));
+    storeLastErrno(pFile, errno);
+    return unixLogError(SQLITE_IOERR_TRUNCATE, "ftruncate", pFile->zPath);
   }
-  *pFd = fd;
-  if (fd >= 0) return SQLITE_OK;
-  return unixLogError(SQLITE_CANTOPEN, "openDirectory", zDirname);
+  return SQLITE_OK;
 }
 
 /*
-** Make sure all writes to a particular file are committed to disk.
-**
-** If dataOnly==0 then both the file itself and its metadata (file
-** size, access time, etc) are synced.  If dataOnly!=0 then only the
-** file data is synced.
-**
-** Under Unix, also make sure that the directory entry for the file
-** has been created by fsync-ing the directory that contains the file.
-** If we do not do this and we encounter a power failure, the directory
-** entry for the journal might not exist after we reboot.  The next
-** SQLite to access the file will not know that the journal exists (because
-** the directory entry for the journal was never created) and the transaction
-** will not roll back - possibly leading to database corruption.
+** Close the -wal-hdr file of pFile, if it has one.
 */
-static int unixSync(sqlite3_file *id, int flags)
+static void unixDirectWalClose(unixFile *pFile)
 {
-  int rc;
-  unixFile *pFile = (unixFile *)id;
-
-  int isDataOnly = (flags & SQLITE_SYNC_DATAONLY);
-  int isFullsync = (flags & 0x0F) == SQLITE_SYNC_FULL;
-
-  /* Check that one of SQLITE_SYNC_NORMAL or FULL was passed */
-  assert((flags & 0x0F) == SQLITE_SYNC_NORMAL || (flags & 0x0F) == SQLITE_SYNC_FULL);
-
-  /* Unix cannot, but some systems may return SQLITE_FULL from here. This
-  ** line is to test that doing so does not cause any problems.
-  */
-  SimulateDiskfullError(return SQLITE_FULL);
-
-  assert(pFile);
-  OSTRACE(("SYNC    %-3d\n", pFile->h));
-  rc = full_fsync(pFile->h, isFullsync, isDataOnly);
-  SimulateIOError(rc = 1);
-  if (rc)
-  {
-    storeLastErrno(pFile, errno);
-    return unixLogError(SQLITE_IOERR_FSYNC, "full_fsync", pFile->zPath);
-  }
-
-  /* Also fsync the directory containing the file if the DIRSYNC flag
-  ** is set.  This is a one-time occurrence.  Many systems (examples: AIX)
-  ** are unable to fsync a directory, so ignore errors on the fsync.
-  */
-  if (pFile->ctrlFlags & UNIXFILE_DIRSYNC)
+  if (pFile->pDirectWal)
   {
-    int dirfd;
-    OSTRACE(("DIRSYNC %s (have_fullfsync=%d fullsync=%d)\n", pFile->zPath, HAVE_FULLFSYNC, isFullsync));
-    rc = osOpenDirectory(pFile->zPath, &dirfd);
-    if (rc == SQLITE_OK)
-    {
-      full_fsync(dirfd, 0, 0);
-      robust_close(pFile, dirfd, __LINE__);
-    }
-    else
-    {
-      assert(rc == SQLITE_CANTOPEN);
-      rc = SQLITE_OK;
-    }
-    pFile->ctrlFlags &= ~UNIXFILE_DIRSYNC;
+    robust_close(pFile, pFile->pDirectWal->hHdr, __LINE__);
+    sqlite3_free(pFile->pDirectWal);
+    pFile->pDirectWal = 0;
   }
-  return rc;
 }
 
 /*
-** Truncate an open file to a specified size
+** Set O_DIRECT on the file descriptor of pFile.  Return non-zero on
+** success.  On failure, for example on a file system without O_DIRECT
+** support, a warning is logged and pFile stays buffered.
 */
-static int unixTruncate(sqlite3_file *id, i64 nByte)
+static int unixDirectEnable(unixFile *pFile)
 {
-  unixFile *pFile = (unixFile *)id;
-  int rc;
-  assert(pFile);
-  SimulateIOError(return SQLITE_IOERR_TRUNCATE);
-
-  /* If the user has configured a chunk-size for this file, truncate the
-  ** file so that it consists of an integer number of chunks (i.e. the
-  ** actual file size after the operation may be larger than the requested
-  ** size).
-  */
-  if (pFile->szChunk > 0)
-  {
-    nByte = ((nByte + pFile->szChunk - 1) / pFile->szChunk) * pFile->szChunk;
-  }
-
-  rc = robust_ftruncate(pFile->h, nByte);
-  if (rc)
-  {
-    storeLastErrno(pFile, errno);
-    return unixLogError(SQLITE_IOERR_TRUNCATE, "ftruncate", pFile->zPath);
-  }
-  else
+#ifdef O_DIRECT
+  int flags = osFcntl(pFile->h, F_GETFL);
+  if (flags >= 0 && ((flags & O_DIRECT) || osFcntl(pFile->h, F_SETFL, flags | O_DIRECT) == 0))
   {
-#ifdef SQLITE_DEBUG
-    /* If we are doing a normal write to a database file (as opposed to
-    ** doing a hot-journal rollback or a write to some file other than a
-    ** normal database file) and we truncate the file to zero length,
-    ** that effectively updates the change counter.  This might happen
-    ** when restoring a database using the backup API from a zero-length
-    ** source.
-    */
-    if (pFile->inNormalWrite && nByte == 0)
-    {
-      pFile->transCntrChng = 1;
-    }
-#endif
-
+    pFile->ctrlFlags |= UNIXFILE_DIRECT;
 #if SQLITE_MAX_MMAP_SIZE > 0
-    /* If the file was just truncated to a size smaller than the currently
-    ** mapped region, reduce the effective mapping size as well. SQLite will
-    ** use read() and write() to access data beyond this point from now on.
-    */
-    if (nByte < pFile->mmapSize)
-    {
-      pFile->mmapSize = nByte;
-    }
+    pFile->mmapSizeMax = 0;
 #endif
-
-    return SQLITE_OK;
+    return 1;
   }
+  storeLastErrno(pFile, errno);
+#endif
+  sqlite3_log(SQLITE_WARNING, "direct_io unavailable, using buffered I/O: %s", pFile->zPath);
+  return 0;
 }
 
 /*
-** Determine the current size of a file in bytes
+** Record on the unixInodeInfo of main database file pFile whether it is
+** opened with O_DIRECT, from the "direct_io" URI parameter, and set
+** O_DIRECT on the file descriptor of pFile if so.  As for the -wal
+** directory, the first connection to open the inode decides, because the
+** default layout of the -wal file depends on it.
+**
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
 */
-static int unixFileSize(sqlite3_file *id, i64 *pSize)
+static void setInodeDirectIo(unixFile *pFile)
 {
-  int rc;
-  struct stat buf;
-  assert(id);
-  rc = osFstat(((unixFile *)id)->h, &buf);
-  SimulateIOError(rc = 1);
-  if (rc != 0)
+  unixInodeInfo *pInode = pFile->pInode;
+  const char *zUri = (pFile->ctrlFlags & UNIXFILE_URI) ? pFile->zPath : 0;
+  int bDirect = sqlite3_uri_boolean(zUri, "direct_io", 0);
+
+  assert(unixInodeMutexHeld(pInode));
+  if (pInode->nRef > 1)
   {
-    storeLastErrno((unixFile *)id, errno);
-    return SQLITE_IOERR_FSTAT;
+    if (bDirect != pInode->bDirectIo)
+    {
+      sqlite3_log(SQLITE_WARNING, "conflicting direct_io ignored: %s", pFile->zPath);
+    }
+    if (pInode->bDirectIo) unixDirectEnable(pFile);
+  }
+  else if (bDirect && unixDirectEnable(pFile))
+  {
+    pInode->bDirectIo = 1;
+    __atomic_fetch_add(&nDirectInode, 1, __ATOMIC_RELAXED);
   }
-  *pSize = buf.st_size;
-
-  /* When opening a zero-size database, the findInodeInfo() procedure
-  ** writes a single byte into that file in order to work around a bug
-  ** in the OS-X msdos filesystem.  In order to avoid problems with upper
-  ** layers, we need to report this file size as zero even though it is
-  ** really 1.   Ticket #3260.
-  */
-  if (*pSize == 1) *pSize = 0;
-
-  return SQLITE_OK;
 }
 
-#if SQLITE_ENABLE_LOCKING_STYLE && defined(__APPLE__)
-/*
-** Handler for proxy-locking file-control verbs.  Defined below in the
-** proxying locking division.
-*/
-static int proxyFileControl(sqlite3_file *, int, void *);
-#endif
-
 /*
-** This function is called to handle the SQLITE_FCNTL_SIZE_HINT
-** file-control operation.  Enlarge the database to nBytes in size
-** (rounded up to the next chunk-size).  If the database is already
-** nBytes or larger, this routine is a no-op.
+** Called by unixOpen() for -wal file pFile, which is about to be used by
+** the database zWal names.  Decide the layout of the -wal file of that
+** database if this is the first -wal file opened for it, see above.  If
+** the layout is split, set O_DIRECT on pFile and open its -wal-hdr file,
+** creating it if openFlags allow.
 */
-static int fcntlSizeHint(unixFile *pFile, i64 nByte)
+static int unixDirectWalOpen(unixFile *pFile, const char *zWal, int openFlags)
 {
-  if (pFile->szChunk > 0)
-  {
-    i64 nSize;       /* Required file size */
-    struct stat buf; /* Used to hold return values of fstat() */
-
-    if (osFstat(pFile->h, &buf))
-    {
-      return SQLITE_IOERR_FSTAT;
-    }
+  char zDb[MAX_PATHNAME + 1];  /* Database file path */
+  char zHdr[MAX_PATHNAME + 5]; /* Name of the -wal-hdr file */
+  unixInodeInfo *pDbInode;
+  struct stat sStat;
+  unixDirectWal *p;
+  int eLayout = UNIX_WAL_LAYOUT_USUAL;
 
-    nSize = ((nByte + pFile->szChunk - 1) / pFile->szChunk) * pFile->szChunk;
-    if (nSize > (i64)buf.st_size)
+  sqlite3_snprintf(sizeof(zHdr), zHdr, "%s-hdr", pFile->zPath);
+  if (osFstat(pFile->h, &sStat))
+  {
+    sStat.st_mode = SQLITE_DEFAULT_FILE_PERMISSIONS;
+    sStat.st_size = 0;
+  }
+  pDbInode = unixWalDbInode(zWal, zDb);
+  if (pDbInode)
+  {
+    if (pDbInode->eWalLayout == UNIX_WAL_LAYOUT_UNKNOWN)
     {
-#if defined(HAVE_POSIX_FALLOCATE) && HAVE_POSIX_FALLOCATE
-      /* The code below is handling the return value of osFallocate()
-      ** correctly. posix_fallocate() is defined to "returns zero on success,
-      ** or an error number on  failure". See the manpage for details. */
-      int err;
-      do
+      struct stat sHdr;
+      if (osStat(zHdr, &sHdr) == 0)
       {
-        err = osFallocate(pFile->h, buf.st_size, nSize - buf.st_size);
-      } while (err == EINTR);
-      if (err && err != EINVAL) return SQLITE_IOERR_WRITE;
-#else
-      /* If the OS does not have posix_fallocate(), fake it. Write a
-      ** single byte to the last byte in each block that falls entirely
-      ** within the extended region. Then, if required, a single byte
-      ** at offset (nSize-1), to set the size of the file correctly.
-      ** This is a similar technique to that used by glibc on systems
-      ** that do not have a real fallocate() call.
-      */
-      int nBlk = buf.st_blksize; /* File-system block size */
-      int nWrite = 0;            /* Number of bytes written by seekAndWrite */
-      i64 iWrite;                /* Next offset to write to */
-
-      iWrite = (buf.st_size / nBlk) * nBlk + nBlk - 1;
-      assert(iWrite >= buf.st_size);
-      assert(((iWrite + 1) % nBlk) == 0);
-      for (/*no-op*/; iWrite < nSize + nBlk - 1; iWrite += nBlk)
+        pDbInode->eWalLayout = UNIX_WAL_LAYOUT_SPLIT;
+      }
+      else if (sStat.st_size > 0)
       {
-        if (iWrite >= nSize) iWrite = nSize - 1;
-        nWrite = seekAndWrite(pFile, iWrite, "", 1);
-        if (nWrite != 1) return SQLITE_IOERR_WRITE;
+        pDbInode->eWalLayout = UNIX_WAL_LAYOUT_USUAL;
       }
-#endif
-    }
-  }
-
-#if SQLITE_MAX_MMAP_SIZE > 0
-  if (pFile->mmapSizeMax > 0 && nByte > pFile->mmapSize)
-  {
-    int rc;
-    if (pFile->szChunk <= 0)
-    {
-      if (robust_ftruncate(pFile->h, nByte))
+      else
       {
-        storeLastErrno(pFile, errno);
-        return unixLogError(SQLITE_IOERR_TRUNCATE, "ftruncate", pFile->zPath);
+        pDbInode->eWalLayout = pDbInode->bDirectIo ? UNIX_WAL_LAYOUT_SPLIT : UNIX_WAL_LAYOUT_USUAL;
+      }
+      if ((pDbInode->eWalLayout == UNIX_WAL_LAYOUT_SPLIT) != pDbInode->bDirectIo)
+      {
+        sqlite3_log(SQLITE_WARNING, "direct_io layout of the existing -wal file kept: %s", zWal);
+      }
+      if (pDbInode->eWalLayout == UNIX_WAL_LAYOUT_SPLIT)
+      {
+        __atomic_fetch_add(&nSplitInode, 1, __ATOMIC_RELAXED);
       }
     }
-
-    rc = unixMapfile(pFile, nByte);
-    return rc;
+    eLayout = pDbInode->eWalLayout;
+    unixLeaveInodeMutex(pDbInode);
   }
-#endif
+  if (eLayout != UNIX_WAL_LAYOUT_SPLIT) return SQLITE_OK;
 
+  p = (unixDirectWal *)sqlite3_malloc64(sizeof(*p));
+  if (p == 0) return SQLITE_NOMEM;
+  memset(p, 0, sizeof(*p));
+  p->hHdr = robust_open(zHdr, openFlags & ~O_EXCL, sStat.st_mode & 0777);
+  if (p->hHdr < 0)
+  {
+    sqlite3_free(p);
+    return unixLogError(SQLITE_CANTOPEN, "open", zHdr);
+  }
+  pFile->pDirectWal = p;
+  unixDirectEnable(pFile);
   return SQLITE_OK;
 }
 
-/*
-** If *pArg is initially negative then this is a query.  Set *pArg to
-** 1 or 0 depending on whether or not bit mask of pFile->ctrlFlags is set.
+/******************************************************************************
+******************************** Preallocation ********************************
 **
-** If *pArg is 0 or 1, then clear or set the mask bit of pFile->ctrlFlags.
+** With the "prealloc_db=N" and "prealloc_wal=N" URI parameters, space is
+** reserved with fallocate(FALLOC_FL_KEEP_SIZE) ahead of writes that extend
+** the database or its -wal file, so that extent allocation and the
+** metadata journaling that comes with it are not paid at every commit that
+** grows the file.  Each reservation is as large as the file already is, so
+** a file that grows to size S is extended O(log S) times, but no more than
+** N bytes are reserved past the end of the file.  The file size itself
+** only changes as SQLite writes, so readers and recovery see no difference.
+**
+** The reservation is released when the file is truncated, and when the
+** -wal file is restarted after a checkpoint, so that an idle database does
+** not hold on to space it may not need again.
+**
+** The end of the space reserved is kept on the unixInodeInfo of the
+** database, so that connections sharing a file do not each reserve it
+** again.  The first connection to open the database decides, as for
+** "wal_dir".
 */
-static void unixModeBit(unixFile *pFile, unsigned char mask, int *pArg)
+#define UNIX_PREALLOC_MIN (64 * 1024) /* Smallest reservation */
+
+/*
+** Reserve space for a write to pFile ending at offset iEnd, which lies
+** past the space reserved so far.
+*/
+static void unixPreallocate(unixFile *pFile, i64 iEnd)
 {
-  if (*pArg < 0)
-  {
-    *pArg = (pFile->ctrlFlags & mask) != 0;
+#if HAVE_LINUX_FALLOCATE
+  struct stat buf;
+  i64 nStep;
+  i64 iStart;
+  i64 iNew;
+  i64 iReserved = __atomic_load_n(pFile->piPreallocEnd, __ATOMIC_RELAXED);
+
+  if (osFstat(pFile->h, &buf)) return;
+  nStep = buf.st_size > UNIX_PREALLOC_MIN ? buf.st_size : UNIX_PREALLOC_MIN;
+  if (nStep > pFile->mxPrealloc) nStep = pFile->mxPrealloc;
+  iNew = ((iEnd + nStep + UNIX_PREALLOC_MIN - 1) / UNIX_PREALLOC_MIN) * UNIX_PREALLOC_MIN;
+  iStart = buf.st_size > iReserved ? buf.st_size : iReserved;
+  if (iNew <= iStart)
+  {
+    if (iReserved < iNew) __atomic_store_n(pFile->piPreallocEnd, iNew, __ATOMIC_RELAXED);
+    return;
   }
-  else if ((*pArg) == 0)
+  if (osLinuxFallocate(pFile->h, FALLOC_FL_KEEP_SIZE, iStart, iNew - iStart) == 0)
   {
-    pFile->ctrlFlags &= ~mask;
+    OSTRACE(("PREALLOC %-3d %lld..%lld\n", pFile->h, iStart, iNew));
+    __atomic_store_n(pFile->piPreallocEnd, iNew, __ATOMIC_RELAXED);
   }
-  else
+  else if (errno != EINTR)
   {
-    pFile->ctrlFlags |= mask;
+    /* Not supported here, or out of space.  Writes will allocate. */
+    pFile->mxPrealloc = 0;
   }
+#else
+  UNUSED_PARAMETER(iEnd);
+  pFile->mxPrealloc = 0;
+#endif
 }
 
-/* Forward declaration */
-static int unixGetTempname(int nBuf, char *zBuf);
-
 /*
-** Information and control of an open file handle.
+** Release the space reserved past the end of pFile.
 */
-static int unixFileControl(sqlite3_file *id, int op, void *pArg)
+static void unixPreallocRelease(unixFile *pFile)
 {
-  unixFile *pFile = (unixFile *)id;
-  switch (op)
+  struct stat buf;
+  i64 iReserved = __atomic_load_n(pFile->piPreallocEnd, __ATOMIC_RELAXED);
+  if (osFstat(pFile->h, &buf)) return;
+#if HAVE_LINUX_FALLOCATE
+  if (iReserved > buf.st_size)
   {
-#if defined(__linux__) && defined(SQLITE_ENABLE_BATCH_ATOMIC_WRITE)
-    case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
-    {
-      int rc = osIoctl(pFile->h, F2FS_IOC_START_ATOMIC_WRITE);
-      return rc ? SQLITE_IOERR_BEGIN_ATOMIC : SQLITE_OK;
-    }
-    case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE:
-    {
-      int rc = osIoctl(pFile->h, F2FS_IOC_COMMIT_ATOMIC_WRITE);
-      return rc ? SQLITE_IOERR_COMMIT_ATOMIC : SQLITE_OK;
-    }
-    case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
-    {
-      int rc = osIoctl(pFile->h, F2FS_IOC_ABORT_VOLATILE_WRITE);
-      return rc ? SQLITE_IOERR_ROLLBACK_ATOMIC : SQLITE_OK;
-    }
-#endif /* __linux__ && SQLITE_ENABLE_BATCH_ATOMIC_WRITE */
+    osLinuxFallocate(pFile->h, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, buf.st_size, iReserved - buf.st_size);
+  }
+#endif
+  __atomic_store_n(pFile->piPreallocEnd, (i64)buf.st_size, __ATOMIC_RELAXED);
+}
 
-    case SQLITE_FCNTL_LOCKSTATE:
+/*
+** Parse the "prealloc_db" or "prealloc_wal" parameter zParam of pFile.
+*/
+static i64 unixPreallocParam(unixFile *pFile, const char *zParam)
+{
+  const char *zUri = (pFile->ctrlFlags & UNIXFILE_URI) ? pFile->zPath : 0;
+  i64 mx = sqlite3_uri_int64(zUri, zParam, 0);
+  return mx > 0 ? mx : 0;
+}
+
+/*
+** Record the preallocation limits of main database file pFile on its
+** unixInodeInfo, if it is the first unixFile on the inode, and set the
+** limit of pFile.
+**
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
+*/
+static void setInodePrealloc(unixFile *pFile)
+{
+  unixInodeInfo *pInode = pFile->pInode;
+  assert(unixInodeMutexHeld(pInode));
+  if (pInode->nRef == 1)
+  {
+    pInode->mxPreallocDb = unixPreallocParam(pFile, "prealloc_db");
+    pInode->mxPreallocWal = unixPreallocParam(pFile, "prealloc_wal");
+    if (pInode->mxPreallocWal) __atomic_fetch_add(&nPreallocInode, 1, __ATOMIC_RELAXED);
+  }
+  pFile->mxPrealloc = pInode->mxPreallocDb;
+  pFile->piPreallocEnd = &pInode->iPreallocEndDb;
+}
+
+/*
+** Set the preallocation limit of the -wal file pFile from its database,
+** whose -wal file SQLite names zWal.
+*/
+static void unixPreallocWal(unixFile *pFile, const char *zWal)
+{
+  char zDb[MAX_PATHNAME + 1]; /* Database file path */
+  unixInodeInfo *pDbInode = unixWalDbInode(zWal, zDb);
+  if (pDbInode)
+  {
+    pFile->mxPrealloc = pDbInode->mxPreallocWal;
+    pFile->piPreallocEnd = &pDbInode->iPreallocEndWal;
+    unixLeaveInodeMutex(pDbInode);
+  }
+}
+
+/******************************************************************************
+******************************* Write combining *******************************
+**
+** With the "write_combine=N" URI parameter, the -wal files of a database
+** opened through the "proc" VFS collect writes in a staging buffer of N
+** bytes, instead of making one pwrite() call for each frame header and
+** another for each page.  A write that continues where the previous one
+** ended is copied into the buffer and queued as one more iovec.  The queue
+** is written with pwritev(), in file order, when:
+**
+**   *  a write does not continue the queued range, or the staging buffer
+**      or the iovec array is full,
+**   *  the page of a commit frame has been queued,
+**   *  xRead() is asked for bytes that overlap the queue, and
+**   *  before any other method of the file does its work.
+**
+** So a commit of F frames costs one pwritev() per N bytes instead of 2*F
+** pwrite() calls.  As for the io_uring backend, frames are invisible to
+** other connections until their commit is published, and the commit frame
+** is written before xWrite() returns, so a process that dies with writes
+** queued only loses a transaction that never committed.  An error is
+** returned by whichever method wrote the queue.
+**
+** The "proc-uring" VFS batches -wal writes on its ring instead.  Database
+** and journal writes are never combined, for the reasons given for the
+** io_uring backend.  The first connection to open the database decides,
+** as for "wal_dir".
+*/
+#define UNIX_COMBINE_NIOV 512                 /* Most iovecs per pwritev(), < IOV_MAX */
+#define UNIX_COMBINE_MIN (64 * 1024)          /* Smallest staging buffer */
+#define UNIX_COMBINE_MAX (64 * 1024 * 1024)   /* Largest staging buffer */
+
+struct unixCombine
+{
+  i64 iOfst;                           /* File offset of the first queued byte */
+  i64 iEnd;                            /* File offset after the last queued byte */
+  int nIov;                            /* Number of queued writes */
+  int nBuf;                            /* Bytes of aBuf[] in use */
+  int szBuf;                           /* Size of aBuf[] */
+  u8 bCommitHdr;                       /* Last write was a commit frame header */
+  struct iovec aIov[UNIX_COMBINE_NIOV]; /* Queued writes */
+  u8 *aBuf;                            /* Staging buffer */
+};
+
+/*
+** Write the queue of pFile, and start writeback of it if that is the
+** sync strategy of pFile.  The queue is empty afterwards, even on error.
+*/
+static int unixCombineFlush(unixFile *pFile)
+{
+  unixCombine *p = pFile->pCombine;
+  struct iovec *aIov = p->aIov;
+  int nIov = p->nIov;
+  i64 iOfst = p->iOfst;
+
+  p->nIov = 0;
+  p->nBuf = 0;
+  while (nIov > 0)
+  {
+    ssize_t n;
+#if HAVE_PWRITEV
+    do
     {
-      *(int *)pArg = pFile->eFileLock;
-      return SQLITE_OK;
+      n = osPwritev(pFile->h, aIov, nIov, iOfst);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) storeLastErrno(pFile, errno);
+#else
+    n = seekAndWriteFd(pFile->h, iOfst, aIov->iov_base, (int)aIov->iov_len, &pFile->lastErrno);
+#endif
+    OSTRACE(("WRITEV  %-3d %5lld %7lld %d\n", pFile->h, (i64)n, iOfst, nIov));
+    if (n <= 0)
+    {
+      if (n < 0 && pFile->lastErrno != ENOSPC) return SQLITE_IOERR_WRITE;
+      storeLastErrno(pFile, 0); /* not a system error */
+      return SQLITE_FULL;
     }
-    case SQLITE_FCNTL_LAST_ERRNO:
+    iOfst += n;
+    while (nIov > 0 && (size_t)n >= aIov->iov_len)
     {
-      *(int *)pArg = pFile->lastErrno;
-      return SQLITE_OK;
+      n -= aIov->iov_len;
+      aIov++;
+      nIov--;
     }
-    case SQLITE_FCNTL_CHUNK_SIZE:
+    if (nIov > 0)
     {
-      pFile->szChunk = *(int *)pArg;
-      return SQLITE_OK;
+      aIov->iov_base = (u8 *)aIov->iov_base + n;
+      aIov->iov_len -= n;
     }
-    case SQLITE_FCNTL_SIZE_HINT:
+  }
+
+  unixDirtyAdd(pFile, p->iOfst, iOfst - p->iOfst);
+  return SQLITE_OK;
+}
+
+/*
+** Queue a write of amt bytes, which fit in the staging buffer, to -wal
+** file pFile.
+*/
+static int unixCombineWrite(unixFile *pFile, const void *pBuf, int amt, i64 iOfst)
+{
+  unixCombine *p = pFile->pCombine;
+  int bCommit = 0;
+  int rc;
+
+  assert(amt <= p->szBuf);
+
+  /* Recognize commit frames, as uringWrite() does */
+  if (amt == UNIX_WAL_FRAME_HDRSIZE)
+  {
+    const u8 *a = (const u8 *)pBuf;
+    p->bCommitHdr = (a[4] | a[5] | a[6] | a[7]) != 0;
+  }
+  else if (p->bCommitHdr)
+  {
+    bCommit = 1;
+    p->bCommitHdr = 0;
+  }
+
+  if (p->nIov > 0 && (iOfst != p->iEnd || p->nIov == UNIX_COMBINE_NIOV || p->nBuf + amt > p->szBuf))
+  {
+    rc = unixCombineFlush(pFile);
+    if (rc != SQLITE_OK) return rc;
+  }
+  if (p->nIov == 0) p->iOfst = p->iEnd = iOfst;
+  memcpy(&p->aBuf[p->nBuf], pBuf, amt);
+  p->aIov[p->nIov].iov_base = &p->aBuf[p->nBuf];
+  p->aIov[p->nIov].iov_len = amt;
+  p->nIov++;
+  p->iEnd += amt;
+  p->nBuf += (amt + 7) & ~7;
+  if (p->nBuf > p->szBuf) p->nBuf = p->szBuf;
+
+  return bCommit ? unixCombineFlush(pFile) : SQLITE_OK;
+}
+
+/*
+** Write the queue of pFile if it overlaps the nAmt bytes at iOfst, or
+** unconditionally if nAmt is 0.  A no-op if pFile does not combine writes.
+*/
+static int unixCombineSync(unixFile *pFile, i64 iOfst, int nAmt)
+{
+  unixCombine *p = pFile->pCombine;
+  if (p == 0 || p->nIov == 0) return SQLITE_OK;
+  if (nAmt > 0 && (iOfst >= p->iEnd || iOfst + nAmt <= p->iOfst)) return SQLITE_OK;
+  return unixCombineFlush(pFile);
+}
+
+/*
+** Record the "write_combine" size of main database file pFile on its
+** unixInodeInfo, if it is the first unixFile on the inode.
+**
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
+*/
+static void setInodeCombine(unixFile *pFile)
+{
+  unixInodeInfo *pInode = pFile->pInode;
+  const char *zUri = (pFile->ctrlFlags & UNIXFILE_URI) ? pFile->zPath : 0;
+  i64 sz = sqlite3_uri_int64(zUri, "write_combine", 0);
+
+  assert(unixInodeMutexHeld(pInode));
+  if (pInode->nRef > 1 || sz <= 0) return;
+  if (sz < UNIX_COMBINE_MIN) sz = UNIX_COMBINE_MIN;
+  if (sz > UNIX_COMBINE_MAX) sz = UNIX_COMBINE_MAX;
+  pInode->szCombine = (int)sz;
+  __atomic_fetch_add(&nCombineInode, 1, __ATOMIC_RELAXED);
+}
+
+/*
+** Set the "write_combine" size of the -wal file pFile from its database,
+** whose -wal file SQLite names zWal.  The staging buffer is allocated by
+** the first write.
+*/
+static void unixCombineWal(unixFile *pFile, const char *zWal)
+{
+  char zDb[MAX_PATHNAME + 1]; /* Database file path */
+  unixInodeInfo *pDbInode = unixWalDbInode(zWal, zDb);
+  if (pDbInode)
+  {
+    pFile->szCombine = pDbInode->szCombine;
+    unixLeaveInodeMutex(pDbInode);
+  }
+}
+
+/*
+** Allocate the staging buffer of pFile.  Return NULL if out of memory, in
+** which case writes are not combined.
+*/
+static unixCombine *unixCombineAlloc(unixFile *pFile)
+{
+  unixCombine *p = (unixCombine *)sqlite3_malloc64(sizeof(unixCombine) + pFile->szCombine);
+  if (p)
+  {
+    memset(p, 0, sizeof(*p));
+    p->szBuf = pFile->szCombine;
+    p->aBuf = (u8 *)&p[1];
+  }
+  else
+  {
+    pFile->szCombine = 0;
+  }
+  return p;
+}
+
+static void cbtMark(unixFile *pFile, i64 iOfst, int nAmt);
+static void shipWrite(unixShipLog *p, unixFile *pFile, const void *pBuf, int amt, i64 iOfst);
+static void unixCkptWrote(unixCkpt *p, i64 iOfst, int amt);
+
+/*
+** Write data from a buffer into a file.  Return SQLITE_OK on success
+** or some other error code on failure.
+*/
+static int unixWrite(sqlite3_file *id, const void *pBuf, int amt, sqlite3_int64 offset)
+{
+  unixFile *pFile = (unixFile *)id;
+  int wrote = 0;
+  i64 iRange; /* Start of the range written by seekAndWrite() */
+  int nRange; /* Size of that range */
+  assert(id);
+  assert(amt > 0);
+  vfsstatAdd(pFile->pStat, VFSSTAT_WRITE, 1);
+  vfsstatAdd(pFile->pStat, VFSSTAT_WRITE_BYTES, amt);
+  pFile->nDirty += amt;
+
+/* If this is a database file (not a journal, master-journal or temp
+** file), the bytes in the locking range should never be read or written. */
+#if 0
+  assert( pFile->pPreallocatedUnused==0
+       || offset>=PENDING_BYTE+512
+       || offset+amt<=PENDING_BYTE 
+  );
+#endif
+
+#ifdef SQLITE_DEBUG
+  /* If we are doing a normal write to a database file (as opposed to
+  ** doing a hot-journal rollback or a write to some file other than a
+  ** normal database file) then record the fact that the database
+  ** has changed.  If the transaction counter is modified, record that
+  ** fact too.
+  */
+  if (pFile->inNormalWrite)
+  {
+    pFile->dbUpdate = 1; /* The database has been modified */
+    if (offset <= 24 && offset + amt >= 27)
     {
       int rc;
+      char oldCntr[4];
       SimulateIOErrorBenign(1);
-      rc = fcntlSizeHint(pFile, *(i64 *)pArg);
+      rc = seekAndRead(pFile, 24, oldCntr, 4);
       SimulateIOErrorBenign(0);
-      return rc;
+      if (rc != 4 || memcmp(oldCntr, &((char *)pBuf)[24 - offset], 4) != 0)
+      {
+        pFile->transCntrChng = 1; /* The transaction counter has changed */
+      }
     }
-    case SQLITE_FCNTL_PERSIST_WAL:
+  }
+#endif
+
+  /* Record the blocks about to change if changed-block tracking is on. */
+  if (pFile->pInode && (pFile->pInode->hCbt >= 0 || pFile->pInode->cbtProbe)) cbtMark(pFile, offset, amt);
+  if (pFile->pShip) shipWrite(pFile->pShip, pFile, pBuf, amt, offset);
+  if (pFile->pCkpt) unixCkptWrote(pFile->pCkpt, offset, amt);
+
+  /* Reserve space ahead of writes that extend the file. */
+  if (pFile->mxPrealloc > 0 && pFile->pDirectWal == 0)
+  {
+    if (offset + amt > __atomic_load_n(pFile->piPreallocEnd, __ATOMIC_RELAXED))
     {
-      unixModeBit(pFile, UNIXFILE_PERSIST_WAL, (int *)pArg);
-      return SQLITE_OK;
+      unixPreallocate(pFile, offset + amt);
     }
-    case SQLITE_FCNTL_POWERSAFE_OVERWRITE:
+    else if (offset == 0 && amt == 32 && (pFile->ctrlFlags & UNIXFILE_WAL) && pFile->pUring == 0)
     {
-      unixModeBit(pFile, UNIXFILE_PSOW, (int *)pArg);
-      return SQLITE_OK;
+      /* A new -wal header.  The WAL restarts after a checkpoint. */
+      unixPreallocRelease(pFile);
     }
-    case SQLITE_FCNTL_VFSNAME:
+  }
+
+  /* Combine -wal writes if "write_combine" is in effect. */
+  if (pFile->szCombine > 0)
+  {
+    int rc;
+    if (pFile->pCombine == 0) pFile->pCombine = unixCombineAlloc(pFile);
+    if (pFile->pCombine && amt <= pFile->pCombine->szBuf) return unixCombineWrite(pFile, pBuf, amt, offset);
+    rc = unixCombineSync(pFile, 0, 0);
+    if (rc != SQLITE_OK) return rc;
+  }
+
+  /* Queue -wal writes on the ring if there is one. */
+  if (pFile->pUring)
+  {
+    int rc;
+    if (amt <= URING_BUFSZ) return uringWrite(pFile, pBuf, amt, offset);
+    rc = uringFlush(pFile);
+    if (rc != SQLITE_OK) return rc;
+  }
+
+#if defined(SQLITE_MMAP_READWRITE) && SQLITE_MAX_MMAP_SIZE > 0
+  /* Deal with as much of this write request as possible by transfering
+  ** data from the memory mapping using memcpy().  */
+  if (offset < pFile->mmapSize)
+  {
+    if (offset + amt <= pFile->mmapSize)
     {
-      *(char **)pArg = sqlite3_mprintf("%s", pFile->pVfs->zName);
+      memcpy(&((u8 *)(pFile->pMapRegion))[offset], pBuf, amt);
       return SQLITE_OK;
     }
-    case SQLITE_FCNTL_TEMPFILENAME:
+    else
     {
-      char *zTFile = (char *)sqlite3_malloc64(pFile->pVfs->mxPathname);
-      if (zTFile)
-      {
-        unixGetTempname(pFile->pVfs->mxPathname, zTFile);
-        *(char **)pArg = zTFile;
-      }
-      return SQLITE_OK;
+      int nCopy = pFile->mmapSize - offset;
+      memcpy(&((u8 *)(pFile->pMapRegion))[offset], pBuf, nCopy);
+      pBuf = &((u8 *)pBuf)[nCopy];
+      amt -= nCopy;
+      offset += nCopy;
     }
-    case SQLITE_FCNTL_HAS_MOVED:
+  }
+#endif
+
+  iRange = offset;
+  nRange = amt;
+  while ((wrote = seekAndWrite(pFile, offset, pBuf, amt)) < amt && wrote > 0)
+  {
+    amt -= wrote;
+    offset += wrote;
+    pBuf = &((char *)pBuf)[wrote];
+  }
+  SimulateIOError((wrote = (-1), amt = 1));
+  SimulateDiskfullError((wrote = 0, amt = 1));
+
+  if (amt > wrote)
+  {
+    if (wrote < 0 && pFile->lastErrno != ENOSPC)
     {
-      *(int *)pArg = fileHasMoved(pFile);
-      return SQLITE_OK;
+      /* lastErrno set by seekAndWrite */
+      return SQLITE_IOERR_WRITE;
     }
-#ifdef SQLITE_ENABLE_SETLK_TIMEOUT
-    case SQLITE_FCNTL_LOCK_TIMEOUT:
+    else
     {
-      pFile->iBusyTimeout = *(int *)pArg;
-      return SQLITE_OK;
+      storeLastErrno(pFile, 0); /* not a system error */
+      return SQLITE_FULL;
     }
-#endif
-#if SQLITE_MAX_MMAP_SIZE > 0
-    case SQLITE_FCNTL_MMAP_SIZE:
-    {
-      i64 newLimit = *(i64 *)pArg;
-      int rc = SQLITE_OK;
-      if (newLimit > sqlite3GlobalConfig_mxMmap)
-      {
-        newLimit = sqlite3GlobalConfig_mxMmap;
-      }
+  }
 
-      /* The value of newLimit may be eventually cast to (size_t) and passed
-      ** to mmap(). Restrict its value to 2GB if (size_t) is not at least a
-      ** 64-bit type. */
-      if (newLimit > 0 && sizeof(size_t) < 8)
-      {
-        newLimit = (newLimit & 0x7FFFFFFF);
-      }
+  unixDirtyAdd(pFile, iRange, nRange);
+  return SQLITE_OK;
+}
 
-      *(i64 *)pArg = pFile->mmapSizeMax;
-      if (newLimit >= 0 && newLimit != pFile->mmapSizeMax && pFile->nFetchOut == 0)
-      {
-        pFile->mmapSizeMax = newLimit;
-        if (pFile->mmapSize > 0)
-        {
-          unixUnmapfile(pFile);
-          rc = unixMapfile(pFile, -1);
-        }
-      }
-      return rc;
-    }
+/*
+** We do not trust systems to provide a working fdatasync().  Some do.
+** Others do no.  To be safe, we will stick with the (slightly slower)
+** fsync(). If you know that your system does support fdatasync() correctly,
+** then simply compile with -Dfdatasync=fdatasync or -DHAVE_FDATASYNC
+*/
+#if !defined(fdatasync) && !HAVE_FDATASYNC
+#define fdatasync fsync
 #endif
-//#ifdef SQLITE_DEBUG
-//    /* The pager calls this method to signal that it has done
-//    ** a rollback and that the database is therefore unchanged and
-//    ** it hence it is OK for the transaction change counter to be
-//    ** unchanged.
-//    */
-//    case SQLITE_FCNTL_DB_UNCHANGED:
-//    {
-//      ((unixFile *)id)->dbUpdate = 0;
-//      return SQLITE_OK;
-//    }
-//#endif
-#if SQLITE_ENABLE_LOCKING_STYLE && defined(__APPLE__)
-    case SQLITE_FCNTL_SET_LOCKPROXYFILE:
-    case SQLITE_FCNTL_GET_LOCKPROXYFILE:
-    {
-      return proxyFileControl(id, op, pArg);
-    }
-#endif /* SQLITE_ENABLE_LOCKING_STYLE && defined(__APPLE__) */
-  }
-  return SQLITE_NOTFOUND;
-}
 
 /*
-** If pFd->sectorSize is non-zero when this function is called, it is a
-** no-op. Otherwise, the values of pFd->sectorSize and
-** pFd->deviceCharacteristics are set according to the file-system
-** characteristics.
+** Define HAVE_FULLFSYNC to 0 or 1 depending on whether or not
+** the F_FULLFSYNC macro is defined.  F_FULLFSYNC is currently
+** only available on Mac OS X.  But that could change.
+*/
+#ifdef F_FULLFSYNC
+#define HAVE_FULLFSYNC 1
+#else
+#define HAVE_FULLFSYNC 0
+#endif
+
+/*
+** The fsync() system call does not work as advertised on many
+** unix systems.  The following procedure is an attempt to make
+** it work better.
 **
-** There are two versions of this function. One for QNX and one for all
-** other systems.
+** The SQLITE_NO_SYNC macro disables all fsync()s.  This is useful
+** for testing when we want to run through the test suite quickly.
+** You are strongly advised *not* to deploy with SQLITE_NO_SYNC
+** enabled, however, since with SQLITE_NO_SYNC enabled, an OS crash
+** or power failure will likely corrupt the database file.
+**
+** SQLite sets the dataOnly flag if the size of the file is unchanged.
+** The idea behind dataOnly is that it should only write the file content
+** to disk, not the inode.  We only set dataOnly if the file size is
+** unchanged since the file size is part of the inode.  However,
+** Ted Ts'o tells us that fdatasync() will also write the inode if the
+** file size has changed.  The only real difference between fdatasync()
+** and fsync(), Ted tells us, is that fdatasync() will not flush the
+** inode if the mtime or owner or other inode attributes have changed.
+** We only care about the file size, not the other file attributes, so
+** as far as SQLite is concerned, an fdatasync() is always adequate.
+** So, we always use fdatasync() if it is available, regardless of
+** the value of the dataOnly flag.
 */
-#ifndef __QNXNTO__
-static void setDeviceCharacteristics(unixFile *pFd)
+static int full_fsync(int fd, int fullSync, int dataOnly)
 {
-  assert(pFd->deviceCharacteristics == 0 || pFd->sectorSize != 0);
-  if (pFd->sectorSize == 0)
+  int rc;
+
+/* The following "ifdef/elif/else/" block has the same structure as
+** the one below. It is replicated here solely to avoid cluttering
+** up the real code with the UNUSED_PARAMETER() macros.
+*/
+#ifdef SQLITE_NO_SYNC
+  UNUSED_PARAMETER(fd);
+  UNUSED_PARAMETER(fullSync);
+  UNUSED_PARAMETER(dataOnly);
+#elif HAVE_FULLFSYNC
+  UNUSED_PARAMETER(dataOnly);
+#else
+  UNUSED_PARAMETER(fullSync);
+  UNUSED_PARAMETER(dataOnly);
+#endif
+
+/* Record the number of times that we do a normal fsync() and
+** FULLSYNC.  This is used during testing to verify that this procedure
+** gets called with the correct arguments.
+*/
+#ifdef SQLITE_TEST
+  if (fullSync) sqlite3_fullsync_count++;
+  sqlite3_sync_count++;
+#endif
+
+/* If we compiled with the SQLITE_NO_SYNC flag, then syncing is a
+** no-op.  But go ahead and call fstat() to validate the file
+** descriptor as we need a method to provoke a failure during
+** coverate testing.
+*/
+#ifdef SQLITE_NO_SYNC
   {
-#if defined(__linux__) && defined(SQLITE_ENABLE_BATCH_ATOMIC_WRITE)
-    int res;
-    u32 f = 0;
+    struct stat buf;
+    rc = osFstat(fd, &buf);
+  }
+#elif HAVE_FULLFSYNC
+  if (fullSync)
+  {
+    rc = osFcntl(fd, F_FULLFSYNC, 0);
+  }
+  else
+  {
+    rc = 1;
+  }
+  /* If the FULLFSYNC failed, fall back to attempting an fsync().
+  ** It shouldn't be possible for fullfsync to fail on the local
+  ** file system (on OSX), so failure indicates that FULLFSYNC
+  ** isn't supported for this file system. So, attempt an fsync
+  ** and (for now) ignore the overhead of a superfluous fcntl call.
+  ** It'd be better to detect fullfsync support once and avoid
+  ** the fcntl call every time sync is called.
+  */
+  if (rc) rc = fsync(fd);
 
-    /* Check for support for F2FS atomic batch writes. */
-    res = osIoctl(pFd->h, F2FS_IOC_GET_FEATURES, &f);
-    if (res == 0 && (f & F2FS_FEATURE_ATOMIC_WRITE))
-    {
-      pFd->deviceCharacteristics = SQLITE_IOCAP_BATCH_ATOMIC;
-    }
-#endif /* __linux__ && SQLITE_ENABLE_BATCH_ATOMIC_WRITE */
+#elif defined(__APPLE__)
+  /* fdatasync() on HFS+ doesn't yet flush the file size if it changed correctly
+  ** so currently we default to the macro that redefines fdatasync to fsync
+  */
+  rc = fsync(fd);
+#else
+  rc = fdatasync(fd);
+#endif /* ifdef SQLITE_NO_SYNC elif HAVE_FULLFSYNC */
 
-    /* Set the POWERSAFE_OVERWRITE flag if requested. */
-    if (pFd->ctrlFlags & UNIXFILE_PSOW)
-    {
-      pFd->deviceCharacteristics |= SQLITE_IOCAP_POWERSAFE_OVERWRITE;
-    }
+  return rc;
+}
 
-    pFd->sectorSize = SQLITE_DEFAULT_SECTOR_SIZE;
+/******************************************************************************
+******************************* Sync strategies *******************************
+**
+** By default every file is synced with full_fsync().  The "sync_db",
+** "sync_wal" and "sync_journal" URI parameters of a database choose how
+** its database file, its -wal file and its rollback journal are synced:
+**
+**   fsync      full_fsync(), as by default.
+**   fdatasync  fdatasync(), which skips inode updates SQLite does not need.
+**   dsync      The file is opened O_DSYNC, so every write is durable when
+**              it returns and xSync() has nothing left to do unless the
+**              file was truncated or extended since.  Not available for
+**              the database file, whose descriptor may be reused from an
+**              earlier connection; "fdatasync" is used instead.
+**   range      The ranges written are collected, and writeback of them is
+**              started with sync_file_range() every UNIX_WRITEBACK_BATCH
+**              bytes, so the fdatasync() made by xSync() has less to wait
+**              for.  Suits checkpoints, which write many database pages
+**              and then sync once: writeback proceeds while they write
+**              rather than all at the end.  See unixDirtyAdd().
+**   syncfs     syncfs() on the file system.  Connections syncing at the
+**              same time share one call.  See unixSyncfsShared().
+**   auto       The cheapest of fsync, fdatasync, dsync and range, as
+**              measured on the device holding the database the first time
+**              it is needed.  See unixSyncResolve().
+**
+** As with "wal_dir", the first connection to open the database decides,
+** and later connections that disagree are logged.
+*/
+#define UNIX_SYNC_ROLE_DB 0      /* Index in unixInodeInfo.aSyncMode[] */
+#define UNIX_SYNC_ROLE_WAL 1     /*   "            "             "     */
+#define UNIX_SYNC_ROLE_JOURNAL 2 /*   "            "             "     */
+
+#define UNIX_SYNC_NCAL 4    /* Strategies "auto" chooses between */
+#define UNIX_SYNC_NCALDEV 8 /* Devices whose measurements are kept */
+
+static const char *const azSyncMode[] = {"fsync", "fdatasync", "dsync", "range", "syncfs", "auto"};
+static const char *const azSyncParam[] = {"sync_db", "sync_wal", "sync_journal"};
+
+/*
+** Measured cost, in microseconds, of UNIX_SYNC_NCAL strategies on one
+** device, or -1 for strategies that failed.
+*/
+typedef struct unixSyncCal unixSyncCal;
+struct unixSyncCal
+{
+  dev_t dev;
+  i64 aCost[UNIX_SYNC_NCAL];
+};
+static std::mutex syncCalMutex; /* Protects the two below */
+static unixSyncCal aSyncCal[UNIX_SYNC_NCALDEV];
+static int nSyncCal = 0;
+
+/*
+** State shared by threads calling syncfs().  A syncfs() call covers every
+** request made before it started, so a thread that finds one running
+** waits for it to end and then, if that is not enough, for its own.
+*/
+static struct
+{
+  std::mutex mutex;             /* Protects the fields below */
+  std::condition_variable cond; /* Signalled when a syncfs() returns */
+  u64 nRequest;                 /* Requests made so far */
+  u64 nCovered;                 /* Requests covered by the last syncfs() */
+  dev_t dev;                    /* File system of the last syncfs() */
+  int rc;                       /* Its return value */
+  int iErrno;                   /* And errno */
+  int bRunning;                 /* True while a syncfs() is in progress */
+} syncfsGroup;
+
+/*
+** Sync the file system holding fd, sharing the syncfs() call with other
+** threads that sync at the same time.  Returns as syncfs() does.
+*/
+static int unixSyncfsShared(int fd)
+{
+  struct stat sStat;
+  u64 iTicket;
+  u64 iStart;
+  int rc;
+  int iErrno;
+
+  if (osFstat(fd, &sStat)) return -1;
+  std::unique_lock<std::mutex> lock(syncfsGroup.mutex);
+  iTicket = ++syncfsGroup.nRequest;
+  for (;;)
+  {
+    if (syncfsGroup.nCovered >= iTicket && syncfsGroup.dev == sStat.st_dev)
+    {
+      errno = syncfsGroup.iErrno;
+      return syncfsGroup.rc;
+    }
+    if (!syncfsGroup.bRunning) break;
+    syncfsGroup.cond.wait(lock);
+  }
+  iStart = syncfsGroup.nRequest;
+  syncfsGroup.bRunning = 1;
+  lock.unlock();
+  rc = osSyncfs(fd);
+  iErrno = errno;
+  lock.lock();
+  syncfsGroup.bRunning = 0;
+  syncfsGroup.nCovered = iStart;
+  syncfsGroup.dev = sStat.st_dev;
+  syncfsGroup.rc = rc;
+  syncfsGroup.iErrno = iErrno;
+  syncfsGroup.cond.notify_all();
+  errno = iErrno;
+  return rc;
+}
+
+/*
+** Sync file descriptor fd using strategy eSync.  bPending is true if an
+** O_DSYNC file was truncated or extended since its last sync.  Returns as
+** full_fsync() does.
+*/
+static int unixSyncWith(int fd, int eSync, int bPending, int isFullsync, int isDataOnly)
+{
+  switch (eSync)
+  {
+    case UNIX_SYNC_FDATASYNC:
+    case UNIX_SYNC_RANGE:
+      return osFdatasync(fd);
+    case UNIX_SYNC_DSYNC:
+      return bPending ? osFdatasync(fd) : 0;
+    case UNIX_SYNC_SYNCFS:
+      return unixSyncfsShared(fd);
   }
+  return full_fsync(fd, isFullsync, isDataOnly);
 }
-#else
-#include <sys/dcmd_blk.h>
-#include <sys/statvfs.h>
-static void setDeviceCharacteristics(unixFile *pFile)
+
+/*
+** Start writeback of the ranges collected by unixDirtyAdd() for pFile.
+*/
+static void unixWriteback(unixFile *pFile)
 {
-  if (pFile->sectorSize == 0)
+#if HAVE_SYNC_FILE_RANGE
+  int i;
+  for (i = 0; i < pFile->nDirtyRange; i++)
   {
-    struct statvfs fsInfo;
+    osSyncFileRange(pFile->h, pFile->aDirty[i].iOfst, pFile->aDirty[i].nByte, SYNC_FILE_RANGE_WRITE);
+  }
+  vfsstatAdd(pFile->pStat, VFSSTAT_WRITEBACK, pFile->nDirtyRange);
+#endif
+  pFile->nDirtyRange = 0;
+  pFile->nDirtyQueued = 0;
+}
 
-    /* Set defaults for non-supported filesystems */
-    pFile->sectorSize = SQLITE_DEFAULT_SECTOR_SIZE;
-    pFile->deviceCharacteristics = 0;
-    if (fstatvfs(pFile->h, &fsInfo) == -1)
+/*
+** Record that nByte bytes at iOfst of pFile were written.  For the "range"
+** strategy, merge the range with those already collected, which are
+** mostly adjacent pages, and start writeback of all of them once they add
+** up to UNIX_WRITEBACK_BATCH bytes or aDirty[] is full.
+*/
+#define UNIX_WRITEBACK_BATCH (128 * 1024)
+static void unixDirtyAdd(unixFile *pFile, i64 iOfst, i64 nByte)
+{
+  unixDirtyRange *p;
+  int i;
+
+  if (pFile->eSync != UNIX_SYNC_RANGE || (pFile->ctrlFlags & UNIXFILE_DIRECT) || nByte <= 0) return;
+  for (i = 0; i < pFile->nDirtyRange; i++)
+  {
+    p = &pFile->aDirty[i];
+    if (iOfst <= p->iOfst + p->nByte && iOfst + nByte >= p->iOfst)
     {
-      return;
+      i64 iEnd = p->iOfst + p->nByte;
+      if (iOfst + nByte > iEnd) iEnd = iOfst + nByte;
+      if (iOfst < p->iOfst) p->iOfst = iOfst;
+      p->nByte = iEnd - p->iOfst;
+      break;
     }
+  }
+  if (i == pFile->nDirtyRange)
+  {
+    if (i == UNIX_DIRTY_NRANGE) unixWriteback(pFile);
+    p = &pFile->aDirty[pFile->nDirtyRange++];
+    p->iOfst = iOfst;
+    p->nByte = nByte;
+  }
+  pFile->nDirtyQueued += nByte;
+  if (pFile->nDirtyQueued >= UNIX_WRITEBACK_BATCH) unixWriteback(pFile);
+}
 
-    if (!strcmp(fsInfo.f_basetype, "tmp"))
+/*
+** Parse the value z of the URI parameter that sets the strategy for file
+** role eRole.  Unknown or unavailable strategies are logged and replaced.
+*/
+static int unixSyncMode(const char *zPath, const char *z, int eRole)
+{
+  int i;
+  if (z == 0) return UNIX_SYNC_FSYNC;
+  for (i = 0; i < (int)ArraySize(azSyncMode) && strcmp(z, azSyncMode[i]); i++)
+    ;
+  if (i == (int)ArraySize(azSyncMode))
+  {
+    sqlite3_log(SQLITE_WARNING, "unknown %s value \"%s\" ignored: %s", azSyncParam[eRole], z, zPath);
+    return UNIX_SYNC_FSYNC;
+  }
+  if (i == UNIX_SYNC_DSYNC && eRole == UNIX_SYNC_ROLE_DB) return UNIX_SYNC_FDATASYNC;
+#if !HAVE_SYNC_FILE_RANGE
+  if (i == UNIX_SYNC_RANGE) return UNIX_SYNC_FDATASYNC;
+  if (i == UNIX_SYNC_SYNCFS) return UNIX_SYNC_FSYNC;
+#endif
+  return i;
+}
+
+/*
+** Return the time in microseconds taken to append UNIX_SYNC_ROUNDS small
+** transactions to file zFile, syncing each with strategy eSync, or -1 if
+** something failed.
+*/
+#define UNIX_SYNC_ROUNDS 8 /* Transactions timed per strategy */
+#define UNIX_SYNC_PAGES 4  /* 4KiB pages written by each */
+static i64 unixSyncMeasure(const char *zFile, int eSync)
+{
+  static const u8 aPage[4096] = {0};
+  struct timespec t0, t1;
+  int iErrno;
+  int h;
+  int i;
+
+  h = robust_open(zFile, O_RDWR | O_CREAT | O_TRUNC | (eSync == UNIX_SYNC_DSYNC ? O_DSYNC : 0), 0600);
+  if (h < 0) return -1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < UNIX_SYNC_ROUNDS * UNIX_SYNC_PAGES; i++)
+  {
+    i64 iOfst = (i64)i * sizeof(aPage);
+    if (seekAndWriteFd(h, iOfst, aPage, sizeof(aPage), &iErrno) != (int)sizeof(aPage)) break;
+#if HAVE_SYNC_FILE_RANGE
+    if (eSync == UNIX_SYNC_RANGE) osSyncFileRange(h, iOfst, sizeof(aPage), SYNC_FILE_RANGE_WRITE);
+#endif
+    if ((i + 1) % UNIX_SYNC_PAGES == 0 && unixSyncWith(h, eSync, 0, 0, 0)) break;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  robust_close(0, h, __LINE__);
+  if (i < UNIX_SYNC_ROUNDS * UNIX_SYNC_PAGES) return -1;
+  return (i64)(t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000;
+}
+
+/*
+** Return the strategy to use for a file of role eRole of database zDb,
+** when the database asks for eSync.  For "auto", the first call for a
+** device times each strategy on a scratch file next to zDb, so that the
+** choice reflects the device and file system actually used.
+*/
+static int unixSyncResolve(int eSync, int eRole, const char *zDb)
+{
+  char zFile[MAX_PATHNAME + 16]; /* Scratch file */
+  struct stat sStat;
+  unixSyncCal *pCal = 0;
+  int eBest = UNIX_SYNC_FSYNC;
+  int i;
+
+  if (eSync != UNIX_SYNC_AUTO) return eSync;
+  if (osStat(zDb, &sStat)) return UNIX_SYNC_FSYNC;
+  syncCalMutex.lock();
+  for (i = 0; i < nSyncCal; i++)
+  {
+    if (aSyncCal[i].dev == sStat.st_dev) pCal = &aSyncCal[i];
+  }
+  if (pCal == 0)
+  {
+    pCal = &aSyncCal[nSyncCal < UNIX_SYNC_NCALDEV ? nSyncCal++ : UNIX_SYNC_NCALDEV - 1];
+    pCal->dev = sStat.st_dev;
+    sqlite3_snprintf(sizeof(zFile), zFile, "%s-synccal", zDb);
+    for (i = 0; i < UNIX_SYNC_NCAL; i++)
     {
-      pFile->sectorSize = fsInfo.f_bsize;
-      pFile->deviceCharacteristics = SQLITE_IOCAP_ATOMIC4K |    /* All ram filesystem writes are atomic */
-                                     SQLITE_IOCAP_SAFE_APPEND | /* growing the file does not occur until
-                                                                ** the write succeeds */
-                                     SQLITE_IOCAP_SEQUENTIAL |  /* The ram filesystem has no write behind
-                                                                ** so it is ordered */
-                                     0;
-    }
-    else if (strstr(fsInfo.f_basetype, "etfs"))
-    {
-      pFile->sectorSize = fsInfo.f_bsize;
-      pFile->deviceCharacteristics =
-          /* etfs cluster size writes are atomic */
-          (pFile->sectorSize / 512 * SQLITE_IOCAP_ATOMIC512) |
-          SQLITE_IOCAP_SAFE_APPEND | /* growing the file does not occur until
-                                     ** the write succeeds */
-          SQLITE_IOCAP_SEQUENTIAL |  /* The ram filesystem has no write behind
-                                     ** so it is ordered */
-          0;
-    }
-    else if (!strcmp(fsInfo.f_basetype, "qnx6"))
-    {
-      pFile->sectorSize = fsInfo.f_bsize;
-      pFile->deviceCharacteristics = SQLITE_IOCAP_ATOMIC |      /* All filesystem writes are atomic */
-                                     SQLITE_IOCAP_SAFE_APPEND | /* growing the file does not occur until
-                                                                ** the write succeeds */
-                                     SQLITE_IOCAP_SEQUENTIAL |  /* The ram filesystem has no write behind
-                                                                ** so it is ordered */
-                                     0;
-    }
-    else if (!strcmp(fsInfo.f_basetype, "qnx4"))
-    {
-      pFile->sectorSize = fsInfo.f_bsize;
-      pFile->deviceCharacteristics =
-          /* full bitset of atomics from max sector size and smaller */
-          ((pFile->sectorSize / 512 * SQLITE_IOCAP_ATOMIC512) << 1) - 2 |
-          SQLITE_IOCAP_SEQUENTIAL | /* The ram filesystem has no write behind
-                                    ** so it is ordered */
-          0;
-    }
-    else if (strstr(fsInfo.f_basetype, "dos"))
-    {
-      pFile->sectorSize = fsInfo.f_bsize;
-      pFile->deviceCharacteristics =
-          /* full bitset of atomics from max sector size and smaller */
-          ((pFile->sectorSize / 512 * SQLITE_IOCAP_ATOMIC512) << 1) - 2 |
-          SQLITE_IOCAP_SEQUENTIAL | /* The ram filesystem has no write behind
-                                    ** so it is ordered */
-          0;
-    }
-    else
-    {
-      pFile->deviceCharacteristics = SQLITE_IOCAP_ATOMIC512 |   /* blocks are atomic */
-                                     SQLITE_IOCAP_SAFE_APPEND | /* growing the file does not occur until
-                                                                ** the write succeeds */
-                                     0;
+      pCal->aCost[i] = unixSyncMeasure(zFile, i);
     }
+#if !HAVE_SYNC_FILE_RANGE
+    pCal->aCost[UNIX_SYNC_RANGE] = -1;
+#endif
+    osUnlink(zFile);
+    sqlite3_log(SQLITE_NOTICE, "sync costs (us): fsync %lld fdatasync %lld dsync %lld range %lld: %s",
+                pCal->aCost[0], pCal->aCost[1], pCal->aCost[2], pCal->aCost[3], zDb);
   }
-  /* Last chance verification.  If the sector size isn't a multiple of 512
-  ** then it isn't valid.*/
-  if (pFile->sectorSize % 512 != 0)
+  for (i = 0; i < UNIX_SYNC_NCAL; i++)
   {
-    pFile->deviceCharacteristics = 0;
-    pFile->sectorSize = SQLITE_DEFAULT_SECTOR_SIZE;
+    if (i == UNIX_SYNC_DSYNC && eRole == UNIX_SYNC_ROLE_DB) continue;
+    if (pCal->aCost[i] >= 0 && (pCal->aCost[eBest] < 0 || pCal->aCost[i] < pCal->aCost[eBest])) eBest = i;
   }
+  syncCalMutex.unlock();
+  return eBest;
 }
-#endif
 
 /*
-** Return the sector size in bytes of the underlying block device for
-** the specified file. This is almost always 512 bytes, but may be
-** larger for some devices.
-**
-** SQLite code assumes this function cannot fail. It also assumes that
-** if two files are created in the same file-system directory (i.e.
-** a database and its journal file) that the sector size will be the
-** same for both.
+** Return the strategy for -wal or rollback journal zPath, of type eType,
+** as set by its database.
 */
-static int unixSectorSize(sqlite3_file *id)
+static int unixSyncFileMode(const char *zPath, int eType)
 {
-  unixFile *pFd = (unixFile *)id;
-  setDeviceCharacteristics(pFd);
-  return pFd->sectorSize;
+  char zDb[MAX_PATHNAME + 1]; /* Database file path */
+  int eRole = eType == SQLITE_OPEN_WAL ? UNIX_SYNC_ROLE_WAL : UNIX_SYNC_ROLE_JOURNAL;
+  unixInodeInfo *pInode;
+  int eSync;
+
+  pInode = unixSuffixDbInode(zPath, eRole == UNIX_SYNC_ROLE_WAL ? "-wal" : "-journal", zDb);
+  if (pInode == 0) return UNIX_SYNC_FSYNC;
+  eSync = pInode->aSyncMode[eRole];
+  unixLeaveInodeMutex(pInode);
+  return unixSyncResolve(eSync, eRole, zDb);
 }
 
 /*
-** Return the device characteristics for the file.
+** Record on the unixInodeInfo of main database file pFile the strategies
+** given by its URI parameters, and set the strategy of pFile.  "auto" is
+** resolved later, by unixOpen(), without the mutex.
 **
-** This VFS is set up to return SQLITE_IOCAP_POWERSAFE_OVERWRITE by default.
-** However, that choice is controversial since technically the underlying
-** file system does not always provide powersafe overwrites.  (In other
-** words, after a power-loss event, parts of the file that were never
-** written might end up being altered.)  However, non-PSOW behavior is very,
-** very rare.  And asserting PSOW makes a large reduction in the amount
-** of required I/O for journaling, since a lot of padding is eliminated.
-**  Hence, while POWERSAFE_OVERWRITE is on by default, there is a file-control
-** available to turn it off and URI query parameter available to turn it off.
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
 */
-static int unixDeviceCharacteristics(sqlite3_file *id)
+static void setInodeSyncModes(unixFile *pFile)
 {
-  unixFile *pFd = (unixFile *)id;
-  setDeviceCharacteristics(pFd);
-  return pFd->deviceCharacteristics;
-}
+  unixInodeInfo *pInode = pFile->pInode;
+  const char *zUri = (pFile->ctrlFlags & UNIXFILE_URI) ? pFile->zPath : 0;
+  unsigned char aMode[3];
+  int bSet = 0;
+  int i;
 
-#if !defined(SQLITE_OMIT_WAL) || SQLITE_MAX_MMAP_SIZE > 0
+  assert(unixInodeMutexHeld(pInode));
+  for (i = 0; i < 3; i++)
+  {
+    aMode[i] = (unsigned char)unixSyncMode(pFile->zPath, sqlite3_uri_parameter(zUri, azSyncParam[i]), i);
+    bSet |= aMode[i];
+  }
+  if (pInode->nRef > 1)
+  {
+    if (memcmp(aMode, pInode->aSyncMode, sizeof(aMode)))
+    {
+      sqlite3_log(SQLITE_WARNING, "conflicting sync_db/sync_wal/sync_journal ignored: %s", pFile->zPath);
+    }
+  }
+  else if (bSet)
+  {
+    memcpy(pInode->aSyncMode, aMode, sizeof(aMode));
+    __atomic_fetch_add(&nSyncInode, 1, __ATOMIC_RELAXED);
+  }
+  pFile->eSync = pInode->aSyncMode[UNIX_SYNC_ROLE_DB];
+}
 
 /*
-** Return the system page size.
+** Open a file descriptor to the directory containing file zFilename.
+** If successful, *pFd is set to the opened file descriptor and
+** SQLITE_OK is returned. If an error occurs, either SQLITE_NOMEM
+** or SQLITE_CANTOPEN is returned and *pFd is set to an undefined
+** value.
 **
-** This function should not be called directly by other code in this file.
-** Instead, it should be called via macro osGetpagesize().
+** The directory file descriptor is used for only one thing - to
+** fsync() a directory to make sure file creation and deletion events
+** are flushed to disk.  Such fsyncs are not needed on newer
+** journaling filesystems, but are required on older filesystems.
+**
+** This routine can be overridden using the xSetSysCall interface.
+** The ability to override this routine was added in support of the
+** chromium sandbox.  Opening a directory is a security risk (we are
+** told) so making it overrideable allows the chromium sandbox to
+** replace this routine with a harmless no-op.  To make this routine
+** a no-op, replace it with a stub that returns SQLITE_OK but leaves
+** *pFd set to a negative number.
+**
+** If SQLITE_OK is returned, the caller is responsible for closing
+** the file descriptor *pFd using close().
 */
-static int unixGetpagesize(void)
+static int openDirectory(const char *zFilename, int *pFd)
 {
-  return (int)sysconf(_SC_PAGESIZE);
-}
-
-#endif /* !defined(SQLITE_OMIT_WAL) || SQLITE_MAX_MMAP_SIZE>0 */
+  int ii;
+  int fd = -1;
+  char zDirname[MAX_PATHNAME + 1];
 
-#ifndef SQLITE_OMIT_WAL
+  sqlite3_snprintf(MAX_PATHNAME, zDirname, "%s", zFilename);
+  for (ii = (int)strlen(zDirname); ii > 0 && zDirname[ii] != '/'; ii--)
+    ;
+  if (ii > 0)
+  {
+    zDirname[ii] = '\0';
+  }
+  else
+  {
+    if (zDirname[0] != '/') zDirname[0] = '.';
+    zDirname[1] = 0;
+  }
+  fd = robust_open(zDirname, O_RDONLY | O_BINARY, 0);
+  if (fd >= 0)
+  {
+    OSTRACE(("OPENDIR %-3d %s\n", fd, zDirname));
+  }
+  *pFd = fd;
+  if (fd >= 0) return SQLITE_OK;
+  return unixLogError(SQLITE_CANTOPEN, "openDirectory", zDirname);
+}
 
 /*
-** Object used to represent an shared memory buffer.
-**
-** When multiple threads all reference the same wal-index, each thread
-** has its own unixShm object, but they all point to a single instance
-** of this unixShmNode object.  In other words, each wal-index is opened
-** only once per process.
-**
-** Each unixShmNode object is connected to a single unixInodeInfo object.
-** We could coalesce this object into unixInodeInfo, but that would mean
-** every open file that does not use shared memory (in other words, most
-** open files) would have to carry around this extra information.  So
-** the unixInodeInfo object contains a pointer to this unixShmNode object
-** and the unixShmNode object is created only when needed.
-**
-** unixMutexHeld() must be true when creating or destroying
-** this object or while reading or writing the following fields:
-**
-**      nRef
-**
-** The following fields are read-only after the object is created:
+** Directory file descriptors kept open for the DIRSYNC step of unixSync().
 **
-**      fid
-**      zFilename
-**
-** Either unixShmNode.mutex must be held or unixShmNode.nRef==0 and
-** unixMutexHeld() is true when reading or writing any other field
-** in this structure.
+** Every rollback journal and every -wal file that SQLite creates has its
+** directory synced after its first sync.  Opening and closing the
+** directory each time costs two system calls and a path lookup.  Instead,
+** the descriptors of the last UNIX_NDIRFD directories synced are kept.
+** Before a cached descriptor is used, fstatat() checks that the file being
+** synced is linked into that directory under its name, so a directory
+** that has been renamed or replaced since is never synced in its place.
 */
-struct unixShmNode
+#define UNIX_NDIRFD 16
+
+struct unixDirFd
 {
-  unixInodeInfo *pInode; /* unixInodeInfo that owns this SHM node */
-  std::mutex *mutex;     /* Mutex to access this object */
-  char *zFilename;       /* Name of the mmapped file */
-  int h;                 /* Open file descriptor */
-  int szRegion;          /* Size of shared-memory regions */
-  u16 nRegion;           /* Size of array apRegion */
-  u8 isReadonly;         /* True if read-only */
-  u8 isUnlocked;         /* True if no DMS lock held */
-  char **apRegion;       /* Array of mapped shared-memory regions */
-  int nRef;              /* Number of unixShm objects pointing to this */
-  unixShm *pFirst;       /* All unixShm objects pointing to this */
-#ifdef SQLITE_DEBUG
-  u8 exclMask;   /* Mask of exclusive locks held */
-  u8 sharedMask; /* Mask of shared locks held */
-  u8 nextShmId;  /* Next available unixShm.id value */
-#endif
+  char *zDir; /* Directory name, from sqlite3_malloc(), or NULL if unused */
+  int h;      /* Open descriptor of zDir */
+  int nRef;   /* Syncs using h right now.  It is not closed while >0 */
+  u64 iUsed;  /* Value of dirFdClock when last used */
 };
+static std::mutex dirFdMutex; /* Protects the two below */
+static unixDirFd aDirFd[UNIX_NDIRFD];
+static u64 dirFdClock = 0;
 
 /*
-** Structure used internally by this VFS to record the state of an
-** open shared memory connection.
-**
-** The following fields are initialized when this object is created and
-** are read-only thereafter:
-**
-**    unixShm.pFile
-**    unixShm.id
-**
-** All other fields are read/write.  The unixShm.pFile->mutex must be held
-** while accessing any read/write fields.
+** Forget the cached directory descriptor p.  It is closed as soon as no
+** sync is using it.  dirFdMutex is held.
 */
-struct unixShm
+static void unixDirFdClose(unixDirFd *p)
 {
-  unixShmNode *pShmNode; /* The underlying unixShmNode object */
-  unixShm *pNext;        /* Next unixShm with the same unixShmNode */
-  u8 hasMutex;           /* True if holding the unixShmNode mutex */
-  u8 id;                 /* Id of this connection within its unixShmNode */
-  u16 sharedMask;        /* Mask of shared locks held */
-  u16 exclMask;          /* Mask of exclusive locks held */
-};
+  sqlite3_free(p->zDir);
+  p->zDir = 0;
+  if (p->nRef == 0) robust_close(0, p->h, __LINE__);
+}
 
 /*
-** Constants used for locking
+** Finish using the cached directory descriptor p.  dirFdMutex is held.
 */
-#define UNIX_SHM_BASE ((22 + SQLITE_SHM_NLOCK) * 4)     /* first lock byte */
-#define UNIX_SHM_DMS (UNIX_SHM_BASE + SQLITE_SHM_NLOCK) /* deadman switch */
+static void unixDirFdRelease(unixDirFd *p)
+{
+  if (--p->nRef == 0 && p->zDir == 0) robust_close(0, p->h, __LINE__);
+}
 
 /*
-** Apply posix advisory locks for all bytes from ofst through ofst+n-1.
-**
-** Locks block if the mask is exactly UNIX_SHM_C and are non-blocking
-** otherwise.
+** Sync the directory that contains the file pFile.  Errors are ignored, as
+** in unixSync().
 */
-static int unixShmSystemLock(unixFile *pFile, /* Open connection to the WAL file */
-                             int lockType,    /* F_UNLCK, F_RDLCK, or F_WRLCK */
-                             int ofst,        /* First byte of the locking range */
-                             int n            /* Number of bytes to lock */
-                             )
+static void unixDirSync(unixFile *pFile)
 {
-  unixShmNode *pShmNode; /* Apply locks to this open shared-memory segment */
-  struct flock f;        /* The posix advisory locking structure */
-  int rc = SQLITE_OK;    /* Result code form fcntl() */
-
-  /* Access to the unixShmNode object is serialized by the caller */
-  pShmNode = pFile->pInode->pShmNode;
-  assert(pShmNode->nRef == 0 || mutex_held(pShmNode->mutex));
-
-  /* Shared locks never span more than one byte */
-  assert(n == 1 || lockType != F_RDLCK);
-
-  /* Locks are within range */
-  assert(n >= 1 && n <= SQLITE_SHM_NLOCK);
+  char zDir[MAX_PATHNAME + 1];
+  const char *zBase;
+  unixDirFd *p = 0;
+  struct stat sStat;
+  int h;
+  int i;
+
+  sqlite3_snprintf(sizeof(zDir), zDir, "%s", pFile->zPath);
+  for (i = (int)strlen(zDir); i > 0 && zDir[i] != '/'; i--)
+    ;
+  zBase = &pFile->zPath[i > 0 || zDir[0] == '/' ? i + 1 : 0];
+  zDir[i > 0 ? i : 1] = '\0';
+  if (i == 0 && zDir[0] != '/') zDir[0] = '.';
 
-  if (pShmNode->h >= 0)
+  dirFdMutex.lock();
+  for (i = 0; i < UNIX_NDIRFD && (aDirFd[i].zDir == 0 || strcmp(aDirFd[i].zDir, zDir)); i++)
+    ;
+  if (i < UNIX_NDIRFD)
   {
-    /* Initialize the locking parameters */
-    f.l_type = lockType;
-    f.l_whence = SEEK_SET;
-    f.l_start = ofst;
-    f.l_len = n;
-    rc = osSetPosixAdvisoryLock(pShmNode->h, &f, pFile);
-    rc = (rc != (-1)) ? SQLITE_OK : SQLITE_BUSY;
+    p = &aDirFd[i];
+    p->nRef++;
+    p->iUsed = ++dirFdClock;
   }
+  dirFdMutex.unlock();
 
-/* Update the global lock state and do debug tracing */
-#ifdef SQLITE_DEBUG
+  if (p)
   {
-    u16 mask;
-    OSTRACE(("SHM-LOCK "));
-    mask = ofst > 31 ? 0xffff : (1 << (ofst + n)) - (1 << ofst);
-    if (rc == SQLITE_OK)
+    if (pFile->pInode && osFstatat(p->h, zBase, &sStat, AT_SYMLINK_NOFOLLOW) == 0 &&
+        sStat.st_dev == pFile->pInode->fileId.dev && (u64)sStat.st_ino == pFile->pInode->fileId.ino)
     {
-      if (lockType == F_UNLCK)
-      {
-        OSTRACE(("unlock %d ok", ofst));
-        pShmNode->exclMask &= ~mask;
-        pShmNode->sharedMask &= ~mask;
-      }
-      else if (lockType == F_RDLCK)
-      {
-        OSTRACE(("read-lock %d ok", ofst));
-        pShmNode->exclMask &= ~mask;
-        pShmNode->sharedMask |= mask;
-      }
-      else
-      {
-        assert(lockType == F_WRLCK);
-        OSTRACE(("write-lock %d ok", ofst));
-        pShmNode->exclMask |= mask;
-        pShmNode->sharedMask &= ~mask;
-      }
+      OSTRACE(("DIRSYNC %-3d %s (cached)\n", p->h, zDir));
+      full_fsync(p->h, 0, 0);
+      dirFdMutex.lock();
+      unixDirFdRelease(p);
+      dirFdMutex.unlock();
+      return;
     }
-    else
+    dirFdMutex.lock();
+    if (p->zDir) unixDirFdClose(p);
+    unixDirFdRelease(p);
+    dirFdMutex.unlock();
+  }
+
+  if (osOpenDirectory(pFile->zPath, &h) != SQLITE_OK) return;
+  full_fsync(h, 0, 0);
+  if (h >= 0)
+  {
+    dirFdMutex.lock();
+    p = 0;
+    for (i = 0; i < UNIX_NDIRFD; i++)
     {
-      if (lockType == F_UNLCK)
-      {
-        OSTRACE(("unlock %d failed", ofst));
-      }
-      else if (lockType == F_RDLCK)
+      unixDirFd *pSlot = &aDirFd[i];
+      if (pSlot->zDir && strcmp(pSlot->zDir, zDir) == 0)
       {
-        OSTRACE(("read-lock failed"));
+        p = 0; /* Another thread has cached it meanwhile */
+        break;
       }
-      else
+      if (pSlot->nRef == 0 && (p == 0 || pSlot->zDir == 0 || (p->zDir && pSlot->iUsed < p->iUsed))) p = pSlot;
+    }
+    if (p)
+    {
+      char *zCopy = sqlite3_mprintf("%s", zDir);
+      if (zCopy)
       {
-        assert(lockType == F_WRLCK);
-        OSTRACE(("write-lock %d failed", ofst));
+        if (p->zDir) unixDirFdClose(p);
+        p->zDir = zCopy;
+        p->h = h;
+        p->iUsed = ++dirFdClock;
+        h = -1;
       }
     }
-    OSTRACE((" - afterwards %03x,%03x\n", pShmNode->sharedMask, pShmNode->exclMask));
+    dirFdMutex.unlock();
+    if (h >= 0) robust_close(pFile, h, __LINE__);
   }
-#endif
-
-  return rc;
 }
 
 /*
-** Return the minimum number of 32KB shm regions that should be mapped at
-** a time, assuming that each mapping must be an integer multiple of the
-** current system page-size.
+** Close all cached directory descriptors.  Called by procvfs_close().
+*/
+static void unixDirFdCloseAll(void)
+{
+  int i;
+  dirFdMutex.lock();
+  for (i = 0; i < UNIX_NDIRFD; i++)
+  {
+    if (aDirFd[i].zDir) unixDirFdClose(&aDirFd[i]);
+  }
+  dirFdMutex.unlock();
+}
+
+/******************************************************************************
+******************************** WAL recycling ********************************
 **
-** Usually, this is 1. The exception seems to be systems that are configured
-** to use 64KB pages - in this case each mapping must cover at least two
-** shm regions.
+** With the "wal_recycle=1" URI parameter, a -wal file keeps the blocks it
+** has grown into.  SQLite shrinks the -wal file when "PRAGMA
+** journal_size_limit" is set, truncates it to zero bytes in
+** wal_checkpoint(TRUNCATE) and deletes it when the last connection closes.
+** Every time, the transactions that follow pay again for block allocation
+** and for the metadata updates that each extending write brings to the
+** next fsync.  Instead:
+**
+**   *  Truncating the -wal file to less than its 32-byte header overwrites
+**      the rest of the header with zeros.  Recovery ignores a -wal file
+**      with a bad magic number, so it reads as empty, as if truncated.
+**      Truncating to any larger size does nothing.  The frames past the new
+**      end belong to an earlier generation of the log and their salts no
+**      longer match, as when a -wal file is reused without a size limit.
+**
+**   *  Deleting the -wal file renames it to "<wal>-spare" instead, once its
+**      header is zeroed and synced.  The next time SQLite creates the -wal
+**      file, the spare is linked into its place.
+**
+** With "wal_spare=N" as well, a background thread makes sure that a spare
+** of at least N bytes of written and synced zeros exists, so that even a
+** -wal file that is created afresh is only overwritten, and each commit
+** needs no more than fdatasync().  The first spare is built once the
+** database first opens its -wal file, so a database in rollback journal
+** mode never has one.  The spare is built as an O_TMPFILE and linked to
+** its name once complete, so a spare that exists is always ready for use,
+** and a crash leaves nothing half-built behind.  Spares are moved into
+** place with rename(), and with renameat2(RENAME_NOREPLACE) where an
+** existing -wal file must not be replaced, so no name is ever missing or
+** wrong in between.
+**
+** Neither applies to a database that uses direct I/O, as its -wal file is
+** laid out differently.  The first connection to open the database decides,
+** as for "wal_dir".
 */
-static int unixShmRegionPerMap(void)
+#define UNIX_SPARE_CHUNK (64 * 1024) /* Bytes of zeros per write() */
+
+static std::mutex spareMutex;             /* Protects nSpareJob */
+static std::condition_variable spareCond; /* Signalled when a job finishes */
+static int nSpareJob = 0;                 /* Spares being built */
+
+/*
+** Write the name of the spare of -wal file zWal to zSpare[], a buffer of
+** MAX_PATHNAME+7 bytes.
+*/
+static void unixWalSpareName(const char *zWal, char *zSpare)
 {
-  int shmsz = 32 * 1024;            /* SHM region size */
-  int pgsz = osGetpagesize();       /* System page size */
-  assert(((pgsz - 1) & pgsz) == 0); /* Page size must be a power of 2 */
-  if (pgsz < shmsz) return 1;
-  return pgsz / shmsz;
+  sqlite3_snprintf(MAX_PATHNAME + 7, zSpare, "%s-spare", zWal);
 }
 
 /*
-** Purge the unixShmNodeList list of all entries with unixShmNode.nRef==0.
-**
-** This is not a VFS shared-memory method; it is a utility function called
-** by VFS shared-memory methods.
+** Build a spare of szSpare bytes for -wal file zWal, unless one at least
+** that large exists already.  Runs on a background thread.
 */
-static void unixShmPurge(unixFile *pFd)
+static void unixWalSpareBuild(const char *zWal, i64 szSpare, mode_t mode)
 {
-  unixShmNode *p = pFd->pInode->pShmNode;
-  assert(unixMutexHeld());
-  if (p && ALWAYS(p->nRef == 0))
+#if defined(O_TMPFILE)
+  static const char aZero[UNIX_SPARE_CHUNK] = {0};
+  char zSpare[MAX_PATHNAME + 7]; /* Name of the spare */
+  char zNew[MAX_PATHNAME + 11];  /* Name of a spare about to replace it */
+  char zDir[MAX_PATHNAME + 1];   /* Directory holding zWal */
+  char zProc[32];                /* /proc name of the O_TMPFILE */
+  struct stat sStat;
+  int iErrno = 0;
+  i64 iOfst;
+  int rc;
+  int fd;
+  int i;
+
+  unixWalSpareName(zWal, zSpare);
+  if (osStat(zSpare, &sStat) == 0 && sStat.st_size >= szSpare) return;
+  sqlite3_snprintf(sizeof(zDir), zDir, "%s", zWal);
+  for (i = sqlite3Strlen30(zDir); i > 0 && zDir[i] != '/'; i--)
+    ;
+  zDir[i > 0 ? i : 1] = '\0';
+  if (i == 0 && zDir[0] != '/') zDir[0] = '.';
+
+  fd = robust_open(zDir, O_TMPFILE | O_RDWR, mode);
+  if (fd < 0)
   {
-    int nShmPerMap = unixShmRegionPerMap();
-    int i;
-    assert(p->pInode == pFd->pInode);
-    mutex_free(p->mutex);
-    for (i = 0; i < p->nRegion; i += nShmPerMap)
+    sqlite3_log(SQLITE_WARNING, "wal_spare unavailable (errno=%d): %s", errno, zWal);
+    return;
+  }
+  for (iOfst = 0; iOfst < szSpare;)
+  {
+    int nChunk = szSpare - iOfst < UNIX_SPARE_CHUNK ? (int)(szSpare - iOfst) : UNIX_SPARE_CHUNK;
+    int nWrite = seekAndWriteFd(fd, iOfst, aZero, nChunk, &iErrno);
+    if (nWrite <= 0) break;
+    iOfst += nWrite;
+  }
+  if (iOfst != szSpare || full_fsync(fd, 0, 1))
+  {
+    sqlite3_log(SQLITE_WARNING, "wal_spare not built (errno=%d): %s", iErrno ? iErrno : errno, zWal);
+    robust_close(0, fd, __LINE__);
+    return;
+  }
+  sqlite3_snprintf(sizeof(zProc), zProc, "/proc/self/fd/%d", fd);
+  rc = linkat(AT_FDCWD, zProc, AT_FDCWD, zSpare, AT_SYMLINK_FOLLOW);
+  if (rc && errno == EEXIST)
+  {
+    /* A spare was recycled meanwhile.  Replace it, in one rename(), only if
+    ** it is too small.  A "-new" name left by a crash is complete, and so
+    ** is one that another thread links and renames at the same time. */
+    if (osStat(zSpare, &sStat) == 0 && sStat.st_size >= szSpare)
     {
-      if (p->h >= 0)
-      {
-        osMunmap(p->apRegion[i], p->szRegion);
-      }
-      else
-      {
-        sqlite3_free(p->apRegion[i]);
-      }
+      robust_close(0, fd, __LINE__);
+      return;
     }
-    sqlite3_free(p->apRegion);
-    if (p->h >= 0)
+    sqlite3_snprintf(sizeof(zNew), zNew, "%s-new", zSpare);
+    osUnlink(zNew);
+    rc = linkat(AT_FDCWD, zProc, AT_FDCWD, zNew, AT_SYMLINK_FOLLOW);
+    if (rc == 0 && rename(zNew, zSpare))
     {
-      robust_close(pFd, p->h, __LINE__);
-      p->h = -1;
+      int iErrRename = errno;
+      osUnlink(zNew);
+      rc = -1;
+      errno = iErrRename == ENOENT ? EEXIST : iErrRename; /* ENOENT: renamed by the other thread */
     }
-    p->pInode->pShmNode = 0;
-    sqlite3_free(p);
   }
+  if (rc == 0)
+  {
+    int hDir;
+    OSTRACE(("SPARE   %-3d %s %lld\n", fd, zSpare, szSpare));
+    if (osOpenDirectory(zSpare, &hDir) == SQLITE_OK)
+    {
+      full_fsync(hDir, 0, 0);
+      robust_close(0, hDir, __LINE__);
+    }
+  }
+  else if (errno != EEXIST)
+  {
+    sqlite3_log(SQLITE_WARNING, "wal_spare not linked (errno=%d): %s", errno, zSpare);
+  }
+  robust_close(0, fd, __LINE__);
+#else
+  UNUSED_PARAMETER(zWal);
+  UNUSED_PARAMETER(szSpare);
+  UNUSED_PARAMETER(mode);
+#endif
 }
 
 /*
-** The DMS lock has not yet been taken on shm file pShmNode. Attempt to
-** take it now. Return SQLITE_OK if successful, or an SQLite error
-** code otherwise.
-**
-** If the DMS cannot be locked because this is a readonly_shm=1
-** connection and no other process already holds a lock, return
-** SQLITE_READONLY_CANTINIT and set pShmNode->isUnlocked=1.
+** Start a background thread to build a spare of szSpare bytes for -wal
+** file zWal, created with permissions mode.
 */
-static int unixLockSharedMemory(unixFile *pDbFd, unixShmNode *pShmNode)
+static void unixWalSpareStart(const char *zWal, i64 szSpare, mode_t mode)
 {
-  struct flock lock;
-  int rc = SQLITE_OK;
+  char *zCopy = sqlite3_mprintf("%s", zWal);
+  if (zCopy == 0) return;
+  {
+    std::lock_guard<std::mutex> lock(spareMutex);
+    nSpareJob++;
+  }
+  try
+  {
+    std::thread([zCopy, szSpare, mode]() {
+      unixWalSpareBuild(zCopy, szSpare, mode);
+      sqlite3_free(zCopy);
+      std::lock_guard<std::mutex> lock(spareMutex);
+      if (--nSpareJob == 0) spareCond.notify_all();
+    }).detach();
+  }
+  catch (const std::system_error &)
+  {
+    sqlite3_free(zCopy);
+    std::lock_guard<std::mutex> lock(spareMutex);
+    if (--nSpareJob == 0) spareCond.notify_all();
+  }
+}
 
-  /* Use F_GETLK to determine the locks other processes are holding
-  ** on the DMS byte. If it indicates that another process is holding
-  ** a SHARED lock, then this process may also take a SHARED lock
-  ** and proceed with opening the *-shm file.
-  **
-  ** Or, if no other process is holding any lock, then this process
-  ** is the first to open it. In this case take an EXCLUSIVE lock on the
-  ** DMS byte and truncate the *-shm file to zero bytes in size. Then
-  ** downgrade to a SHARED lock on the DMS byte.
-  **
-  ** If another process is holding an EXCLUSIVE lock on the DMS byte,
-  ** return SQLITE_BUSY to the caller (it will try again). An earlier
-  ** version of this code attempted the SHARED lock at this point. But
-  ** this introduced a subtle race condition: if the process holding
-  ** EXCLUSIVE failed just before truncating the *-shm file, then this
-  ** process might open and use the *-shm file without truncating it.
-  ** And if the *-shm file has been corrupted by a power failure or
-  ** system crash, the database itself may also become corrupt.  */
-  lock.l_whence = SEEK_SET;
-  lock.l_start = UNIX_SHM_DMS;
-  lock.l_len = 1;
-  lock.l_type = F_WRLCK;
-  if (osFcntl(pShmNode->h, F_GETLK, &lock) != 0)
+/*
+** Wait for every spare being built to be finished.
+*/
+static void unixWalSpareWait(void)
+{
+  std::unique_lock<std::mutex> lock(spareMutex);
+  spareCond.wait(lock, [] { return nSpareJob == 0; });
+}
+
+/*
+** Called by unixOpen() before it opens -wal file zWal.  Move the spare
+** into place if there is one and zWal does not exist, and start building
+** the next spare if szSpare is non-zero.
+*/
+static void unixWalSpareTake(const char *zWal, i64 szSpare, mode_t mode)
+{
+  char zSpare[MAX_PATHNAME + 7];
+  int rc;
+  unixWalSpareName(zWal, zSpare);
+  rc = renameat2(AT_FDCWD, zSpare, AT_FDCWD, zWal, RENAME_NOREPLACE);
+  if (rc && errno == EINVAL)
   {
-    rc = SQLITE_IOERR_LOCK;
+    /* The file system cannot rename without replacing.  link() cannot
+    ** replace either, but leaves the spare to be removed afterwards. */
+    rc = link(zSpare, zWal);
+    if (rc == 0 && osUnlink(zSpare)) unixLogError(SQLITE_OK, "unlink", zSpare);
   }
-  else if (lock.l_type == F_UNLCK)
+  if (rc == 0)
   {
-    if (pShmNode->isReadonly)
-    {
-      pShmNode->isUnlocked = 1;
-      rc = SQLITE_READONLY_CANTINIT;
-    }
-    else
+    OSTRACE(("RECYCLE %s\n", zWal));
+  }
+  else if (errno == EEXIST)
+  {
+    /* The -wal file exists already.  So does the spare, or its build. */
+    return;
+  }
+  else if (errno != ENOENT)
+  {
+    unixLogError(SQLITE_OK, "renameat2", zSpare);
+    return;
+  }
+  if (szSpare > 0) unixWalSpareStart(zWal, szSpare, mode);
+}
+
+/*
+** Called by unixDelete() instead of unlinking -wal file zWal.  Zero its
+** header and keep it as the spare, unless the spare is already at least as
+** large.  Return non-zero if zWal was renamed, or zero if the caller should
+** unlink it as usual.
+*/
+static int unixWalRecycleDelete(const char *zWal)
+{
+  static const char aZero[UNIX_WAL_HDRSIZE] = {0};
+  char zSpare[MAX_PATHNAME + 7];
+  struct stat sWal;
+  struct stat sSpare;
+  int iErrno = 0;
+  int bRecycle = 0;
+  int fd;
+
+  unixWalSpareName(zWal, zSpare);
+  fd = robust_open(zWal, O_RDWR | O_BINARY, 0);
+  if (fd < 0) return 0;
+  if (osFstat(fd, &sWal) == 0 && sWal.st_size > UNIX_WAL_HDRSIZE &&
+      (osStat(zSpare, &sSpare) || sSpare.st_size < sWal.st_size) &&
+      seekAndWriteFd(fd, 0, aZero, UNIX_WAL_HDRSIZE, &iErrno) == UNIX_WAL_HDRSIZE && full_fsync(fd, 0, 1) == 0)
+  {
+    bRecycle = rename(zWal, zSpare) == 0;
+  }
+  robust_close(0, fd, __LINE__);
+  return bRecycle;
+}
+
+/*
+** unixTruncate() for a recycled -wal file pFile, which is nByte bytes or
+** more.  See above.
+*/
+static int unixWalRecycleTruncate(unixFile *pFile, i64 nByte)
+{
+  static const char aZero[UNIX_WAL_HDRSIZE] = {0};
+  int nZero = (int)(UNIX_WAL_HDRSIZE - nByte);
+  if (nByte < UNIX_WAL_HDRSIZE && seekAndWrite(pFile, nByte, aZero, nZero) != nZero)
+  {
+    return unixLogError(SQLITE_IOERR_TRUNCATE, "write", pFile->zPath);
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Record the "wal_recycle" and "wal_spare" parameters of main database
+** file pFile on its unixInodeInfo, if it is the first unixFile on the
+** inode.  The first spare is built by unixWalSpareTake() once the -wal
+** file is first opened.  Must be called after setInodeDirectIo().
+**
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
+*/
+static void setInodeWalRecycle(unixFile *pFile)
+{
+  unixInodeInfo *pInode = pFile->pInode;
+  const char *zUri = (pFile->ctrlFlags & UNIXFILE_URI) ? pFile->zPath : 0;
+  i64 szSpare = sqlite3_uri_int64(zUri, "wal_spare", 0);
+  int bRecycle = szSpare > 0 || sqlite3_uri_boolean(zUri, "wal_recycle", 0);
+
+  assert(unixInodeMutexHeld(pInode));
+  if (szSpare < 0) szSpare = 0;
+  if (pInode->nRef > 1)
+  {
+    if (!pInode->bDirectIo && (bRecycle != pInode->bWalRecycle || szSpare != pInode->szWalSpare))
     {
-      rc = unixShmSystemLock(pDbFd, F_WRLCK, UNIX_SHM_DMS, 1);
-      if (rc == SQLITE_OK && robust_ftruncate(pShmNode->h, 0))
-      {
-        rc = unixLogError(SQLITE_IOERR_SHMOPEN, "ftruncate", pShmNode->zFilename);
-      }
+      sqlite3_log(SQLITE_WARNING, "conflicting wal_recycle/wal_spare ignored: %s", pFile->zPath);
     }
+    return;
   }
-  else if (lock.l_type == F_WRLCK)
+  if (!bRecycle) return;
+  if (pInode->bDirectIo)
   {
-    rc = SQLITE_BUSY;
+    sqlite3_log(SQLITE_WARNING, "wal_recycle ignored with direct_io: %s", pFile->zPath);
+    return;
   }
+  pInode->bWalRecycle = 1;
+  pInode->szWalSpare = szSpare;
+  __atomic_fetch_add(&nRecycleInode, 1, __ATOMIC_RELAXED);
+}
 
-  if (rc == SQLITE_OK)
+/*
+** If the database whose -wal file SQLite names zWal recycles it, return
+** non-zero and set *pszSpare to its "wal_spare" size.
+*/
+static int unixWalRecycle(const char *zWal, i64 *pszSpare)
+{
+  char zDb[MAX_PATHNAME + 1]; /* Database file path */
+  unixInodeInfo *pDbInode;
+  int bRecycle = 0;
+
+  if (__atomic_load_n(&nRecycleInode, __ATOMIC_RELAXED) == 0) return 0;
+  pDbInode = unixWalDbInode(zWal, zDb);
+  if (pDbInode)
   {
-    assert(lock.l_type == F_UNLCK || lock.l_type == F_RDLCK);
-    rc = unixShmSystemLock(pDbFd, F_RDLCK, UNIX_SHM_DMS, 1);
+    bRecycle = pDbInode->bWalRecycle;
+    *pszSpare = pDbInode->szWalSpare;
+    unixLeaveInodeMutex(pDbInode);
   }
-  return rc;
+  return bRecycle;
 }
 
-/*
-** Open a shared-memory area associated with open database file pDbFd.
-** This particular implementation uses mmapped files.
+/******************************************************************************
+************************* I/O priority and write hints *************************
 **
-** The file used to implement shared-memory is in the same directory
-** as the open database file and has the same name as the open database
-** file with the "-shm" suffix added.  For example, if the database file
-** is "/home/user1/config.db" then the file that is created and mmapped
-** for shared memory will be called "/home/user1/config.db-shm".
+** With the "io_hints=1" URI parameter, the kernel is told which role each
+** file plays for the database:
 **
-** Another approach to is to use files in /dev/shm or /dev/tmp or an
-** some other tmpfs mount. But if a file in a different directory
-** from the database file is used, then differing access permissions
-** or a chroot() might cause two different processes on the same
-** database to end up using different files for shared memory -
-** meaning that their memory would not really be shared - resulting
-** in database corruption.  Nevertheless, this tmpfs file usage
-** can be enabled at compile-time using -DSQLITE_SHM_DIRECTORY="/dev/shm"
-** or the equivalent.  The use of the SQLITE_SHM_DIRECTORY compile-time
-** option results in an incompatible build of SQLite;  builds of SQLite
-** that with differing SQLITE_SHM_DIRECTORY settings attempt to use the
-** same database file at the same time, database corruption will likely
-** result. The SQLITE_SHM_DIRECTORY compile-time option is considered
-** "unsupported" and may go away in a future SQLite release.
+**   *  Every file gets a write-lifetime hint with F_SET_RW_HINT: short for
+**      the -wal file, the rollback journal, the -shm file and temporary
+**      files, which are overwritten or deleted soon after they are
+**      written, and long for the database file.  File systems and devices
+**      that place data by expected lifetime, such as F2FS or NVMe with
+**      write streams, then keep the churn of the logs apart from the
+**      database pages.
 **
-** When opening a new shared-memory file, if no other instances of that
-** file are currently open, in this process or in other processes, then
-** the file must be truncated to zero length or have its header cleared.
+**   *  A thread holding the checkpoint lock of the wal-index runs at the
+**      lowest best-effort I/O priority until it releases the lock, and then
+**      gets its own priority back.  With the BFQ and mq-deadline
+**      schedulers, the database writes and syncs of a checkpoint then give
+**      way to the -wal writes of commits and to reads.  The idle class is
+**      not used, as a checkpoint starved under steady load would let the
+**      -wal file grow without bound.
 **
-** If the original database file (pDbFd) is using the "unix-excl" VFS
-** that means that an exclusive lock is held on the database file and
-** that no other processes are able to read or write the database.  In
-** that case, we do not really need shared memory.  No shared memory
-** file is created.  The shared memory will be simulated with heap memory.
+** Kernels that know neither hint ignore them.  Temporary files and master
+** journals belong to no single database, so they are hinted as soon as
+** any database open in the process uses "io_hints".  The first connection
+** to open the database decides, as for "wal_dir".
 */
-static int unixOpenSharedMemory(unixFile *pDbFd)
+#define UNIX_WRITE_LIFE_SHORT 2          /* RWH_WRITE_LIFE_SHORT */
+#define UNIX_WRITE_LIFE_LONG 4           /* RWH_WRITE_LIFE_LONG */
+#define UNIX_IOPRIO_WHO_PROCESS 1        /* IOPRIO_WHO_PROCESS: the calling thread if who is 0 */
+#define UNIX_IOPRIO_CKPT ((2 << 13) | 7) /* IOPRIO_CLASS_BE, lowest level */
+#define UNIX_IOPRIO_CLASS(x) ((x) >> 13) /* IOPRIO_PRIO_CLASS() */
+
+/*
+** Give file descriptor h the write-lifetime hint iHint.
+*/
+static void unixWriteHint(int h, u64 iHint)
 {
-  struct unixShm *p = 0;        /* The connection to be opened */
-  struct unixShmNode *pShmNode; /* The underlying mmapped file */
-  int rc = SQLITE_OK;           /* Result code */
-  unixInodeInfo *pInode;        /* The inode of fd */
-  char *zShm;                   /* Name of the file used for SHM */
-  int nShmFilename;             /* Size of the SHM filename in bytes */
+#if HAVE_RW_HINT
+  osFcntl(h, F_SET_RW_HINT, &iHint);
+#else
+  UNUSED_PARAMETER(h);
+  UNUSED_PARAMETER(iHint);
+#endif
+}
 
-  /* Allocate space for the new unixShm object. */
-  p = (unixShm *)sqlite3_malloc64(sizeof(*p));
-  if (p == 0) return SQLITE_NOMEM;
-  memset(p, 0, sizeof(*p));
-  assert(pDbFd->pShm == 0);
+/*
+** Record the "io_hints" setting of main database file pFile on its
+** unixInodeInfo, if it is the first unixFile on the inode, and hint pFile
+** if it is set.
+**
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
+*/
+static void setInodeIoHints(unixFile *pFile)
+{
+  unixInodeInfo *pInode = pFile->pInode;
+  const char *zUri = (pFile->ctrlFlags & UNIXFILE_URI) ? pFile->zPath : 0;
 
-  /* Check to see if a unixShmNode object already exists. Reuse an existing
-  ** one if present. Create a new one if necessary.
-  */
-  unixEnterMutex();
-  pInode = pDbFd->pInode;
-  pShmNode = pInode->pShmNode;
-  if (pShmNode == 0)
+  assert(unixInodeMutexHeld(pInode));
+  if (pInode->nRef == 1 && sqlite3_uri_boolean(zUri, "io_hints", 0))
   {
-    struct stat sStat; /* fstat() info for database file */
-#ifndef SQLITE_SHM_DIRECTORY
-    const char *zBasePath = pDbFd->zPath;
-#endif
+    pInode->bIoHints = 1;
+    __atomic_fetch_add(&nHintInode, 1, __ATOMIC_RELAXED);
+  }
+  if (pInode->bIoHints)
+  {
+    pFile->ctrlFlags |= UNIXFILE_IOHINTS;
+    pFile->iCkptIoprio = -1;
+    unixWriteHint(pFile->h, UNIX_WRITE_LIFE_LONG);
+  }
+}
 
-    /* Call fstat() to figure out the permissions on the database file. If
-    ** a new *-shm file is created, an attempt will be made to create it
-    ** with the same permissions.
-    */
-    if (osFstat(pDbFd->h, &sStat))
+/*
+** Give pFile, opened by unixOpen() as a file of type eType other than a
+** main database, its write-lifetime hint if it is due one.  zPath is the
+** name SQLite gave the file.
+*/
+static void unixWriteHintFile(unixFile *pFile, const char *zPath, int eType)
+{
+  char zDb[MAX_PATHNAME + 1]; /* Database file path */
+  unixInodeInfo *pDbInode;
+  int bHint = 1;
+
+  if (eType == SQLITE_OPEN_WAL || eType == SQLITE_OPEN_MAIN_JOURNAL)
+  {
+    pDbInode = unixSuffixDbInode(zPath, eType == SQLITE_OPEN_WAL ? "-wal" : "-journal", zDb);
+    bHint = pDbInode && pDbInode->bIoHints;
+    if (pDbInode) unixLeaveInodeMutex(pDbInode);
+  }
+  if (bHint) unixWriteHint(pFile->h, UNIX_WRITE_LIFE_SHORT);
+}
+
+/*
+** Lower the I/O priority of the calling thread, which has just taken the
+** checkpoint lock through pDbFd, if bLock is true.  Otherwise the lock
+** has just been released: restore the priority.
+*/
+static void unixCkptIoprio(unixFile *pDbFd, int bLock)
+{
+#if HAVE_IOPRIO
+  if (bLock)
+  {
+    pDbFd->iCkptIoprio = osIoprioGet(UNIX_IOPRIO_WHO_PROCESS, 0);
+    if (pDbFd->iCkptIoprio >= 0 && osIoprioSet(UNIX_IOPRIO_WHO_PROCESS, 0, UNIX_IOPRIO_CKPT))
     {
-      rc = SQLITE_IOERR_FSTAT;
-      goto shm_open_err;
+      pDbFd->iCkptIoprio = -1;
     }
-
-#ifdef SQLITE_SHM_DIRECTORY
-    nShmFilename = sizeof(SQLITE_SHM_DIRECTORY) + 31;
-#else
-    nShmFilename = 6 + (int)strlen(zBasePath);
-#endif
-    pShmNode = (unixShmNode *)sqlite3_malloc64(sizeof(*pShmNode) + nShmFilename);
-    if (pShmNode == 0)
+  }
+  else if (pDbFd->iCkptIoprio >= 0)
+  {
+    /* Older kernels report a thread that never set a priority as class
+    ** NONE with a level, which ioprio_set() rejects.  Class NONE is 0. */
+    int iPrio = UNIX_IOPRIO_CLASS(pDbFd->iCkptIoprio) == 0 ? 0 : pDbFd->iCkptIoprio;
+    if (osIoprioSet(UNIX_IOPRIO_WHO_PROCESS, 0, iPrio))
     {
-      rc = SQLITE_NOMEM;
-      goto shm_open_err;
+      unixLogError(SQLITE_OK, "ioprio_set", pDbFd->zPath);
     }
-    memset(pShmNode, 0, sizeof(*pShmNode) + nShmFilename);
-    zShm = pShmNode->zFilename = (char *)&pShmNode[1];
-#ifdef SQLITE_SHM_DIRECTORY
-    sqlite3_snprintf(nShmFilename, zShm, SQLITE_SHM_DIRECTORY "/sqlite-shm-%x-%x", (u32)sStat.st_ino,
-                     (u32)sStat.st_dev);
+    pDbFd->iCkptIoprio = -1;
+  }
 #else
-    sqlite3_snprintf(nShmFilename, zShm, "%s-shm", zBasePath);
-    sqlite3FileSuffix3(pDbFd->zPath, zShm);
+  UNUSED_PARAMETER(pDbFd);
+  UNUSED_PARAMETER(bLock);
 #endif
-    pShmNode->h = -1;
-    pDbFd->pInode->pShmNode = pShmNode;
-    pShmNode->pInode = pDbFd->pInode;
-    if (sqlite3GlobalConfig_bCoreMutex)
-    {
-      pShmNode->mutex = mutex_alloc(SQLITE_MUTEX_FAST);
-      if (pShmNode->mutex == 0)
-      {
-        rc = SQLITE_NOMEM;
-        goto shm_open_err;
-      }
-    }
+}
 
-    if (pInode->bProcessLock == 0)
-    {
-      if (0 == sqlite3_uri_boolean(pDbFd->zPath, "readonly_shm", 0))
-      {
-        pShmNode->h = robust_open(zShm, O_RDWR | O_CREAT, (sStat.st_mode & 0777));
-      }
-      if (pShmNode->h < 0)
-      {
-        pShmNode->h = robust_open(zShm, O_RDONLY, (sStat.st_mode & 0777));
-        if (pShmNode->h < 0)
-        {
-          rc = unixLogError(SQLITE_CANTOPEN, "open", zShm);
-          goto shm_open_err;
-        }
-        pShmNode->isReadonly = 1;
-      }
+/******************************************************************************
+**************************** Background checkpoints ***************************
+**
+** With any of the URI parameters below, the checkpoints of a WAL database
+** are run by a scheduler thread of the VFS, so that no commit pays for
+** one:
+**
+**   ckpt_wal=N         Checkpoint once N bytes have been logged since the
+**                      previous checkpoint.
+**   ckpt_interval=MS   Checkpoint at least every MS milliseconds.
+**   ckpt_idle=MS       Checkpoint once nothing has been logged for MS
+**                      milliseconds, if anything was since the previous
+**                      checkpoint.
+**   wal_limit=N        Hold back writers while the log is longer than N
+**                      bytes: each write transaction, once it has ended,
+**                      waits for the next checkpoint to finish, or for
+**                      "wal_limit_wait" milliseconds (100 by default),
+**                      whichever is sooner.
+**
+** Checkpoints are PASSIVE, so they never wait for readers or writers.  One
+** that backfills the whole log escalates, without waiting either: to
+** TRUNCATE if it was started by "ckpt_idle", so that an idle database
+** gives back the space of its -wal file, and to RESTART if the log is
+** longer than "wal_limit", so that the next writer starts again at the
+** beginning of the file.  Either fails at once with SQLITE_BUSY if readers
+** still use the log.
+**
+** Writers wait at the end of their transaction, once they have released
+** their read lock on the log, rather than before it: a read lock taken
+** before the commit would keep the checkpoint waited for from backfilling
+** the frames just written, and the next transaction from restarting the
+** log.
+**
+** The scheduler opens a connection of its own for each checkpoint and
+** closes it afterwards, so it never keeps open a database the application
+** has closed.  It holds a reference to the unixInodeInfo while it does,
+** so its connection is never the first to the database, which would
+** decide the settings of the inode without the URI parameters of the
+** application, and a database closed meanwhile is released only once the
+** checkpoint ends.  The scheduler thread itself ends once no open database
+** has background checkpoints.  The length of the log is followed through
+** the -wal writes made in this process; "ckpt_interval" catches those of
+** other processes.
+**
+** SQLite still runs its own auto-checkpoints on commit.  With "ckpt_wal"
+** below the "PRAGMA wal_autocheckpoint" threshold, or that turned off,
+** they find the log already backfilled, or the checkpoint lock taken by
+** the scheduler, and return at once.  The first connection to open the
+** database decides, as for "wal_dir".
+*/
+#define UNIX_CKPT_LIMIT_WAIT 100 /* Default "wal_limit_wait", in ms */
 
-      /* If this process is running as root, make sure that the SHM file
-      ** is owned by the same user that owns the original database.  Otherwise,
-      ** the original owner will not be able to connect.
-      */
-      robustFchown(pShmNode->h, sStat.st_uid, sStat.st_gid);
+#define UNIX_CKPT_PASSIVE 0  /* Escalation of a checkpoint: none */
+#define UNIX_CKPT_RESTART 1  /*   RESTART, the log is over "wal_limit" */
+#define UNIX_CKPT_TRUNCATE 2 /*   TRUNCATE, the database is idle */
 
-      rc = unixLockSharedMemory(pDbFd, pShmNode);
-      if (rc != SQLITE_OK && rc != SQLITE_READONLY_CANTINIT) goto shm_open_err;
-    }
-  }
+struct unixCkpt
+{
+  char *zDb;                 /* URI of the database, for the connection of the scheduler */
+  const char *zVfs;          /* Name of the VFS to open it with */
+  unixInodeInfo *pInode;     /* Inode of the database.  Valid until bGone is set */
+  unixInodeBucket *pBucket;  /* Hash bucket of pInode, whose mutex protects it */
+  i64 szWal;        /* "ckpt_wal", or 0 */
+  i64 msInterval;   /* "ckpt_interval", or 0 */
+  i64 msIdle;       /* "ckpt_idle", or 0 */
+  i64 szLimit;      /* "wal_limit", or 0 */
+  i64 msLimitWait;  /* "wal_limit_wait" */
+  i64 iWalEnd;      /* End of the log written in this process.  Atomic */
+  i64 iCkptEnd;     /* iWalEnd when the last checkpoint began.  Atomic */
+  i64 msWrite;      /* unixMonotonicMs() of the last -wal write.  Atomic */
+  int bWanted;      /* Checkpoint as soon as possible.  Atomic */
+  /* The fields below are protected by ckptMutex */
+  i64 msCkpt;      /* unixMonotonicMs() when the last checkpoint began */
+  i64 msIdleCkpt;  /* msWrite when the last "ckpt_idle" checkpoint began */
+  int bRunning;    /* The scheduler is checkpointing this database */
+  int bGone;       /* Released while bRunning was set */
+  u64 nCheckpoint; /* Checkpoints run */
+  u64 nThrottle;   /* Write transactions held back by "wal_limit" */
+  unixCkpt *pNext; /* Next database of the scheduler */
+};
 
-  /* Make the new connection a child of the unixShmNode */
-  p->pShmNode = pShmNode;
-#ifdef SQLITE_DEBUG
-  p->id = pShmNode->nextShmId++;
-#endif
-  pShmNode->nRef++;
-  pDbFd->pShm = p;
-  unixLeaveMutex();
+/*
+** The condition variables are never destroyed, as the scheduler may still
+** wait on them when the process exits with databases open.
+*/
+static std::mutex ckptMutex;                                /* Protects the list and the scheduler */
+static auto &ckptWork = *new std::condition_variable;       /* Wakes the scheduler */
+static auto &ckptDone = *new std::condition_variable;       /* Signalled after each checkpoint */
+static unixCkpt *pCkptList = 0;                             /* Databases with background checkpoints */
+static int bCkptRunning = 0;                                /* The scheduler thread exists */
+static thread_local int bCkptScheduler = 0;                 /* True on the scheduler thread */
 
-  /* The reference count on pShmNode has already been incremented under
-  ** the cover of the unixEnterMutex() mutex and the pointer from the
-  ** new (struct unixShm) object to the pShmNode has been set. All that is
-  ** left to do is to link the new object into the linked list starting
-  ** at pShmNode->pFirst. This must be done while holding the pShmNode->mutex
-  ** mutex.
-  */
-  mutex_enter(pShmNode->mutex);
-  p->pNext = pShmNode->pFirst;
-  pShmNode->pFirst = p;
-  mutex_leave(pShmNode->mutex);
-  return rc;
+/*
+** Ask the scheduler to checkpoint p as soon as possible.
+*/
+static void unixCkptWake(unixCkpt *p)
+{
+  std::lock_guard<std::mutex> lock(ckptMutex);
+  __atomic_store_n(&p->bWanted, 1, __ATOMIC_RELAXED);
+  ckptWork.notify_one();
+}
 
-/* Jump here on any error */
-shm_open_err:
-  unixShmPurge(pDbFd); /* This call frees pShmNode if required */
-  sqlite3_free(p);
-  unixLeaveMutex();
-  return rc;
+/*
+** Called by unixWrite() for each write of amt bytes at offset iOfst to a
+** -wal file of the database of p.
+*/
+static void unixCkptWrote(unixCkpt *p, i64 iOfst, int amt)
+{
+  i64 iEnd = iOfst + amt;
+  if (iOfst == 0 && amt == 32)
+  {
+    /* A new -wal header.  The log restarts. */
+    __atomic_store_n(&p->iWalEnd, iEnd, __ATOMIC_RELAXED);
+    __atomic_store_n(&p->iCkptEnd, 0, __ATOMIC_RELAXED);
+  }
+  else if (iEnd > __atomic_load_n(&p->iWalEnd, __ATOMIC_RELAXED))
+  {
+    __atomic_store_n(&p->iWalEnd, iEnd, __ATOMIC_RELAXED);
+  }
+  if (p->msIdle > 0) __atomic_store_n(&p->msWrite, unixMonotonicMs(), __ATOMIC_RELAXED);
+  if (p->szWal > 0 && iEnd - __atomic_load_n(&p->iCkptEnd, __ATOMIC_RELAXED) >= p->szWal &&
+      __atomic_load_n(&p->bWanted, __ATOMIC_RELAXED) == 0)
+  {
+    unixCkptWake(p);
+  }
 }
 
 /*
-** This function is called to obtain a pointer to region iRegion of the
-** shared-memory associated with the database file fd. Shared-memory regions
-** are numbered starting from zero. Each shared-memory region is szRegion
-** bytes in size.
-**
-** If an error occurs, an error code is returned and *pp is set to NULL.
-**
-** Otherwise, if the bExtend parameter is 0 and the requested shared-memory
-** region has not been allocated (by any client, including one running in a
-** separate process), then *pp is set to NULL and SQLITE_OK returned. If
-** bExtend is non-zero and the requested shared-memory region has not yet
-** been allocated, it is allocated by this function.
-**
-** If the shared-memory region has already been allocated or is allocated by
-** this call as described above, then it is mapped into this processes
-** address space (if it is not already), *pp is set to point to the mapped
-** memory and SQLITE_OK returned.
+** Return true if the log of p is longer than "wal_limit" and the caller is
+** not the scheduler.
 */
-static int unixShmMap(sqlite3_file *fd,  /* Handle open on database file */
-                      int iRegion,       /* Region to retrieve */
-                      int szRegion,      /* Size of regions */
-                      int bExtend,       /* True to extend file if necessary */
-                      void volatile **pp /* OUT: Mapped memory */
-                      )
+static int unixCkptOverLimit(unixCkpt *p)
 {
-  unixFile *pDbFd = (unixFile *)fd;
-  unixShm *p;
-  unixShmNode *pShmNode;
-  int rc = SQLITE_OK;
-  int nShmPerMap = unixShmRegionPerMap();
-  int nReqRegion;
+  return p->szLimit > 0 && !bCkptScheduler && __atomic_load_n(&p->iWalEnd, __ATOMIC_RELAXED) > p->szLimit;
+}
 
-  /* If the shared-memory file has not yet been opened, open it now. */
-  if (pDbFd->pShm == 0)
+/*
+** Called by unixShmLock() when a connection that committed to the log of
+** p while it was over "wal_limit" releases its read lock.  Wait for the
+** next checkpoint, or for "wal_limit_wait".
+*/
+static void unixCkptThrottle(unixCkpt *p)
+{
+  u64 nDone;
+  std::unique_lock<std::mutex> lock(ckptMutex);
+  nDone = p->nCheckpoint;
+  p->nThrottle++;
+  __atomic_store_n(&p->bWanted, 1, __ATOMIC_RELAXED);
+  ckptWork.notify_one();
+  ckptDone.wait_for(lock, std::chrono::milliseconds(p->msLimitWait), [p, nDone] { return p->nCheckpoint != nDone; });
+}
+
+/*
+** Return the time, in unixMonotonicMs() terms, at which p is due for a
+** checkpoint, or -1 if it is not due until a write wakes the scheduler.
+** Set *peMode to the escalation of that checkpoint.  ckptMutex is held.
+*/
+static i64 unixCkptDue(unixCkpt *p, int *peMode)
+{
+  i64 iWalEnd = __atomic_load_n(&p->iWalEnd, __ATOMIC_RELAXED);
+  i64 nLogged = iWalEnd - __atomic_load_n(&p->iCkptEnd, __ATOMIC_RELAXED);
+  i64 msDue = -1;
+
+  *peMode = (p->szLimit > 0 && iWalEnd > p->szLimit) ? UNIX_CKPT_RESTART : UNIX_CKPT_PASSIVE;
+  if (__atomic_load_n(&p->bWanted, __ATOMIC_RELAXED) || (p->szWal > 0 && nLogged >= p->szWal)) return 0;
+  if (p->msInterval > 0) msDue = p->msCkpt + p->msInterval;
+  if (p->msIdle > 0 && iWalEnd > 0 && __atomic_load_n(&p->msWrite, __ATOMIC_RELAXED) != p->msIdleCkpt)
   {
-    rc = unixOpenSharedMemory(pDbFd);
-    if (rc != SQLITE_OK) return rc;
+    i64 msIdle = __atomic_load_n(&p->msWrite, __ATOMIC_RELAXED) + p->msIdle;
+    if (msDue < 0 || msIdle <= msDue)
+    {
+      msDue = msIdle;
+      *peMode = UNIX_CKPT_TRUNCATE;
+    }
   }
+  return msDue;
+}
 
-  p = pDbFd->pShm;
-  pShmNode = p->pShmNode;
-  mutex_enter(pShmNode->mutex);
-  if (pShmNode->isUnlocked)
+/*
+** Take a reference to the unixInodeInfo of the database of p, unless the
+** application has closed it.  Return the inode, or NULL.  p->bRunning is
+** set, so p itself stays valid.
+*/
+static unixInodeInfo *unixCkptPin(unixCkpt *p)
+{
+  unixInodeInfo *pInode = 0;
+  std::lock_guard<std::mutex> inodeLock(p->pBucket->mutex);
+  std::lock_guard<std::mutex> lock(ckptMutex);
+  if (!p->bGone)
   {
-    rc = unixLockSharedMemory(pDbFd, pShmNode);
-    if (rc != SQLITE_OK) goto shmpage_out;
-    pShmNode->isUnlocked = 0;
+    pInode = p->pInode;
+    pInode->nRef++;
   }
-  assert(szRegion == pShmNode->szRegion || pShmNode->nRegion == 0);
-  assert(pShmNode->pInode == pDbFd->pInode);
-  assert(pShmNode->h >= 0 || pDbFd->pInode->bProcessLock == 1);
-  assert(pShmNode->h < 0 || pDbFd->pInode->bProcessLock == 0);
+  return pInode;
+}
 
-  /* Minimum number of regions required to be mapped. */
-  nReqRegion = ((iRegion + nShmPerMap) / nShmPerMap) * nShmPerMap;
+/*
+** Drop the reference taken by unixCkptPin().  If it was the last, the
+** inode is released as by the close of its last unixFile.
+*/
+static void unixCkptUnpin(unixCkpt *p, unixInodeInfo *pInode)
+{
+  unixFile f;
+  memset(&f, 0, sizeof(f));
+  f.pInode = pInode;
+  f.zPath = p->zDb;
+  std::lock_guard<std::mutex> inodeLock(p->pBucket->mutex);
+  releaseInodeInfo(&f);
+}
 
-  if (pShmNode->nRegion < nReqRegion)
+/*
+** Checkpoint the database of p on a connection of the scheduler.
+*/
+static void unixCkptRun(unixCkpt *p, int eMode)
+{
+  unixInodeInfo *pInode = unixCkptPin(p);
+  sqlite3 *db = 0;
+  int nLog = -1;
+  int nCkpt = -1;
+  int rc;
+
+  if (pInode == 0) return;
+  rc = sqlite3_open_v2(p->zDb, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, p->zVfs);
+  /* A connection only opens the -wal file once it reads the database */
+  if (rc == SQLITE_OK) rc = sqlite3_exec(db, "PRAGMA schema_version", 0, 0, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_wal_checkpoint_v2(db, 0, SQLITE_CHECKPOINT_PASSIVE, &nLog, &nCkpt);
+  if (rc == SQLITE_OK && eMode != UNIX_CKPT_PASSIVE && nLog >= 0 && nCkpt == nLog)
   {
-    char **apNew;                      /* New apRegion[] array */
-    int nByte = nReqRegion * szRegion; /* Minimum required file size */
-    struct stat sStat;                 /* Used by fstat() */
+    rc = sqlite3_wal_checkpoint_v2(db, 0, eMode == UNIX_CKPT_TRUNCATE ? SQLITE_CHECKPOINT_TRUNCATE : SQLITE_CHECKPOINT_RESTART,
+                                   0, 0);
+  }
+  OSTRACE(("CKPT    %s mode %d log %d ckpt %d rc %d\n", p->zDb, eMode, nLog, nCkpt, rc));
+  sqlite3_close(db);
+  unixCkptUnpin(p, pInode);
+}
 
-    pShmNode->szRegion = szRegion;
+/*
+** Remove p from the list of the scheduler and free it.  ckptMutex is held.
+*/
+static void unixCkptFree(unixCkpt *p)
+{
+  unixCkpt **pp;
+  for (pp = &pCkptList; *pp; pp = &(*pp)->pNext)
+  {
+    if (*pp == p)
+    {
+      *pp = p->pNext;
+      break;
+    }
+  }
+  sqlite3_free(p);
+}
 
-    if (pShmNode->h >= 0)
+/*
+** The scheduler thread.  Runs until the list of databases is empty.
+*/
+static void unixCkptMain(void)
+{
+  bCkptScheduler = 1;
+  std::unique_lock<std::mutex> lock(ckptMutex);
+  while (pCkptList)
+  {
+    i64 msNow = unixMonotonicMs();
+    i64 msNext = -1; /* Earliest time a database is due, or -1 */
+    unixCkpt *pRun = 0;
+    int eMode = UNIX_CKPT_PASSIVE;
+    unixCkpt *p;
+
+    for (p = pCkptList; p; p = p->pNext)
     {
-      /* The requested region is not mapped into this processes address space.
-      ** Check to see if it has been allocated (i.e. if the wal-index file is
-      ** large enough to contain the requested region).
-      */
-      if (osFstat(pShmNode->h, &sStat))
+      int e;
+      i64 msDue = unixCkptDue(p, &e);
+      if (msDue >= 0 && msDue <= msNow)
       {
-        rc = SQLITE_IOERR_SHMSIZE;
-        goto shmpage_out;
+        pRun = p;
+        eMode = e;
+        break;
       }
-
-      if (sStat.st_size < nByte)
+      if (msDue >= 0 && (msNext < 0 || msDue < msNext)) msNext = msDue;
+    }
+    if (pRun == 0)
+    {
+      if (msNext < 0)
       {
-        /* The requested memory region does not exist. If bExtend is set to
-        ** false, exit early. *pp will be set to NULL and SQLITE_OK returned.
-        */
-        if (!bExtend)
-        {
-          goto shmpage_out;
-        }
+        ckptWork.wait(lock);
+      }
+      else
+      {
+        ckptWork.wait_for(lock, std::chrono::milliseconds(msNext - msNow));
+      }
+      continue;
+    }
+
+    __atomic_store_n(&pRun->bWanted, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&pRun->iCkptEnd, __atomic_load_n(&pRun->iWalEnd, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    pRun->msCkpt = msNow;
+    if (eMode == UNIX_CKPT_TRUNCATE) pRun->msIdleCkpt = __atomic_load_n(&pRun->msWrite, __ATOMIC_RELAXED);
+    pRun->bRunning = 1;
+    lock.unlock();
+    unixCkptRun(pRun, eMode);
+    lock.lock();
+    pRun->bRunning = 0;
+    pRun->nCheckpoint++;
+    ckptDone.notify_all();
+    if (pRun->bGone) unixCkptFree(pRun);
+  }
+  bCkptRunning = 0;
+  ckptDone.notify_all();
+}
 
-        /* Alternatively, if bExtend is true, extend the file. Do this by
-        ** writing a single byte to the end of each (OS) page being
-        ** allocated or extended. Technically, we need only write to the
-        ** last page in order to extend the file. But writing to all new
-        ** pages forces the OS to allocate them immediately, which reduces
-        ** the chances of SIGBUS while accessing the mapped region later on.
-        */
-        else
-        {
-          static const int pgsz = 4096;
-          int iPg;
+/*
+** Wait for the scheduler thread to end.  Return SQLITE_BUSY at once if a
+** database with background checkpoints is still open: the scheduler keeps
+** running for it.
+*/
+static int unixCkptStop(void)
+{
+  std::unique_lock<std::mutex> lock(ckptMutex);
+  unixCkpt *p;
+  for (p = pCkptList; p && p->bGone; p = p->pNext)
+  {
+  }
+  if (p) return SQLITE_BUSY;
+  ckptDone.wait(lock, [] { return bCkptRunning == 0; });
+  return SQLITE_OK;
+}
 
-          /* Write to the last byte of each newly allocated or extended page */
-          assert((nByte % pgsz) == 0);
-          for (iPg = (sStat.st_size / pgsz); iPg < (nByte / pgsz); iPg++)
-          {
-            int x = 0;
-            if (seekAndWriteFd(pShmNode->h, iPg * pgsz + pgsz - 1, "", 1, &x) != 1)
-            {
-              const char *zFile = pShmNode->zFilename;
-              rc = unixLogError(SQLITE_IOERR_SHMSIZE, "write", zFile);
-              goto shmpage_out;
-            }
-          }
-        }
-      }
-    }
+/*
+** Write to zOut the "file:" URI of main database file zPath, which is named
+** as passed to xOpen(), with its URI parameters after it, and return the
+** number of bytes written.  Every byte that could be taken for a delimiter
+** is %-escaped.  With zOut NULL, only return the length.
+*/
+static int unixCkptUri(const char *zPath, char *zOut)
+{
+  static const char aHex[] = "0123456789ABCDEF";
+  const char *z = zPath;
+  int n = 5;
+  int i;
 
-    /* Map the requested memory region into this processes address space. */
-    apNew = (char **)sqlite3_realloc(pShmNode->apRegion, nReqRegion * sizeof(char *));
-    if (!apNew)
-    {
-      rc = SQLITE_IOERR_NOMEM;
-      goto shmpage_out;
-    }
-    pShmNode->apRegion = apNew;
-    while (pShmNode->nRegion < nReqRegion)
+  if (zOut) memcpy(zOut, "file:", 5);
+  for (i = 0; *z || (i > 0 && i % 2 == 0); i++)
+  {
+    if (i > 0 && zOut) zOut[n] = i == 1 ? '?' : i % 2 ? '&' : '=';
+    if (i > 0) n++;
+    for (; *z; z++)
     {
-      int nMap = szRegion * nShmPerMap;
-      int i;
-      void *pMem;
-      if (pShmNode->h >= 0)
+      unsigned char c = (unsigned char)*z;
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("/.-_", c))
       {
-        pMem = osMmap(0, nMap, pShmNode->isReadonly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, pShmNode->h,
-                      szRegion * (i64)pShmNode->nRegion);
-        if (pMem == MAP_FAILED)
-        {
-          rc = unixLogError(SQLITE_IOERR_SHMMAP, "mmap", pShmNode->zFilename);
-          goto shmpage_out;
-        }
+        if (zOut) zOut[n] = (char)c;
+        n++;
       }
       else
       {
-        pMem = sqlite3_malloc64(szRegion);
-        if (pMem == 0)
+        if (zOut)
         {
-          rc = SQLITE_NOMEM;
-          goto shmpage_out;
+          zOut[n] = '%';
+          zOut[n + 1] = aHex[c >> 4];
+          zOut[n + 2] = aHex[c & 0xf];
         }
-        memset(pMem, 0, szRegion);
+        n += 3;
       }
+    }
+    z++;
+  }
+  if (zOut) zOut[n] = '\0';
+  return n;
+}
 
-      for (i = 0; i < nShmPerMap; i++)
-      {
-        pShmNode->apRegion[pShmNode->nRegion + i] = &((char *)pMem)[szRegion * i];
-      }
-      pShmNode->nRegion += nShmPerMap;
+/*
+** Record the background checkpoints asked for by the URI parameters of
+** main database file pFile on its unixInodeInfo, if it is the first
+** unixFile on the inode, and start the scheduler if need be.
+**
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
+*/
+static void setInodeCheckpoint(unixFile *pFile)
+{
+  unixInodeInfo *pInode = pFile->pInode;
+  const char *zUri = (pFile->ctrlFlags & UNIXFILE_URI) ? pFile->zPath : 0;
+  i64 szWal, msInterval, msIdle, szLimit;
+  unixCkpt *p;
+  int nDb;
+
+  assert(unixInodeMutexHeld(pInode));
+  if (pInode->nRef > 1 || zUri == 0 || (pFile->ctrlFlags & UNIXFILE_RDONLY)) return;
+  szWal = sqlite3_uri_int64(zUri, "ckpt_wal", 0);
+  msInterval = sqlite3_uri_int64(zUri, "ckpt_interval", 0);
+  msIdle = sqlite3_uri_int64(zUri, "ckpt_idle", 0);
+  szLimit = sqlite3_uri_int64(zUri, "wal_limit", 0);
+  if (szWal <= 0 && msInterval <= 0 && msIdle <= 0 && szLimit <= 0) return;
+
+  nDb = unixCkptUri(pFile->zPath, 0);
+  p = (unixCkpt *)sqlite3_malloc64(sizeof(unixCkpt) + nDb + 1);
+  if (p == 0) return;
+  memset(p, 0, sizeof(*p));
+  p->zDb = (char *)&p[1];
+  unixCkptUri(pFile->zPath, p->zDb);
+  p->zVfs = pFile->pVfs->zName;
+  p->pInode = pInode;
+  p->pBucket = pInode->pBucket;
+  p->szWal = szWal > 0 ? szWal : 0;
+  p->msInterval = msInterval > 0 ? msInterval : 0;
+  p->msIdle = msIdle > 0 ? msIdle : 0;
+  p->szLimit = szLimit > 0 ? szLimit : 0;
+  p->msLimitWait = sqlite3_uri_int64(zUri, "wal_limit_wait", UNIX_CKPT_LIMIT_WAIT);
+  if (p->msLimitWait < 0) p->msLimitWait = 0;
+  p->msCkpt = unixMonotonicMs();
+
+  std::lock_guard<std::mutex> lock(ckptMutex);
+  if (!bCkptRunning)
+  {
+    try
+    {
+      std::thread(unixCkptMain).detach();
+      bCkptRunning = 1;
+    }
+    catch (const std::system_error &)
+    {
+      sqlite3_log(SQLITE_WARNING, "no checkpoint scheduler: %s", pFile->zPath);
+      sqlite3_free(p);
+      return;
     }
   }
+  p->pNext = pCkptList;
+  pCkptList = p;
+  pInode->pCkpt = p;
+  __atomic_fetch_add(&nCkptInode, 1, __ATOMIC_RELAXED);
+  ckptWork.notify_one();
+}
 
-shmpage_out:
-  if (pShmNode->nRegion > iRegion)
+/*
+** Called when the unixInodeInfo of the database of p is released.  Free
+** p, or leave that to the scheduler if it is checkpointing it.
+*/
+static void unixCkptRelease(unixCkpt *p)
+{
+  std::lock_guard<std::mutex> lock(ckptMutex);
+  if (p->bRunning)
   {
-    *pp = pShmNode->apRegion[iRegion];
+    p->bGone = 1;
   }
   else
   {
-    *pp = 0;
+    unixCkptFree(p);
+    if (pCkptList == 0) ckptWork.notify_one();
   }
-  if (pShmNode->isReadonly && rc == SQLITE_OK) rc = SQLITE_READONLY;
-  mutex_leave(pShmNode->mutex);
-  return rc;
 }
 
 /*
-** Change the lock state for a shared-memory segment.
+** Give the -wal file pFile, which SQLite names zWal, the background
+** checkpoints of its database.
+*/
+static void unixCkptWal(unixFile *pFile, const char *zWal)
+{
+  char zDb[MAX_PATHNAME + 1]; /* Database file path */
+  unixInodeInfo *pDbInode = unixWalDbInode(zWal, zDb);
+  if (pDbInode)
+  {
+    pFile->pCkpt = pDbInode->pCkpt;
+    unixLeaveInodeMutex(pDbInode);
+  }
+}
+
+/******************************************************************************
+****************************** io_uring backend *******************************
 **
-** Note that the relationship between SHAREd and EXCLUSIVE locks is a little
-** different here than in posix.  In xShmLock(), one can go from unlocked
-** to shared and back or from unlocked to exclusive and back.  But one may
-** not go from shared to exclusive or from exclusive to shared.
+** The "proc-uring" VFS writes -wal files through an io_uring instance,
+** one per open -wal file.  The file descriptor and a staging buffer are
+** registered with the kernel.  Other files use the same system calls as
+** the "proc" VFS, and so does everything if the kernel refuses io_uring.
+**
+** unixWrite() copies each write into the staging buffer and queues it.
+** uringSubmit() hands all queued writes to the kernel in one call, linked
+** so that they are performed in order.  That happens:
+**
+**   *  when the staging buffer or the submission queue is full,
+**   *  before any other method of the -wal file does its work, and
+**   *  once the page of a commit frame has been queued, unless the previous
+**      commit was followed by xSync().  In that case the commit waits for
+**      xSync(), which appends a linked fsync, so a synchronous commit
+**      costs a single io_uring_enter() call.
+**
+** Other connections only read frames after the writer publishes a new
+** wal-index header, and the writer calls xShmBarrier() first.  So
+** unixShmBarrier() submits any commit of the calling thread that is still
+** waiting for an xSync(), which covers the case where the xSync() never
+** comes, for example after "PRAGMA synchronous=NORMAL".  Queued frames
+** that are not part of a commit are invisible to other connections, so
+** nothing is lost if they are still queued when the process dies.
+**
+** Database and journal writes are not queued.  A checkpoint publishes
+** backfilled pages by a plain store to the wal-index, and a rollback
+** journal transaction ends once the journal is deleted or truncated, after
+** which other processes may read the database.  Those writes must be
+** complete when xWrite() returns.
 */
-static int unixShmLock(sqlite3_file *fd, /* Database file holding the shared memory */
-                       int ofst,         /* First lock to acquire or release */
-                       int n,            /* Number of locks to acquire or release */
-                       int flags         /* What to do with the lock */
-                       )
+#define URING_FRAME_HDRSIZE 24 /* Size of a WAL frame header */
+
+/*
+** Allowed values for unixUring.eCommit
+*/
+#define URING_COMMIT_NONE 0 /* No commit since the last frame */
+#define URING_COMMIT_DONE 1 /* Commit submitted, watching for xSync() */
+#define URING_COMMIT_WAIT 2 /* Commit queued until xSync(), on uringWaitList */
+
+#if HAVE_IO_URING
+struct unixUring
 {
-  unixFile *pDbFd = (unixFile *)fd;    /* Connection holding shared memory */
-  unixShm *p = pDbFd->pShm;            /* The shared memory being locked */
-  unixShm *pX;                         /* For looping over all siblings */
-  unixShmNode *pShmNode = p->pShmNode; /* The underlying file iNode */
-  int rc = SQLITE_OK;                  /* Result code */
-  u16 mask;                            /* Mask of locks to take or release */
+  unixFile *pFile;               /* The -wal file written through this ring */
+  int fd;                        /* From io_uring_setup() */
+  unsigned *sqTail;              /* Submission queue tail */
+  unsigned *sqMask;              /* Submission queue index mask */
+  unsigned *sqArray;             /* Submission queue index array */
+  struct io_uring_sqe *aSqe;     /* Submission queue entries */
+  unsigned *cqHead;              /* Completion queue head */
+  unsigned *cqTail;              /* Completion queue tail */
+  unsigned *cqMask;              /* Completion queue index mask */
+  struct io_uring_cqe *aCqe;     /* Completion queue entries */
+  void *pSqRing;                 /* Mapping of the submission queue ring */
+  size_t szSqRing;               /* Size of pSqRing */
+  void *pCqRing;                 /* Mapping of the completion queue ring */
+  size_t szCqRing;               /* Size of pCqRing */
+  size_t szSqe;                  /* Size of the aSqe[] mapping */
+  u8 *aBuf;                      /* Registered staging buffer */
+  int nBuf;                      /* Bytes of aBuf[] in use */
+  int nPend;                     /* Number of queued writes */
+  struct
+  {
+    i64 iOfst;                   /* File offset to write to */
+    int iBuf;                    /* Offset of the data in aBuf[] */
+    int nByte;                   /* Number of bytes to write */
+  } aPend[URING_DEPTH];
+  int aRes[URING_DEPTH];         /* Result of each submitted entry */
+  u8 bCommitHdr;                 /* Last write was a commit frame header */
+  u8 eCommit;                    /* One of the URING_COMMIT_* values */
+  u8 bExpectSync;                /* The last commit was followed by xSync() */
+  u8 bBroken;                    /* io_uring_enter() failed.  Stop using it */
+  int rcDeferred;                /* Error from a submission by xShmBarrier() */
+  pthread_t owner;               /* Thread of the commit on uringWaitList */
+  unixUring *pNextWait;          /* Next ring on uringWaitList */
+};
 
-  assert(pShmNode == pDbFd->pInode->pShmNode);
-  assert(pShmNode->pInode == pDbFd->pInode);
-  assert(ofst >= 0 && ofst + n <= SQLITE_SHM_NLOCK);
-  assert(n >= 1);
-  assert(flags == (SQLITE_SHM_LOCK | SQLITE_SHM_SHARED) || flags == (SQLITE_SHM_LOCK | SQLITE_SHM_EXCLUSIVE) ||
-         flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_SHARED) || flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE));
-  assert(n == 1 || (flags & SQLITE_SHM_EXCLUSIVE) != 0);
-  assert(pShmNode->h >= 0 || pDbFd->pInode->bProcessLock == 1);
-  assert(pShmNode->h < 0 || pDbFd->pInode->bProcessLock == 0);
+/*
+** Rings holding a commit that waits for xSync().  Protected by the
+** mutex entered by unixEnterMutex().  The head is also read without the
+** mutex, by uringWaiting(), so it is always stored atomically.
+*/
+static unixUring *uringWaitList = 0;
 
-  mask = (1 << (ofst + n)) - (1 << ofst);
-  assert(n > 1 || mask == (1 << ofst));
-  mutex_enter(pShmNode->mutex);
-  if (flags & SQLITE_SHM_UNLOCK)
+/*
+** Return true if any commit waits for xSync().  A commit queued by the
+** calling thread is always seen.
+*/
+static int uringWaiting(void) { return __atomic_load_n(&uringWaitList, __ATOMIC_RELAXED) != 0; }
+
+/*
+** Release all resources held by ring p.
+*/
+static void uringClose(unixUring *p)
+{
+  if (p == 0) return;
+  if (p->aSqe) osMunmap(p->aSqe, p->szSqe);
+  if (p->pCqRing) osMunmap(p->pCqRing, p->szCqRing);
+  if (p->pSqRing) osMunmap(p->pSqRing, p->szSqRing);
+  if (p->aBuf) osMunmap(p->aBuf, URING_BUFSZ);
+  if (p->fd >= 0) robust_close(p->pFile, p->fd, __LINE__);
+  sqlite3_free(p);
+}
+
+/*
+** Create a ring for -wal file pFile and register the file descriptor and
+** a staging buffer with it.  Return NULL if io_uring is unavailable, in
+** which case pFile is written with ordinary system calls.
+*/
+static unixUring *uringOpen(unixFile *pFile)
+{
+  struct io_uring_params params;
+  struct iovec iov;
+  unixUring *p;
+  u8 *pSq;
+  u8 *pCq;
+
+  if (osIoUringSetup == 0) return 0;
+  p = (unixUring *)sqlite3_malloc64(sizeof(*p));
+  if (p == 0) return 0;
+  memset(p, 0, sizeof(*p));
+  p->pFile = pFile;
+  memset(&params, 0, sizeof(params));
+  p->fd = osIoUringSetup(URING_DEPTH, &params);
+  if (p->fd < 0) goto uring_open_failed;
+
+  p->szSqRing = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  p->szCqRing = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  p->szSqe = params.sq_entries * sizeof(struct io_uring_sqe);
+  pSq = (u8 *)osMmap(0, p->szSqRing, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, IORING_OFF_SQ_RING);
+  if (pSq == MAP_FAILED) goto uring_open_failed;
+  p->pSqRing = pSq;
+  pCq = (u8 *)osMmap(0, p->szCqRing, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, IORING_OFF_CQ_RING);
+  if (pCq == MAP_FAILED) goto uring_open_failed;
+  p->pCqRing = pCq;
+  p->aSqe = (struct io_uring_sqe *)osMmap(0, p->szSqe, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, IORING_OFF_SQES);
+  if (p->aSqe == MAP_FAILED)
+  {
+    p->aSqe = 0;
+    goto uring_open_failed;
+  }
+  p->sqTail = (unsigned *)&pSq[params.sq_off.tail];
+  p->sqMask = (unsigned *)&pSq[params.sq_off.ring_mask];
+  p->sqArray = (unsigned *)&pSq[params.sq_off.array];
+  p->cqHead = (unsigned *)&pCq[params.cq_off.head];
+  p->cqTail = (unsigned *)&pCq[params.cq_off.tail];
+  p->cqMask = (unsigned *)&pCq[params.cq_off.ring_mask];
+  p->aCqe = (struct io_uring_cqe *)&pCq[params.cq_off.cqes];
+
+  p->aBuf = (u8 *)osMmap(0, URING_BUFSZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p->aBuf == MAP_FAILED)
+  {
+    p->aBuf = 0;
+    goto uring_open_failed;
+  }
+  iov.iov_base = p->aBuf;
+  iov.iov_len = URING_BUFSZ;
+  if (osIoUringRegister(p->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) goto uring_open_failed;
+  if (osIoUringRegister(p->fd, IORING_REGISTER_FILES, &pFile->h, 1) < 0) goto uring_open_failed;
+  OSTRACE(("URING   %-3d ring %d\n", pFile->h, p->fd));
+  return p;
+
+uring_open_failed:
+  OSTRACE(("URING   %-3d unavailable, errno %d\n", pFile->h, errno));
+  uringClose(p);
+  return 0;
+}
+
+/*
+** Take ring p off uringWaitList if it is there.  The caller must hold
+** the mutex entered by unixEnterMutex().
+*/
+static void uringUnwait(unixUring *p)
+{
+  unixUring **pp;
+  assert(unixMutexHeld());
+  if (p->eCommit != URING_COMMIT_WAIT) return;
+  for (pp = &uringWaitList; *pp != p; pp = &(*pp)->pNextWait)
   {
-    u16 allMask = 0; /* Mask of locks held by siblings */
+    assert(*pp);
+  }
+  __atomic_store_n(pp, p->pNextWait, __ATOMIC_RELAXED);
+  p->pNextWait = 0;
+  p->eCommit = URING_COMMIT_NONE;
+}
 
-    /* See if any siblings hold this same lock */
-    for (pX = pShmNode->pFirst; pX; pX = pX->pNext)
+/*
+** Write queued entries iFrom and later with ordinary system calls.  Used
+** when a submission fails part way, and when io_uring_enter() itself
+** fails.
+*/
+static int uringWriteThrough(unixUring *p, int iFrom)
+{
+  unixFile *pFile = p->pFile;
+  int i;
+  for (i = iFrom; i < p->nPend; i++)
+  {
+    const u8 *aData = &p->aBuf[p->aPend[i].iBuf];
+    i64 iOfst = p->aPend[i].iOfst;
+    int nByte = p->aPend[i].nByte;
+    int wrote;
+    while ((wrote = seekAndWriteFd(pFile->h, iOfst, aData, nByte, &pFile->lastErrno)) < nByte && wrote > 0)
     {
-      if (pX == p) continue;
-      assert((pX->exclMask & (p->exclMask | p->sharedMask)) == 0);
-      allMask |= pX->sharedMask;
+      nByte -= wrote;
+      iOfst += wrote;
+      aData += wrote;
     }
-
-    /* Unlock the system-level locks */
-    if ((mask & allMask) == 0)
+    if (wrote < nByte)
     {
-      rc = unixShmSystemLock(pDbFd, F_UNLCK, ofst + UNIX_SHM_BASE, n);
+      if (wrote < 0 && pFile->lastErrno != ENOSPC) return SQLITE_IOERR_WRITE;
+      storeLastErrno(pFile, 0);
+      return SQLITE_FULL;
     }
-    else
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Submit the queued writes of ring p, followed by an fsync if bSync is
+** true, and wait for them all to complete.  The writes and the fsync are
+** linked, so each starts only after the previous one succeeded.  If an
+** entry fails, it and the rest of the queue are written with ordinary
+** system calls so that a transient error does not lose data.
+*/
+static int uringSubmit(unixUring *p, int bSync)
+{
+  unixFile *pFile = p->pFile;
+  unsigned nSqe = p->nPend + (bSync ? 1 : 0);
+  unsigned nSubmit = nSqe;
+  unsigned nDone = 0;
+  unsigned iTail;
+  unsigned i;
+  int rc = SQLITE_OK;
+
+  if (p->nPend == 0 && !bSync) return SQLITE_OK;
+  if (p->bBroken) goto uring_fallback;
+
+  iTail = *p->sqTail;
+  for (i = 0; i < nSqe; i++)
+  {
+    unsigned iSqe = (iTail + i) & *p->sqMask;
+    struct io_uring_sqe *pSqe = &p->aSqe[iSqe];
+    memset(pSqe, 0, sizeof(*pSqe));
+    pSqe->fd = 0; /* Index of pFile->h in the registered file table */
+    pSqe->flags = IOSQE_FIXED_FILE | (i + 1 < nSqe ? IOSQE_IO_LINK : 0);
+    pSqe->user_data = i;
+    if (i < (unsigned)p->nPend)
     {
-      rc = SQLITE_OK;
+      pSqe->opcode = IORING_OP_WRITE_FIXED;
+      pSqe->addr = (u64)(uintptr_t)&p->aBuf[p->aPend[i].iBuf];
+      pSqe->len = p->aPend[i].nByte;
+      pSqe->off = p->aPend[i].iOfst;
+      pSqe->buf_index = 0;
     }
-
-    /* Undo the local locks */
-    if (rc == SQLITE_OK)
+    else
     {
-      p->exclMask &= ~mask;
-      p->sharedMask &= ~mask;
+      pSqe->opcode = IORING_OP_FSYNC;
+#if HAVE_FDATASYNC
+      pSqe->fsync_flags = IORING_FSYNC_DATASYNC;
+#endif
     }
+    p->sqArray[iSqe] = iSqe;
+    p->aRes[i] = -ECANCELED;
   }
-  else if (flags & SQLITE_SHM_SHARED)
-  {
-    u16 allShared = 0; /* Union of locks held by connections other than "p" */
+  __atomic_store_n(p->sqTail, iTail + nSqe, __ATOMIC_RELEASE);
 
-    /* Find out which shared locks are already held by sibling connections.
-    ** If any sibling already holds an exclusive lock, go ahead and return
-    ** SQLITE_BUSY.
-    */
-    for (pX = pShmNode->pFirst; pX; pX = pX->pNext)
+  while (nDone < nSqe)
+  {
+    unsigned iHead;
+    int n = osIoUringEnter(p->fd, nSubmit, nSqe - nDone, IORING_ENTER_GETEVENTS);
+    if (n < 0)
     {
-      if ((pX->exclMask & mask) != 0)
-      {
-        rc = SQLITE_BUSY;
-        break;
-      }
-      allShared |= pX->sharedMask;
+      if (errno == EINTR) continue;
+      /* The state of the ring is unknown.  Stop using it. */
+      storeLastErrno(pFile, errno);
+      sqlite3_log(SQLITE_IOERR_WRITE, "io_uring_enter() failed on %s, errno %d", pFile->zPath, errno);
+      p->bBroken = 1;
+      goto uring_fallback;
     }
-
-    /* Get shared locks at the system level, if necessary */
-    if (rc == SQLITE_OK)
+    nSubmit -= (unsigned)n;
+    iHead = *p->cqHead;
+    while (iHead != __atomic_load_n(p->cqTail, __ATOMIC_ACQUIRE))
     {
-      if ((allShared & mask) == 0)
-      {
-        rc = unixShmSystemLock(pDbFd, F_RDLCK, ofst + UNIX_SHM_BASE, n);
-      }
-      else
-      {
-        rc = SQLITE_OK;
-      }
+      struct io_uring_cqe *pCqe = &p->aCqe[iHead & *p->cqMask];
+      if (pCqe->user_data < nSqe) p->aRes[pCqe->user_data] = pCqe->res;
+      iHead++;
+      nDone++;
     }
+    __atomic_store_n(p->cqHead, iHead, __ATOMIC_RELEASE);
+  }
 
-    /* Get the local shared locks */
-    if (rc == SQLITE_OK)
-    {
-      p->sharedMask |= mask;
-    }
+  for (i = 0; i < (unsigned)p->nPend; i++)
+  {
+    if (p->aRes[i] != p->aPend[i].nByte) break;
   }
-  else
+  if (i < (unsigned)p->nPend)
   {
-    /* Make sure no sibling connections hold locks that will block this
-    ** lock.  If any do, return SQLITE_BUSY right away.
-    */
-    for (pX = pShmNode->pFirst; pX; pX = pX->pNext)
+    OSTRACE(("URING   %-3d write %u of %d failed: %d\n", pFile->h, i, p->nPend, p->aRes[i]));
+    rc = uringWriteThrough(p, (int)i);
+    if (rc == SQLITE_OK && bSync && full_fsync(pFile->h, 0, 0))
     {
-      if ((pX->exclMask & mask) != 0 || (pX->sharedMask & mask) != 0)
-      {
-        rc = SQLITE_BUSY;
-        break;
-      }
+      storeLastErrno(pFile, errno);
+      rc = unixLogError(SQLITE_IOERR_FSYNC, "full_fsync", pFile->zPath);
     }
+  }
+  else if (bSync && p->aRes[nSqe - 1] < 0)
+  {
+    storeLastErrno(pFile, -p->aRes[nSqe - 1]);
+    rc = unixLogError(SQLITE_IOERR_FSYNC, "io_uring fsync", pFile->zPath);
+  }
+  OSTRACE(("URING   %-3d submitted %d writes%s\n", pFile->h, p->nPend, bSync ? " and fsync" : ""));
+  p->nPend = 0;
+  p->nBuf = 0;
+  return rc;
 
-    /* Get the exclusive locks at the system level.  Then if successful
-    ** also mark the local connection as being locked.
-    */
-    if (rc == SQLITE_OK)
-    {
-      rc = unixShmSystemLock(pDbFd, F_WRLCK, ofst + UNIX_SHM_BASE, n);
-      if (rc == SQLITE_OK)
-      {
-        assert((p->sharedMask & mask) == 0);
-        p->exclMask |= mask;
-      }
-    }
+uring_fallback:
+  rc = uringWriteThrough(p, 0);
+  if (rc == SQLITE_OK && bSync && full_fsync(pFile->h, 0, 0))
+  {
+    storeLastErrno(pFile, errno);
+    rc = unixLogError(SQLITE_IOERR_FSYNC, "full_fsync", pFile->zPath);
   }
-  mutex_leave(pShmNode->mutex);
-  OSTRACE(("SHM-LOCK shmid-%d, pid-%d got %03x,%03x\n", p->id, osGetpid(0), p->sharedMask, p->exclMask));
+  p->nPend = 0;
+  p->nBuf = 0;
   return rc;
 }
 
 /*
-** Implement a memory barrier or memory fence on shared memory.
-**
-** All loads and stores begun before the barrier must complete before
-** any load or store begun after the barrier.
+** Called at the start of every method of a -wal file written through a
+** ring, other than xWrite() and xSync().  Submit whatever is queued so the
+** method sees the file as SQLite expects it.  A commit that was waiting
+** for xSync() shows that xSync() does not follow commits any more.
 */
-static void unixShmBarrier(sqlite3_file *fd /* Database file holding the shared memory */
-                           )
+static int uringFlush(unixFile *pFile)
 {
-  UNUSED_PARAMETER(fd);
-  sqlite3MemoryBarrier(); /* compiler-defined memory barrier */
-  unixEnterMutex();       /* Also mutex, for redundancy */
-  unixLeaveMutex();
+  unixUring *p = pFile->pUring;
+  int rc = p->rcDeferred;
+  p->rcDeferred = SQLITE_OK;
+  if (p->eCommit == URING_COMMIT_WAIT)
+  {
+    unixEnterMutex();
+    uringUnwait(p);
+    unixLeaveMutex();
+    p->bExpectSync = 0;
+  }
+  if (p->nPend)
+  {
+    int rc2 = uringSubmit(p, 0);
+    if (rc == SQLITE_OK) rc = rc2;
+  }
+  return rc;
 }
 
 /*
-** Close a connection to shared-memory.  Delete the underlying
-** storage if deleteFlag is true.
-**
-** If there is no shared memory associated with the connection then this
-** routine is a harmless no-op.
+** Queue a write to a -wal file written through a ring.  amt is no larger
+** than URING_BUFSZ.
 */
-static int unixShmUnmap(sqlite3_file *fd, /* The underlying database file */
-                        int deleteFlag    /* Delete shared-memory if true */
-                        )
+static int uringWrite(unixFile *pFile, const void *pBuf, int amt, i64 iOfst)
 {
-  unixShm *p;            /* The connection to be closed */
-  unixShmNode *pShmNode; /* The underlying shared-memory file */
-  unixShm **pp;          /* For looping over sibling connections */
-  unixFile *pDbFd;       /* The underlying database file */
+  unixUring *p = pFile->pUring;
+  int bCommit = 0;
+  int rc = p->rcDeferred;
 
-  pDbFd = (unixFile *)fd;
-  p = pDbFd->pShm;
-  if (p == 0) return SQLITE_OK;
-  pShmNode = p->pShmNode;
+  assert(amt <= URING_BUFSZ);
+  p->rcDeferred = SQLITE_OK;
+  if (rc != SQLITE_OK) return rc;
 
-  assert(pShmNode == pDbFd->pInode->pShmNode);
-  assert(pShmNode->pInode == pDbFd->pInode);
+  /* Recognize commit frames.  A frame is written as a header, whose second
+  ** big-endian word is non-zero for a commit frame, then the page.  */
+  if (amt == URING_FRAME_HDRSIZE)
+  {
+    const u8 *a = (const u8 *)pBuf;
+    p->bCommitHdr = (a[4] | a[5] | a[6] | a[7]) != 0;
+    if (!p->bCommitHdr && p->eCommit == URING_COMMIT_DONE)
+    {
+      /* A new transaction began without an xSync() after the last commit */
+      p->bExpectSync = 0;
+      p->eCommit = URING_COMMIT_NONE;
+    }
+  }
+  else if (p->bCommitHdr)
+  {
+    bCommit = 1;
+    p->bCommitHdr = 0;
+  }
 
-  /* Remove connection p from the set of connections associated
-  ** with pShmNode */
-  mutex_enter(pShmNode->mutex);
-  for (pp = &pShmNode->pFirst; (*pp) != p; pp = &(*pp)->pNext)
+  if (p->nPend == URING_DEPTH - 1 || p->nBuf + amt > URING_BUFSZ)
   {
+    rc = uringSubmit(p, 0);
+    if (rc != SQLITE_OK) return rc;
   }
-  *pp = p->pNext;
+  memcpy(&p->aBuf[p->nBuf], pBuf, amt);
+  p->aPend[p->nPend].iOfst = iOfst;
+  p->aPend[p->nPend].iBuf = p->nBuf;
+  p->aPend[p->nPend].nByte = amt;
+  p->nPend++;
+  p->nBuf += (amt + 7) & ~7;
+  if (p->nBuf > URING_BUFSZ) p->nBuf = URING_BUFSZ;
 
-  /* Free the connection p */
-  sqlite3_free(p);
-  pDbFd->pShm = 0;
-  mutex_leave(pShmNode->mutex);
+  if (bCommit && p->eCommit != URING_COMMIT_WAIT)
+  {
+    if (p->bExpectSync)
+    {
+      unixEnterMutex();
+      p->owner = pthread_self();
+      p->pNextWait = uringWaitList;
+      __atomic_store_n(&uringWaitList, p, __ATOMIC_RELAXED);
+      p->eCommit = URING_COMMIT_WAIT;
+      unixLeaveMutex();
+    }
+    else
+    {
+      rc = uringSubmit(p, 0);
+      p->eCommit = URING_COMMIT_DONE;
+    }
+  }
+  return rc;
+}
 
-  /* If pShmNode->nRef has reached 0, then close the underlying
-  ** shared-memory file, too */
+/*
+** xSync() on a -wal file written through a ring.  Submit the queued
+** writes with a linked fsync.
+*/
+static int uringSync(unixFile *pFile)
+{
+  unixUring *p = pFile->pUring;
+  int rc = p->rcDeferred;
+  p->rcDeferred = SQLITE_OK;
+  if (p->eCommit != URING_COMMIT_NONE) p->bExpectSync = 1;
+  if (p->eCommit == URING_COMMIT_WAIT)
+  {
+    unixEnterMutex();
+    uringUnwait(p);
+    unixLeaveMutex();
+  }
+  p->eCommit = URING_COMMIT_NONE;
+  if (rc == SQLITE_OK) rc = uringSubmit(p, 1);
+  return rc;
+}
+
+/*
+** Submit the waiting commits of the calling thread.  Called by
+** unixShmBarrier().  An error is reported by the next method called on the
+** -wal file.
+*/
+static void uringSubmitWaiting(void)
+{
+  unixUring **pp = &uringWaitList;
+  pthread_t self = pthread_self();
   unixEnterMutex();
-  assert(pShmNode->nRef > 0);
-  pShmNode->nRef--;
-  if (pShmNode->nRef == 0)
+  while (*pp)
   {
-    if (deleteFlag && pShmNode->h >= 0)
+    unixUring *p = *pp;
+    if (pthread_equal(p->owner, self))
     {
-      osUnlink(pShmNode->zFilename);
+      int rc;
+      __atomic_store_n(pp, p->pNextWait, __ATOMIC_RELAXED);
+      p->pNextWait = 0;
+      p->eCommit = URING_COMMIT_NONE;
+      p->bExpectSync = 0;
+      rc = uringSubmit(p, 0);
+      if (rc != SQLITE_OK && p->rcDeferred == SQLITE_OK) p->rcDeferred = rc;
+    }
+    else
+    {
+      pp = &p->pNextWait;
     }
-    unixShmPurge(pDbFd);
   }
   unixLeaveMutex();
-
+}
+#else  /* !HAVE_IO_URING */
+static unixUring *uringOpen(unixFile *pFile)
+{
+  UNUSED_PARAMETER(pFile);
+  return 0;
+}
+static void uringClose(unixUring *p) { UNUSED_PARAMETER(p); }
+static int uringFlush(unixFile *pFile)
+{
+  UNUSED_PARAMETER(pFile);
+  return SQLITE_OK;
+}
+static int uringWrite(unixFile *pFile, const void *pBuf, int amt, i64 iOfst)
+{
+  UNUSED_PARAMETER(pFile);
+  UNUSED_PARAMETER(pBuf);
+  UNUSED_PARAMETER(amt);
+  UNUSED_PARAMETER(iOfst);
+  return SQLITE_OK;
+}
+static int uringSync(unixFile *pFile)
+{
+  UNUSED_PARAMETER(pFile);
   return SQLITE_OK;
 }
+#define uringWaiting() 0
+#define uringSubmitWaiting()
+#endif /* HAVE_IO_URING */
 
-#else
-#define unixShmMap 0
-#define unixShmLock 0
-#define unixShmBarrier 0
-#define unixShmUnmap 0
-#endif /* #ifndef SQLITE_OMIT_WAL */
+/******************************************************************************
+****************************** Changed-block tracking *************************
+**
+** When a file named "<database>-cbt" exists next to a database, every
+** write to the database file is recorded in a bitmap with one bit per
+** SQLITE_CBT_BLOCK_SIZE byte block of the database.  The bitmap lives in
+** the -cbt file behind a CbtHeader and holds every block written since
+** the epoch named in the header began.  procvfs_cbt_backup() uses it to
+** copy only the blocks that changed since the last backup.
+**
+** Blocks are marked in memory by unixWrite() and merged into the -cbt
+** file by unixSync() before the database itself is synced.  Database
+** writes are always followed by a sync while the writer still holds the
+** lock that excludes other writers (EXCLUSIVE in rollback mode and the
+** WAL checkpoint lock in WAL mode), so the read-modify-write of the
+** bitmap never races with another process.  A database change that
+** reaches the disk without its sync completing is redone or undone by
+** crash recovery, which writes the same blocks again.
+**
+** The -cbt file is looked for when a process first writes or syncs the
+** database, rather than when it opens it, so that connections that only
+** read never pay for the lookup.  If it is missing, syncs look again at
+** most every CBT_RECHECK_MS milliseconds rather than at every commit.
+** procvfs_cbt_start() keeps writers blocked for that long after creating
+** the file, so every process has looked again before its next write
+** reaches the database.  A process that has already written the database
+** without tracking notices the -cbt file at its next sync.  The blocks it
+** wrote since are unknown, so it sets CBT_FLAG_FULL and the next backup
+** copies every block.
+*/
+#ifndef SQLITE_CBT_BLOCK_SIZE
+#define SQLITE_CBT_BLOCK_SIZE 4096
+#endif
+#define CBT_MAGIC "PVFSCBT1"
+#define CBT_CHUNK 512 /* Bitmap bytes merged into the -cbt file at a time */
+#define CBT_FLAG_FULL 0x01
+#define CBT_RECHECK_MS 250 /* Syncs look for a missing -cbt file this often */
 
-#if SQLITE_MAX_MMAP_SIZE > 0
 /*
-** If it is currently memory mapped, unmap file pFd.
+** The first bytes of a -cbt file.  The bitmap follows immediately.  Bit
+** (i%8) of bitmap byte (i/8) is set if block i has been written.
 */
-static void unixUnmapfile(unixFile *pFd)
+typedef struct CbtHeader CbtHeader;
+struct CbtHeader
 {
-  assert(pFd->nFetchOut == 0);
-  if (pFd->pMapRegion)
+  char aMagic[8];  /* CBT_MAGIC */
+  u32 szBlock;     /* SQLITE_CBT_BLOCK_SIZE when the file was created */
+  u32 flags;       /* Mask of CBT_FLAG_* bits */
+  char zEpoch[64]; /* Nul-terminated name of the current epoch */
+  u8 aReserved[48];
+};
+#define CBT_HDRSIZE ((int)sizeof(CbtHeader))
+
+/*
+** Write a new header to -cbt file h, discarding any bitmap that follows it.
+*/
+static int cbtReset(int h, const char *zEpoch)
+{
+  CbtHeader hdr;
+  int iErrno;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.aMagic, CBT_MAGIC, sizeof(hdr.aMagic));
+  hdr.szBlock = SQLITE_CBT_BLOCK_SIZE;
+  sqlite3_snprintf(sizeof(hdr.zEpoch), hdr.zEpoch, "%s", zEpoch);
+  if (robust_ftruncate(h, 0) || seekAndWriteFd(h, 0, &hdr, CBT_HDRSIZE, &iErrno) != CBT_HDRSIZE || full_fsync(h, 0, 0))
   {
-    osMunmap(pFd->pMapRegion, pFd->mmapSizeActual);
-    pFd->pMapRegion = 0;
-    pFd->mmapSize = 0;
-    pFd->mmapSizeActual = 0;
+    return SQLITE_IOERR_WRITE;
   }
+  return SQLITE_OK;
 }
 
 /*
-** Attempt to set the size of the memory mapping maintained by file
-** descriptor pFd to nNew bytes. Any existing mapping is discarded.
-**
-** If successful, this function sets the following variables:
-**
-**       unixFile.pMapRegion
-**       unixFile.mmapSize
-**       unixFile.mmapSizeActual
+** Start tracking writes to the database file pFile if its -cbt file
+** exists.  Set bFull if writes may already have been missed.  Either way,
+** the lookup deferred by the cbtProbe flag has been done.
 **
-** If unsuccessful, an error message is logged via sqlite3_log() and
-** the three variables above are zeroed. In this case SQLite should
-** continue accessing the database using the xRead() and xWrite()
-** methods.
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
 */
-static void unixRemapfile(unixFile *pFd, /* File descriptor object */
-                          i64 nNew       /* Required mapping size */
-                          )
+static void cbtAttach(unixFile *pFile, int bFull)
 {
-  const char *zErr = "mmap";
-  int h = pFd->h;                    /* File descriptor open on db file */
-  u8 *pOrig = (u8 *)pFd->pMapRegion; /* Pointer to current file mapping */
-  i64 nOrig = pFd->mmapSizeActual;   /* Size of pOrig region in bytes */
-  u8 *pNew = 0;                      /* Location of new mapping */
-  int flags = PROT_READ;             /* Flags to pass to mmap() */
+  unixInodeInfo *pInode = pFile->pInode;
+  char zCbt[MAX_PATHNAME + 5];
+  CbtHeader hdr;
+  int iErrno;
+  int h;
+
+  assert(unixInodeMutexHeld(pInode));
+  pInode->cbtProbe = 0;
+  if (pInode->hCbt >= 0 || pFile->zPath == 0) return;
+  sqlite3_snprintf(sizeof(zCbt), zCbt, "%s-cbt", pFile->zPath);
+  h = robust_open(zCbt, O_RDWR | O_BINARY, 0);
+  if (h < 0)
+  {
+    pInode->msCbtMiss = unixMonotonicMs();
+    return;
+  }
+  if (seekAndReadFd(h, 0, &hdr, CBT_HDRSIZE, &iErrno) != CBT_HDRSIZE || memcmp(hdr.aMagic, CBT_MAGIC, sizeof(hdr.aMagic)) ||
+      hdr.szBlock != SQLITE_CBT_BLOCK_SIZE)
+  {
+    sqlite3_log(SQLITE_WARNING, "ignoring changed-block tracking file %s: bad header", zCbt);
+    robust_close(pFile, h, __LINE__);
+    return;
+  }
+  OSTRACE(("CBT     %-3d %s full=%d\n", h, zCbt, bFull));
+  pInode->hCbt = h;
+  if (bFull) pInode->cbtFull = 1;
+}
 
-  assert(pFd->nFetchOut == 0);
-  assert(nNew > pFd->mmapSize);
-  assert(nNew <= pFd->mmapSizeMax);
-  assert(nNew > 0);
-  assert(pFd->mmapSizeActual >= pFd->mmapSize);
-  assert(MAP_FAILED != 0);
+/*
+** Stop tracking writes to the database file pFile and forget any blocks
+** that have not been flushed yet.
+**
+** The mutex entered using the unixEnterInodeMutex() function must be held
+** when this function is called.
+*/
+static void cbtDetach(unixFile *pFile)
+{
+  unixInodeInfo *pInode = pFile->pInode;
+  assert(unixInodeMutexHeld(pInode));
+  if (pInode->hCbt >= 0) robust_close(pFile, pInode->hCbt, __LINE__);
+  sqlite3_free(pInode->aCbtPending);
+  pInode->hCbt = -1;
+  pInode->cbtFull = 0;
+  pInode->cbtProbe = 0;
+  pInode->aCbtPending = 0;
+  pInode->nCbtPending = 0;
+  pInode->iCbtLo = pInode->iCbtHi = 0;
+}
 
-#ifdef SQLITE_MMAP_READWRITE
-  if ((pFd->ctrlFlags & UNIXFILE_RDONLY) == 0) flags |= PROT_WRITE;
-#endif
+/*
+** Record that nAmt bytes at offset iOfst of the database file are being
+** written.  If memory runs out, give up and ask for a full backup.
+*/
+static void cbtMark(unixFile *pFile, i64 iOfst, int nAmt)
+{
+  unixInodeInfo *pInode = pFile->pInode;
+  i64 iFirst = iOfst / SQLITE_CBT_BLOCK_SIZE;
+  i64 iLast = (iOfst + nAmt - 1) / SQLITE_CBT_BLOCK_SIZE;
+  i64 i;
 
-  if (pOrig)
+  unixEnterInodeMutex(pInode);
+  if (pInode->cbtProbe) cbtAttach(pFile, 0);
+  if (pInode->hCbt >= 0)
   {
-#if HAVE_MREMAP
-    i64 nReuse = pFd->mmapSize;
-#else
-    const int szSyspage = osGetpagesize();
-    i64 nReuse = (pFd->mmapSize & ~(szSyspage - 1));
-#endif
-    u8 *pReq = &pOrig[nReuse];
-
-    /* Unmap any pages of the existing mapping that cannot be reused. */
-    if (nReuse != nOrig)
-    {
-      osMunmap(pReq, nOrig - nReuse);
-    }
-
-#if HAVE_MREMAP
-    pNew = (u8 *)osMremap(pOrig, nReuse, nNew, MREMAP_MAYMOVE);
-    zErr = "mremap";
-#else
-    pNew = osMmap(pReq, nNew - nReuse, flags, MAP_SHARED, h, nReuse);
-    if (pNew != MAP_FAILED)
+    if (iLast / 8 >= pInode->nCbtPending)
     {
-      if (pNew != pReq)
-      {
-        osMunmap(pNew, nNew - nReuse);
-        pNew = 0;
-      }
-      else
+      i64 nNew = (iLast / 8 / CBT_CHUNK + 1) * CBT_CHUNK;
+      u8 *aNew;
+      if (nNew < 2 * (i64)pInode->nCbtPending) nNew = 2 * (i64)pInode->nCbtPending;
+      aNew = nNew > 0x7fffffff ? 0 : (u8 *)sqlite3_realloc64(pInode->aCbtPending, nNew);
+      if (aNew == 0)
       {
-        pNew = pOrig;
+        pInode->cbtFull = 1;
+        unixLeaveInodeMutex(pInode);
+        return;
       }
+      memset(&aNew[pInode->nCbtPending], 0, nNew - pInode->nCbtPending);
+      pInode->aCbtPending = aNew;
+      pInode->nCbtPending = (int)nNew;
     }
-#endif
-
-    /* The attempt to extend the existing mapping failed. Free it. */
-    if (pNew == MAP_FAILED || pNew == 0)
+    for (i = iFirst; i <= iLast; i++)
     {
-      osMunmap(pOrig, nReuse);
+      pInode->aCbtPending[i / 8] |= (u8)(1 << (i & 7));
     }
+    if (pInode->iCbtLo == pInode->iCbtHi || iFirst / 8 < pInode->iCbtLo) pInode->iCbtLo = (int)(iFirst / 8);
+    if (iLast / 8 + 1 > pInode->iCbtHi) pInode->iCbtHi = (int)(iLast / 8 + 1);
   }
-
-  /* If pNew is still NULL, try to create an entirely new mapping. */
-  if (pNew == 0)
-  {
-    pNew = (u8 *)osMmap(0, nNew, flags, MAP_SHARED, h, 0);
-  }
-
-  if (pNew == MAP_FAILED)
-  {
-    pNew = 0;
-    nNew = 0;
-    unixLogError(SQLITE_OK, zErr, pFd->zPath);
-
-    /* If the mmap() above failed, assume that all subsequent mmap() calls
-    ** will probably fail too. Fall back to using xRead/xWrite exclusively
-    ** in this case.  */
-    pFd->mmapSizeMax = 0;
-  }
-  pFd->pMapRegion = (void *)pNew;
-  pFd->mmapSize = pFd->mmapSizeActual = nNew;
+  unixLeaveInodeMutex(pInode);
 }
 
 /*
-** Memory map or remap the file opened by file-descriptor pFd (if the file
-** is already mapped, the existing mapping is replaced by the new). Or, if
-** there already exists a mapping for this file, and there are still
-** outstanding xFetch() references to it, this function is a no-op.
-**
-** If parameter nByte is non-negative, then it is the requested size of
-** the mapping to create. Otherwise, if nByte is less than zero, then the
-** requested size is the size of the file on disk. The actual size of the
-** created mapping is either the requested size or the value configured
-** using SQLITE_FCNTL_MMAP_LIMIT, whichever is smaller.
-**
-** SQLITE_OK is returned if no error occurs (even if the mapping is not
-** recreated as a result of outstanding references) or an SQLite error
-** code otherwise.
+** Merge the blocks marked by cbtMark() into the -cbt file of database
+** pFile and sync it.  This is called by unixSync() before the database
+** file is synced, so that no synced change is ever missing from the
+** bitmap.
 */
-static int unixMapfile(unixFile *pFd, i64 nMap)
+static int cbtFlush(unixFile *pFile)
 {
-  assert(nMap >= 0 || pFd->nFetchOut == 0);
-  assert(nMap > 0 || (pFd->mmapSize == 0 && pFd->pMapRegion == 0));
-  if (pFd->nFetchOut > 0) return SQLITE_OK;
+  unixInodeInfo *pInode = pFile->pInode;
+  struct stat buf;
+  int bDirty = 0;
+  int rc = SQLITE_OK;
+  int h;
+  int i;
 
-  if (nMap < 0)
+  unixEnterInodeMutex(pInode);
+  if (pInode->hCbt < 0)
   {
-    struct stat statbuf; /* Low-level file information */
-    if (osFstat(pFd->h, &statbuf))
+    if (pInode->cbtProbe || unixMonotonicMs() - pInode->msCbtMiss >= CBT_RECHECK_MS)
     {
-      return SQLITE_IOERR_FSTAT;
+      cbtAttach(pFile, !pInode->cbtProbe);
     }
-    nMap = statbuf.st_size;
   }
-  if (nMap > pFd->mmapSizeMax)
+  else if (osFstat(pInode->hCbt, &buf) == 0 && buf.st_nlink == 0)
   {
-    nMap = pFd->mmapSizeMax;
+    /* Another process stopped, and maybe restarted, tracking.  Keep the
+    ** pending blocks for the new -cbt file, if there is one. */
+    robust_close(pFile, pInode->hCbt, __LINE__);
+    pInode->hCbt = -1;
+    cbtAttach(pFile, 1);
+    if (pInode->hCbt < 0) cbtDetach(pFile);
   }
-
-  assert(nMap > 0 || (pFd->mmapSize == 0 && pFd->pMapRegion == 0));
-  if (nMap != pFd->mmapSize)
+  h = pInode->hCbt;
+  if (h >= 0 && pInode->cbtFull)
   {
-    unixRemapfile(pFd, nMap);
+    u32 flags = CBT_FLAG_FULL;
+    if (seekAndWriteFd(h, offsetof(CbtHeader, flags), &flags, sizeof(flags), &pFile->lastErrno) != sizeof(flags))
+    {
+      rc = SQLITE_IOERR_WRITE;
+    }
+    pInode->cbtFull = 0;
+    bDirty = 1;
+  }
+  for (i = pInode->iCbtLo / CBT_CHUNK * CBT_CHUNK; h >= 0 && rc == SQLITE_OK && i < pInode->iCbtHi; i += CBT_CHUNK)
+  {
+    u8 *aPending = &pInode->aCbtPending[i];
+    u8 aBuf[CBT_CHUNK];
+    int nRead;
+    int j;
+
+    for (j = 0; j < CBT_CHUNK && aPending[j] == 0; j++)
+      ;
+    if (j == CBT_CHUNK) continue;
+    nRead = seekAndReadFd(h, CBT_HDRSIZE + i, aBuf, CBT_CHUNK, &pFile->lastErrno);
+    if (nRead < 0)
+    {
+      rc = SQLITE_IOERR_READ;
+      break;
+    }
+    memset(&aBuf[nRead], 0, CBT_CHUNK - nRead);
+    for (j = 0; j < CBT_CHUNK; j++) aBuf[j] |= aPending[j];
+    if (seekAndWriteFd(h, CBT_HDRSIZE + i, aBuf, CBT_CHUNK, &pFile->lastErrno) != CBT_CHUNK)
+    {
+      rc = SQLITE_IOERR_WRITE;
+      break;
+    }
+    memset(aPending, 0, CBT_CHUNK);
+    bDirty = 1;
   }
+  if (rc == SQLITE_OK) pInode->iCbtLo = pInode->iCbtHi = 0;
+  unixLeaveInodeMutex(pInode);
 
+  if (rc == SQLITE_OK && bDirty && full_fsync(h, 0, 1))
+  {
+    storeLastErrno(pFile, errno);
+    rc = SQLITE_IOERR_FSYNC;
+  }
+  if (rc != SQLITE_OK) return unixLogError(rc, "cbtFlush", pFile->zPath);
   return SQLITE_OK;
 }
-#endif /* SQLITE_MAX_MMAP_SIZE>0 */
 
 /*
-** If possible, return a pointer to a mapping of file fd starting at offset
-** iOff. The mapping must be valid for at least nAmt bytes.
+** Make sure all writes to a particular file are committed to disk.
 **
-** If such a pointer can be obtained, store it in *pp and return SQLITE_OK.
-** Or, if one cannot but no error occurs, set *pp to 0 and return SQLITE_OK.
-** Finally, if an error does occur, return an SQLite error code. The final
-** value of *pp is undefined in this case.
+** If dataOnly==0 then both the file itself and its metadata (file
+** size, access time, etc) are synced.  If dataOnly!=0 then only the
+** file data is synced.
 **
-** If this function does return a pointer, the caller must eventually
-** release the reference by calling unixUnfetch().
+** Under Unix, also make sure that the directory entry for the file
+** has been created by fsync-ing the directory that contains the file.
+** If we do not do this and we encounter a power failure, the directory
+** entry for the journal might not exist after we reboot.  The next
+** SQLite to access the file will not know that the journal exists (because
+** the directory entry for the journal was never created) and the transaction
+** will not roll back - possibly leading to database corruption.
 */
-static int unixFetch(sqlite3_file *fd, i64 iOff, int nAmt, void **pp)
+static int unixSync(sqlite3_file *id, int flags)
 {
-#if SQLITE_MAX_MMAP_SIZE > 0
-  unixFile *pFd = (unixFile *)fd; /* The underlying database file */
-#endif
-  *pp = 0;
+  int rc;
+  unixFile *pFile = (unixFile *)id;
 
-#if SQLITE_MAX_MMAP_SIZE > 0
-  if (pFd->mmapSizeMax > 0)
+  int isDataOnly = (flags & SQLITE_SYNC_DATAONLY);
+  int isFullsync = (flags & 0x0F) == SQLITE_SYNC_FULL;
+
+  /* Check that one of SQLITE_SYNC_NORMAL or FULL was passed */
+  assert((flags & 0x0F) == SQLITE_SYNC_NORMAL || (flags & 0x0F) == SQLITE_SYNC_FULL);
+
+  /* Unix cannot, but some systems may return SQLITE_FULL from here. This
+  ** line is to test that doing so does not cause any problems.
+  */
+  SimulateDiskfullError(return SQLITE_FULL);
+
+  assert(pFile);
+  vfsstatAdd(pFile->pStat, VFSSTAT_SYNC, 1);
+  if ((pFile->ctrlFlags & UNIXFILE_NOLOCK) == 0 && pFile->pInode)
   {
-    if (pFd->pMapRegion == 0)
+    rc = cbtFlush(pFile);
+    if (rc != SQLITE_OK) return rc;
+  }
+
+  OSTRACE(("SYNC    %-3d\n", pFile->h));
+  rc = unixCombineSync(pFile, 0, 0);
+  if (rc != SQLITE_OK) return rc;
+  if (pFile->pUring)
+  {
+    /* Submit the queued -wal writes with a linked fsync */
+    rc = uringSync(pFile);
+    if (rc != SQLITE_OK) return rc;
+  }
+  else
+  {
+    int bPending = (pFile->ctrlFlags & UNIXFILE_SYNC_PENDING) != 0;
+    rc = unixSyncWith(pFile->h, pFile->eSync, bPending, isFullsync, isDataOnly);
+    if (rc == 0 && pFile->pDirectWal)
     {
-      int rc = unixMapfile(pFd, -1);
-      if (rc != SQLITE_OK) return rc;
+      rc = unixSyncWith(pFile->pDirectWal->hHdr, pFile->eSync, bPending, isFullsync, isDataOnly);
     }
-    if (pFd->mmapSize >= iOff + nAmt)
+    SimulateIOError(rc = 1);
+    if (rc)
     {
-      *pp = &((u8 *)pFd->pMapRegion)[iOff];
-      pFd->nFetchOut++;
+      storeLastErrno(pFile, errno);
+      return unixLogError(SQLITE_IOERR_FSYNC, azSyncMode[pFile->eSync], pFile->zPath);
     }
+    pFile->ctrlFlags &= ~UNIXFILE_SYNC_PENDING;
   }
-#endif
-  return SQLITE_OK;
+
+  /* The sync covered every range collected since the last one */
+  vfsstatAdd(pFile->pStat, VFSSTAT_SYNC_BYTES, pFile->nDirty);
+  pFile->nDirty = 0;
+  pFile->nDirtyRange = 0;
+  pFile->nDirtyQueued = 0;
+
+  /* A transaction this file committed is durable now */
+  if (pFile->pShip) shipSynced(pFile);
+
+  /* Also fsync the directory containing the file if the DIRSYNC flag
+  ** is set.  This is a one-time occurrence.  Many systems (examples: AIX)
+  ** are unable to fsync a directory, so ignore errors on the fsync.
+  */
+  if (pFile->ctrlFlags & UNIXFILE_DIRSYNC)
+  {
+    OSTRACE(("DIRSYNC %s (have_fullfsync=%d fullsync=%d)\n", pFile->zPath, HAVE_FULLFSYNC, isFullsync));
+    unixDirSync(pFile);
+    pFile->ctrlFlags &= ~UNIXFILE_DIRSYNC;
+  }
+  return rc;
 }
 
 /*
-** If the third argument is non-NULL, then this function releases a
-** reference obtained by an earlier call to unixFetch(). The second
-** argument passed to this function must be the same as the corresponding
-** argument that was passed to the unixFetch() invocation.
-**
-** Or, if the third argument is NULL, then this function is being called
-** to inform the VFS layer that, according to POSIX, any existing mapping
-** may now be invalid and should be unmapped.
+** Truncate an open file to a specified size
 */
-static int unixUnfetch(sqlite3_file *fd, i64 iOff, void *p)
+static int unixTruncate(sqlite3_file *id, i64 nByte)
 {
-#if SQLITE_MAX_MMAP_SIZE > 0
-  unixFile *pFd = (unixFile *)fd; /* The underlying database file */
-  UNUSED_PARAMETER(iOff);
-
-  /* If p==0 (unmap the entire file) then there must be no outstanding
-  ** xFetch references. Or, if p!=0 (meaning it is an xFetch reference),
-  ** then there must be at least one outstanding.  */
-  assert((p == 0) == (pFd->nFetchOut == 0));
+  unixFile *pFile = (unixFile *)id;
+  int rc;
+  assert(pFile);
+  SimulateIOError(return SQLITE_IOERR_TRUNCATE);
+  if (pFile->pUring)
+  {
+    rc = uringFlush(pFile);
+    if (rc != SQLITE_OK) return rc;
+  }
+  rc = unixCombineSync(pFile, 0, 0);
+  if (rc != SQLITE_OK) return rc;
+  if (pFile->ctrlFlags & UNIXFILE_RECYCLE)
+  {
+    struct stat buf;
+    if (osFstat(pFile->h, &buf) == 0 && nByte <= buf.st_size) return unixWalRecycleTruncate(pFile, nByte);
+  }
+  pFile->ctrlFlags |= UNIXFILE_SYNC_PENDING;
+  if (pFile->pDirectWal) return unixDirectWalTruncate(pFile, nByte);
 
-  /* If p!=0, it must match the iOff value. */
-  assert(p == 0 || p == &((u8 *)pFd->pMapRegion)[iOff]);
+  /* If the user has configured a chunk-size for this file, truncate the
+  ** file so that it consists of an integer number of chunks (i.e. the
+  ** actual file size after the operation may be larger than the requested
+  ** size).
+  */
+  if (pFile->szChunk > 0)
+  {
+    nByte = ((nByte + pFile->szChunk - 1) / pFile->szChunk) * pFile->szChunk;
+  }
 
-  if (p)
+  rc = robust_ftruncate(pFile->h, nByte);
+  if (rc)
   {
-    pFd->nFetchOut--;
+    storeLastErrno(pFile, errno);
+    return unixLogError(SQLITE_IOERR_TRUNCATE, "ftruncate", pFile->zPath);
   }
   else
   {
-    unixUnmapfile(pFd);
-  }
+#ifdef SQLITE_DEBUG
+    /* If we are doing a normal write to a database file (as opposed to
+    ** doing a hot-journal rollback or a write to some file other than a
+    ** normal database file) and we truncate the file to zero length,
+    ** that effectively updates the change counter.  This might happen
+    ** when restoring a database using the backup API from a zero-length
+    ** source.
+    */
+    if (pFile->inNormalWrite && nByte == 0)
+    {
+      pFile->transCntrChng = 1;
+    }
+#endif
 
-  assert(pFd->nFetchOut >= 0);
-#else
-  UNUSED_PARAMETER(fd);
-  UNUSED_PARAMETER(p);
-  UNUSED_PARAMETER(iOff);
+#if SQLITE_MAX_MMAP_SIZE > 0
+    /* If the file was just truncated to a size smaller than the currently
+    ** mapped region, reduce the effective mapping size as well. SQLite will
+    ** use read() and write() to access data beyond this point from now on.
+    */
+    if (nByte < pFile->mmapSize)
+    {
+      pFile->mmapSize = nByte;
+    }
 #endif
-  return SQLITE_OK;
+
+    if (pFile->mxPrealloc > 0) unixPreallocRelease(pFile);
+    return SQLITE_OK;
+  }
 }
 
 /*
-** Here ends the implementation of all sqlite3_file methods.
-**
-********************** End sqlite3_file Methods *******************************
-******************************************************************************/
+** Determine the current size of a file in bytes
+*/
+static int unixFileSize(sqlite3_file *id, i64 *pSize)
+{
+  int rc;
+  struct stat buf;
+  assert(id);
+  if (((unixFile *)id)->pUring)
+  {
+    rc = uringFlush((unixFile *)id);
+    if (rc != SQLITE_OK) return rc;
+  }
+  rc = unixCombineSync((unixFile *)id, 0, 0);
+  if (rc != SQLITE_OK) return rc;
+  if (((unixFile *)id)->pDirectWal) return unixDirectWalSize((unixFile *)id, pSize);
+  rc = osFstat(((unixFile *)id)->h, &buf);
+  SimulateIOError(rc = 1);
+  if (rc != 0)
+  {
+    storeLastErrno((unixFile *)id, errno);
+    return SQLITE_IOERR_FSTAT;
+  }
+  *pSize = buf.st_size;
+
+  /* When opening a zero-size database, the findInodeInfo() procedure
+  ** writes a single byte into that file in order to work around a bug
+  ** in the OS-X msdos filesystem.  In order to avoid problems with upper
+  ** layers, we need to report this file size as zero even though it is
+  ** really 1.   Ticket #3260.
+  */
+  if (*pSize == 1) *pSize = 0;
+
+  return SQLITE_OK;
+}
 
+#if SQLITE_ENABLE_LOCKING_STYLE && defined(__APPLE__)
 /*
-** This division contains definitions of sqlite3_io_methods objects that
-** implement various file locking strategies.  It also contains definitions
-** of "finder" functions.  A finder-function is used to locate the appropriate
-** sqlite3_io_methods object for a particular database file.  The pAppData
-** field of the sqlite3_vfs VFS objects are initialized to be pointers to
-** the correct finder-function for that VFS.
-**
-** Most finder functions return a pointer to a fixed sqlite3_io_methods
-** object.  The only interesting finder-function is autolockIoFinder, which
-** looks at the filesystem type and tries to guess the best locking
-** strategy from that.
-**
-** For finder-function F, two objects are created:
-**
-**    (1) The real finder-function named "FImpt()".
-**
-**    (2) A constant pointer to this function named just "F".
-**
-**
-** A pointer to the F pointer is used as the pAppData value for VFS
-** objects.  We have to do this instead of letting pAppData point
-** directly at the finder-function since C90 rules prevent a void*
-** from be cast into a function pointer.
-**
-**
-** Each instance of this macro generates two objects:
-**
-**   *  A constant sqlite3_io_methods object call METHOD that has locking
-**      methods CLOSE, LOCK, UNLOCK, CKRESLOCK.
-**
-**   *  An I/O method finder function called FINDER that returns a pointer
-**      to the METHOD object in the previous bullet.
+** Handler for proxy-locking file-control verbs.  Defined below in the
+** proxying locking division.
 */
-#define IOMETHODS(FINDER, METHOD, VERSION, CLOSE, LOCK, UNLOCK, CKLOCK, SHMMAP) \
-  static const sqlite3_io_methods METHOD = {                                    \
-      VERSION,                   /* iVersion */                                 \
-      CLOSE,                     /* xClose */                                   \
-      unixRead,                  /* xRead */                                    \
-      unixWrite,                 /* xWrite */                                   \
-      unixTruncate,              /* xTruncate */                                \
-      unixSync,                  /* xSync */                                    \
-      unixFileSize,              /* xFileSize */                                \
-      LOCK,                      /* xLock */                                    \
-      UNLOCK,                    /* xUnlock */                                  \
-      CKLOCK,                    /* xCheckReservedLock */                       \
-      unixFileControl,           /* xFileControl */                             \
-      unixSectorSize,            /* xSectorSize */                              \
-      unixDeviceCharacteristics, /* xDeviceCapabilities */                      \
-      SHMMAP,                    /* xShmMap */                                  \
-      unixShmLock,               /* xShmLock */                                 \
-      unixShmBarrier,            /* xShmBarrier */                              \
-      unixShmUnmap,              /* xShmUnmap */                                \
-      unixFetch,                 /* xFetch */                                   \
-      unixUnfetch,               /* xUnfetch */                                 \
-  };                                                                            \
-  static const sqlite3_io_methods *FINDER##Impl(const char *z, unixFile *p)     \
-  {                                                                             \
-    UNUSED_PARAMETER(z);                                                        \
-    UNUSED_PARAMETER(p);                                                        \
-    return &METHOD;                                                             \
-  }                                                                             \
-  static const sqlite3_io_methods *(*const FINDER)(const char *, unixFile *p) = FINDER##Impl;
+static int proxyFileControl(sqlite3_file *, int, void *);
+#endif
 
 /*
-** Here are all of the sqlite3_io_methods objects for each of the
-** locking strategies.  Functions that return pointers to these methods
-** are also created.
+** This function is called to handle the SQLITE_FCNTL_SIZE_HINT
+** file-control operation.  Enlarge the database to nBytes in size
+** (rounded up to the next chunk-size).  If the database is already
+** nBytes or larger, this routine is a no-op.
 */
-IOMETHODS(posixIoFinder,         /* Finder function name */
-          posixIoMethods,        /* sqlite3_io_methods object name */
-          3,                     /* shared memory and mmap are enabled */
-          unixClose,             /* xClose method */
-          unixLock,              /* xLock method */
-          unixUnlock,            /* xUnlock method */
-          unixCheckReservedLock, /* xCheckReservedLock method */
-          unixShmMap             /* xShmMap method */
-          )
-
-/*
-** An abstract type for a pointer to an IO method finder function:
-*/
-typedef const sqlite3_io_methods *(*finder_type)(const char *, unixFile *);
-
-/****************************************************************************
-**************************** sqlite3_vfs methods ****************************
-**
-** This division contains the implementation of methods on the
-** sqlite3_vfs object.
-*/
-
-/*
-** Initialize the contents of the unixFile structure pointed to by pId.
-*/
-static int fillInUnixFile(sqlite3_vfs *pVfs,     /* Pointer to vfs object */
-                          int h,                 /* Open file descriptor of file being opened */
-                          sqlite3_file *pId,     /* Write to the unixFile structure here */
-                          const char *zFilename, /* Name of the file being opened */
-                          int ctrlFlags          /* Zero or more UNIXFILE_* values */
-                          )
+static int fcntlSizeHint(unixFile *pFile, i64 nByte)
 {
-  const sqlite3_io_methods *pLockingStyle;
-  unixFile *pNew = (unixFile *)pId;
-  int rc = SQLITE_OK;
+  if (pFile->szChunk > 0)
+  {
+    i64 nSize;       /* Required file size */
+    struct stat buf; /* Used to hold return values of fstat() */
 
-  assert(pNew->pInode == NULL);
+    if (osFstat(pFile->h, &buf))
+    {
+      return SQLITE_IOERR_FSTAT;
+    }
 
-  /* No locking occurs in temporary files */
-  assert(zFilename != 0 || (ctrlFlags & UNIXFILE_NOLOCK) != 0);
+    nSize = ((nByte + pFile->szChunk - 1) / pFile->szChunk) * pFile->szChunk;
+    if (nSize > (i64)buf.st_size)
+    {
+      pFile->ctrlFlags |= UNIXFILE_SYNC_PENDING;
+#if defined(HAVE_POSIX_FALLOCATE) && HAVE_POSIX_FALLOCATE
+      /* The code below is handling the return value of osFallocate()
+      ** correctly. posix_fallocate() is defined to "returns zero on success,
+      ** or an error number on  failure". See the manpage for details. */
+      int err;
+      do
+      {
+        err = osFallocate(pFile->h, buf.st_size, nSize - buf.st_size);
+      } while (err == EINTR);
+      if (err && err != EINVAL) return SQLITE_IOERR_WRITE;
+#else
+      /* If the OS does not have posix_fallocate(), fake it. Write a
+      ** single byte to the last byte in each block that falls entirely
+      ** within the extended region. Then, if required, a single byte
+      ** at offset (nSize-1), to set the size of the file correctly.
+      ** This is a similar technique to that used by glibc on systems
+      ** that do not have a real fallocate() call.
+      */
+      int nBlk = buf.st_blksize; /* File-system block size */
+      int nWrite = 0;            /* Number of bytes written by seekAndWrite */
+      i64 iWrite;                /* Next offset to write to */
 
-  OSTRACE(("OPEN    %-3d %s\n", h, zFilename));
-  pNew->h = h;
-  pNew->pVfs = pVfs;
-  pNew->zPath = zFilename;
-  pNew->ctrlFlags = (u8)ctrlFlags;
-#if SQLITE_MAX_MMAP_SIZE > 0
-  pNew->mmapSizeMax = sqlite3GlobalConfig_szMmap;
+      iWrite = (buf.st_size / nBlk) * nBlk + nBlk - 1;
+      assert(iWrite >= buf.st_size);
+      assert(((iWrite + 1) % nBlk) == 0);
+#if HAVE_LINUX_FALLOCATE
+      /* Where the file system supports it, one call does the whole job */
+      if (osLinuxFallocate(pFile->h, 0, buf.st_size, nSize - buf.st_size) == 0) iWrite = nSize + nBlk - 1;
 #endif
-  if (sqlite3_uri_boolean(((ctrlFlags & UNIXFILE_URI) ? zFilename : 0), "psow", SQLITE_POWERSAFE_OVERWRITE))
-  {
-    pNew->ctrlFlags |= UNIXFILE_PSOW;
-  }
-  if (strcmp(pVfs->zName, "unix-excl") == 0)
-  {
-    pNew->ctrlFlags |= UNIXFILE_EXCL;
-  }
-
-
-  {
-    pLockingStyle = (**(finder_type *)pVfs->pAppData)(zFilename, pNew);
-#if SQLITE_ENABLE_LOCKING_STYLE
-    /* Cache zFilename in the locking context (AFP and dotlock override) for
-    ** proxyLock activation is possible (remote proxy is based on db name)
-    ** zFilename remains valid until file is closed, to support */
-    pNew->lockingContext = (void *)zFilename;
+      for (/*no-op*/; iWrite < nSize + nBlk - 1; iWrite += nBlk)
+      {
+        if (iWrite >= nSize) iWrite = nSize - 1;
+        nWrite = seekAndWrite(pFile, iWrite, "", 1);
+        if (nWrite != 1) return SQLITE_IOERR_WRITE;
+      }
 #endif
+    }
   }
 
-  if (pLockingStyle == &posixIoMethods
-      )
+#if SQLITE_MAX_MMAP_SIZE > 0
+  if (pFile->mmapSizeMax > 0 && nByte > pFile->mmapSize)
   {
-    unixEnterMutex();
-    rc = findInodeInfo(pNew, &pNew->pInode);
-    if (rc != SQLITE_OK)
+    int rc;
+    if (pFile->szChunk <= 0)
     {
-      /* If an error occurred in findInodeInfo(), close the file descriptor
-      ** immediately, before releasing the mutex. findInodeInfo() may fail
-      ** in two scenarios:
-      **
-      **   (a) A call to fstat() failed.
-      **   (b) A malloc failed.
-      **
-      ** Scenario (b) may only occur if the process is holding no other
-      ** file descriptors open on the same file. If there were other file
-      ** descriptors on this file, then no malloc would be required by
-      ** findInodeInfo(). If this is the case, it is quite safe to close
-      ** handle h - as it is guaranteed that no posix locks will be released
-      ** by doing so.
-      **
-      ** If scenario (a) caused the error then things are not so safe. The
-      ** implicit assumption here is that if fstat() fails, things are in
-      ** such bad shape that dropping a lock or two doesn't matter much.
-      */
-      robust_close(pNew, h, __LINE__);
-      h = -1;
+      if (robust_ftruncate(pFile->h, nByte))
+      {
+        storeLastErrno(pFile, errno);
+        return unixLogError(SQLITE_IOERR_TRUNCATE, "ftruncate", pFile->zPath);
+      }
     }
-    unixLeaveMutex();
-  }
 
-  storeLastErrno(pNew, 0);
-  if (rc != SQLITE_OK)
-  {
-    if (h >= 0) robust_close(pNew, h, __LINE__);
-  }
-  else
-  {
-    pNew->pMethod = pLockingStyle;
-    OpenCounter(+1);
-    verifyDbFile(pNew);
+    rc = unixMapfile(pFile, nByte);
+    return rc;
   }
-  return rc;
+#endif
+
+  return SQLITE_OK;
 }
 
 /*
-** Return the name of a directory in which to put temporary files.
-** If no suitable temporary file directory can be found, return NULL.
+** If *pArg is initially negative then this is a query.  Set *pArg to
+** 1 or 0 depending on whether or not bit mask of pFile->ctrlFlags is set.
+**
+** If *pArg is 0 or 1, then clear or set the mask bit of pFile->ctrlFlags.
 */
-static const char *unixTempFileDir(void)
+static void unixModeBit(unixFile *pFile, unsigned char mask, int *pArg)
 {
-  static const char *azDirs[] = {0, 0, "/var/tmp", "/usr/tmp", "/tmp", "."};
-  unsigned int i = 0;
-  struct stat buf;
-  const char *zDir = sqlite3_temp_directory;
-
-  if (!azDirs[0]) azDirs[0] = getenv("SQLITE_TMPDIR");
-  if (!azDirs[1]) azDirs[1] = getenv("TMPDIR");
-  while (1)
+  if (*pArg < 0)
   {
-    if (zDir != 0 && osStat(zDir, &buf) == 0 && S_ISDIR(buf.st_mode) && osAccess(zDir, 03) == 0)
-    {
-      return zDir;
-    }
-    if (i >= sizeof(azDirs) / sizeof(azDirs[0])) break;
-    zDir = azDirs[i++];
+    *pArg = (pFile->ctrlFlags & mask) != 0;
   }
-  return 0;
-}
-
-/*
-** Create a temporary file name in zBuf.  zBuf must be allocated
-** by the calling process and must be big enough to hold at least
-** pVfs->mxPathname bytes.
-*/
-static int unixGetTempname(int nBuf, char *zBuf)
-{
-  const char *zDir;
-  int iLimit = 0;
-
-  /* It's odd to simulate an io-error here, but really this is just
-  ** using the io-error infrastructure to test that SQLite handles this
-  ** function failing.
-  */
-  zBuf[0] = 0;
-  SimulateIOError(return SQLITE_IOERR);
-
-  zDir = unixTempFileDir();
-  if (zDir == 0) return SQLITE_IOERR_GETTEMPPATH;
-  do
+  else if ((*pArg) == 0)
   {
-    u64 r;
-    sqlite3_randomness(sizeof(r), &r);
-    assert(nBuf > 2);
-    zBuf[nBuf - 2] = 0;
-    sqlite3_snprintf(nBuf, zBuf, "%s/" SQLITE_TEMP_FILE_PREFIX "%llx%c", zDir, r, 0);
-    if (zBuf[nBuf - 2] != 0 || (iLimit++) > 10) return SQLITE_ERROR;
-  } while (osAccess(zBuf, 0) == 0);
-  return SQLITE_OK;
+    pFile->ctrlFlags &= ~mask;
+  }
+  else
+  {
+    pFile->ctrlFlags |= mask;
+  }
 }
 
-#if SQLITE_ENABLE_LOCKING_STYLE && defined(__APPLE__)
-/*
-** Routine to transform a unixFile into a proxy-locking unixFile.
-** Implementation in the proxy-lock division, but used by unixOpen()
-** if SQLITE_PREFER_PROXY_LOCKING is defined.
-*/
-static int proxyTransformUnixFile(unixFile *, const char *);
-#endif
+/* Forward declaration */
+static int unixGetTempname(int nBuf, char *zBuf);
 
 /*
-** Search for an unused file descriptor that was opened on the database
-** file (not a journal or master-journal file) identified by pathname
-** zPath with SQLITE_OPEN_XXX flags matching those passed as the second
-** argument to this function.
-**
-** Such a file descriptor may exist if a database connection was closed
-** but the associated file descriptor could not be closed because some
-** other file descriptor open on the same file is holding a file-lock.
-** Refer to comments in the unixClose() function and the lengthy comment
-** describing "Posix Advisory Locking" at the start of this file for
-** further details. Also, ticket #4018.
-**
-** If a suitable file descriptor is found, then it is returned. If no
-** such file descriptor is located, -1 is returned.
+** Information and control of an open file handle.
 */
-static UnixUnusedFd *findReusableFd(const char *zPath, int flags)
+static int unixFileControl(sqlite3_file *id, int op, void *pArg)
 {
-  UnixUnusedFd *pUnused = 0;
-
-  struct stat sStat; /* Results of stat() call */
-
-  unixEnterMutex();
-
-  /* A stat() call may fail for various reasons. If this happens, it is
-  ** almost certain that an open() call on the same path will also fail.
-  ** For this reason, if an error occurs in the stat() call here, it is
-  ** ignored and -1 is returned. The caller will try to open a new file
-  ** descriptor on the same path, fail, and return an error to SQLite.
-  **
-  ** Even if a subsequent open() call does succeed, the consequences of
-  ** not searching for a reusable file descriptor are not dire.  */
-  if (nUnusedFd > 0 && 0 == osStat(zPath, &sStat))
+  unixFile *pFile = (unixFile *)id;
+  if (pFile->pUring)
   {
-    unixInodeInfo *pInode;
+    int rc = uringFlush(pFile);
+    if (rc != SQLITE_OK) return rc;
+  }
+  if (pFile->pCombine)
+  {
+    int rc = unixCombineSync(pFile, 0, 0);
+    if (rc != SQLITE_OK) return rc;
+  }
+  switch (op)
+  {
+#if defined(__linux__) && defined(SQLITE_ENABLE_BATCH_ATOMIC_WRITE)
+    case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+    {
+      int rc = osIoctl(pFile->h, F2FS_IOC_START_ATOMIC_WRITE);
+      return rc ? SQLITE_IOERR_BEGIN_ATOMIC : SQLITE_OK;
+    }
+    case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE:
+    {
+      int rc = osIoctl(pFile->h, F2FS_IOC_COMMIT_ATOMIC_WRITE);
+      return rc ? SQLITE_IOERR_COMMIT_ATOMIC : SQLITE_OK;
+    }
+    case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
+    {
+      int rc = osIoctl(pFile->h, F2FS_IOC_ABORT_VOLATILE_WRITE);
+      return rc ? SQLITE_IOERR_ROLLBACK_ATOMIC : SQLITE_OK;
+    }
+#endif /* __linux__ && SQLITE_ENABLE_BATCH_ATOMIC_WRITE */
 
-    pInode = inodeList;
-    while (pInode && (pInode->fileId.dev != sStat.st_dev || pInode->fileId.ino != (u64)sStat.st_ino))
+    case SQLITE_FCNTL_LOCKSTATE:
     {
-      pInode = pInode->pNext;
+      *(int *)pArg = pFile->eFileLock;
+      return SQLITE_OK;
     }
-    if (pInode)
+    case SQLITE_FCNTL_LAST_ERRNO:
     {
-      UnixUnusedFd **pp;
-      for (pp = &pInode->pUnused; *pp && (*pp)->flags != flags; pp = &((*pp)->pNext))
-        ;
-      pUnused = *pp;
-      if (pUnused)
+      *(int *)pArg = pFile->lastErrno;
+      return SQLITE_OK;
+    }
+    case SQLITE_FCNTL_CHUNK_SIZE:
+    {
+      pFile->szChunk = *(int *)pArg;
+      return SQLITE_OK;
+    }
+    case SQLITE_FCNTL_SIZE_HINT:
+    {
+      int rc;
+      SimulateIOErrorBenign(1);
+      rc = fcntlSizeHint(pFile, *(i64 *)pArg);
+      SimulateIOErrorBenign(0);
+      return rc;
+    }
+    case SQLITE_FCNTL_PERSIST_WAL:
+    {
+      unixModeBit(pFile, UNIXFILE_PERSIST_WAL, (int *)pArg);
+      return SQLITE_OK;
+    }
+    case SQLITE_FCNTL_POWERSAFE_OVERWRITE:
+    {
+      unixModeBit(pFile, UNIXFILE_PSOW, (int *)pArg);
+      return SQLITE_OK;
+    }
+    case SQLITE_FCNTL_VFSNAME:
+    {
+      *(char **)pArg = sqlite3_mprintf("%s", pFile->pVfs->zName);
+      return SQLITE_OK;
+    }
+    case SQLITE_FCNTL_TEMPFILENAME:
+    {
+      char *zTFile = (char *)sqlite3_malloc64(pFile->pVfs->mxPathname);
+      if (zTFile)
       {
-        nUnusedFd--;
-        *pp = pUnused->pNext;
+        unixGetTempname(pFile->pVfs->mxPathname, zTFile);
+        *(char **)pArg = zTFile;
       }
+      return SQLITE_OK;
     }
-  }
-  unixLeaveMutex();
-  return pUnused;
-}
+    case SQLITE_FCNTL_HAS_MOVED:
+    {
+      *(int *)pArg = fileHasMoved(pFile);
+      return SQLITE_OK;
+    }
+    case SQLITE_FCNTL_LOCK_TIMEOUT:
+    {
+      pFile->iBusyTimeout = *(int *)pArg;
+      return SQLITE_OK;
+    }
+    case VFS_FCNTL_PREFETCH:
+    {
+      /* Reads with O_DIRECT bypass the page cache readahead() fills */
+      if (pFile->ctrlFlags & UNIXFILE_DIRECT) return SQLITE_OK;
+      pFile->ctrlFlags |= UNIXFILE_PREFETCH;
+      return vfsprefetch_queue(pFile->h, (const VfsPrefetch *)pArg);
+    }
+#if SQLITE_MAX_MMAP_SIZE > 0
+    case SQLITE_FCNTL_MMAP_SIZE:
+    {
+      i64 newLimit = *(i64 *)pArg;
+      int rc = SQLITE_OK;
+      if (newLimit > sqlite3GlobalConfig_mxMmap)
+      {
+        newLimit = sqlite3GlobalConfig_mxMmap;
+      }
 
-/*
-** Find the mode, uid and gid of file zFile.
-*/
-static int getFileMode(const char *zFile, /* File name */
-                       mode_t *pMode,     /* OUT: Permissions of zFile */
-                       uid_t *pUid,       /* OUT: uid of zFile. */
-                       gid_t *pGid        /* OUT: gid of zFile. */
-                       )
-{
-  struct stat sStat; /* Output of stat() on database file */
-  int rc = SQLITE_OK;
-  if (0 == osStat(zFile, &sStat))
-  {
-    *pMode = sStat.st_mode & 0777;
-    *pUid = sStat.st_uid;
-    *pGid = sStat.st_gid;
-  }
-  else
-  {
-    rc = SQLITE_IOERR_FSTAT;
+      /* The value of newLimit may be eventually cast to (size_t) and passed
+      ** to mmap(). Restrict its value to 2GB if (size_t) is not at least a
+      ** 64-bit type. */
+      if (newLimit > 0 && sizeof(size_t) < 8)
+      {
+        newLimit = (newLimit & 0x7FFFFFFF);
+      }
+      if (pFile->ctrlFlags & UNIXFILE_DIRECT) newLimit = 0;
+
+      *(i64 *)pArg = pFile->mmapSizeMax;
+      if (newLimit >= 0 && newLimit != pFile->mmapSizeMax && pFile->nFetchOut == 0)
+      {
+        pFile->mmapSizeMax = newLimit;
+        if (pFile->mmapSize > 0)
+        {
+          unixUnmapfile(pFile);
+          rc = unixMapfile(pFile, -1);
+        }
+      }
+      return rc;
+    }
+#endif
+//#ifdef SQLITE_DEBUG
+//    /* The pager calls this method to signal that it has done
+//    ** a rollback and that the database is therefore unchanged and
+//    ** it hence it is OK for the transaction change counter to be
+//    ** unchanged.
+//    */
+//    case SQLITE_FCNTL_DB_UNCHANGED:
+//    {
+//      ((unixFile *)id)->dbUpdate = 0;
+//      return SQLITE_OK;
+//    }
+//#endif
+#if SQLITE_ENABLE_LOCKING_STYLE && defined(__APPLE__)
+    case SQLITE_FCNTL_SET_LOCKPROXYFILE:
+    case SQLITE_FCNTL_GET_LOCKPROXYFILE:
+    {
+      return proxyFileControl(id, op, pArg);
+    }
+#endif /* SQLITE_ENABLE_LOCKING_STYLE && defined(__APPLE__) */
   }
-  return rc;
+  return SQLITE_NOTFOUND;
 }
 
 /*
-** This function is called by unixOpen() to determine the unix permissions
-** to create new files with. If no error occurs, then SQLITE_OK is returned
-** and a value suitable for passing as the third argument to open(2) is
-** written to *pMode. If an IO error occurs, an SQLite error code is
-** returned and the value of *pMode is not modified.
-**
-** In most cases, this routine sets *pMode to 0, which will become
-** an indication to robust_open() to create the file using
-** SQLITE_DEFAULT_FILE_PERMISSIONS adjusted by the umask.
-** But if the file being opened is a WAL or regular journal file, then
-** this function queries the file-system for the permissions on the
-** corresponding database file and sets *pMode to this value. Whenever
-** possible, WAL and journal files are created using the same permissions
-** as the associated database file.
+** If pFd->sectorSize is non-zero when this function is called, it is a
+** no-op. Otherwise, the values of pFd->sectorSize and
+** pFd->deviceCharacteristics are set according to the file-system
+** characteristics.
 **
-** If the SQLITE_ENABLE_8_3_NAMES option is enabled, then the
-** original filename is unavailable.  But 8_3_NAMES is only used for
-** FAT filesystems and permissions do not matter there, so just use
-** the default permissions.
+** There are two versions of this function. One for QNX and one for all
+** other systems.
 */
-static int findCreateFileMode(const char *zPath, /* Path of file (possibly) being created */
-                              int flags,         /* Flags passed as 4th argument to xOpen() */
-                              mode_t *pMode,     /* OUT: Permissions to open file with */
-                              uid_t *pUid,       /* OUT: uid to set on the file */
-                              gid_t *pGid        /* OUT: gid to set on the file */
-                              )
+#ifndef __QNXNTO__
+static void setDeviceCharacteristics(unixFile *pFd)
 {
-  int rc = SQLITE_OK; /* Return Code */
-  *pMode = 0;
-  *pUid = 0;
-  *pGid = 0;
-  if (flags & (SQLITE_OPEN_WAL | SQLITE_OPEN_MAIN_JOURNAL))
+  assert(pFd->deviceCharacteristics == 0 || pFd->sectorSize != 0);
+  if (pFd->sectorSize == 0)
   {
-    char zDb[MAX_PATHNAME + 1]; /* Database file path */
-    int nDb;                    /* Number of valid bytes in zDb */
+#if defined(__linux__) && defined(SQLITE_ENABLE_BATCH_ATOMIC_WRITE)
+    int res;
+    u32 f = 0;
 
-    /* zPath is a path to a WAL or journal file. The following block derives
-    ** the path to the associated database file from zPath. This block handles
-    ** the following naming conventions:
-    **
-    **   "<path to db>-journal"
-    **   "<path to db>-wal"
-    **   "<path to db>-journalNN"
-    **   "<path to db>-walNN"
-    **
-    ** where NN is a decimal number. The NN naming schemes are
-    ** used by the test_multiplex.c module.
-    */
-    nDb = sqlite3Strlen30(zPath) - 1;
-    while (zPath[nDb] != '-')
+    /* Check for support for F2FS atomic batch writes. */
+    res = osIoctl(pFd->h, F2FS_IOC_GET_FEATURES, &f);
+    if (res == 0 && (f & F2FS_FEATURE_ATOMIC_WRITE))
     {
-      /* In normal operation, the journal file name will always contain
-      ** a '-' character.  However in 8+3 filename mode, or if a corrupt
-      ** rollback journal specifies a master journal with a goofy name, then
-      ** the '-' might be missing. */
-      if (nDb == 0 || zPath[nDb] == '.') return SQLITE_OK;
-      nDb--;
+      pFd->deviceCharacteristics = SQLITE_IOCAP_BATCH_ATOMIC;
     }
-    memcpy(zDb, zPath, nDb);
-    zDb[nDb] = '\0';
+#endif /* __linux__ && SQLITE_ENABLE_BATCH_ATOMIC_WRITE */
 
-    rc = getFileMode(zDb, pMode, pUid, pGid);
-  }
-  else if (flags & SQLITE_OPEN_DELETEONCLOSE)
-  {
-    *pMode = 0600;
-  }
-  else if (flags & SQLITE_OPEN_URI)
-  {
-    /* If this is a main database file and the file was opened using a URI
-    ** filename, check for the "modeof" parameter. If present, interpret
-    ** its value as a filename and try to copy the mode, uid and gid from
-    ** that file.  */
-    const char *z = sqlite3_uri_parameter(zPath, "modeof");
-    if (z)
+    /* Set the POWERSAFE_OVERWRITE flag if requested. */
+    if (pFd->ctrlFlags & UNIXFILE_PSOW)
     {
-      rc = getFileMode(z, pMode, pUid, pGid);
+      pFd->deviceCharacteristics |= SQLITE_IOCAP_POWERSAFE_OVERWRITE;
     }
+
+    pFd->sectorSize = SQLITE_DEFAULT_SECTOR_SIZE;
   }
-  return rc;
 }
-
-/*
-** Open the file zPath.
-**
+#else
+#include <sys/dcmd_blk.h>
+#include <sys/statvfs.h>
+static void setDeviceCharacteristics(unixFile *pFile)
+{
+  if (pFile->sectorSize == 0)
+  {
+    struct statvfs fsInfo;
+
+    /* Set defaults for non-supported filesystems */
+    pFile->sectorSize = SQLITE_DEFAULT_SECTOR_SIZE;
+    pFile->deviceCharacteristics = 0;
+    if (fstatvfs(pFile->h, &fsInfo) == -1)
+    {
+      return;
+    }
+
+    if (!strcmp(fsInfo.f_basetype, "tmp"))
+    {
+      pFile->sectorSize = fsInfo.f_bsize;
+      pFile->deviceCharacteristics = SQLITE_IOCAP_ATOMIC4K |    /* All ram filesystem writes are atomic */
+                                     SQLITE_IOCAP_SAFE_APPEND | /* growing the file does not occur until
+                                                                ** the write succeeds */
+                                     SQLITE_IOCAP_SEQUENTIAL |  /* The ram filesystem has no write behind
+                                                                ** so it is ordered */
+                                     0;
+    }
+    else if (strstr(fsInfo.f_basetype, "etfs"))
+    {
+      pFile->sectorSize = fsInfo.f_bsize;
+      pFile->deviceCharacteristics =
+          /* etfs cluster size writes are atomic */
+          (pFile->sectorSize / 512 * SQLITE_IOCAP_ATOMIC512) |
+          SQLITE_IOCAP_SAFE_APPEND | /* growing the file does not occur until
+                                     ** the write succeeds */
+          SQLITE_IOCAP_SEQUENTIAL |  /* The ram filesystem has no write behind
+                                     ** so it is ordered */
+          0;
+    }
+    else if (!strcmp(fsInfo.f_basetype, "qnx6"))
+    {
+      pFile->sectorSize = fsInfo.f_bsize;
+      pFile->deviceCharacteristics = SQLITE_IOCAP_ATOMIC |      /* All filesystem writes are atomic */
+                                     SQLITE_IOCAP_SAFE_APPEND | /* growing the file does not occur until
+                                                                ** the write succeeds */
+                                     SQLITE_IOCAP_SEQUENTIAL |  /* The ram filesystem has no write behind
+                                                                ** so it is ordered */
+                                     0;
+    }
+    else if (!strcmp(fsInfo.f_basetype, "qnx4"))
+    {
+      pFile->sectorSize = fsInfo.f_bsize;
+      pFile->deviceCharacteristics =
+          /* full bitset of atomics from max sector size and smaller */
+          ((pFile->sectorSize / 512 * SQLITE_IOCAP_ATOMIC512) << 1) - 2 |
+          SQLITE_IOCAP_SEQUENTIAL | /* The ram filesystem has no write behind
+                                    ** so it is ordered */
+          0;
+    }
+    else if (strstr(fsInfo.f_basetype, "dos"))
+    {
+      pFile->sectorSize = fsInfo.f_bsize;
+      pFile->deviceCharacteristics =
+          /* full bitset of atomics from max sector size and smaller */
+          ((pFile->sectorSize / 512 * SQLITE_IOCAP_ATOMIC512) << 1) - 2 |
+          SQLITE_IOCAP_SEQUENTIAL | /* The ram filesystem has no write behind
+                                    ** so it is ordered */
+          0;
+    }
+    else
+    {
+      pFile->deviceCharacteristics = SQLITE_IOCAP_ATOMIC512 |   /* blocks are atomic */
+                                     SQLITE_IOCAP_SAFE_APPEND | /* growing the file does not occur until
+                                                                ** the write succeeds */
+                                     0;
+    }
+  }
+  /* Last chance verification.  If the sector size isn't a multiple of 512
+  ** then it isn't valid.*/
+  if (pFile->sectorSize % 512 != 0)
+  {
+    pFile->deviceCharacteristics = 0;
+    pFile->sectorSize = SQLITE_DEFAULT_SECTOR_SIZE;
+  }
+}
+#endif
+
+/*
+** Return the sector size in bytes of the underlying block device for
+** the specified file. This is almost always 512 bytes, but may be
+** larger for some devices.
+**
+** SQLite code assumes this function cannot fail. It also assumes that
+** if two files are created in the same file-system directory (i.e.
+** a database and its journal file) that the sector size will be the
+** same for both.
+*/
+static int unixSectorSize(sqlite3_file *id)
+{
+  unixFile *pFd = (unixFile *)id;
+  setDeviceCharacteristics(pFd);
+  return pFd->sectorSize;
+}
+
+/*
+** Return the device characteristics for the file.
+**
+** This VFS is set up to return SQLITE_IOCAP_POWERSAFE_OVERWRITE by default.
+** However, that choice is controversial since technically the underlying
+** file system does not always provide powersafe overwrites.  (In other
+** words, after a power-loss event, parts of the file that were never
+** written might end up being altered.)  However, non-PSOW behavior is very,
+** very rare.  And asserting PSOW makes a large reduction in the amount
+** of required I/O for journaling, since a lot of padding is eliminated.
+**  Hence, while POWERSAFE_OVERWRITE is on by default, there is a file-control
+** available to turn it off and URI query parameter available to turn it off.
+*/
+static int unixDeviceCharacteristics(sqlite3_file *id)
+{
+  unixFile *pFd = (unixFile *)id;
+  setDeviceCharacteristics(pFd);
+  return pFd->deviceCharacteristics;
+}
+
+#if !defined(SQLITE_OMIT_WAL) || SQLITE_MAX_MMAP_SIZE > 0
+
+/*
+** Return the system page size.
+**
+** This function should not be called directly by other code in this file.
+** Instead, it should be called via macro osGetpagesize().
+*/
+static int unixGetpagesize(void)
+{
+  return (int)sysconf(_SC_PAGESIZE);
+}
+
+#endif /* !defined(SQLITE_OMIT_WAL) || SQLITE_MAX_MMAP_SIZE>0 */
+
+#ifndef SQLITE_OMIT_WAL
+
+/*
+** Object used to represent an shared memory buffer.
+**
+** When multiple threads all reference the same wal-index, each thread
+** has its own unixShm object, but they all point to a single instance
+** of this unixShmNode object.  In other words, each wal-index is opened
+** only once per process.
+**
+** Each unixShmNode object is connected to a single unixInodeInfo object.
+** We could coalesce this object into unixInodeInfo, but that would mean
+** every open file that does not use shared memory (in other words, most
+** open files) would have to carry around this extra information.  So
+** the unixInodeInfo object contains a pointer to this unixShmNode object
+** and the unixShmNode object is created only when needed.
+**
+** unixInodeMutexHeld(pInode) must be true when creating or destroying
+** this object or while reading or writing the following fields:
+**
+**      nRef
+**
+** The following fields are read-only after the object is created:
+**
+**      fid
+**      zFilename
+**
+** Either unixShmNode.mutex must be held or unixShmNode.nRef==0 and
+** unixInodeMutexHeld(pInode) is true when reading or writing any other field
+** in this structure.
+**
+** hLock, aLock and iLockSlot are only used by wal-indexes opened with
+** "shm_lock=atomic".  See unixShmAtomicLock().  hMem, pMem, szMem and aMemHdr
+** are only used by wal-indexes opened with "shm_memfd".  See
+** unixShmMemfdCreate().
+*/
+struct unixShmNode
+{
+  unixInodeInfo *pInode; /* unixInodeInfo that owns this SHM node */
+  std::mutex *mutex;     /* Mutex to access this object */
+  char *zFilename;       /* Name of the mmapped file */
+  int h;                 /* Open file descriptor */
+  int hLock;             /* Descriptor of the -shm-lock file, or -1 */
+  u32 *aLock;            /* Mapping of the -shm-lock file */
+  int iLockSlot;         /* Slot of this process in aLock[] */
+  int hMem;              /* memfd holding the wal-index, or -1 */
+  char *pMem;            /* Mapping of all szMem bytes of hMem */
+  u32 szMem;             /* Bytes reserved for the wal-index */
+  u32 *aMemHdr;          /* Mapping of the -shm file header */
+  u8 eMemfd;             /* UNIX_SHM_MEMFD_* mode requested, or 0 */
+  int szRegion;          /* Size of shared-memory regions */
+  u16 nRegion;           /* Size of array apRegion */
+  u8 isReadonly;         /* True if read-only */
+  u8 isUnlocked;         /* True if no DMS lock held */
+  char **apRegion;       /* Array of mapped shared-memory regions */
+  int nRef;              /* Number of unixShm objects pointing to this */
+  unixShm *pFirst;       /* All unixShm objects pointing to this */
+#ifdef SQLITE_DEBUG
+  u8 exclMask;   /* Mask of exclusive locks held */
+  u8 sharedMask; /* Mask of shared locks held */
+  u8 nextShmId;  /* Next available unixShm.id value */
+#endif
+};
+
+/*
+** Structure used internally by this VFS to record the state of an
+** open shared memory connection.
+**
+** The following fields are initialized when this object is created and
+** are read-only thereafter:
+**
+**    unixShm.pFile
+**    unixShm.id
+**
+** All other fields are read/write.  The unixShm.pFile->mutex must be held
+** while accessing any read/write fields.
+*/
+struct unixShm
+{
+  unixShmNode *pShmNode; /* The underlying unixShmNode object */
+  unixShm *pNext;        /* Next unixShm with the same unixShmNode */
+  u8 hasMutex;           /* True if holding the unixShmNode mutex */
+  u8 id;                 /* Id of this connection within its unixShmNode */
+  u16 sharedMask;        /* Mask of shared locks held */
+  u16 exclMask;          /* Mask of exclusive locks held */
+};
+
+/*
+** Constants used for locking
+*/
+#define UNIX_SHM_BASE ((22 + SQLITE_SHM_NLOCK) * 4)     /* first lock byte */
+#define UNIX_SHM_DMS (UNIX_SHM_BASE + SQLITE_SHM_NLOCK) /* deadman switch */
+
+/*
+** Layout of the -shm-lock file used by "shm_lock=atomic".  In the first
+** cache line, word 0 is one more than the highest slot ever claimed, word
+** 1 is a futex bumped when locks are released while word 2, the number of
+** connections waiting for a lock, is non-zero.  Each following cache line is the slot of one process: a word holding the
+** shared locks it has in bits 0-7, its exclusive locks in bits 8-15 and
+** in bits 16-31 a count of the processes that have claimed the slot.
+*/
+#define UNIX_SHM_LOCKSZ 4096                                     /* File size */
+#define UNIX_SHM_SLOTSZ (64 / sizeof(u32))                       /* Words per slot */
+#define UNIX_SHM_NSLOT (UNIX_SHM_LOCKSZ / 64 - 1)                /* Slots */
+#define UNIX_SHM_SLOT(aLock, iSlot) (&(aLock)[((iSlot) + 1) * UNIX_SHM_SLOTSZ])
+#define UNIX_SHM_WAKE 1                                          /* Futex word */
+#define UNIX_SHM_NWAITER 2                                       /* Waiter count */
+
+/*
+** Layout of the -shm file of a wal-index opened with "shm_memfd".  The
+** wal-index itself is in a memfd.  The -shm file holds the fcntl() locks
+** as usual, and a one page header saying how to find the memfd: word 1 is
+** the size of the memfd, word 2 the number of bytes of it in use and words
+** 3 and 4 its inode number.  Each of the following pairs of words is the
+** pid and descriptor number of a process that has the memfd open.  A pair
+** is only valid while byte UNIX_SHM_MEMFD_SLOTLOCK+i of the -shm file is
+** locked by that process.
+*/
+#define UNIX_SHM_MEMFD 1                                         /* Use memfd */
+#define UNIX_SHM_MEMFD_HUGE 2                                    /* MFD_HUGETLB */
+#define UNIX_SHM_MEMFD_MAGIC 0x6d656d66                          /* "memf" */
+#define UNIX_SHM_MEMFD_HDRSZ 4096                                /* Header size */
+#define UNIX_SHM_MEMFD_SIZE 1                                    /* memfd size */
+#define UNIX_SHM_MEMFD_NALLOC 2                                  /* Bytes used */
+#define UNIX_SHM_MEMFD_INO 3                                     /* Inode */
+#define UNIX_SHM_MEMFD_SLOT(aHdr, iSlot) (&(aHdr)[16 + 2 * (iSlot)])
+#define UNIX_SHM_MEMFD_NSLOT 64                                  /* Slots */
+#define UNIX_SHM_MEMFD_SLOTLOCK UNIX_SHM_MEMFD_HDRSZ             /* Slot locks */
+#define UNIX_SHM_MEMFD_MAXSZ (1 << 30)                           /* Reservation */
+#define UNIX_SHM_MEMFD_HUGESZ (32 << 20)                         /* Same, huge */
+
+/*
+** Pools for the objects created when a connection first uses shared
+** memory.  A unixShmNode is followed by its filename, which fits in a
+** pooled block unless it is unusually long.  apRegion[] arrays of up to
+** SHM_POOL_REGIONS entries, enough for a wal-index of 512KiB, are pooled
+** too.
+*/
+#define SHM_POOL_REGIONS 16
+static VfsPool shmPool = VFSPOOL_INIT("unixShm", sizeof(unixShm));
+static VfsPool shmNodePool = VFSPOOL_INIT("unixShmNode", sizeof(unixShmNode) + MAX_PATHNAME + 8);
+static VfsPool shmRegionPool = VFSPOOL_INIT("unixShmNode.apRegion", SHM_POOL_REGIONS * sizeof(char *));
+
+/*
+** Return true if the process that claimed slot iSlot of the -shm-lock file
+** is still running.  A slot is owned through a POSIX lock on its byte of
+** the file, which the kernel releases if the process dies.  Any error is
+** taken to mean that the owner is alive.
+*/
+static int unixShmSlotLive(unixShmNode *pShmNode, int iSlot)
+{
+  struct flock f;
+  memset(&f, 0, sizeof(f));
+  f.l_type = F_WRLCK;
+  f.l_whence = SEEK_SET;
+  f.l_start = iSlot;
+  f.l_len = 1;
+  if (osFcntl(pShmNode->hLock, F_GETLK, &f)) return 1;
+  return f.l_type != F_UNLCK;
+}
+
+/*
+** Wake the connections, in any process, that are waiting for a lock of
+** pShmNode to be released.
+*/
+static void unixShmAtomicWake(unixShmNode *pShmNode)
+{
+#if HAVE_FUTEX
+  if (__atomic_load_n(&pShmNode->aLock[UNIX_SHM_NWAITER], __ATOMIC_SEQ_CST))
+  {
+    __atomic_fetch_add(&pShmNode->aLock[UNIX_SHM_WAKE], 1, __ATOMIC_SEQ_CST);
+    osFutex(&pShmNode->aLock[UNIX_SHM_WAKE], FUTEX_WAKE, 0x7fffffff, 0);
+  }
+#else
+  UNUSED_PARAMETER(pShmNode);
+#endif
+}
+
+/*
+** The "shm_lock=atomic" version of the lock in unixShmSystemLock().  Lock
+** iLock through iLock+n-1 of the wal-index are set in the slot of this
+** process with an atomic read-modify-write, after which the slots of all
+** other processes are checked for conflicting locks.  Since every process
+** publishes its own lock before looking at the others, two processes can
+** never both succeed; at worst both back off with SQLITE_BUSY.
+**
+** A process that finds a conflicting lock held by a dead process clears
+** the locks of its slot.  The claim count in the word keeps this from
+** touching the slot if a new owner has claimed it in the meantime.  No
+** system call is made unless there is a conflict.
+*/
+static int unixShmAtomicLock(unixShmNode *pShmNode, int lockType, int iLock, int n)
+{
+  u32 *pSlot = UNIX_SHM_SLOT(pShmNode->aLock, pShmNode->iLockSlot);
+  u32 mask = ((1u << n) - 1) << iLock;
+  u32 bits = (lockType == F_RDLCK ? mask : mask << 8);
+  u32 conflict = (lockType == F_RDLCK ? mask << 8 : mask | mask << 8);
+  int nSlot;
+  int i;
+
+  if (lockType == F_UNLCK)
+  {
+    __atomic_fetch_and(pSlot, ~(mask | mask << 8), __ATOMIC_SEQ_CST);
+    unixShmAtomicWake(pShmNode);
+    return SQLITE_OK;
+  }
+  __atomic_fetch_or(pSlot, bits, __ATOMIC_SEQ_CST);
+  nSlot = (int)__atomic_load_n(&pShmNode->aLock[0], __ATOMIC_SEQ_CST);
+  for (i = 0; i < nSlot && i < UNIX_SHM_NSLOT; i++)
+  {
+    u32 *pOther = UNIX_SHM_SLOT(pShmNode->aLock, i);
+    u32 w = __atomic_load_n(pOther, __ATOMIC_SEQ_CST);
+    if (i == pShmNode->iLockSlot || (w & conflict) == 0) continue;
+    if (unixShmSlotLive(pShmNode, i))
+    {
+      /* No wake-up is needed for a waiter that saw these bits: the
+      ** release of the lock that conflicts here will wake it. */
+      __atomic_fetch_and(pSlot, ~bits, __ATOMIC_SEQ_CST);
+      return SQLITE_BUSY;
+    }
+    if (__atomic_compare_exchange_n(pOther, &w, w & 0xffff0000, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+      unixShmAtomicWake(pShmNode);
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Apply posix advisory locks for all bytes from ofst through ofst+n-1.
+** For a wal-index opened with "shm_lock=atomic", the wal.c locks are
+** taken by unixShmAtomicLock() instead; only the DMS lock uses fcntl().
+**
+** Locks block if the mask is exactly UNIX_SHM_C and are non-blocking
+** otherwise.
+*/
+static int unixShmSystemLock(unixFile *pFile, /* Open connection to the WAL file */
+                             int lockType,    /* F_UNLCK, F_RDLCK, or F_WRLCK */
+                             int ofst,        /* First byte of the locking range */
+                             int n            /* Number of bytes to lock */
+                             )
+{
+  unixShmNode *pShmNode; /* Apply locks to this open shared-memory segment */
+  struct flock f;        /* The posix advisory locking structure */
+  int rc = SQLITE_OK;    /* Result code form fcntl() */
+
+  /* Access to the unixShmNode object is serialized by the caller */
+  pShmNode = pFile->pInode->pShmNode;
+  assert(pShmNode->nRef == 0 || mutex_held(pShmNode->mutex));
+
+  /* Shared locks never span more than one byte */
+  assert(n == 1 || lockType != F_RDLCK);
+
+  /* Locks are within range */
+  assert(n >= 1 && n <= SQLITE_SHM_NLOCK);
+
+  if (pShmNode->aLock && ofst < UNIX_SHM_DMS)
+  {
+    rc = unixShmAtomicLock(pShmNode, lockType, ofst - UNIX_SHM_BASE, n);
+  }
+  else if (pShmNode->h >= 0)
+  {
+    /* Initialize the locking parameters */
+    f.l_type = lockType;
+    f.l_whence = SEEK_SET;
+    f.l_start = ofst;
+    f.l_len = n;
+    rc = osSetPosixAdvisoryLock(pShmNode->h, &f, pFile);
+    rc = (rc != (-1)) ? SQLITE_OK : SQLITE_BUSY;
+  }
+
+/* Update the global lock state and do debug tracing */
+#ifdef SQLITE_DEBUG
+  {
+    u16 mask;
+    OSTRACE(("SHM-LOCK "));
+    mask = ofst > 31 ? 0xffff : (1 << (ofst + n)) - (1 << ofst);
+    if (rc == SQLITE_OK)
+    {
+      if (lockType == F_UNLCK)
+      {
+        OSTRACE(("unlock %d ok", ofst));
+        pShmNode->exclMask &= ~mask;
+        pShmNode->sharedMask &= ~mask;
+      }
+      else if (lockType == F_RDLCK)
+      {
+        OSTRACE(("read-lock %d ok", ofst));
+        pShmNode->exclMask &= ~mask;
+        pShmNode->sharedMask |= mask;
+      }
+      else
+      {
+        assert(lockType == F_WRLCK);
+        OSTRACE(("write-lock %d ok", ofst));
+        pShmNode->exclMask |= mask;
+        pShmNode->sharedMask &= ~mask;
+      }
+    }
+    else
+    {
+      if (lockType == F_UNLCK)
+      {
+        OSTRACE(("unlock %d failed", ofst));
+      }
+      else if (lockType == F_RDLCK)
+      {
+        OSTRACE(("read-lock failed"));
+      }
+      else
+      {
+        assert(lockType == F_WRLCK);
+        OSTRACE(("write-lock %d failed", ofst));
+      }
+    }
+    OSTRACE((" - afterwards %03x,%03x\n", pShmNode->sharedMask, pShmNode->exclMask));
+  }
+#endif
+
+  return rc;
+}
+
+/*
+** Return the minimum number of 32KB shm regions that should be mapped at
+** a time, assuming that each mapping must be an integer multiple of the
+** current system page-size.
+**
+** Usually, this is 1. The exception seems to be systems that are configured
+** to use 64KB pages - in this case each mapping must cover at least two
+** shm regions.
+*/
+static int unixShmRegionPerMap(void)
+{
+  int shmsz = 32 * 1024;            /* SHM region size */
+  int pgsz = osGetpagesize();       /* System page size */
+  assert(((pgsz - 1) & pgsz) == 0); /* Page size must be a power of 2 */
+  if (pgsz < shmsz) return 1;
+  return pgsz / shmsz;
+}
+
+/*
+** Purge the unixShmNodeList list of all entries with unixShmNode.nRef==0.
+**
+** This is not a VFS shared-memory method; it is a utility function called
+** by VFS shared-memory methods.
+*/
+static void unixShmPurge(unixFile *pFd)
+{
+  unixShmNode *p = pFd->pInode->pShmNode;
+  assert(unixInodeMutexHeld(pFd->pInode));
+  if (p && ALWAYS(p->nRef == 0))
+  {
+    int nShmPerMap = unixShmRegionPerMap();
+    int i;
+    assert(p->pInode == pFd->pInode);
+    mutex_free(p->mutex);
+    for (i = 0; i < p->nRegion && p->pMem == 0; i += nShmPerMap)
+    {
+      if (p->h >= 0)
+      {
+        osMunmap(p->apRegion[i], p->szRegion);
+      }
+      else
+      {
+        sqlite3_free(p->apRegion[i]);
+      }
+    }
+    vfspool_free(p->apRegion);
+    if (p->pMem) osMunmap(p->pMem, p->szMem);
+    if (p->hMem >= 0)
+    {
+      robust_close(pFd, p->hMem, __LINE__);
+      p->hMem = -1;
+    }
+    if (p->aMemHdr) osMunmap(p->aMemHdr, UNIX_SHM_MEMFD_HDRSZ);
+    if (p->aLock)
+    {
+      __atomic_fetch_and(UNIX_SHM_SLOT(p->aLock, p->iLockSlot), 0xffff0000, __ATOMIC_SEQ_CST);
+      osMunmap(p->aLock, UNIX_SHM_LOCKSZ);
+    }
+    if (p->hLock >= 0)
+    {
+      robust_close(pFd, p->hLock, __LINE__);
+      p->hLock = -1;
+    }
+    if (p->h >= 0)
+    {
+      robust_close(pFd, p->h, __LINE__);
+      p->h = -1;
+    }
+    p->pInode->pShmNode = 0;
+    vfspool_free(p);
+  }
+}
+
+/*
+** Map the header page of the -shm file of a "shm_memfd" wal-index.
+*/
+static int unixShmMemfdHeader(unixShmNode *pShmNode)
+{
+  void *pHdr = osMmap(0, UNIX_SHM_MEMFD_HDRSZ, PROT_READ | PROT_WRITE, MAP_SHARED, pShmNode->h, 0);
+  if (pHdr == MAP_FAILED)
+  {
+    return unixLogError(SQLITE_IOERR_SHMMAP, "mmap", pShmNode->zFilename);
+  }
+  pShmNode->aMemHdr = (u32 *)pHdr;
+  return SQLITE_OK;
+}
+
+/*
+** Map all szMem bytes of memfd hMem and publish it in a free slot of the
+** -shm header, so that other processes can open it.  On success pShmNode
+** takes ownership of hMem.  Return SQLITE_BUSY if all slots are taken.
+*/
+static int unixShmMemfdAttach(unixShmNode *pShmNode, int hMem, u32 szMem)
+{
+  struct flock f;
+  u32 *pSlot;
+  void *pMem;
+  int i;
+
+  pMem = osMmap(0, szMem, PROT_READ | PROT_WRITE, MAP_SHARED, hMem, 0);
+  if (pMem == MAP_FAILED)
+  {
+    return unixLogError(SQLITE_IOERR_SHMMAP, "mmap", pShmNode->zFilename);
+  }
+#ifdef MADV_HUGEPAGE
+  /* Transparent huge pages, where the system allows them for shmem */
+  osMadvise(pMem, szMem, MADV_HUGEPAGE);
+#endif
+
+  memset(&f, 0, sizeof(f));
+  f.l_type = F_WRLCK;
+  f.l_whence = SEEK_SET;
+  f.l_len = 1;
+  for (i = 0; i < UNIX_SHM_MEMFD_NSLOT; i++)
+  {
+    f.l_start = UNIX_SHM_MEMFD_SLOTLOCK + i;
+    if (osFcntl(pShmNode->h, F_SETLK, &f) == 0) break;
+  }
+  if (i == UNIX_SHM_MEMFD_NSLOT)
+  {
+    osMunmap(pMem, szMem);
+    return SQLITE_BUSY;
+  }
+  pSlot = UNIX_SHM_MEMFD_SLOT(pShmNode->aMemHdr, i);
+  __atomic_store_n(&pSlot[0], (u32)osGetpid(0), __ATOMIC_SEQ_CST);
+  __atomic_store_n(&pSlot[1], (u32)hMem, __ATOMIC_SEQ_CST);
+
+  pShmNode->hMem = hMem;
+  pShmNode->pMem = (char *)pMem;
+  pShmNode->szMem = szMem;
+  return SQLITE_OK;
+}
+
+#if HAVE_MEMFD_CREATE
+/*
+** Create the memfd of a "shm_memfd" wal-index.  Called by the first process
+** to open the wal-index, with the DMS lock held exclusively and the -shm
+** file just truncated.
+**
+** The memfd is sized and mapped once for the largest wal-index allowed, so
+** it never needs to be remapped.  Pages of it are only allocated when they
+** are first written.  With "shm_memfd=huge" the memfd is backed by
+** MFD_HUGETLB pages, which are reserved up front so that a shortage cannot
+** raise SIGBUS later.  If too few huge pages are available, ordinary pages
+** are used instead.
+*/
+static int unixShmMemfdCreate(unixShmNode *pShmNode)
+{
+  struct stat sStat;
+  u32 *aHdr;
+  int hMem = -1;
+  int rc;
+
+  if (robust_ftruncate(pShmNode->h, UNIX_SHM_MEMFD_HDRSZ))
+  {
+    return unixLogError(SQLITE_IOERR_SHMOPEN, "ftruncate", pShmNode->zFilename);
+  }
+  rc = unixShmMemfdHeader(pShmNode);
+  if (rc != SQLITE_OK) return rc;
+
+  rc = SQLITE_CANTOPEN;
+#ifdef MFD_HUGETLB
+  if (pShmNode->eMemfd == UNIX_SHM_MEMFD_HUGE)
+  {
+    hMem = osMemfdCreate("sqlite-shm", MFD_CLOEXEC | MFD_HUGETLB);
+    if (hMem >= 0)
+    {
+      if (robust_ftruncate(hMem, UNIX_SHM_MEMFD_HUGESZ) == 0)
+      {
+        rc = unixShmMemfdAttach(pShmNode, hMem, UNIX_SHM_MEMFD_HUGESZ);
+      }
+      if (rc != SQLITE_OK)
+      {
+        robust_close(0, hMem, __LINE__);
+        hMem = -1;
+      }
+    }
+  }
+#endif
+  if (hMem < 0)
+  {
+    hMem = osMemfdCreate("sqlite-shm", MFD_CLOEXEC);
+    if (hMem < 0)
+    {
+      return unixLogError(SQLITE_CANTOPEN, "memfd_create", pShmNode->zFilename);
+    }
+    if (robust_ftruncate(hMem, UNIX_SHM_MEMFD_MAXSZ))
+    {
+      rc = unixLogError(SQLITE_IOERR_SHMSIZE, "ftruncate", pShmNode->zFilename);
+    }
+    else
+    {
+      rc = unixShmMemfdAttach(pShmNode, hMem, UNIX_SHM_MEMFD_MAXSZ);
+    }
+    if (rc != SQLITE_OK)
+    {
+      robust_close(0, hMem, __LINE__);
+      return rc;
+    }
+  }
+
+  if (osFstat(hMem, &sStat)) return SQLITE_IOERR_FSTAT;
+  aHdr = pShmNode->aMemHdr;
+  aHdr[UNIX_SHM_MEMFD_SIZE] = pShmNode->szMem;
+  aHdr[UNIX_SHM_MEMFD_NALLOC] = 0;
+  aHdr[UNIX_SHM_MEMFD_INO] = (u32)sStat.st_ino;
+  aHdr[UNIX_SHM_MEMFD_INO + 1] = (u32)((u64)sStat.st_ino >> 32);
+  __atomic_store_n(&aHdr[0], UNIX_SHM_MEMFD_MAGIC, __ATOMIC_SEQ_CST);
+  return SQLITE_OK;
+}
+#endif /* HAVE_MEMFD_CREATE */
+
+/*
+** Open the memfd of a "shm_memfd" wal-index that another process created.
+** The DMS lock is held, so that process, or another that has since opened
+** the memfd, still has it open.  It is opened through /proc/<pid>/fd/<fd>
+** of any such process.  The inode number is checked in case the slot is
+** stale and the descriptor has been reused.
+*/
+static int unixShmMemfdJoin(unixShmNode *pShmNode)
+{
+  struct stat sStat;
+  struct flock f;
+  u32 *aHdr;
+  u64 iIno;
+  int hMem = -1;
+  int rc;
+  int i;
+
+  if (osFstat(pShmNode->h, &sStat)) return SQLITE_IOERR_FSTAT;
+  if (sStat.st_size < UNIX_SHM_MEMFD_HDRSZ) goto not_memfd;
+  rc = unixShmMemfdHeader(pShmNode);
+  if (rc != SQLITE_OK) return rc;
+  aHdr = pShmNode->aMemHdr;
+  if (__atomic_load_n(&aHdr[0], __ATOMIC_SEQ_CST) != UNIX_SHM_MEMFD_MAGIC) goto not_memfd;
+  iIno = aHdr[UNIX_SHM_MEMFD_INO] | ((u64)aHdr[UNIX_SHM_MEMFD_INO + 1] << 32);
+
+  memset(&f, 0, sizeof(f));
+  for (i = 0; i < UNIX_SHM_MEMFD_NSLOT && hMem < 0; i++)
+  {
+    u32 *pSlot = UNIX_SHM_MEMFD_SLOT(aHdr, i);
+    char zPath[64];
+    f.l_type = F_WRLCK;
+    f.l_whence = SEEK_SET;
+    f.l_start = UNIX_SHM_MEMFD_SLOTLOCK + i;
+    f.l_len = 1;
+    if (osFcntl(pShmNode->h, F_GETLK, &f) || f.l_type == F_UNLCK) continue;
+    if ((u32)f.l_pid != __atomic_load_n(&pSlot[0], __ATOMIC_SEQ_CST)) continue;
+    sqlite3_snprintf(sizeof(zPath), zPath, "/proc/%d/fd/%d", (int)f.l_pid,
+                     (int)__atomic_load_n(&pSlot[1], __ATOMIC_SEQ_CST));
+    hMem = robust_open(zPath, O_RDWR, 0);
+    if (hMem >= 0 && (osFstat(hMem, &sStat) || (u64)sStat.st_ino != iIno))
+    {
+      robust_close(0, hMem, __LINE__);
+      hMem = -1;
+    }
+  }
+  if (hMem < 0)
+  {
+    return unixLogError(SQLITE_CANTOPEN, "open", pShmNode->zFilename);
+  }
+  rc = unixShmMemfdAttach(pShmNode, hMem, aHdr[UNIX_SHM_MEMFD_SIZE]);
+  if (rc != SQLITE_OK) robust_close(0, hMem, __LINE__);
+  return rc;
+
+not_memfd:
+  /* The processes that have the database open do not use "shm_memfd" */
+  sqlite3_log(SQLITE_CANTOPEN, "%s is not a shm_memfd wal-index", pShmNode->zFilename);
+  return SQLITE_CANTOPEN;
+}
+
+/*
+** The DMS lock has not yet been taken on shm file pShmNode. Attempt to
+** take it now. Return SQLITE_OK if successful, or an SQLite error
+** code otherwise.
+**
+** If the DMS cannot be locked because this is a readonly_shm=1
+** connection and no other process already holds a lock, return
+** SQLITE_READONLY_CANTINIT and set pShmNode->isUnlocked=1.
+*/
+static int unixLockSharedMemory(unixFile *pDbFd, unixShmNode *pShmNode)
+{
+  struct flock lock;
+  int rc = SQLITE_OK;
+
+  /* Use F_GETLK to determine the locks other processes are holding
+  ** on the DMS byte. If it indicates that another process is holding
+  ** a SHARED lock, then this process may also take a SHARED lock
+  ** and proceed with opening the *-shm file.
+  **
+  ** Or, if no other process is holding any lock, then this process
+  ** is the first to open it. In this case take an EXCLUSIVE lock on the
+  ** DMS byte and truncate the *-shm file to zero bytes in size. Then
+  ** downgrade to a SHARED lock on the DMS byte.
+  **
+  ** If another process is holding an EXCLUSIVE lock on the DMS byte,
+  ** return SQLITE_BUSY to the caller (it will try again). An earlier
+  ** version of this code attempted the SHARED lock at this point. But
+  ** this introduced a subtle race condition: if the process holding
+  ** EXCLUSIVE failed just before truncating the *-shm file, then this
+  ** process might open and use the *-shm file without truncating it.
+  ** And if the *-shm file has been corrupted by a power failure or
+  ** system crash, the database itself may also become corrupt.  */
+  lock.l_whence = SEEK_SET;
+  lock.l_start = UNIX_SHM_DMS;
+  lock.l_len = 1;
+  lock.l_type = F_WRLCK;
+  if (osFcntl(pShmNode->h, F_GETLK, &lock) != 0)
+  {
+    rc = SQLITE_IOERR_LOCK;
+  }
+  else if (lock.l_type == F_UNLCK)
+  {
+    if (pShmNode->isReadonly)
+    {
+      pShmNode->isUnlocked = 1;
+      rc = SQLITE_READONLY_CANTINIT;
+    }
+    else
+    {
+      rc = unixShmSystemLock(pDbFd, F_WRLCK, UNIX_SHM_DMS, 1);
+      if (rc == SQLITE_OK && robust_ftruncate(pShmNode->h, 0))
+      {
+        rc = unixLogError(SQLITE_IOERR_SHMOPEN, "ftruncate", pShmNode->zFilename);
+      }
+      /* Slots left by processes that are gone are cleared too */
+      if (rc == SQLITE_OK && pShmNode->hLock >= 0 && robust_ftruncate(pShmNode->hLock, 0))
+      {
+        rc = unixLogError(SQLITE_IOERR_SHMOPEN, "ftruncate", pShmNode->zFilename);
+      }
+#if HAVE_MEMFD_CREATE
+      if (rc == SQLITE_OK && pShmNode->eMemfd) rc = unixShmMemfdCreate(pShmNode);
+#endif
+    }
+  }
+  else if (lock.l_type == F_WRLCK)
+  {
+    rc = SQLITE_BUSY;
+  }
+
+  if (rc == SQLITE_OK)
+  {
+    assert(lock.l_type == F_UNLCK || lock.l_type == F_RDLCK);
+    rc = unixShmSystemLock(pDbFd, F_RDLCK, UNIX_SHM_DMS, 1);
+  }
+  return rc;
+}
+
+/*
+** Map the -shm-lock file of pShmNode and claim a slot in it for this
+** process.  The DMS lock is held, so no other process is reinitializing
+** the file.  Return SQLITE_BUSY if all slots are taken.
+*/
+static int unixShmAtomicOpen(unixShmNode *pShmNode)
+{
+  struct stat sStat;
+  struct flock f;
+  u32 *aLock;
+  u32 *pSlot;
+  u32 nSlot;
+  int i;
+
+  if (osFstat(pShmNode->hLock, &sStat)) return SQLITE_IOERR_SHMSIZE;
+  if (sStat.st_size < UNIX_SHM_LOCKSZ && robust_ftruncate(pShmNode->hLock, UNIX_SHM_LOCKSZ))
+  {
+    return unixLogError(SQLITE_IOERR_SHMSIZE, "ftruncate", pShmNode->zFilename);
+  }
+  aLock = (u32 *)osMmap(0, UNIX_SHM_LOCKSZ, PROT_READ | PROT_WRITE, MAP_SHARED, pShmNode->hLock, 0);
+  if (aLock == MAP_FAILED)
+  {
+    return unixLogError(SQLITE_IOERR_SHMMAP, "mmap", pShmNode->zFilename);
+  }
+
+  memset(&f, 0, sizeof(f));
+  f.l_type = F_WRLCK;
+  f.l_whence = SEEK_SET;
+  f.l_len = 1;
+  for (i = 0; i < UNIX_SHM_NSLOT; i++)
+  {
+    f.l_start = i;
+    if (osFcntl(pShmNode->hLock, F_SETLK, &f) == 0) break;
+  }
+  if (i == UNIX_SHM_NSLOT)
+  {
+    osMunmap(aLock, UNIX_SHM_LOCKSZ);
+    return SQLITE_BUSY;
+  }
+
+  /* Clear whatever a dead previous owner left in the slot */
+  pSlot = UNIX_SHM_SLOT(aLock, i);
+  __atomic_store_n(pSlot, (__atomic_load_n(pSlot, __ATOMIC_SEQ_CST) & 0xffff0000) + 0x10000, __ATOMIC_SEQ_CST);
+  nSlot = __atomic_load_n(&aLock[0], __ATOMIC_SEQ_CST);
+  while (nSlot < (u32)i + 1 &&
+         !__atomic_compare_exchange_n(&aLock[0], &nSlot, (u32)i + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+  {
+  }
+  pShmNode->aLock = aLock;
+  pShmNode->iLockSlot = i;
+  return SQLITE_OK;
+}
+
+/*
+** Open a shared-memory area associated with open database file pDbFd.
+** This particular implementation uses mmapped files.
+**
+** The file used to implement shared-memory is in the same directory
+** as the open database file and has the same name as the open database
+** file with the "-shm" suffix added.  For example, if the database file
+** is "/home/user1/config.db" then the file that is created and mmapped
+** for shared memory will be called "/home/user1/config.db-shm".
+**
+** Another approach to is to use files in /dev/shm or /dev/tmp or an
+** some other tmpfs mount. But if a file in a different directory
+** from the database file is used, then differing access permissions
+** or a chroot() might cause two different processes on the same
+** database to end up using different files for shared memory -
+** meaning that their memory would not really be shared - resulting
+** in database corruption.  Nevertheless, this tmpfs file usage
+** can be enabled at compile-time using -DSQLITE_SHM_DIRECTORY="/dev/shm"
+** or the equivalent.  The use of the SQLITE_SHM_DIRECTORY compile-time
+** option results in an incompatible build of SQLite;  builds of SQLite
+** that with differing SQLITE_SHM_DIRECTORY settings attempt to use the
+** same database file at the same time, database corruption will likely
+** result. The SQLITE_SHM_DIRECTORY compile-time option is considered
+** "unsupported" and may go away in a future SQLite release.
+**
+** When opening a new shared-memory file, if no other instances of that
+** file are currently open, in this process or in other processes, then
+** the file must be truncated to zero length or have its header cleared.
+**
+** If the original database file (pDbFd) is using the "unix-excl" VFS
+** that means that an exclusive lock is held on the database file and
+** that no other processes are able to read or write the database.  In
+** that case, we do not really need shared memory.  No shared memory
+** file is created.  The shared memory will be simulated with heap memory.
+**
+** With the "shm_lock=atomic" URI parameter, the wal.c locks are words in
+** a second mapped file named after the -shm file with "-lock" appended.
+** Only the DMS lock is left to fcntl().  Every process that opens the
+** database must then use "shm_lock=atomic", as processes using fcntl()
+** locks would not see the atomic ones.
+**
+** With "shm_memfd=1" the wal-index is kept in a memfd instead of the -shm
+** file, so that it is never written back to the filesystem, and is mapped
+** in one piece, never remapped as it grows.  "shm_memfd=huge" asks for the
+** memfd to use huge pages.  The -shm file still holds the fcntl() locks and
+** says how to find the memfd.  Every process that opens the database must
+** then use "shm_memfd", and be allowed to open the memfd of the others
+** through /proc, which normally means running as the same user.
+*/
+static int unixOpenSharedMemory(unixFile *pDbFd)
+{
+  struct unixShm *p = 0;        /* The connection to be opened */
+  struct unixShmNode *pShmNode; /* The underlying mmapped file */
+  int rc = SQLITE_OK;           /* Result code */
+  unixInodeInfo *pInode;        /* The inode of fd */
+  char *zShm;                   /* Name of the file used for SHM */
+  char *zRedirect = 0;          /* SHM name when "shm_dir" is in effect */
+  const char *zLockFile;        /* Name of the "shm_lock=atomic" file */
+  const char *zMemfd;           /* Value of the "shm_memfd" parameter */
+  int nShmFilename;             /* Size of the SHM filename in bytes */
+
+  /* Allocate space for the new unixShm object. */
+  p = (unixShm *)vfspool_alloc(&shmPool, sizeof(*p));
+  if (p == 0) return SQLITE_NOMEM;
+  memset(p, 0, sizeof(*p));
+  assert(pDbFd->pShm == 0);
+
+  /* Check to see if a unixShmNode object already exists. Reuse an existing
+  ** one if present. Create a new one if necessary.
+  */
+  pInode = pDbFd->pInode;
+  unixEnterInodeMutex(pInode);
+  pShmNode = pInode->pShmNode;
+  if (pShmNode == 0)
+  {
+    struct stat sStat; /* fstat() info for database file */
+#ifndef SQLITE_SHM_DIRECTORY
+    const char *zBasePath = pDbFd->zPath;
+#endif
+
+    /* Call fstat() to figure out the permissions on the database file. If
+    ** a new *-shm file is created, an attempt will be made to create it
+    ** with the same permissions.
+    */
+    if (osFstat(pDbFd->h, &sStat))
+    {
+      rc = SQLITE_IOERR_FSTAT;
+      goto shm_open_err;
+    }
+
+    /* A "shm_dir" setting on the inode moves the -shm file to another
+    ** directory, typically a tmpfs mount. */
+    if (pInode->zShmDir)
+    {
+      zRedirect = unixRedirectName(pInode->zShmDir, pInode->zRedirect, "shm");
+      if (zRedirect == 0)
+      {
+        rc = SQLITE_NOMEM;
+        goto shm_open_err;
+      }
+      nShmFilename = 1 + (int)strlen(zRedirect);
+    }
+    else
+    {
+#ifdef SQLITE_SHM_DIRECTORY
+      nShmFilename = sizeof(SQLITE_SHM_DIRECTORY) + 31;
+#else
+      nShmFilename = 6 + (int)strlen(zBasePath);
+#endif
+    }
+    pShmNode = (unixShmNode *)vfspool_alloc(&shmNodePool, sizeof(*pShmNode) + nShmFilename);
+    if (pShmNode == 0)
+    {
+      rc = SQLITE_NOMEM;
+      goto shm_open_err;
+    }
+    memset(pShmNode, 0, sizeof(*pShmNode) + nShmFilename);
+    zShm = pShmNode->zFilename = (char *)&pShmNode[1];
+    if (zRedirect)
+    {
+      memcpy(zShm, zRedirect, nShmFilename);
+      sqlite3_free(zRedirect);
+      zRedirect = 0;
+    }
+    else
+    {
+#ifdef SQLITE_SHM_DIRECTORY
+      sqlite3_snprintf(nShmFilename, zShm, SQLITE_SHM_DIRECTORY "/sqlite-shm-%x-%x", (u32)sStat.st_ino,
+                       (u32)sStat.st_dev);
+#else
+      sqlite3_snprintf(nShmFilename, zShm, "%s-shm", zBasePath);
+      sqlite3FileSuffix3(pDbFd->zPath, zShm);
+#endif
+    }
+    pShmNode->h = -1;
+    pShmNode->hLock = -1;
+    pShmNode->hMem = -1;
+    pDbFd->pInode->pShmNode = pShmNode;
+    pShmNode->pInode = pDbFd->pInode;
+    if (sqlite3GlobalConfig_bCoreMutex)
+    {
+      pShmNode->mutex = mutex_alloc(SQLITE_MUTEX_FAST);
+      if (pShmNode->mutex == 0)
+      {
+        rc = SQLITE_NOMEM;
+        goto shm_open_err;
+      }
+    }
+
+    if (pInode->bProcessLock == 0)
+    {
+      if (0 == sqlite3_uri_boolean(pDbFd->zPath, "readonly_shm", 0))
+      {
+        pShmNode->h = robust_open(zShm, O_RDWR | O_CREAT, (sStat.st_mode & 0777));
+      }
+      if (pShmNode->h < 0)
+      {
+        pShmNode->h = robust_open(zShm, O_RDONLY, (sStat.st_mode & 0777));
+        if (pShmNode->h < 0)
+        {
+          rc = unixLogError(SQLITE_CANTOPEN, "open", zShm);
+          goto shm_open_err;
+        }
+        pShmNode->isReadonly = 1;
+      }
+
+      /* If this process is running as root, make sure that the SHM file
+      ** is owned by the same user that owns the original database.  Otherwise,
+      ** the original owner will not be able to connect.
+      */
+      robustFchown(pShmNode->h, sStat.st_uid, sStat.st_gid);
+      if (pDbFd->ctrlFlags & UNIXFILE_IOHINTS) unixWriteHint(pShmNode->h, UNIX_WRITE_LIFE_SHORT);
+
+      zLockFile = sqlite3_uri_parameter(pDbFd->zPath, "shm_lock");
+      if (zLockFile && strcmp(zLockFile, "atomic") == 0)
+      {
+        zLockFile = sqlite3_mprintf("%s-lock", zShm);
+        if (zLockFile == 0)
+        {
+          rc = SQLITE_NOMEM;
+          goto shm_open_err;
+        }
+        /* The slots must be written even to take read locks */
+        if (pShmNode->isReadonly == 0)
+        {
+          pShmNode->hLock = robust_open(zLockFile, O_RDWR | O_CREAT, (sStat.st_mode & 0777));
+        }
+        if (pShmNode->hLock < 0)
+        {
+          rc = unixLogError(SQLITE_CANTOPEN, "open", zLockFile);
+          sqlite3_free((char *)zLockFile);
+          goto shm_open_err;
+        }
+        robustFchown(pShmNode->hLock, sStat.st_uid, sStat.st_gid);
+        sqlite3_free((char *)zLockFile);
+      }
+
+      zMemfd = sqlite3_uri_parameter(pDbFd->zPath, "shm_memfd");
+      if (zMemfd && strcmp(zMemfd, "huge") == 0)
+      {
+        pShmNode->eMemfd = UNIX_SHM_MEMFD_HUGE;
+      }
+      else if (sqlite3_uri_boolean(pDbFd->zPath, "shm_memfd", 0))
+      {
+        pShmNode->eMemfd = UNIX_SHM_MEMFD;
+      }
+      if (pShmNode->eMemfd && (pShmNode->isReadonly || !HAVE_MEMFD_CREATE))
+      {
+        sqlite3_log(SQLITE_CANTOPEN, "shm_memfd not available for %s", zShm);
+        rc = SQLITE_CANTOPEN;
+        goto shm_open_err;
+      }
+
+      rc = unixLockSharedMemory(pDbFd, pShmNode);
+      if (rc == SQLITE_OK && pShmNode->hLock >= 0) rc = unixShmAtomicOpen(pShmNode);
+      if (rc == SQLITE_OK && pShmNode->eMemfd && pShmNode->pMem == 0) rc = unixShmMemfdJoin(pShmNode);
+      if (rc != SQLITE_OK && rc != SQLITE_READONLY_CANTINIT) goto shm_open_err;
+    }
+  }
+
+  /* Make the new connection a child of the unixShmNode */
+  p->pShmNode = pShmNode;
+#ifdef SQLITE_DEBUG
+  p->id = pShmNode->nextShmId++;
+#endif
+  pShmNode->nRef++;
+  pDbFd->pShm = p;
+  unixLeaveInodeMutex(pInode);
+
+  /* The reference count on pShmNode has already been incremented under
+  ** the cover of the unixEnterInodeMutex() mutex and the pointer from the
+  ** new (struct unixShm) object to the pShmNode has been set. All that is
+  ** left to do is to link the new object into the linked list starting
+  ** at pShmNode->pFirst. This must be done while holding the pShmNode->mutex
+  ** mutex.
+  */
+  mutex_enter(pShmNode->mutex);
+  p->pNext = pShmNode->pFirst;
+  pShmNode->pFirst = p;
+  mutex_leave(pShmNode->mutex);
+  return rc;
+
+/* Jump here on any error */
+shm_open_err:
+  unixShmPurge(pDbFd); /* This call frees pShmNode if required */
+  sqlite3_free(zRedirect);
+  vfspool_free(p);
+  unixLeaveInodeMutex(pInode);
+  return rc;
+}
+
+/*
+** This function is called to obtain a pointer to region iRegion of the
+** shared-memory associated with the database file fd. Shared-memory regions
+** are numbered starting from zero. Each shared-memory region is szRegion
+** bytes in size.
+**
+** If an error occurs, an error code is returned and *pp is set to NULL.
+**
+** Otherwise, if the bExtend parameter is 0 and the requested shared-memory
+** region has not been allocated (by any client, including one running in a
+** separate process), then *pp is set to NULL and SQLITE_OK returned. If
+** bExtend is non-zero and the requested shared-memory region has not yet
+** been allocated, it is allocated by this function.
+**
+** If the shared-memory region has already been allocated or is allocated by
+** this call as described above, then it is mapped into this processes
+** address space (if it is not already), *pp is set to point to the mapped
+** memory and SQLITE_OK returned.
+*/
+static int unixShmMap(sqlite3_file *fd,  /* Handle open on database file */
+                      int iRegion,       /* Region to retrieve */
+                      int szRegion,      /* Size of regions */
+                      int bExtend,       /* True to extend file if necessary */
+                      void volatile **pp /* OUT: Mapped memory */
+                      )
+{
+  unixFile *pDbFd = (unixFile *)fd;
+  unixShm *p;
+  unixShmNode *pShmNode;
+  int rc = SQLITE_OK;
+  int nShmPerMap = unixShmRegionPerMap();
+  int nReqRegion;
+
+  vfsstatAdd(pDbFd->pStat, VFSSTAT_SHM_MAP, 1);
+
+  /* If the shared-memory file has not yet been opened, open it now. */
+  if (pDbFd->pShm == 0)
+  {
+    rc = unixOpenSharedMemory(pDbFd);
+    if (rc != SQLITE_OK) return rc;
+  }
+
+  p = pDbFd->pShm;
+  pShmNode = p->pShmNode;
+  mutex_enter(pShmNode->mutex);
+  if (pShmNode->isUnlocked)
+  {
+    rc = unixLockSharedMemory(pDbFd, pShmNode);
+    if (rc != SQLITE_OK) goto shmpage_out;
+    pShmNode->isUnlocked = 0;
+  }
+  assert(szRegion == pShmNode->szRegion || pShmNode->nRegion == 0);
+  assert(pShmNode->pInode == pDbFd->pInode);
+  assert(pShmNode->h >= 0 || pDbFd->pInode->bProcessLock == 1);
+  assert(pShmNode->h < 0 || pDbFd->pInode->bProcessLock == 0);
+
+  /* Minimum number of regions required to be mapped. */
+  nReqRegion = ((iRegion + nShmPerMap) / nShmPerMap) * nShmPerMap;
+
+  if (pShmNode->nRegion < nReqRegion)
+  {
+    char **apNew;                      /* New apRegion[] array */
+    int nByte = nReqRegion * szRegion; /* Minimum required file size */
+    struct stat sStat;                 /* Used by fstat() */
+
+    pShmNode->szRegion = szRegion;
+
+    if (pShmNode->pMem)
+    {
+      /* A "shm_memfd" wal-index is already mapped in full.  Only the count
+      ** of bytes in use, shared through the -shm header, needs to grow. */
+      u32 *pAlloc = &pShmNode->aMemHdr[UNIX_SHM_MEMFD_NALLOC];
+      u32 nAlloc = __atomic_load_n(pAlloc, __ATOMIC_SEQ_CST);
+      if (nAlloc < (u32)nByte)
+      {
+        if (!bExtend) goto shmpage_out;
+        if ((u32)nByte > pShmNode->szMem)
+        {
+          rc = SQLITE_IOERR_SHMSIZE;
+          goto shmpage_out;
+        }
+        while (nAlloc < (u32)nByte &&
+               !__atomic_compare_exchange_n(pAlloc, &nAlloc, (u32)nByte, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+        }
+      }
+    }
+    else if (pShmNode->h >= 0)
+    {
+      /* The requested region is not mapped into this processes address space.
+      ** Check to see if it has been allocated (i.e. if the wal-index file is
+      ** large enough to contain the requested region).
+      */
+      if (osFstat(pShmNode->h, &sStat))
+      {
+        rc = SQLITE_IOERR_SHMSIZE;
+        goto shmpage_out;
+      }
+
+      if (sStat.st_size < nByte)
+      {
+        /* The requested memory region does not exist. If bExtend is set to
+        ** false, exit early. *pp will be set to NULL and SQLITE_OK returned.
+        */
+        if (!bExtend)
+        {
+          goto shmpage_out;
+        }
+
+        /* Alternatively, if bExtend is true, extend the file. Do this by
+        ** writing a single byte to the end of each (OS) page being
+        ** allocated or extended. Technically, we need only write to the
+        ** last page in order to extend the file. But writing to all new
+        ** pages forces the OS to allocate them immediately, which reduces
+        ** the chances of SIGBUS while accessing the mapped region later on.
+        */
+        else
+        {
+          static const int pgsz = 4096;
+          int iPg;
+
+          /* Write to the last byte of each newly allocated or extended page */
+          assert((nByte % pgsz) == 0);
+          for (iPg = (sStat.st_size / pgsz); iPg < (nByte / pgsz); iPg++)
+          {
+            int x = 0;
+            if (seekAndWriteFd(pShmNode->h, iPg * pgsz + pgsz - 1, "", 1, &x) != 1)
+            {
+              const char *zFile = pShmNode->zFilename;
+              rc = unixLogError(SQLITE_IOERR_SHMSIZE, "write", zFile);
+              goto shmpage_out;
+            }
+          }
+        }
+      }
+    }
+
+    /* Map the requested memory region into this processes address space. */
+    apNew = (char **)vfspool_realloc(&shmRegionPool, pShmNode->apRegion, nReqRegion * sizeof(char *));
+    if (!apNew)
+    {
+      rc = SQLITE_IOERR_NOMEM;
+      goto shmpage_out;
+    }
+    pShmNode->apRegion = apNew;
+    while (pShmNode->nRegion < nReqRegion)
+    {
+      int nMap = szRegion * nShmPerMap;
+      int i;
+      void *pMem;
+      if (pShmNode->pMem)
+      {
+        pMem = &pShmNode->pMem[szRegion * (i64)pShmNode->nRegion];
+      }
+      else if (pShmNode->h >= 0)
+      {
+        pMem = osMmap(0, nMap, pShmNode->isReadonly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, pShmNode->h,
+                      szRegion * (i64)pShmNode->nRegion);
+        if (pMem == MAP_FAILED)
+        {
+          rc = unixLogError(SQLITE_IOERR_SHMMAP, "mmap", pShmNode->zFilename);
+          goto shmpage_out;
+        }
+      }
+      else
+      {
+        pMem = sqlite3_malloc64(szRegion);
+        if (pMem == 0)
+        {
+          rc = SQLITE_NOMEM;
+          goto shmpage_out;
+        }
+        memset(pMem, 0, szRegion);
+      }
+
+      for (i = 0; i < nShmPerMap; i++)
+      {
+        pShmNode->apRegion[pShmNode->nRegion + i] = &((char *)pMem)[szRegion * i];
+      }
+      pShmNode->nRegion += nShmPerMap;
+    }
+  }
+
+shmpage_out:
+  if (pShmNode->nRegion > iRegion)
+  {
+    *pp = pShmNode->apRegion[iRegion];
+  }
+  else
+  {
+    *pp = 0;
+  }
+  if (pShmNode->isReadonly && rc == SQLITE_OK) rc = SQLITE_READONLY;
+  mutex_leave(pShmNode->mutex);
+  return rc;
+}
+
+/*
+** Offsets of the wal.c locks that this file needs to know about.
+*/
+#define WAL_WRITE_LOCK 0
+#define WAL_CKPT_LOCK 1
+#define WAL_READ_LOCK0 3
+
+/*
+** Return true if connection p may wait up to pDbFd->iBusyTimeout for the
+** lock that unixShmLock() just failed to take.  Waits are only possible
+** for "shm_lock=atomic" wal-indexes, and only when they cannot be part of
+** a deadlock: a shared lock requested by a connection that holds no other
+** lock, or the write or checkpoint lock.  The holder of an exclusive lock
+** never waits, so no cycle of waiters can form.
+**
+** Other exclusive requests, such as those on the READ(i) slots that
+** walTryBeginRead() makes, are probes that SQLite expects to fail while
+** the slot is in use, and fail at once.
+*/
+static int unixShmCanWait(unixFile *pDbFd, unixShm *p, int ofst, int n, int flags)
+{
+#if HAVE_FUTEX
+  if (pDbFd->iBusyTimeout == 0 || p->pShmNode->aLock == 0 || (flags & SQLITE_SHM_LOCK) == 0) return 0;
+  if (p->exclMask) return 0;
+  if (flags & SQLITE_SHM_SHARED) return p->sharedMask == 0;
+  return n == 1 && (ofst == WAL_WRITE_LOCK || ofst == WAL_CKPT_LOCK);
+#else
+  UNUSED_PARAMETER(pDbFd);
+  UNUSED_PARAMETER(p);
+  UNUSED_PARAMETER(ofst);
+  UNUSED_PARAMETER(n);
+  UNUSED_PARAMETER(flags);
+  return 0;
+#endif
+}
+
+/*
+** Sleep until a lock of pShmNode is released, or until iDeadline, and
+** return 0.  iWake is the value of the futex word read before the failed
+** attempt; if it has changed since, return at once.  Return non-zero if
+** the deadline has already passed.
+*/
+static int unixShmAtomicWait(unixShmNode *pShmNode, u32 iWake, i64 iDeadline)
+{
+#if HAVE_FUTEX
+  i64 ms = iDeadline - unixMonotonicMs();
+  struct timespec ts;
+  if (ms <= 0) return 1;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  osFutex(&pShmNode->aLock[UNIX_SHM_WAKE], FUTEX_WAIT, iWake, &ts);
+  return 0;
+#else
+  UNUSED_PARAMETER(pShmNode);
+  UNUSED_PARAMETER(iWake);
+  UNUSED_PARAMETER(iDeadline);
+  return 1;
+#endif
+}
+
+/*
+** Read n bytes at offset iOfst of -wal file pWal, as SQLite sees it.
+** Return non-zero on success.
+*/
+static int shipReadWal(unixFile *pWal, void *pBuf, int n, i64 iOfst)
+{
+  if (pWal->pDirectWal) return unixDirectWalIo(pWal, 0, (u8 *)pBuf, n, iOfst) == n;
+  return seekAndReadFd(pWal->h, iOfst, pBuf, n, &pWal->lastErrno) == n;
+}
+
+/*
+** Called by shipBegin() with the WAL writer lock of database pDbFd held.
+** Bring the log up to date with the WAL.  Cut off a transaction left
+** incomplete at the end of the log by a process that died appending it,
+** and ship the transactions committed to the WAL after the last one in the
+** log, which a process died before shipping.
+*/
+static void shipCatchUp(unixShipLog *p, unixFile *pDbFd)
+{
+  void volatile *pMap = 0;
+  const u8 *aHdr;
+  struct stat sStat;
+  unixFile sWal;
+  unixDirectWal sDirect;
+  char *zWal;
+  char *zRedirect;
+  u32 mxFrame;
+  u32 aSalt[2];
+  u32 iFrame;
+  u16 szHdrPage;
+  int szPage;
+
+  /* Find the end of the last complete transaction, appended by any process */
+  if (osFstat(p->h, &sStat))
+  {
+    shipFail(p, errno);
+    return;
+  }
+  if (sStat.st_size != p->iScan)
+  {
+    ShipRecord last;
+    i64 iFrom = sStat.st_size < p->iScan ? 0 : p->iScan; /* 0 if the log was replaced */
+    int rc;
+    last.magic = 0;
+    rc = shipScan(p->h, iFrom, sStat.st_size, &p->iScan, &last);
+    if (rc == SQLITE_CORRUPT && iFrom > 0)
+    {
+      /* procvfs_ship_truncate() released the space from iFrom on */
+      iFrom = 0;
+      rc = shipScan(p->h, 0, sStat.st_size, &p->iScan, &last);
+    }
+    if (iFrom == 0)
+    {
+      p->iFrame = 0;
+      memset(p->aSalt, 0, sizeof(p->aSalt));
+    }
+    if (rc == SQLITE_OK && last.magic)
+    {
+      p->iFrame = last.iFrame;
+      memcpy(p->aSalt, last.aSalt, sizeof(p->aSalt));
+    }
+    if (rc == SQLITE_OK && p->iScan < sStat.st_size && robust_ftruncate(p->h, p->iScan)) rc = SQLITE_IOERR_TRUNCATE;
+    if (rc != SQLITE_OK)
+    {
+      shipFail(p, rc == SQLITE_CORRUPT ? EINVAL : errno);
+      return;
+    }
+  }
+
+  /* Find the committed frames it does not have from the wal-index header,
+  ** which cannot change while the writer lock is held */
+  if (unixShmMap((sqlite3_file *)pDbFd, 0, 32768, 0, &pMap) != SQLITE_OK || pMap == 0) return;
+  aHdr = (const u8 *)pMap;
+  memcpy(&szHdrPage, &aHdr[14], sizeof(szHdrPage));
+  memcpy(&mxFrame, &aHdr[16], sizeof(mxFrame));
+  memcpy(aSalt, &aHdr[32], sizeof(aSalt));
+  if (aHdr[12] == 0 || mxFrame == 0) return; /* Not initialized, or empty */
+  iFrame = memcmp(aSalt, p->aSalt, sizeof(aSalt)) == 0 ? p->iFrame + 1 : 1;
+  if (iFrame > mxFrame) return;
+  szPage = szHdrPage == 1 ? 65536 : szHdrPage;
+
+  /* Read them back from the -wal file, synced first */
+  zWal = sqlite3_mprintf("%s-wal", pDbFd->zPath);
+  zRedirect = unixWalRedirect(zWal);
+  memset(&sWal, 0, sizeof(sWal));
+  memset(&sDirect, 0, sizeof(sDirect));
+  sWal.zPath = zRedirect ? zRedirect : zWal;
+  sWal.h = zWal ? robust_open(sWal.zPath, O_RDONLY | O_BINARY, 0) : -1;
+  sDirect.hHdr = -1;
+  if (sWal.h >= 0 && pDbFd->pInode->eWalLayout == UNIX_WAL_LAYOUT_SPLIT)
+  {
+    char *zHdr = sqlite3_mprintf("%s-hdr", sWal.zPath);
+    sDirect.hHdr = zHdr ? robust_open(zHdr, O_RDONLY | O_BINARY, 0) : -1;
+    sDirect.szPage = szPage;
+    sWal.pDirectWal = &sDirect;
+    sqlite3_free(zHdr);
+  }
+  if (sWal.h < 0 || (sWal.pDirectWal && sDirect.hHdr < 0))
+  {
+    shipFail(p, errno);
+  }
+  else if (full_fsync(sWal.h, 0, 1) || (sWal.pDirectWal && full_fsync(sDirect.hHdr, 0, 1)))
+  {
+    /* Not durable yet, so not shipped yet.  The next writer tries again. */
+    unixLogError(SQLITE_IOERR_FSYNC, "fdatasync", sWal.zPath);
+  }
+  else
+  {
+    p->szPage = szPage;
+    for (; iFrame <= mxFrame && p->h >= 0; iFrame++)
+    {
+      i64 iOfst = 32 + (i64)(iFrame - 1) * (24 + szPage);
+      u8 aFrame[24];
+      if (!shipGrow(p, szPage))
+      {
+        shipFail(p, ENOMEM);
+        break;
+      }
+      if (!shipReadWal(&sWal, aFrame, 24, iOfst) ||
+          !shipReadWal(&sWal, &p->aData[(i64)p->nFrame * szPage], szPage, iOfst + 24))
+      {
+        shipFail(p, sWal.lastErrno ? sWal.lastErrno : EIO);
+        break;
+      }
+      p->aOfst[p->nFrame] = iOfst;
+      p->aPgno[p->nFrame] = ((u32)aFrame[0] << 24) | ((u32)aFrame[1] << 16) | ((u32)aFrame[2] << 8) | aFrame[3];
+      p->nFrame++;
+      p->nCommit = ((u32)aFrame[4] << 24) | ((u32)aFrame[5] << 16) | ((u32)aFrame[6] << 8) | aFrame[7];
+      memcpy(p->aHdrSalt, &aFrame[8], sizeof(p->aHdrSalt));
+      if (p->nCommit) shipCommit(p);
+    }
+    shipReset(p);
+  }
+  if (sDirect.hHdr >= 0) robust_close(0, sDirect.hHdr, __LINE__);
+  if (sWal.h >= 0) robust_close(0, sWal.h, __LINE__);
+  sqlite3_free(zRedirect);
+  sqlite3_free(zWal);
+}
+
+/*
+** Called by unixShmLock() once database pDbFd has the WAL writer lock.
+*/
+static void shipBegin(unixFile *pDbFd)
+{
+  unixShipLog *p = pDbFd->pInode->pShip;
+
+  /* Frames buffered by an earlier writer that rolled back are stale */
+  shipReset(p);
+  if (p->h >= 0) shipCatchUp(p, pDbFd);
+}
+
+/*
+** Called by unixShmLock() before database pDbFd releases the WAL writer
+** lock.  Ship the transaction just committed if SQLite did not sync it.
+** A commit frame the wal-index header does not cover was not committed,
+** because SQLite failed to sync it, so syncing it now must not ship it.
+*/
+static void shipEnd(unixFile *pDbFd)
+{
+  unixShipLog *p = pDbFd->pInode->pShip;
+  void volatile *pMap = 0;
+  u32 mxFrame;
+
+  if (p->nCommit == 0) return;
+  if (unixShmMap((sqlite3_file *)pDbFd, 0, 32768, 0, &pMap) != SQLITE_OK || pMap == 0)
+  {
+    shipReset(p);
+    return;
+  }
+  memcpy(&mxFrame, (const u8 *)pMap + 16, sizeof(mxFrame));
+  if (mxFrame >= (u32)((p->aOfst[p->nFrame - 1] - 32) / (24 + p->szPage) + 1) &&
+      memcmp((const u8 *)pMap + 32, p->aHdrSalt, sizeof(p->aHdrSalt)) == 0)
+  {
+    shipFlush(p);
+  }
+  else
+  {
+    shipReset(p);
+  }
+}
+
+/*
+** Change the lock state for a shared-memory segment.
+**
+** Note that the relationship between SHAREd and EXCLUSIVE locks is a little
+** different here than in posix.  In xShmLock(), one can go from unlocked
+** to shared and back or from unlocked to exclusive and back.  But one may
+** not go from shared to exclusive or from exclusive to shared.
+*/
+static int unixShmLock(sqlite3_file *fd, /* Database file holding the shared memory */
+                       int ofst,         /* First lock to acquire or release */
+                       int n,            /* Number of locks to acquire or release */
+                       int flags         /* What to do with the lock */
+                       )
+{
+  unixFile *pDbFd = (unixFile *)fd;    /* Connection holding shared memory */
+  unixShm *p = pDbFd->pShm;            /* The shared memory being locked */
+  unixShm *pX;                         /* For looping over all siblings */
+  unixShmNode *pShmNode = p->pShmNode; /* The underlying file iNode */
+  int rc = SQLITE_OK;                  /* Result code */
+  u16 mask;                            /* Mask of locks to take or release */
+  i64 iDeadline = 0;                   /* When to stop waiting, if waiting */
+  u32 iWake = 0;                       /* Futex value before the last attempt */
+
+  assert(pShmNode == pDbFd->pInode->pShmNode);
+  assert(pShmNode->pInode == pDbFd->pInode);
+  assert(ofst >= 0 && ofst + n <= SQLITE_SHM_NLOCK);
+  assert(n >= 1);
+  assert(flags == (SQLITE_SHM_LOCK | SQLITE_SHM_SHARED) || flags == (SQLITE_SHM_LOCK | SQLITE_SHM_EXCLUSIVE) ||
+         flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_SHARED) || flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE));
+  assert(n == 1 || (flags & SQLITE_SHM_EXCLUSIVE) != 0);
+  assert(pShmNode->h >= 0 || pDbFd->pInode->bProcessLock == 1);
+  assert(pShmNode->h < 0 || pDbFd->pInode->bProcessLock == 0);
+
+  mask = (1 << (ofst + n)) - (1 << ofst);
+  assert(n > 1 || mask == (1 << ofst));
+  if (ofst == WAL_WRITE_LOCK && n == 1 && flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE) && (p->exclMask & mask) &&
+      pDbFd->pInode->pShip)
+  {
+    shipEnd(pDbFd);
+  }
+  for (;;)
+  {
+    if (iDeadline) iWake = __atomic_load_n(&pShmNode->aLock[UNIX_SHM_WAKE], __ATOMIC_SEQ_CST);
+    rc = SQLITE_OK;
+    mutex_enter(pShmNode->mutex);
+    if (flags & SQLITE_SHM_UNLOCK)
+    {
+      u16 allMask = 0; /* Mask of locks held by siblings */
+
+      /* See if any siblings hold this same lock */
+      for (pX = pShmNode->pFirst; pX; pX = pX->pNext)
+      {
+        if (pX == p) continue;
+        assert((pX->exclMask & (p->exclMask | p->sharedMask)) == 0);
+        allMask |= pX->sharedMask;
+      }
+
+      /* Unlock the system-level locks */
+      if ((mask & allMask) == 0)
+      {
+        rc = unixShmSystemLock(pDbFd, F_UNLCK, ofst + UNIX_SHM_BASE, n);
+      }
+      else
+      {
+        rc = SQLITE_OK;
+      }
+
+      /* Undo the local locks */
+      if (rc == SQLITE_OK)
+      {
+        p->exclMask &= ~mask;
+        p->sharedMask &= ~mask;
+      }
+    }
+    else if (flags & SQLITE_SHM_SHARED)
+    {
+      u16 allShared = 0; /* Union of locks held by connections other than "p" */
+
+      /* Find out which shared locks are already held by sibling connections.
+      ** If any sibling already holds an exclusive lock, go ahead and return
+      ** SQLITE_BUSY.
+      */
+      for (pX = pShmNode->pFirst; pX; pX = pX->pNext)
+      {
+        if ((pX->exclMask & mask) != 0)
+        {
+          rc = SQLITE_BUSY;
+          break;
+        }
+        allShared |= pX->sharedMask;
+      }
+
+      /* Get shared locks at the system level, if necessary */
+      if (rc == SQLITE_OK)
+      {
+        if ((allShared & mask) == 0)
+        {
+          rc = unixShmSystemLock(pDbFd, F_RDLCK, ofst + UNIX_SHM_BASE, n);
+        }
+        else
+        {
+          rc = SQLITE_OK;
+        }
+      }
+
+      /* Get the local shared locks */
+      if (rc == SQLITE_OK)
+      {
+        p->sharedMask |= mask;
+      }
+    }
+    else
+    {
+      /* Make sure no sibling connections hold locks that will block this
+      ** lock.  If any do, return SQLITE_BUSY right away.
+      */
+      for (pX = pShmNode->pFirst; pX; pX = pX->pNext)
+      {
+        if ((pX->exclMask & mask) != 0 || (pX->sharedMask & mask) != 0)
+        {
+          rc = SQLITE_BUSY;
+          break;
+        }
+      }
+
+      /* Get the exclusive locks at the system level.  Then if successful
+      ** also mark the local connection as being locked.
+      */
+      if (rc == SQLITE_OK)
+      {
+        rc = unixShmSystemLock(pDbFd, F_WRLCK, ofst + UNIX_SHM_BASE, n);
+        if (rc == SQLITE_OK)
+        {
+          assert((p->sharedMask & mask) == 0);
+          p->exclMask |= mask;
+        }
+      }
+    }
+    mutex_leave(pShmNode->mutex);
+    if (rc != SQLITE_BUSY || !unixShmCanWait(pDbFd, p, ofst, n, flags)) break;
+    if (iDeadline == 0)
+    {
+      /* Register as a waiter, then try again before sleeping so that a
+      ** release in between is not missed */
+      iDeadline = unixMonotonicMs() + pDbFd->iBusyTimeout;
+      __atomic_fetch_add(&pShmNode->aLock[UNIX_SHM_NWAITER], 1, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    if (unixShmAtomicWait(pShmNode, iWake, iDeadline)) break;
+  }
+  if (iDeadline) __atomic_fetch_sub(&pShmNode->aLock[UNIX_SHM_NWAITER], 1, __ATOMIC_SEQ_CST);
+  if (flags & SQLITE_SHM_LOCK)
+  {
+    vfsstatAdd(pDbFd->pStat, rc == SQLITE_OK ? VFSSTAT_LOCK : VFSSTAT_LOCK_FAIL, 1);
+  }
+  if (ofst == WAL_WRITE_LOCK && n == 1 && flags == (SQLITE_SHM_LOCK | SQLITE_SHM_EXCLUSIVE) && rc == SQLITE_OK &&
+      pDbFd->pInode->pShip)
+  {
+    shipBegin(pDbFd);
+  }
+  if ((pDbFd->ctrlFlags & UNIXFILE_IOHINTS) && ofst == WAL_CKPT_LOCK && n == 1 && (flags & SQLITE_SHM_EXCLUSIVE) &&
+      rc == SQLITE_OK)
+  {
+    unixCkptIoprio(pDbFd, flags & SQLITE_SHM_LOCK);
+  }
+  if (ofst == WAL_WRITE_LOCK && n == 1 && flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE) && pDbFd->pInode->pCkpt)
+  {
+    pDbFd->bCkptWait = unixCkptOverLimit(pDbFd->pInode->pCkpt);
+  }
+  else if (pDbFd->bCkptWait && ofst >= WAL_READ_LOCK0 && flags == (SQLITE_SHM_UNLOCK | SQLITE_SHM_SHARED))
+  {
+    pDbFd->bCkptWait = 0;
+    unixCkptThrottle(pDbFd->pInode->pCkpt);
+  }
+  OSTRACE(("SHM-LOCK shmid-%d, pid-%d got %03x,%03x\n", p->id, osGetpid(0), p->sharedMask, p->exclMask));
+  return rc;
+}
+
+/*
+** Implement a memory barrier or memory fence on shared memory.
+**
+** All loads and stores begun before the barrier must complete before
+** any load or store begun after the barrier.
+*/
+static void unixShmBarrier(sqlite3_file *fd /* Database file holding the shared memory */
+                           )
+{
+  unixFile *pDbFd = (unixFile *)fd;
+  sqlite3MemoryBarrier();             /* compiler-defined memory barrier */
+  unixEnterInodeMutex(pDbFd->pInode); /* Also mutex, for redundancy */
+  unixLeaveInodeMutex(pDbFd->pInode);
+  /* A commit about to be published must be in the -wal file first */
+  if (uringWaiting()) uringSubmitWaiting();
+}
+
+/*
+** Close a connection to shared-memory.  Delete the underlying
+** storage if deleteFlag is true.
+**
+** If there is no shared memory associated with the connection then this
+** routine is a harmless no-op.
+*/
+static int unixShmUnmap(sqlite3_file *fd, /* The underlying database file */
+                        int deleteFlag    /* Delete shared-memory if true */
+                        )
+{
+  unixShm *p;            /* The connection to be closed */
+  unixShmNode *pShmNode; /* The underlying shared-memory file */
+  unixShm **pp;          /* For looping over sibling connections */
+  unixFile *pDbFd;       /* The underlying database file */
+
+  pDbFd = (unixFile *)fd;
+  p = pDbFd->pShm;
+  if (p == 0) return SQLITE_OK;
+  pShmNode = p->pShmNode;
+
+  assert(pShmNode == pDbFd->pInode->pShmNode);
+  assert(pShmNode->pInode == pDbFd->pInode);
+
+  /* Remove connection p from the set of connections associated
+  ** with pShmNode */
+  mutex_enter(pShmNode->mutex);
+  for (pp = &pShmNode->pFirst; (*pp) != p; pp = &(*pp)->pNext)
+  {
+  }
+  *pp = p->pNext;
+
+  /* Free the connection p */
+  vfspool_free(p);
+  pDbFd->pShm = 0;
+  mutex_leave(pShmNode->mutex);
+
+  /* If pShmNode->nRef has reached 0, then close the underlying
+  ** shared-memory file, too */
+  unixEnterInodeMutex(pDbFd->pInode);
+  assert(pShmNode->nRef > 0);
+  pShmNode->nRef--;
+  if (pShmNode->nRef == 0)
+  {
+    if (deleteFlag && pShmNode->h >= 0)
+    {
+      osUnlink(pShmNode->zFilename);
+    }
+    if (deleteFlag && pShmNode->hLock >= 0)
+    {
+      char *zLockFile = sqlite3_mprintf("%s-lock", pShmNode->zFilename);
+      if (zLockFile) osUnlink(zLockFile);
+      sqlite3_free(zLockFile);
+    }
+    unixShmPurge(pDbFd);
+  }
+  unixLeaveInodeMutex(pDbFd->pInode);
+
+  return SQLITE_OK;
+}
+
+#else
+#define unixShmMap 0
+#define unixShmLock 0
+#define unixShmBarrier 0
+#define unixShmUnmap 0
+#endif /* #ifndef SQLITE_OMIT_WAL */
+
+#if SQLITE_MAX_MMAP_SIZE > 0
+/*
+** If it is currently memory mapped, unmap file pFd.
+*/
+static void unixUnmapfile(unixFile *pFd)
+{
+  assert(pFd->nFetchOut == 0);
+  if (pFd->pMapRegion)
+  {
+    osMunmap(pFd->pMapRegion, pFd->mmapSizeReserved ? pFd->mmapSizeReserved : pFd->mmapSizeActual);
+    pFd->pMapRegion = 0;
+    pFd->mmapSize = 0;
+    pFd->mmapSizeActual = 0;
+    pFd->mmapSizeReserved = 0;
+    pFd->eMmapAdvice = MADV_NORMAL;
+    pFd->iMmapWillneed = 0;
+  }
+}
+
+/*
+** Size of the windows in which 64-bit builds map files.
+*/
+#define UNIX_MMAP_WINDOW ((i64)256 << 20)
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0 /* Before Linux 4.17: the address is only a hint */
+#endif
+
+/*
+** Reserve nByte bytes of address space at pAddr, or anywhere if pAddr is
+** NULL.  Return the reservation, or NULL if it could not be made there.
+*/
+static u8 *unixMmapReserve(u8 *pAddr, i64 nByte)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  u8 *p;
+  if (pAddr) flags |= MAP_FIXED_NOREPLACE;
+  p = (u8 *)osMmap(pAddr, nByte, PROT_NONE, flags, -1, 0);
+  if (p == MAP_FAILED) return 0;
+  if (pAddr && p != pAddr)
+  {
+    osMunmap(p, nByte);
+    return 0;
+  }
+  return p;
+}
+
+/*
+** The 64-bit version of unixRemapfile().  Address space is reserved for
+** the file and one more window, and the file is mapped into it in windows
+** of UNIX_MMAP_WINDOW bytes as it grows.  Reserving the whole of
+** "mmap_size" instead would let a few hundred connections use up the
+** address space of the process.
+**
+** Once the file outgrows the reservation, it is extended in place to twice
+** its size if the address space after it is free.  Otherwise the file is
+** mapped again elsewhere, unless xFetch() references are outstanding, in
+** which case the mapping stays as it is and xRead() is used for the rest
+** of the file.  Within the reservation the mapping never moves, so growing
+** it does not depend on mremap() and is possible even while xFetch()
+** references are outstanding.
+*/
+static void unixRemapWindows(unixFile *pFd, i64 nNew)
+{
+  u8 *pBase = (u8 *)pFd->pMapRegion;
+  i64 nWant = (nNew + UNIX_MMAP_WINDOW - 1) / UNIX_MMAP_WINDOW * UNIX_MMAP_WINDOW;
+  i64 nMax = (pFd->mmapSizeMax + UNIX_MMAP_WINDOW - 1) / UNIX_MMAP_WINDOW * UNIX_MMAP_WINDOW;
+  int prot = PROT_READ;
+  int flags = MAP_SHARED | MAP_FIXED;
+
+#ifdef SQLITE_MMAP_READWRITE
+  if ((pFd->ctrlFlags & UNIXFILE_RDONLY) == 0) prot |= PROT_WRITE;
+#endif
+#ifdef MAP_POPULATE
+  if (pFd->ctrlFlags & UNIXFILE_POPULATE) flags |= MAP_POPULATE;
+#endif
+
+  if (pBase && nWant > pFd->mmapSizeReserved && pFd->mmapSizeReserved < nMax)
+  {
+    i64 nReserve = pFd->mmapSizeReserved * 2;
+    if (nReserve < nWant + UNIX_MMAP_WINDOW) nReserve = nWant + UNIX_MMAP_WINDOW;
+    if (nReserve > nMax) nReserve = nMax;
+    if (unixMmapReserve(&pBase[pFd->mmapSizeReserved], nReserve - pFd->mmapSizeReserved))
+    {
+      pFd->mmapSizeReserved = nReserve;
+    }
+    else if (pFd->nFetchOut == 0)
+    {
+      unixUnmapfile(pFd);
+      pBase = 0;
+    }
+  }
+  if (pBase == 0)
+  {
+    i64 nReserve = nWant + UNIX_MMAP_WINDOW;
+    if (nReserve > nMax) nReserve = nMax;
+    pBase = unixMmapReserve(0, nReserve);
+    if (pBase == 0)
+    {
+      unixLogError(SQLITE_OK, "mmap", pFd->zPath);
+      pFd->mmapSizeMax = 0;
+      return;
+    }
+    pFd->pMapRegion = (void *)pBase;
+    pFd->mmapSizeReserved = nReserve;
+    pFd->mmapSizeActual = 0;
+  }
+  if (nWant > pFd->mmapSizeReserved) nWant = pFd->mmapSizeReserved;
+
+  if (nWant > pFd->mmapSizeActual)
+  {
+    i64 iOff = pFd->mmapSizeActual;
+    if (osMmap(&pBase[iOff], nWant - iOff, prot, flags, pFd->h, iOff) == MAP_FAILED)
+    {
+      /* Keep what is already mapped, and use xRead() for the rest */
+      unixLogError(SQLITE_OK, "mmap", pFd->zPath);
+    }
+    else
+    {
+      if (pFd->eMmapAdvice != MADV_NORMAL) osMadvise(&pBase[iOff], nWant - iOff, pFd->eMmapAdvice);
+      pFd->mmapSizeActual = nWant;
+    }
+  }
+  pFd->mmapSize = nNew < pFd->mmapSizeActual ? nNew : pFd->mmapSizeActual;
+}
+
+/*
+** Attempt to set the size of the memory mapping maintained by file
+** descriptor pFd to nNew bytes. Any existing mapping is discarded.
+**
+** If successful, this function sets the following variables:
+**
+**       unixFile.pMapRegion
+**       unixFile.mmapSize
+**       unixFile.mmapSizeActual
+**
+** If unsuccessful, an error message is logged via sqlite3_log() and
+** the three variables above are zeroed. In this case SQLite should
+** continue accessing the database using the xRead() and xWrite()
+** methods.
+*/
+static void unixRemapfile(unixFile *pFd, /* File descriptor object */
+                          i64 nNew       /* Required mapping size */
+                          )
+{
+  const char *zErr = "mmap";
+  int h = pFd->h;                    /* File descriptor open on db file */
+  u8 *pOrig = (u8 *)pFd->pMapRegion; /* Pointer to current file mapping */
+  i64 nOrig = pFd->mmapSizeActual;   /* Size of pOrig region in bytes */
+  u8 *pNew = 0;                      /* Location of new mapping */
+  int flags = PROT_READ;             /* Flags to pass to mmap() */
+  int mapFlags = MAP_SHARED;         /* MAP_* flags for a new mapping */
+
+  if (sizeof(void *) >= 8)
+  {
+    unixRemapWindows(pFd, nNew);
+    return;
+  }
+
+  assert(pFd->nFetchOut == 0);
+  assert(nNew > pFd->mmapSize);
+  assert(nNew <= pFd->mmapSizeMax);
+  assert(nNew > 0);
+  assert(pFd->mmapSizeActual >= pFd->mmapSize);
+  assert(MAP_FAILED != 0);
+
+#ifdef SQLITE_MMAP_READWRITE
+  if ((pFd->ctrlFlags & UNIXFILE_RDONLY) == 0) flags |= PROT_WRITE;
+#endif
+
+  if (pOrig)
+  {
+#if HAVE_MREMAP
+    i64 nReuse = pFd->mmapSize;
+#else
+    const int szSyspage = osGetpagesize();
+    i64 nReuse = (pFd->mmapSize & ~(szSyspage - 1));
+#endif
+    u8 *pReq = &pOrig[nReuse];
+
+    /* Unmap any pages of the existing mapping that cannot be reused. */
+    if (nReuse != nOrig)
+    {
+      osMunmap(pReq, nOrig - nReuse);
+    }
+
+#if HAVE_MREMAP
+    pNew = (u8 *)osMremap(pOrig, nReuse, nNew, MREMAP_MAYMOVE);
+    zErr = "mremap";
+#else
+    pNew = osMmap(pReq, nNew - nReuse, flags, MAP_SHARED, h, nReuse);
+    if (pNew != MAP_FAILED)
+    {
+      if (pNew != pReq)
+      {
+        osMunmap(pNew, nNew - nReuse);
+        pNew = 0;
+      }
+      else
+      {
+        pNew = pOrig;
+      }
+    }
+#endif
+
+    /* The attempt to extend the existing mapping failed. Free it. */
+    if (pNew == MAP_FAILED || pNew == 0)
+    {
+      osMunmap(pOrig, nReuse);
+    }
+  }
+
+  /* If pNew is still NULL, try to create an entirely new mapping. */
+  if (pNew == 0)
+  {
+#ifdef MAP_POPULATE
+    if (pFd->ctrlFlags & UNIXFILE_POPULATE) mapFlags |= MAP_POPULATE;
+#endif
+    pNew = (u8 *)osMmap(0, nNew, flags, mapFlags, h, 0);
+  }
+
+  if (pNew == MAP_FAILED)
+  {
+    pNew = 0;
+    nNew = 0;
+    unixLogError(SQLITE_OK, zErr, pFd->zPath);
+
+    /* If the mmap() above failed, assume that all subsequent mmap() calls
+    ** will probably fail too. Fall back to using xRead/xWrite exclusively
+    ** in this case.  */
+    pFd->mmapSizeMax = 0;
+  }
+  pFd->pMapRegion = (void *)pNew;
+  pFd->mmapSize = pFd->mmapSizeActual = nNew;
+}
+
+/*
+** Memory map or remap the file opened by file-descriptor pFd (if the file
+** is already mapped, the existing mapping is replaced by the new). Or, if
+** there already exists a mapping for this file, and there are still
+** outstanding xFetch() references to it, this function is a no-op, unless
+** the file is mapped in windows that never move.
+**
+** If parameter nByte is non-negative, then it is the requested size of
+** the mapping to create. Otherwise, if nByte is less than zero, then the
+** requested size is the size of the file on disk. The actual size of the
+** created mapping is either the requested size or the value configured
+** using SQLITE_FCNTL_MMAP_LIMIT, whichever is smaller.
+**
+** SQLITE_OK is returned if no error occurs (even if the mapping is not
+** recreated as a result of outstanding references) or an SQLite error
+** code otherwise.
+*/
+static int unixMapfile(unixFile *pFd, i64 nMap)
+{
+  assert(nMap >= 0 || pFd->nFetchOut == 0);
+  assert(nMap > 0 || (pFd->mmapSize == 0 && pFd->pMapRegion == 0));
+  if (pFd->nFetchOut > 0 && pFd->mmapSizeReserved == 0) return SQLITE_OK;
+
+  if (nMap < 0)
+  {
+    struct stat statbuf; /* Low-level file information */
+    if (osFstat(pFd->h, &statbuf))
+    {
+      return SQLITE_IOERR_FSTAT;
+    }
+    nMap = statbuf.st_size;
+  }
+  if (nMap > pFd->mmapSizeMax)
+  {
+    nMap = pFd->mmapSizeMax;
+  }
+
+  assert(nMap > 0 || (pFd->mmapSize == 0 && pFd->pMapRegion == 0));
+  if (nMap != pFd->mmapSize)
+  {
+    unixRemapfile(pFd, nMap);
+  }
+
+  return SQLITE_OK;
+}
+
+/*
+** Parameters of the access policy implemented by unixMmapBackoff().
+*/
+#define UNIX_MMAP_SAMPLE 256                      /* Accesses per sample */
+#define UNIX_MMAP_READAHEAD ((i64)1 << 20)        /* MADV_WILLNEED bytes ahead */
+#define UNIX_MMAP_BACKOFF (16 * UNIX_MMAP_SAMPLE) /* Accesses made with pread() */
+
+/*
+** Return the number of major page faults taken by the calling thread.
+*/
+static long unixMajorFaults(void)
+{
+  struct rusage sUsage;
+#ifdef RUSAGE_THREAD
+  if (osGetrusage(RUSAGE_THREAD, &sUsage)) return 0;
+#else
+  if (osGetrusage(RUSAGE_SELF, &sUsage)) return 0;
+#endif
+  return sUsage.ru_majflt;
+}
+
+/*
+** Called by xFetch() and xRead() before nAmt bytes at iOff are accessed
+** through the mapping of pFd.  Return true if they should be read with
+** pread() instead.
+**
+** Accesses are looked at in samples of UNIX_MMAP_SAMPLE.  At the end of
+** each, the mapping is advised MADV_SEQUENTIAL if most accesses started
+** where the one before ended, MADV_RANDOM if few did, and MADV_NORMAL
+** otherwise.  While it is sequential, the UNIX_MMAP_READAHEAD bytes ahead of
+** each access are advised MADV_WILLNEED.
+**
+** If more than one access in four of a sample took a major page fault,
+** the page cache is under pressure that the mapping only adds to, so the
+** next UNIX_MMAP_BACKOFF accesses are made with pread().  Sampling starts
+** again after that.
+*/
+static int unixMmapBackoff(unixFile *pFd, i64 iOff, int nAmt)
+{
+  if (pFd->nMmapBackoff > 0)
+  {
+    pFd->nMmapBackoff--;
+    return 1;
+  }
+
+  if (pFd->nMmapAccess == 0) pFd->nMmapFault = unixMajorFaults();
+  if (iOff == pFd->iMmapNext) pFd->nMmapSeq++;
+  pFd->iMmapNext = iOff + nAmt;
+  if (++pFd->nMmapAccess == UNIX_MMAP_SAMPLE)
+  {
+    int eAdvice = MADV_NORMAL;
+    if (pFd->nMmapSeq * 4 >= UNIX_MMAP_SAMPLE * 3)
+    {
+      eAdvice = MADV_SEQUENTIAL;
+    }
+    else if (pFd->nMmapSeq * 4 <= UNIX_MMAP_SAMPLE)
+    {
+      eAdvice = MADV_RANDOM;
+    }
+    if (eAdvice != pFd->eMmapAdvice)
+    {
+      osMadvise(pFd->pMapRegion, pFd->mmapSizeActual, eAdvice);
+      pFd->eMmapAdvice = eAdvice;
+      pFd->iMmapWillneed = 0;
+    }
+    if ((unixMajorFaults() - pFd->nMmapFault) * 4 > UNIX_MMAP_SAMPLE)
+    {
+      pFd->nMmapBackoff = UNIX_MMAP_BACKOFF;
+    }
+    pFd->nMmapAccess = 0;
+    pFd->nMmapSeq = 0;
+  }
+
+  if (pFd->eMmapAdvice == MADV_SEQUENTIAL && iOff + nAmt > pFd->iMmapWillneed)
+  {
+    i64 iStart = (iOff > pFd->iMmapWillneed ? iOff : pFd->iMmapWillneed) & ~(i64)(osGetpagesize() - 1);
+    i64 iEnd = iStart + UNIX_MMAP_READAHEAD;
+    if (iEnd > pFd->mmapSize) iEnd = pFd->mmapSize;
+    if (iEnd > iStart) osMadvise(&((u8 *)pFd->pMapRegion)[iStart], iEnd - iStart, MADV_WILLNEED);
+    pFd->iMmapWillneed = iEnd;
+  }
+  return 0;
+}
+#endif /* SQLITE_MAX_MMAP_SIZE>0 */
+
+/*
+** If possible, return a pointer to a mapping of file fd starting at offset
+** iOff. The mapping must be valid for at least nAmt bytes.
+**
+** If such a pointer can be obtained, store it in *pp and return SQLITE_OK.
+** Or, if one cannot but no error occurs, set *pp to 0 and return SQLITE_OK.
+** Finally, if an error does occur, return an SQLite error code. The final
+** value of *pp is undefined in this case.
+**
+** If this function does return a pointer, the caller must eventually
+** release the reference by calling unixUnfetch().
+*/
+static int unixFetch(sqlite3_file *fd, i64 iOff, int nAmt, void **pp)
+{
+#if SQLITE_MAX_MMAP_SIZE > 0
+  unixFile *pFd = (unixFile *)fd; /* The underlying database file */
+#endif
+  *pp = 0;
+
+#if SQLITE_MAX_MMAP_SIZE > 0
+  if (pFd->mmapSizeMax > 0)
+  {
+    if (pFd->pMapRegion == 0)
+    {
+      int rc = unixMapfile(pFd, -1);
+      if (rc != SQLITE_OK) return rc;
+    }
+    if (pFd->mmapSize >= iOff + nAmt && !unixMmapBackoff(pFd, iOff, nAmt))
+    {
+      *pp = &((u8 *)pFd->pMapRegion)[iOff];
+      pFd->nFetchOut++;
+      vfsstatAdd(pFd->pStat, VFSSTAT_MMAP_HIT, 1);
+    }
+  }
+#endif
+  return SQLITE_OK;
+}
+
+/*
+** If the third argument is non-NULL, then this function releases a
+** reference obtained by an earlier call to unixFetch(). The second
+** argument passed to this function must be the same as the corresponding
+** argument that was passed to the unixFetch() invocation.
+**
+** Or, if the third argument is NULL, then this function is being called
+** to inform the VFS layer that, according to POSIX, any existing mapping
+** may now be invalid and should be unmapped.
+*/
+static int unixUnfetch(sqlite3_file *fd, i64 iOff, void *p)
+{
+#if SQLITE_MAX_MMAP_SIZE > 0
+  unixFile *pFd = (unixFile *)fd; /* The underlying database file */
+  UNUSED_PARAMETER(iOff);
+
+  /* If p==0 (unmap the entire file) then there must be no outstanding
+  ** xFetch references. Or, if p!=0 (meaning it is an xFetch reference),
+  ** then there must be at least one outstanding.  */
+  assert((p == 0) == (pFd->nFetchOut == 0));
+
+  /* If p!=0, it must match the iOff value. */
+  assert(p == 0 || p == &((u8 *)pFd->pMapRegion)[iOff]);
+
+  if (p)
+  {
+    pFd->nFetchOut--;
+  }
+  else
+  {
+    unixUnmapfile(pFd);
+  }
+
+  assert(pFd->nFetchOut >= 0);
+#else
+  UNUSED_PARAMETER(fd);
+  UNUSED_PARAMETER(p);
+  UNUSED_PARAMETER(iOff);
+#endif
+  return SQLITE_OK;
+}
+
+/*
+** Here ends the implementation of all sqlite3_file methods.
+**
+********************** End sqlite3_file Methods *******************************
+******************************************************************************/
+
+/*
+** This division contains definitions of sqlite3_io_methods objects that
+** implement various file locking strategies.  It also contains definitions
+** of "finder" functions.  A finder-function is used to locate the appropriate
+** sqlite3_io_methods object for a particular database file.  The pAppData
+** field of the sqlite3_vfs VFS objects are initialized to be pointers to
+** the correct finder-function for that VFS.
+**
+** Most finder functions return a pointer to a fixed sqlite3_io_methods
+** object.  The only interesting finder-function is autolockIoFinder, which
+** looks at the filesystem type and tries to guess the best locking
+** strategy from that.
+**
+** For finder-function F, two objects are created:
+**
+**    (1) The real finder-function named "FImpt()".
+**
+**    (2) A constant pointer to this function named just "F".
+**
+**
+** A pointer to the F pointer is used as the pAppData value for VFS
+** objects.  We have to do this instead of letting pAppData point
+** directly at the finder-function since C90 rules prevent a void*
+** from be cast into a function pointer.
+**
+**
+** Each instance of this macro generates two objects:
+**
+**   *  A constant sqlite3_io_methods object call METHOD that has locking
+**      methods CLOSE, LOCK, UNLOCK, CKRESLOCK.
+**
+**   *  An I/O method finder function called FINDER that returns a pointer
+**      to the METHOD object in the previous bullet.
+*/
+#define IOMETHODS(FINDER, METHOD, VERSION, CLOSE, LOCK, UNLOCK, CKLOCK, SHMMAP) \
+  static const sqlite3_io_methods METHOD = {                                    \
+      VERSION,                   /* iVersion */                                 \
+      CLOSE,                     /* xClose */                                   \
+      unixRead,                  /* xRead */                                    \
+      unixWrite,                 /* xWrite */                                   \
+      unixTruncate,              /* xTruncate */                                \
+      unixSync,                  /* xSync */                                    \
+      unixFileSize,              /* xFileSize */                                \
+      LOCK,                      /* xLock */                                    \
+      UNLOCK,                    /* xUnlock */                                  \
+      CKLOCK,                    /* xCheckReservedLock */                       \
+      unixFileControl,           /* xFileControl */                             \
+      unixSectorSize,            /* xSectorSize */                              \
+      unixDeviceCharacteristics, /* xDeviceCapabilities */                      \
+      SHMMAP,                    /* xShmMap */                                  \
+      unixShmLock,               /* xShmLock */                                 \
+      unixShmBarrier,            /* xShmBarrier */                              \
+      unixShmUnmap,              /* xShmUnmap */                                \
+      unixFetch,                 /* xFetch */                                   \
+      unixUnfetch,               /* xUnfetch */                                 \
+  };                                                                            \
+  static const sqlite3_io_methods *FINDER##Impl(const char *z, unixFile *p)     \
+  {                                                                             \
+    UNUSED_PARAMETER(z);                                                        \
+    UNUSED_PARAMETER(p);                                                        \
+    return &METHOD;                                                             \
+  }                                                                             \
+  static const sqlite3_io_methods *(*const FINDER)(const char *, unixFile *p) = FINDER##Impl;
+
+/*
+** Here are all of the sqlite3_io_methods objects for each of the
+** locking strategies.  Functions that return pointers to these methods
+** are also created.
+*/
+IOMETHODS(posixIoFinder,         /* Finder function name */
+          posixIoMethods,        /* sqlite3_io_methods object name */
+          3,                     /* shared memory and mmap are enabled */
+          unixClose,             /* xClose method */
+          unixLock,              /* xLock method */
+          unixUnlock,            /* xUnlock method */
+          unixCheckReservedLock, /* xCheckReservedLock method */
+          unixShmMap             /* xShmMap method */
+          )
+
+/*
+** The "proc-uring" VFS uses the same methods.  unixOpen() tells it apart
+** by this finder and gives its -wal files a ring.
+*/
+static const sqlite3_io_methods *(*const uringIoFinder)(const char *, unixFile *p) = posixIoFinderImpl;
+
+#if HAVE_OFD_LOCKS
+IOMETHODS(ofdIoFinder,          /* Finder function name */
+          ofdIoMethods,         /* sqlite3_io_methods object name */
+          3,                    /* shared memory and mmap are enabled */
+          ofdClose,             /* xClose method */
+          ofdLock,              /* xLock method */
+          ofdUnlock,            /* xUnlock method */
+          ofdCheckReservedLock, /* xCheckReservedLock method */
+          unixShmMap            /* xShmMap method */
+          )
+#define unixVfsIsOfd(pVfs) ((pVfs)->pAppData == (void *)&ofdIoFinder)
+#else
+#define unixVfsIsOfd(pVfs) 0
+#endif
+
+/*
+** An abstract type for a pointer to an IO method finder function:
+*/
+typedef const sqlite3_io_methods *(*finder_type)(const char *, unixFile *);
+
+/****************************************************************************
+**************************** sqlite3_vfs methods ****************************
+**
+** This division contains the implementation of methods on the
+** sqlite3_vfs object.
+*/
+
+/*
+** Initialize the contents of the unixFile structure pointed to by pId.
+*/
+static int fillInUnixFile(sqlite3_vfs *pVfs,     /* Pointer to vfs object */
+                          int h,                 /* Open file descriptor of file being opened */
+                          sqlite3_file *pId,     /* Write to the unixFile structure here */
+                          const char *zFilename, /* Name of the file being opened */
+                          int ctrlFlags          /* Zero or more UNIXFILE_* values */
+                          )
+{
+  const sqlite3_io_methods *pLockingStyle;
+  unixFile *pNew = (unixFile *)pId;
+  int rc = SQLITE_OK;
+  struct stat sStat; /* fstat() of h taken by findInodeInfo() */
+  int bStat = 0;     /* True if sStat is valid */
+
+  assert(pNew->pInode == NULL);
+
+  /* No locking occurs in temporary files */
+  assert(zFilename != 0 || (ctrlFlags & UNIXFILE_NOLOCK) != 0);
+
+  OSTRACE(("OPEN    %-3d %s\n", h, zFilename));
+  pNew->h = h;
+  pNew->pVfs = pVfs;
+  pNew->zPath = zFilename;
+  pNew->ctrlFlags = (u8)ctrlFlags;
+#if SQLITE_MAX_MMAP_SIZE > 0
+  pNew->mmapSizeMax = sqlite3GlobalConfig_szMmap;
+  if (sqlite3_uri_boolean(((ctrlFlags & UNIXFILE_URI) ? zFilename : 0), "mmap_populate", 0))
+  {
+    pNew->ctrlFlags |= UNIXFILE_POPULATE;
+  }
+#endif
+  if (sqlite3_uri_boolean(((ctrlFlags & UNIXFILE_URI) ? zFilename : 0), "psow", SQLITE_POWERSAFE_OVERWRITE))
+  {
+    pNew->ctrlFlags |= UNIXFILE_PSOW;
+  }
+  {
+    /* Milliseconds to wait on a contended lock before returning SQLITE_BUSY.
+    ** SQLITE_FCNTL_LOCK_TIMEOUT overrides it.  */
+    i64 iTimeout = sqlite3_uri_int64(((ctrlFlags & UNIXFILE_URI) ? zFilename : 0), "lock_timeout", 0);
+    pNew->iBusyTimeout = (unsigned)(iTimeout < 0 ? 0 : iTimeout > 0x7fffffff ? 0x7fffffff : iTimeout);
+  }
+  if (strcmp(pVfs->zName, "unix-excl") == 0)
+  {
+    pNew->ctrlFlags |= UNIXFILE_EXCL;
+  }
+
+
+  {
+    pLockingStyle = (**(finder_type *)pVfs->pAppData)(zFilename, pNew);
+#if SQLITE_ENABLE_LOCKING_STYLE
+    /* Cache zFilename in the locking context (AFP and dotlock override) for
+    ** proxyLock activation is possible (remote proxy is based on db name)
+    ** zFilename remains valid until file is closed, to support */
+    pNew->lockingContext = (void *)zFilename;
+#endif
+  }
+
+  if (pLockingStyle == &posixIoMethods
+#if HAVE_OFD_LOCKS
+      || pLockingStyle == &ofdIoMethods
+#endif
+      )
+  {
+    rc = findInodeInfo(pNew, &pNew->pInode, &sStat);
+    bStat = rc == SQLITE_OK;
+    if (rc != SQLITE_OK)
+    {
+      /* If an error occurred in findInodeInfo(), close the file descriptor
+      ** immediately, before releasing the mutex. findInodeInfo() may fail
+      ** in two scenarios:
+      **
+      **   (a) A call to fstat() failed.
+      **   (b) A malloc failed.
+      **
+      ** Scenario (b) may only occur if the process is holding no other
+      ** file descriptors open on the same file. If there were other file
+      ** descriptors on this file, then no malloc would be required by
+      ** findInodeInfo(). If this is the case, it is quite safe to close
+      ** handle h - as it is guaranteed that no posix locks will be released
+      ** by doing so.
+      **
+      ** If scenario (a) caused the error then things are not so safe. The
+      ** implicit assumption here is that if fstat() fails, things are in
+      ** such bad shape that dropping a lock or two doesn't matter much.
+      */
+      robust_close(pNew, h, __LINE__);
+      h = -1;
+    }
+    else if ((ctrlFlags & UNIXFILE_NOLOCK) == 0)
+    {
+      unixInodeBucket *pBucket = pNew->pInode->pBucket;
+      rc = setInodeDirectories(pNew);
+      if (rc == SQLITE_OK) rc = setInodeShipLog(pNew);
+      if (rc != SQLITE_OK)
+      {
+        /* setInodeDirectories() and setInodeShipLog() only fail for the
+        ** first unixFile on the inode, so no other locks are dropped by
+        ** closing h here. */
+        releaseInodeInfo(pNew);
+        pNew->pInode = 0;
+        robust_close(pNew, h, __LINE__);
+        h = -1;
+      }
+      else
+      {
+        setInodeDirectIo(pNew);
+        setInodeSyncModes(pNew);
+        setInodePrealloc(pNew);
+        setInodeWalRecycle(pNew);
+        setInodeCombine(pNew);
+        setInodeIoHints(pNew);
+        setInodeCheckpoint(pNew);
+        if (pNew->pInode->nRef == 1) pNew->pInode->cbtProbe = 1;
+      }
+      pBucket->mutex.unlock(); /* The unixInodeInfo may have been freed */
+    }
+    else
+    {
+      unixLeaveInodeMutex(pNew->pInode);
+    }
+  }
+
+  storeLastErrno(pNew, 0);
+  if (rc != SQLITE_OK)
+  {
+    if (h >= 0) robust_close(pNew, h, __LINE__);
+  }
+  else
+  {
+    pNew->pMethod = pLockingStyle;
+    OpenCounter(+1);
+    verifyDbFile(pNew, bStat ? &sStat : 0);
+  }
+  return rc;
+}
+
+/*
+** Return the name of a directory in which to put temporary files.
+** If no suitable temporary file directory can be found, return NULL.
+*/
+static const char *unixTempFileDir(void)
+{
+  static const char *azDirs[] = {0, 0, "/var/tmp", "/usr/tmp", "/tmp", "."};
+  unsigned int i = 0;
+  struct stat buf;
+  const char *zDir = sqlite3_temp_directory;
+
+  if (!azDirs[0]) azDirs[0] = getenv("SQLITE_TMPDIR");
+  if (!azDirs[1]) azDirs[1] = getenv("TMPDIR");
+  while (1)
+  {
+    if (zDir != 0 && osStat(zDir, &buf) == 0 && S_ISDIR(buf.st_mode) && osAccess(zDir, 03) == 0)
+    {
+      return zDir;
+    }
+    if (i >= sizeof(azDirs) / sizeof(azDirs[0])) break;
+    zDir = azDirs[i++];
+  }
+  return 0;
+}
+
+/*
+** Create a temporary file name in zBuf.  zBuf must be allocated
+** by the calling process and must be big enough to hold at least
+** pVfs->mxPathname bytes.
+*/
+static int unixGetTempname(int nBuf, char *zBuf)
+{
+  const char *zDir;
+  int iLimit = 0;
+
+  /* It's odd to simulate an io-error here, but really this is just
+  ** using the io-error infrastructure to test that SQLite handles this
+  ** function failing.
+  */
+  zBuf[0] = 0;
+  SimulateIOError(return SQLITE_IOERR);
+
+  zDir = unixTempFileDir();
+  if (zDir == 0) return SQLITE_IOERR_GETTEMPPATH;
+  do
+  {
+    u64 r;
+    sqlite3_randomness(sizeof(r), &r);
+    assert(nBuf > 2);
+    zBuf[nBuf - 2] = 0;
+    sqlite3_snprintf(nBuf, zBuf, "%s/" SQLITE_TEMP_FILE_PREFIX "%llx%c", zDir, r, 0);
+    if (zBuf[nBuf - 2] != 0 || (iLimit++) > 10) return SQLITE_ERROR;
+  } while (osAccess(zBuf, 0) == 0);
+  return SQLITE_OK;
+}
+
+#if SQLITE_ENABLE_LOCKING_STYLE && defined(__APPLE__)
+/*
+** Routine to transform a unixFile into a proxy-locking unixFile.
+** Implementation in the proxy-lock division, but used by unixOpen()
+** if SQLITE_PREFER_PROXY_LOCKING is defined.
+*/
+static int proxyTransformUnixFile(unixFile *, const char *);
+#endif
+
+/*
+** Search for an unused file descriptor that was opened on the database
+** file (not a journal or master-journal file) identified by pathname
+** zPath with SQLITE_OPEN_XXX flags matching those passed as the second
+** argument to this function.
+**
+** Such a file descriptor may exist if a database connection was closed
+** but the associated file descriptor could not be closed because some
+** other file descriptor open on the same file is holding a file-lock.
+** Refer to comments in the unixClose() function and the lengthy comment
+** describing "Posix Advisory Locking" at the start of this file for
+** further details. Also, ticket #4018.
+**
+** If a suitable file descriptor is found, then it is returned. If no
+** such file descriptor is located, -1 is returned.
+*/
+static UnixUnusedFd *findReusableFd(const char *zPath, int flags)
+{
+  UnixUnusedFd *pUnused = 0;
+
+  struct stat sStat; /* Results of stat() call */
+
+  /* A stat() call may fail for various reasons. If this happens, it is
+  ** almost certain that an open() call on the same path will also fail.
+  ** For this reason, if an error occurs in the stat() call here, it is
+  ** ignored and -1 is returned. The caller will try to open a new file
+  ** descriptor on the same path, fail, and return an error to SQLite.
+  **
+  ** Even if a subsequent open() call does succeed, the consequences of
+  ** not searching for a reusable file descriptor are not dire.  */
+  if (__atomic_load_n(&nUnusedFd, __ATOMIC_RELAXED) > 0 && 0 == osStat(zPath, &sStat))
+  {
+    struct unixFileId fileId;
+    unixInodeBucket *pBucket;
+    unixInodeInfo *pInode;
+
+    memset(&fileId, 0, sizeof(fileId));
+    fileId.dev = sStat.st_dev;
+    fileId.ino = (u64)sStat.st_ino;
+    pBucket = inodeBucket(&fileId);
+    pBucket->mutex.lock();
+    pInode = inodeLookup(pBucket, &fileId);
+    if (pInode)
+    {
+      UnixUnusedFd **pp;
+      for (pp = &pInode->pUnused; *pp && (*pp)->flags != flags; pp = &((*pp)->pNext))
+        ;
+      pUnused = *pp;
+      if (pUnused)
+      {
+        __atomic_fetch_sub(&nUnusedFd, 1, __ATOMIC_RELAXED);
+        *pp = pUnused->pNext;
+      }
+    }
+    pBucket->mutex.unlock();
+  }
+  return pUnused;
+}
+
+/*
+** Find the mode, uid and gid of file zFile.
+*/
+static int getFileMode(const char *zFile, /* File name */
+                       mode_t *pMode,     /* OUT: Permissions of zFile */
+                       uid_t *pUid,       /* OUT: uid of zFile. */
+                       gid_t *pGid        /* OUT: gid of zFile. */
+                       )
+{
+  struct stat sStat; /* Output of stat() on database file */
+  int rc = SQLITE_OK;
+  if (0 == osStat(zFile, &sStat))
+  {
+    *pMode = sStat.st_mode & 0777;
+    *pUid = sStat.st_uid;
+    *pGid = sStat.st_gid;
+  }
+  else
+  {
+    rc = SQLITE_IOERR_FSTAT;
+  }
+  return rc;
+}
+
+/*
+** This function is called by unixOpen() to determine the unix permissions
+** to create new files with. If no error occurs, then SQLITE_OK is returned
+** and a value suitable for passing as the third argument to open(2) is
+** written to *pMode. If an IO error occurs, an SQLite error code is
+** returned and the value of *pMode is not modified.
+**
+** In most cases, this routine sets *pMode to 0, which will become
+** an indication to robust_open() to create the file using
+** SQLITE_DEFAULT_FILE_PERMISSIONS adjusted by the umask.
+** But if the file being opened is a WAL or regular journal file, then
+** this function queries the file-system for the permissions on the
+** corresponding database file and sets *pMode to this value. Whenever
+** possible, WAL and journal files are created using the same permissions
+** as the associated database file.
+**
+** If the SQLITE_ENABLE_8_3_NAMES option is enabled, then the
+** original filename is unavailable.  But 8_3_NAMES is only used for
+** FAT filesystems and permissions do not matter there, so just use
+** the default permissions.
+*/
+static int findCreateFileMode(const char *zPath, /* Path of file (possibly) being created */
+                              int flags,         /* Flags passed as 4th argument to xOpen() */
+                              mode_t *pMode,     /* OUT: Permissions to open file with */
+                              uid_t *pUid,       /* OUT: uid to set on the file */
+                              gid_t *pGid        /* OUT: gid to set on the file */
+                              )
+{
+  int rc = SQLITE_OK; /* Return Code */
+  *pMode = 0;
+  *pUid = 0;
+  *pGid = 0;
+  if (flags & (SQLITE_OPEN_WAL | SQLITE_OPEN_MAIN_JOURNAL))
+  {
+    char zDb[MAX_PATHNAME + 1]; /* Database file path */
+    int nDb;                    /* Number of valid bytes in zDb */
+
+    /* zPath is a path to a WAL or journal file. The following block derives
+    ** the path to the associated database file from zPath. This block handles
+    ** the following naming conventions:
+    **
+    **   "<path to db>-journal"
+    **   "<path to db>-wal"
+    **   "<path to db>-journalNN"
+    **   "<path to db>-walNN"
+    **
+    ** where NN is a decimal number. The NN naming schemes are
+    ** used by the test_multiplex.c module.
+    */
+    nDb = sqlite3Strlen30(zPath) - 1;
+    while (zPath[nDb] != '-')
+    {
+      /* In normal operation, the journal file name will always contain
+      ** a '-' character.  However in 8+3 filename mode, or if a corrupt
+      ** rollback journal specifies a master journal with a goofy name, then
+      ** the '-' might be missing. */
+      if (nDb == 0 || zPath[nDb] == '.') return SQLITE_OK;
+      nDb--;
+    }
+    memcpy(zDb, zPath, nDb);
+    zDb[nDb] = '\0';
+
+    rc = getFileMode(zDb, pMode, pUid, pGid);
+  }
+  else if (flags & SQLITE_OPEN_DELETEONCLOSE)
+  {
+    *pMode = 0600;
+  }
+  else if (flags & SQLITE_OPEN_URI)
+  {
+    /* If this is a main database file and the file was opened using a URI
+    ** filename, check for the "modeof" parameter. If present, interpret
+    ** its value as a filename and try to copy the mode, uid and gid from
+    ** that file.  */
+    const char *z = sqlite3_uri_parameter(zPath, "modeof");
+    if (z)
+    {
+      rc = getFileMode(z, pMode, pUid, pGid);
+    }
+  }
+  return rc;
+}
+
+/*
+** Open the file zPath.
+**
 ** Previously, the SQLite OS layer used three functions in place of this
 ** one:
 **
-**     sqlite3OsOpenReadWrite();
-**     sqlite3OsOpenReadOnly();
-**     sqlite3OsOpenExclusive();
+**     sqlite3OsOpenReadWrite();
+**     sqlite3OsOpenReadOnly();
+**     sqlite3OsOpenExclusive();
+**
+** These calls correspond to the following combinations of flags:
+**
+**     ReadWrite() ->     (READWRITE | CREATE)
+**     ReadOnly()  ->     (READONLY)
+**     OpenExclusive() -> (READWRITE | CREATE | EXCLUSIVE)
+**
+** The old OpenExclusive() accepted a boolean argument - "delFlag". If
+** true, the file was configured to be automatically deleted when the
+** file handle closed. To achieve the same effect using this new
+** interface, add the DELETEONCLOSE flag to those specified above for
+** OpenExclusive().
+*/
+static int unixOpen(sqlite3_vfs *pVfs,   /* The VFS for which this is the xOpen method */
+                    const char *zPath,   /* Pathname of file to be opened */
+                    sqlite3_file *pFile, /* The file descriptor to be filled in */
+                    int flags,           /* Input flags to control the opening */
+                    int *pOutFlags       /* Output flags returned to SQLite core */
+                    )
+{
+  unixFile *p = (unixFile *)pFile;
+  int fd = -1;                    /* File descriptor returned by open() */
+  int openFlags = 0;              /* Flags to pass to open() */
+  int eType = flags & 0xFFFFFF00; /* Type of file to open */
+  int noLock;                     /* True to omit locking primitives */
+  int rc = SQLITE_OK;             /* Function Return Code */
+  int ctrlFlags = 0;              /* UNIXFILE_* flags */
+  int eSync = UNIX_SYNC_FSYNC;    /* Sync strategy of a -wal file or journal */
+  int bRecycle = 0;               /* True for a -wal file kept by "wal_recycle" */
+
+  int isExclusive = (flags & SQLITE_OPEN_EXCLUSIVE);
+  int isDelete = (flags & SQLITE_OPEN_DELETEONCLOSE);
+  int isCreate = (flags & SQLITE_OPEN_CREATE);
+  int isReadonly = (flags & SQLITE_OPEN_READONLY);
+  int isReadWrite = (flags & SQLITE_OPEN_READWRITE);
+#if SQLITE_ENABLE_LOCKING_STYLE
+  int isAutoProxy = (flags & SQLITE_OPEN_AUTOPROXY);
+#endif
+
+  /* If creating a master or main-file journal, this function will open
+  ** a file-descriptor on the directory too. The first time unixSync()
+  ** is called the directory file descriptor will be fsync()ed and close()d.
+  */
+  int isNewJrnl = (isCreate && (eType == SQLITE_OPEN_MASTER_JOURNAL || eType == SQLITE_OPEN_MAIN_JOURNAL ||
+                                eType == SQLITE_OPEN_WAL));
+
+  /* If argument zPath is a NULL pointer, this function is required to open
+  ** a temporary file. Use this buffer to store the file name in.
+  */
+  char zTmpname[MAX_PATHNAME + 2];
+  const char *zName = zPath;
+
+  /* If the WAL of this database was redirected with "wal_dir", the name of
+  ** the file actually opened. Owned by the unixFile on success. */
+  char *zRedirect = 0;
+  const char *zWal = 0; /* Name SQLite gave the -wal file, if opening one */
+
+  /* Check the following statements are true:
+  **
+  **   (a) Exactly one of the READWRITE and READONLY flags must be set, and
+  **   (b) if CREATE is set, then READWRITE must also be set, and
+  **   (c) if EXCLUSIVE is set, then CREATE must also be set.
+  **   (d) if DELETEONCLOSE is set, then CREATE must also be set.
+  */
+  assert((isReadonly == 0 || isReadWrite == 0) && (isReadWrite || isReadonly));
+  assert(isCreate == 0 || isReadWrite);
+  assert(isExclusive == 0 || isCreate);
+  assert(isDelete == 0 || isCreate);
+
+  /* The main DB, main journal, WAL file and master journal are never
+  ** automatically deleted. Nor are they ever temporary files.  */
+  assert((!isDelete && zName) || eType != SQLITE_OPEN_MAIN_DB);
+  assert((!isDelete && zName) || eType != SQLITE_OPEN_MAIN_JOURNAL);
+  assert((!isDelete && zName) || eType != SQLITE_OPEN_MASTER_JOURNAL);
+  assert((!isDelete && zName) || eType != SQLITE_OPEN_WAL);
+
+  /* Assert that the upper layer has set one of the "file-type" flags. */
+  assert(eType == SQLITE_OPEN_MAIN_DB || eType == SQLITE_OPEN_TEMP_DB || eType == SQLITE_OPEN_MAIN_JOURNAL ||
+         eType == SQLITE_OPEN_TEMP_JOURNAL || eType == SQLITE_OPEN_SUBJOURNAL || eType == SQLITE_OPEN_MASTER_JOURNAL ||
+         eType == SQLITE_OPEN_TRANSIENT_DB || eType == SQLITE_OPEN_WAL);
+
+  /* Detect a pid change and reset the PRNG.  There is a race condition
+  ** here such that two or more threads all trying to open databases at
+  ** the same instant might all reset the PRNG.  But multiple resets
+  ** are harmless.
+  */
+  if (randomnessPid != osGetpid(0))
+  {
+    randomnessPid = osGetpid(0);
+    sqlite3_randomness(0, 0);
+  }
+  memset(p, 0, sizeof(unixFile));
+
+  if (eType == SQLITE_OPEN_MAIN_DB && unixVfsIsOfd(pVfs))
+  {
+    /* A file with OFD locks is closed at once by ofdClose(), so there is
+    ** never a deferred file descriptor to reuse or to preallocate for. */
+    assert((flags & SQLITE_OPEN_URI) || zName[strlen(zName) + 1] == 0);
+  }
+  else if (eType == SQLITE_OPEN_MAIN_DB)
+  {
+    UnixUnusedFd *pUnused;
+    pUnused = findReusableFd(zName, flags);
+    if (pUnused)
+    {
+      fd = pUnused->fd;
+    }
+    else
+    {
+      pUnused = (UnixUnusedFd *)vfspool_alloc(&unusedFdPool, sizeof(*pUnused));
+      if (!pUnused)
+      {
+        return SQLITE_NOMEM;
+      }
+    }
+    p->pPreallocatedUnused = pUnused;
+
+    /* Database filenames are double-zero terminated if they are not
+    ** URIs with parameters.  Hence, they can always be passed into
+    ** sqlite3_uri_parameter(). */
+    assert((flags & SQLITE_OPEN_URI) || zName[strlen(zName) + 1] == 0);
+  }
+  else if (!zName)
+  {
+    /* If zName is NULL, the upper layer is requesting a temp file. */
+    assert(isDelete && !isNewJrnl);
+    rc = unixGetTempname(pVfs->mxPathname, zTmpname);
+    if (rc != SQLITE_OK)
+    {
+      return rc;
+    }
+    zName = zTmpname;
+
+    /* Generated temporary filenames are always double-zero terminated
+    ** for use by sqlite3_uri_parameter(). */
+    assert(zName[strlen(zName) + 1] == 0);
+  }
+
+  /* Determine the value of the flags parameter passed to POSIX function
+  ** open(). These must be calculated even if open() is not called, as
+  ** they may be stored as part of the file handle and used by the
+  ** 'conch file' locking functions later on.  */
+  if (isReadonly) openFlags |= O_RDONLY;
+  if (isReadWrite) openFlags |= O_RDWR;
+  if (isCreate) openFlags |= O_CREAT;
+  if (isExclusive) openFlags |= (O_EXCL | O_NOFOLLOW);
+  openFlags |= (O_LARGEFILE | O_BINARY);
+
+  if (fd < 0)
+  {
+    mode_t openMode; /* Permissions to create file with */
+    uid_t uid;       /* Userid for the file */
+    gid_t gid;       /* Groupid for the file */
+    rc = findCreateFileMode(zName, flags, &openMode, &uid, &gid);
+    if (rc != SQLITE_OK)
+    {
+      assert(!p->pPreallocatedUnused);
+      assert(eType == SQLITE_OPEN_WAL || eType == SQLITE_OPEN_MAIN_JOURNAL);
+      return rc;
+    }
+    if ((eType == SQLITE_OPEN_WAL || eType == SQLITE_OPEN_MAIN_JOURNAL) &&
+        __atomic_load_n(&nSyncInode, __ATOMIC_RELAXED))
+    {
+      eSync = unixSyncFileMode(zName, eType);
+      if (eSync == UNIX_SYNC_DSYNC) openFlags |= O_DSYNC;
+    }
+    if (eType == SQLITE_OPEN_WAL)
+    {
+      zWal = zName;
+      zRedirect = unixWalRedirect(zName);
+      if (zRedirect) zName = zPath = zRedirect;
+      if (isCreate)
+      {
+        i64 szSpare = 0;
+        bRecycle = unixWalRecycle(zWal, &szSpare);
+        if (bRecycle) unixWalSpareTake(zName, szSpare, openMode);
+      }
+    }
+    fd = robust_open(zName, openFlags, openMode);
+    OSTRACE(("OPENX   %-3d %s 0%o\n", fd, zName, openFlags));
+    assert(!isExclusive || (openFlags & O_CREAT) != 0);
+    if (fd < 0)
+    {
+      if (isNewJrnl && errno == EACCES && osAccess(zName, F_OK))
+      {
+        /* If unable to create a journal because the directory is not
+        ** writable, change the error code to indicate that. */
+        rc = SQLITE_READONLY_DIRECTORY;
+      }
+      else if (errno != EISDIR && isReadWrite)
+      {
+        /* Failed to open the file for read/write access. Try read-only. */
+        flags &= ~(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+        openFlags &= ~(O_RDWR | O_CREAT);
+        flags |= SQLITE_OPEN_READONLY;
+        openFlags |= O_RDONLY;
+        isReadonly = 1;
+        fd = robust_open(zName, openFlags, openMode);
+      }
+    }
+    if (fd < 0)
+    {
+      int rc2 = unixLogError(SQLITE_CANTOPEN, "open", zName);
+      if (rc == SQLITE_OK) rc = rc2;
+      goto open_finished;
+    }
+
+    /* If this process is running as root and if creating a new rollback
+    ** journal or WAL file, set the ownership of the journal or WAL to be
+    ** the same as the original database.
+    */
+    if (flags & (SQLITE_OPEN_WAL | SQLITE_OPEN_MAIN_JOURNAL))
+    {
+      robustFchown(fd, uid, gid);
+    }
+  }
+  assert(fd >= 0);
+  if (pOutFlags)
+  {
+    *pOutFlags = flags;
+  }
+
+  if (p->pPreallocatedUnused)
+  {
+    p->pPreallocatedUnused->fd = fd;
+    p->pPreallocatedUnused->flags = flags;
+  }
+
+  if (isDelete)
+  {
+#if defined(SQLITE_UNLINK_AFTER_CLOSE)
+    zPath = sqlite3_mprintf("%s", zName);
+    if (zPath == 0)
+    {
+      robust_close(p, fd, __LINE__);
+      return SQLITE_NOMEM_BKPT;
+    }
+#else
+    osUnlink(zName);
+#endif
+  }
+#if SQLITE_ENABLE_LOCKING_STYLE
+  else
+  {
+    p->openFlags = openFlags;
+  }
+#endif
+
+#if defined(__APPLE__) || SQLITE_ENABLE_LOCKING_STYLE
+  if (fstatfs(fd, &fsInfo) == -1)
+  {
+    storeLastErrno(p, errno);
+    robust_close(p, fd, __LINE__);
+    return SQLITE_IOERR_ACCESS;
+  }
+  if (0 == strncmp("msdos", fsInfo.f_fstypename, 5))
+  {
+    ((unixFile *)pFile)->fsFlags |= SQLITE_FSFLAGS_IS_MSDOS;
+  }
+  if (0 == strncmp("exfat", fsInfo.f_fstypename, 5))
+  {
+    ((unixFile *)pFile)->fsFlags |= SQLITE_FSFLAGS_IS_MSDOS;
+  }
+#endif
+
+  /* Set up appropriate ctrlFlags */
+  if (isDelete) ctrlFlags |= UNIXFILE_DELETE;
+  if (isReadonly) ctrlFlags |= UNIXFILE_RDONLY;
+  noLock = eType != SQLITE_OPEN_MAIN_DB;
+  if (noLock) ctrlFlags |= UNIXFILE_NOLOCK;
+  if (isNewJrnl) ctrlFlags |= UNIXFILE_DIRSYNC;
+  if ((flags & SQLITE_OPEN_URI) && zRedirect == 0) ctrlFlags |= UNIXFILE_URI;
+
+#if SQLITE_ENABLE_LOCKING_STYLE
+#if SQLITE_PREFER_PROXY_LOCKING
+  isAutoProxy = 1;
+#endif
+  if (isAutoProxy && (zPath != NULL) && (!noLock) && pVfs->xOpen)
+  {
+    char *envforce = getenv("SQLITE_FORCE_PROXY_LOCKING");
+    int useProxy = 0;
+
+    /* SQLITE_FORCE_PROXY_LOCKING==1 means force always use proxy, 0 means
+    ** never use proxy, NULL means use proxy for non-local files only.  */
+    if (envforce != NULL)
+    {
+      useProxy = atoi(envforce) > 0;
+    }
+    else
+    {
+      useProxy = !(fsInfo.f_flags & MNT_LOCAL);
+    }
+    if (useProxy)
+    {
+      rc = fillInUnixFile(pVfs, fd, pFile, zPath, ctrlFlags);
+      if (rc == SQLITE_OK)
+      {
+        rc = proxyTransformUnixFile((unixFile *)pFile, ":auto:");
+        if (rc != SQLITE_OK)
+        {
+          /* Use unixClose to clean up the resources added in fillInUnixFile
+          ** and clear all the structure's references.  Specifically,
+          ** pFile->pMethods will be NULL so sqlite3OsClose will be a no-op
+          */
+          unixClose(pFile);
+          return rc;
+        }
+      }
+      goto open_finished;
+    }
+  }
+#endif
+
+  assert(zPath == 0 || zPath[0] == '/' || eType == SQLITE_OPEN_MASTER_JOURNAL || eType == SQLITE_OPEN_MAIN_JOURNAL);
+  rc = fillInUnixFile(pVfs, fd, pFile, zPath, ctrlFlags);
+  if (rc == SQLITE_OK && eType == SQLITE_OPEN_MAIN_DB)
+  {
+    p->eSync = (u8)unixSyncResolve(p->eSync, UNIX_SYNC_ROLE_DB, zPath);
+  }
+  else if (rc == SQLITE_OK)
+  {
+    p->eSync = (u8)eSync;
+    if (bRecycle) p->ctrlFlags |= UNIXFILE_RECYCLE;
+    if (zWal) p->ctrlFlags |= UNIXFILE_WAL;
+  }
+  if (rc == SQLITE_OK && eType != SQLITE_OPEN_MAIN_DB && __atomic_load_n(&nHintInode, __ATOMIC_RELAXED))
+  {
+    unixWriteHintFile(p, zWal ? zWal : zName, eType);
+  }
+  if (rc == SQLITE_OK && zWal && __atomic_load_n(&nCkptInode, __ATOMIC_RELAXED))
+  {
+    unixCkptWal(p, zWal);
+  }
+  if (rc == SQLITE_OK && zWal && __atomic_load_n(&nShipInode, __ATOMIC_RELAXED))
+  {
+    char zDb[MAX_PATHNAME + 1];
+    unixInodeInfo *pDbInode = unixWalDbInode(zWal, zDb);
+    if (pDbInode)
+    {
+      if (pDbInode->pShip)
+      {
+        p->pShip = pDbInode->pShip;
+        unixEnterMutex();
+        p->pShip->nRef++;
+        unixLeaveMutex();
+      }
+      unixLeaveInodeMutex(pDbInode);
+    }
+  }
+  if (rc == SQLITE_OK && zWal && __atomic_load_n(&nPreallocInode, __ATOMIC_RELAXED))
+  {
+    unixPreallocWal(p, zWal);
+  }
+  if (rc == SQLITE_OK && zWal)
+  {
+    rc = unixDirectWalOpen(p, zWal, openFlags);
+    if (rc != SQLITE_OK) p->pMethod->xClose(pFile);
+  }
+  if (rc == SQLITE_OK && zWal && (flags & SQLITE_OPEN_READWRITE) && pVfs->pAppData == (void *)&uringIoFinder &&
+      p->pDirectWal == 0)
+  {
+    p->pUring = uringOpen(p);
+  }
+  if (rc == SQLITE_OK && zWal && __atomic_load_n(&nCombineInode, __ATOMIC_RELAXED) &&
+      pVfs->pAppData != (void *)&uringIoFinder && p->pDirectWal == 0)
+  {
+    unixCombineWal(p, zWal);
+  }
+
+open_finished:
+  if (rc != SQLITE_OK)
+  {
+    vfspool_free(p->pPreallocatedUnused);
+    sqlite3_free(zRedirect);
+  }
+  else
+  {
+    p->zRedirectPath = zRedirect;
+    p->pStat = vfsstat_open(pVfs->zName, zPath, flags);
+  }
+  return rc;
+}
+
+/*
+** Delete the file at zPath. If the dirSync argument is true, fsync()
+** the directory after deleting the file.
+*/
+static int unixDelete(sqlite3_vfs *NotUsed, /* VFS containing this as the xDelete method */
+                      const char *zPath,    /* Name of file to be deleted */
+                      int dirSync           /* If true, fsync() directory after deleting file */
+                      )
+{
+  int rc = SQLITE_OK;
+  char *zRedirect;          /* Actual WAL name if "wal_dir" is in effect */
+  const char *zWal = zPath; /* Name SQLite uses for zPath */
+  i64 szSpare;              /* "wal_spare" if zPath is a recycled -wal file */
+  UNUSED_PARAMETER(NotUsed);
+  SimulateIOError(return SQLITE_IOERR_DELETE);
+  zRedirect = unixWalRedirect(zPath);
+  if (zRedirect) zPath = zRedirect;
+  if (unixWalRecycle(zWal, &szSpare) && unixWalRecycleDelete(zPath))
+  {
+    /* Kept as the spare of the next -wal file */
+  }
+  else if (osUnlink(zPath) == (-1))
+  {
+    if (errno == ENOENT
+        )
+    {
+      rc = SQLITE_IOERR_DELETE_NOENT;
+    }
+    else
+    {
+      rc = unixLogError(SQLITE_IOERR_DELETE, "unlink", zPath);
+    }
+    sqlite3_free(zRedirect);
+    return rc;
+  }
+  if (__atomic_load_n(&nSplitInode, __ATOMIC_RELAXED))
+  {
+    /* Remove the frame headers of a -wal file in the direct I/O layout */
+    char zDb[MAX_PATHNAME + 1];
+    char zHdr[MAX_PATHNAME + 5];
+    unixInodeInfo *pDbInode = unixWalDbInode(zWal, zDb);
+    if (pDbInode)
+    {
+      int bDirect = pDbInode->eWalLayout == UNIX_WAL_LAYOUT_SPLIT;
+      unixLeaveInodeMutex(pDbInode);
+      sqlite3_snprintf(sizeof(zHdr), zHdr, "%s-hdr", zPath);
+      if (bDirect && osUnlink(zHdr) && errno != ENOENT)
+      {
+        rc = unixLogError(SQLITE_IOERR_DELETE, "unlink", zHdr);
+      }
+    }
+  }
+#ifndef SQLITE_DISABLE_DIRSYNC
+  if ((dirSync & 1) != 0)
+  {
+    int fd;
+    rc = osOpenDirectory(zPath, &fd);
+    if (rc == SQLITE_OK)
+    {
+      if (full_fsync(fd, 0, 0))
+      {
+        rc = unixLogError(SQLITE_IOERR_DIR_FSYNC, "fsync", zPath);
+      }
+      robust_close(0, fd, __LINE__);
+    }
+    else
+    {
+      assert(rc == SQLITE_CANTOPEN);
+      rc = SQLITE_OK;
+    }
+  }
+#endif
+  sqlite3_free(zRedirect);
+  return rc;
+}
+
+/*
+** Test the existence of or access permissions of file zPath. The
+** test performed depends on the value of flags:
+**
+**     SQLITE_ACCESS_EXISTS: Return 1 if the file exists
+**     SQLITE_ACCESS_READWRITE: Return 1 if the file is read and writable.
+**     SQLITE_ACCESS_READONLY: Return 1 if the file is readable.
 **
-** These calls correspond to the following combinations of flags:
+** Otherwise return 0.
+*/
+static int unixAccess(sqlite3_vfs *NotUsed, /* The VFS containing this xAccess method */
+                      const char *zPath,    /* Path of the file to examine */
+                      int flags,            /* What do we want to learn about the zPath file? */
+                      int *pResOut          /* Write result boolean here */
+                      )
+{
+  UNUSED_PARAMETER(NotUsed);
+  SimulateIOError(return SQLITE_IOERR_ACCESS;);
+  assert(pResOut != 0);
+
+  /* The spec says there are three possible values for flags.  But only
+  ** two of them are actually used */
+  assert(flags == SQLITE_ACCESS_EXISTS || flags == SQLITE_ACCESS_READWRITE);
+
+  if (flags == SQLITE_ACCESS_EXISTS)
+  {
+    struct stat buf;
+    char *zRedirect = unixWalRedirect(zPath);
+    *pResOut = (0 == osStat(zRedirect ? zRedirect : zPath, &buf) && buf.st_size > 0);
+    sqlite3_free(zRedirect);
+  }
+  else
+  {
+    *pResOut = osAccess(zPath, W_OK | R_OK) == 0;
+  }
+  return SQLITE_OK;
+}
+
+/*
 **
-**     ReadWrite() ->     (READWRITE | CREATE)
-**     ReadOnly()  ->     (READONLY)
-**     OpenExclusive() -> (READWRITE | CREATE | EXCLUSIVE)
+*/
+static int mkFullPathname(const char *zPath, /* Input path */
+                          char *zOut,        /* Output buffer */
+                          int nOut           /* Allocated size of buffer zOut */
+                          )
+{
+  int nPath = sqlite3Strlen30(zPath);
+  int iOff = 0;
+  if (zPath[0] != '/')
+  {
+    if (osGetcwd(zOut, nOut - 2) == 0)
+    {
+      return unixLogError(SQLITE_CANTOPEN, "getcwd", zPath);
+    }
+    iOff = sqlite3Strlen30(zOut);
+    zOut[iOff++] = '/';
+  }
+  if ((iOff + nPath + 1) > nOut)
+  {
+    /* SQLite assumes that xFullPathname() nul-terminates the output buffer
+    ** even if it returns an error.  */
+    zOut[iOff] = '\0';
+    return SQLITE_CANTOPEN;
+  }
+  sqlite3_snprintf(nOut - iOff, &zOut[iOff], "%s", zPath);
+  return SQLITE_OK;
+}
+
+/*
+** Turn a relative pathname into a full pathname. The relative path
+** is stored as a nul-terminated string in the buffer pointed to by
+** zPath.
 **
-** The old OpenExclusive() accepted a boolean argument - "delFlag". If
-** true, the file was configured to be automatically deleted when the
-** file handle closed. To achieve the same effect using this new
-** interface, add the DELETEONCLOSE flag to those specified above for
-** OpenExclusive().
+** zOut points to a buffer of at least sqlite3_vfs.mxPathname bytes
+** (in this case, MAX_PATHNAME bytes). The full-path is written to
+** this buffer before returning.
+*/
+static int unixFullPathname(sqlite3_vfs *pVfs, /* Pointer to vfs object */
+                            const char *zPath, /* Possibly relative input path */
+                            int nOut,          /* Size of output buffer in bytes */
+                            char *zOut         /* Output buffer */
+                            )
+{
+#if !defined(HAVE_READLINK) || !defined(HAVE_LSTAT)
+  return mkFullPathname(zPath, zOut, nOut);
+#else
+  int rc = SQLITE_OK;
+  int nByte;
+  int nLink = 1;           /* Number of symbolic links followed so far */
+  const char *zIn = zPath; /* Input path for each iteration of loop */
+  char *zDel = 0;
+
+  assert(pVfs->mxPathname == MAX_PATHNAME);
+  UNUSED_PARAMETER(pVfs);
+
+  /* It's odd to simulate an io-error here, but really this is just
+  ** using the io-error infrastructure to test that SQLite handles this
+  ** function failing. This function could fail if, for example, the
+  ** current working directory has been unlinked.
+  */
+  SimulateIOError(return SQLITE_ERROR);
+
+  do
+  {
+    /* Call stat() on path zIn. Set bLink to true if the path is a symbolic
+    ** link, or false otherwise.  */
+    int bLink = 0;
+    struct stat buf;
+    if (osLstat(zIn, &buf) != 0)
+    {
+      if (errno != ENOENT)
+      {
+        rc = unixLogError(SQLITE_CANTOPEN_BKPT, "lstat", zIn);
+      }
+    }
+    else
+    {
+      bLink = S_ISLNK(buf.st_mode);
+    }
+
+    if (bLink)
+    {
+      if (zDel == 0)
+      {
+        zDel = sqlite3_malloc(nOut);
+        if (zDel == 0) rc = SQLITE_NOMEM_BKPT;
+      }
+      else if (++nLink > SQLITE_MAX_SYMLINKS)
+      {
+        rc = SQLITE_CANTOPEN_BKPT;
+      }
+
+      if (rc == SQLITE_OK)
+      {
+        nByte = osReadlink(zIn, zDel, nOut - 1);
+        if (nByte < 0)
+        {
+          rc = unixLogError(SQLITE_CANTOPEN_BKPT, "readlink", zIn);
+        }
+        else
+        {
+          if (zDel[0] != '/')
+          {
+            int n;
+            for (n = sqlite3Strlen30(zIn); n > 0 && zIn[n - 1] != '/'; n--)
+              ;
+            if (nByte + n + 1 > nOut)
+            {
+              rc = SQLITE_CANTOPEN_BKPT;
+            }
+            else
+            {
+              memmove(&zDel[n], zDel, nByte + 1);
+              memcpy(zDel, zIn, n);
+              nByte += n;
+            }
+          }
+          zDel[nByte] = '\0';
+        }
+      }
+
+      zIn = zDel;
+    }
+
+    assert(rc != SQLITE_OK || zIn != zOut || zIn[0] == '/');
+    if (rc == SQLITE_OK && zIn != zOut)
+    {
+      rc = mkFullPathname(zIn, zOut, nOut);
+    }
+    if (bLink == 0) break;
+    zIn = zOut;
+  } while (rc == SQLITE_OK);
+
+  sqlite3_free(zDel);
+  return rc;
+#endif /* HAVE_READLINK && HAVE_LSTAT */
+}
+
+#ifndef SQLITE_OMIT_LOAD_EXTENSION
+/*
+** Interfaces for opening a shared library, finding entry points
+** within the shared library, and closing the shared library.
+*/
+#include <dlfcn.h>
+static void *unixDlOpen(sqlite3_vfs *NotUsed, const char *zFilename)
+{
+  UNUSED_PARAMETER(NotUsed);
+  return dlopen(zFilename, RTLD_NOW | RTLD_GLOBAL);
+}
+
+/*
+** SQLite calls this function immediately after a call to unixDlSym() or
+** unixDlOpen() fails (returns a null pointer). If a more detailed error
+** message is available, it is written to zBufOut. If no error message
+** is available, zBufOut is left unmodified and SQLite uses a default
+** error message.
+*/
+static void unixDlError(sqlite3_vfs *NotUsed, int nBuf, char *zBufOut)
+{
+  const char *zErr;
+  UNUSED_PARAMETER(NotUsed);
+  unixEnterMutex();
+  zErr = dlerror();
+  if (zErr)
+  {
+    sqlite3_snprintf(nBuf, zBufOut, "%s", zErr);
+  }
+  unixLeaveMutex();
+}
+static void (*unixDlSym(sqlite3_vfs *NotUsed, void *p, const char *zSym))(void)
+{
+  /*
+  ** GCC with -pedantic-errors says that C90 does not allow a void* to be
+  ** cast into a pointer to a function.  And yet the library dlsym() routine
+  ** returns a void* which is really a pointer to a function.  So how do we
+  ** use dlsym() with -pedantic-errors?
+  **
+  ** Variable x below is defined to be a pointer to a function taking
+  ** parameters void* and const char* and returning a pointer to a function.
+  ** We initialize x by assigning it a pointer to the dlsym() function.
+  ** (That assignment requires a cast.)  Then we call the function that
+  ** x points to.
+  **
+  ** This work-around is unlikely to work correctly on any system where
+  ** you really cannot cast a function pointer into void*.  But then, on the
+  ** other hand, dlsym() will not work on such a system either, so we have
+  ** not really lost anything.
+  */
+  void (*(*x)(void *, const char *))(void);
+  UNUSED_PARAMETER(NotUsed);
+  x = (void (*(*)(void *, const char *))(void))dlsym;
+  return (*x)(p, zSym);
+}
+static void unixDlClose(sqlite3_vfs *NotUsed, void *pHandle)
+{
+  UNUSED_PARAMETER(NotUsed);
+  dlclose(pHandle);
+}
+#else /* if SQLITE_OMIT_LOAD_EXTENSION is defined: */
+#define unixDlOpen 0
+#define unixDlError 0
+#define unixDlSym 0
+#define unixDlClose 0
+#endif
+
+/*
+** Write nBuf bytes of random data to the supplied buffer zBuf.
 */
-static int unixOpen(sqlite3_vfs *pVfs,   /* The VFS for which this is the xOpen method */
-                    const char *zPath,   /* Pathname of file to be opened */
-                    sqlite3_file *pFile, /* The file descriptor to be filled in */
-                    int flags,           /* Input flags to control the opening */
-                    int *pOutFlags       /* Output flags returned to SQLite core */
-                    )
+static int unixRandomness(sqlite3_vfs *NotUsed, int nBuf, char *zBuf)
 {
-  unixFile *p = (unixFile *)pFile;
-  int fd = -1;                    /* File descriptor returned by open() */
-  int openFlags = 0;              /* Flags to pass to open() */
-  int eType = flags & 0xFFFFFF00; /* Type of file to open */
-  int noLock;                     /* True to omit locking primitives */
-  int rc = SQLITE_OK;             /* Function Return Code */
-  int ctrlFlags = 0;              /* UNIXFILE_* flags */
+  UNUSED_PARAMETER(NotUsed);
+  assert((size_t)nBuf >= (sizeof(time_t) + sizeof(int)));
 
-  int isExclusive = (flags & SQLITE_OPEN_EXCLUSIVE);
-  int isDelete = (flags & SQLITE_OPEN_DELETEONCLOSE);
-  int isCreate = (flags & SQLITE_OPEN_CREATE);
-  int isReadonly = (flags & SQLITE_OPEN_READONLY);
-  int isReadWrite = (flags & SQLITE_OPEN_READWRITE);
-#if SQLITE_ENABLE_LOCKING_STYLE
-  int isAutoProxy = (flags & SQLITE_OPEN_AUTOPROXY);
+  /* We have to initialize zBuf to prevent valgrind from reporting
+  ** errors.  The reports issued by valgrind are incorrect - we would
+  ** prefer that the randomness be increased by making use of the
+  ** uninitialized space in zBuf - but valgrind errors tend to worry
+  ** some users.  Rather than argue, it seems easier just to initialize
+  ** the whole array and silence valgrind, even if that means less randomness
+  ** in the random seed.
+  **
+  ** When testing, initializing zBuf[] to zero is all we do.  That means
+  ** that we always use the same random number sequence.  This makes the
+  ** tests repeatable.
+  */
+  memset(zBuf, 0, nBuf);
+  randomnessPid = osGetpid(0);
+#if !defined(SQLITE_TEST) && !defined(SQLITE_OMIT_RANDOMNESS)
+  {
+    int fd, got;
+    fd = robust_open("/dev/urandom", O_RDONLY, 0);
+    if (fd < 0)
+    {
+      time_t t;
+      time(&t);
+      memcpy(zBuf, &t, sizeof(t));
+      memcpy(&zBuf[sizeof(t)], &randomnessPid, sizeof(randomnessPid));
+      assert(sizeof(t) + sizeof(randomnessPid) <= (size_t)nBuf);
+      nBuf = sizeof(t) + sizeof(randomnessPid);
+    }
+    else
+    {
+      do
+      {
+        got = osRead(fd, zBuf, nBuf);
+      } while (got < 0 && errno == EINTR);
+      robust_close(0, fd, __LINE__);
+    }
+  }
 #endif
+  return nBuf;
+}
 
-  /* If creating a master or main-file journal, this function will open
-  ** a file-descriptor on the directory too. The first time unixSync()
-  ** is called the directory file descriptor will be fsync()ed and close()d.
-  */
-  int isNewJrnl = (isCreate && (eType == SQLITE_OPEN_MASTER_JOURNAL || eType == SQLITE_OPEN_MAIN_JOURNAL ||
-                                eType == SQLITE_OPEN_WAL));
+/*
+** Sleep for a little while.  Return the amount of time slept.
+** The argument is the number of microseconds we want to sleep.
+** The return value is the number of microseconds of sleep actually
+** requested from the underlying operating system, a number which
+** might be greater than or equal to the argument, but not less
+** than the argument.
+*/
+static int unixSleep(sqlite3_vfs *NotUsed, int microseconds)
+{
+#if defined(HAVE_USLEEP) && HAVE_USLEEP
+  usleep(microseconds);
+  UNUSED_PARAMETER(NotUsed);
+  return microseconds;
+#else
+  int seconds = (microseconds + 999999) / 1000000;
+  sleep(seconds);
+  UNUSED_PARAMETER(NotUsed);
+  return seconds * 1000000;
+#endif
+}
 
-  /* If argument zPath is a NULL pointer, this function is required to open
-  ** a temporary file. Use this buffer to store the file name in.
-  */
-  char zTmpname[MAX_PATHNAME + 2];
-  const char *zName = zPath;
+/*
+** Find the current time (in Universal Coordinated Time).  Write into *piNow
+** the current time and date as a Julian Day number times 86_400_000.  In
+** other words, write into *piNow the number of milliseconds since the Julian
+** epoch of noon in Greenwich on November 24, 4714 B.C according to the
+** proleptic Gregorian calendar.
+**
+** On success, return SQLITE_OK.  Return SQLITE_ERROR if the time and date
+** cannot be found.
+*/
+static int unixCurrentTimeInt64(sqlite3_vfs *NotUsed, sqlite3_int64 *piNow)
+{
+  static const sqlite3_int64 unixEpoch = 24405875 * (sqlite3_int64)8640000;
+  int rc = SQLITE_OK;
+#if defined(NO_GETTOD)
+  time_t t;
+  time(&t);
+  *piNow = ((sqlite3_int64)t) * 1000 + unixEpoch;
+#else
+  struct timeval sNow;
+  (void)gettimeofday(&sNow, 0); /* Cannot fail given valid arguments */
+  *piNow = unixEpoch + 1000 * (sqlite3_int64)sNow.tv_sec + sNow.tv_usec / 1000;
+#endif
 
-  /* Check the following statements are true:
-  **
-  **   (a) Exactly one of the READWRITE and READONLY flags must be set, and
-  **   (b) if CREATE is set, then READWRITE must also be set, and
-  **   (c) if EXCLUSIVE is set, then CREATE must also be set.
-  **   (d) if DELETEONCLOSE is set, then CREATE must also be set.
-  */
-  assert((isReadonly == 0 || isReadWrite == 0) && (isReadWrite || isReadonly));
-  assert(isCreate == 0 || isReadWrite);
-  assert(isExclusive == 0 || isCreate);
-  assert(isDelete == 0 || isCreate);
+  UNUSED_PARAMETER(NotUsed);
+  return rc;
+}
 
-  /* The main DB, main journal, WAL file and master journal are never
-  ** automatically deleted. Nor are they ever temporary files.  */
-  assert((!isDelete && zName) || eType != SQLITE_OPEN_MAIN_DB);
-  assert((!isDelete && zName) || eType != SQLITE_OPEN_MAIN_JOURNAL);
-  assert((!isDelete && zName) || eType != SQLITE_OPEN_MASTER_JOURNAL);
-  assert((!isDelete && zName) || eType != SQLITE_OPEN_WAL);
+#ifndef SQLITE_OMIT_DEPRECATED
+/*
+** Find the current time (in Universal Coordinated Time).  Write the
+** current time and date as a Julian Day number into *prNow and
+** return 0.  Return 1 if the time and date cannot be found.
+*/
+static int unixCurrentTime(sqlite3_vfs *NotUsed, double *prNow)
+{
+  sqlite3_int64 i = 0;
+  int rc;
+  UNUSED_PARAMETER(NotUsed);
+  rc = unixCurrentTimeInt64(0, &i);
+  *prNow = i / 86400000.0;
+  return rc;
+}
+#else
+#define unixCurrentTime 0
+#endif
 
-  /* Assert that the upper layer has set one of the "file-type" flags. */
-  assert(eType == SQLITE_OPEN_MAIN_DB || eType == SQLITE_OPEN_TEMP_DB || eType == SQLITE_OPEN_MAIN_JOURNAL ||
-         eType == SQLITE_OPEN_TEMP_JOURNAL || eType == SQLITE_OPEN_SUBJOURNAL || eType == SQLITE_OPEN_MASTER_JOURNAL ||
-         eType == SQLITE_OPEN_TRANSIENT_DB || eType == SQLITE_OPEN_WAL);
+/*
+** The xGetLastError() method is designed to return a better
+** low-level error message when operating-system problems come up
+** during SQLite operation.  Only the integer return code is currently
+** used.
+*/
+static int unixGetLastError(sqlite3_vfs *NotUsed, int NotUsed2, char *NotUsed3)
+{
+  UNUSED_PARAMETER(NotUsed);
+  UNUSED_PARAMETER(NotUsed2);
+  UNUSED_PARAMETER(NotUsed3);
+  return errno;
+}
 
-  /* Detect a pid change and reset the PRNG.  There is a race condition
-  ** here such that two or more threads all trying to open databases at
-  ** the same instant might all reset the PRNG.  But multiple resets
-  ** are harmless.
-  */
-  if (randomnessPid != osGetpid(0))
-  {
-    randomnessPid = osGetpid(0);
-    sqlite3_randomness(0, 0);
+/*
+************************ End of sqlite3_vfs methods ***************************
+******************************************************************************/
+
+/*
+** Initialize the operating system interface.
+**
+** This routine registers all VFS implementations for unix-like operating
+** systems.  This routine, and the sqlite3_os_end() routine that follows,
+** should be the only routines in this file that are visible from other
+** files.
+**
+** This routine is called once during SQLite initialization and by a
+** single thread.  The memory allocation and mutex subsystems have not
+** necessarily been initialized when this routine is called, and so they
+** should not be used.
+*/
+int procvfs_init(void)
+{
+/*
+** The following macro defines an initializer for an sqlite3_vfs object.
+** The name of the VFS is NAME.  The pAppData is a pointer to a pointer
+** to the "finder" function.  (pAppData is a pointer to a pointer because
+** silly C90 rules prohibit a void* from being cast to a function pointer
+** and so we have to go through the intermediate pointer to avoid problems
+** when compiling with -pedantic-errors on GCC.)
+**
+** The FINDER parameter to this macro is the name of the pointer to the
+** finder-function.  The finder-function returns a pointer to the
+** sqlite_io_methods object that implements the desired locking
+** behaviors.  See the division above that contains the IOMETHODS
+** macro for addition information on finder-functions.
+**
+** Most finders simply return a pointer to a fixed sqlite3_io_methods
+** object.  But the "autolockIoFinder" available on MacOSX does a little
+** more than that; it looks at the filesystem type that hosts the
+** database file and tries to choose an locking method appropriate for
+** that filesystem time.
+*/
+#define UNIXVFS(VFSNAME, FINDER)                      \
+  {                                                   \
+    3,                        /* iVersion */          \
+        sizeof(unixFile),     /* szOsFile */          \
+        MAX_PATHNAME,         /* mxPathname */        \
+        0,                    /* pNext */             \
+        VFSNAME,              /* zName */             \
+        (void *)&FINDER,      /* pAppData */          \
+        unixOpen,             /* xOpen */             \
+        unixDelete,           /* xDelete */           \
+        unixAccess,           /* xAccess */           \
+        unixFullPathname,     /* xFullPathname */     \
+        unixDlOpen,           /* xDlOpen */           \
+        unixDlError,          /* xDlError */          \
+        unixDlSym,            /* xDlSym */            \
+        unixDlClose,          /* xDlClose */          \
+        unixRandomness,       /* xRandomness */       \
+        unixSleep,            /* xSleep */            \
+        unixCurrentTime,      /* xCurrentTime */      \
+        unixGetLastError,     /* xGetLastError */     \
+        unixCurrentTimeInt64, /* xCurrentTimeInt64 */ \
+        unixSetSystemCall,    /* xSetSystemCall */    \
+        unixGetSystemCall,    /* xGetSystemCall */    \
+        unixNextSystemCall,   /* xNextSystemCall */   \
   }
-  memset(p, 0, sizeof(unixFile));
 
-  if (eType == SQLITE_OPEN_MAIN_DB)
-  {
-    UnixUnusedFd *pUnused;
-    pUnused = findReusableFd(zName, flags);
-    if (pUnused)
-    {
-      fd = pUnused->fd;
-    }
-    else
-    {
-      pUnused = (UnixUnusedFd *)sqlite3_malloc64(sizeof(*pUnused));
-      if (!pUnused)
-      {
-        return SQLITE_NOMEM;
-      }
-    }
-    p->pPreallocatedUnused = pUnused;
+  /*
+  ** All default VFSes for unix are contained in the following array.
+  **
+  ** Note that the sqlite3_vfs.pNext field of the VFS object is modified
+  ** by the SQLite core when the VFS is registered.  So the following
+  ** array cannot be const.
+  */
+  static sqlite3_vfs aVfs[] = {
+      UNIXVFS("proc", posixIoFinder),
+      UNIXVFS("proc-uring", uringIoFinder),
+#if HAVE_OFD_LOCKS
+      UNIXVFS("proc-ofd", ofdIoFinder),
+#endif
+  };
+  unsigned int i; /* Loop counter */
+
+  /* Double-check that the aSyscall[] array has been constructed
+  ** correctly.  See ticket [bb3a86e890c8e96ab] */
+  assert(ArraySize(aSyscall) == 45);
 
-    /* Database filenames are double-zero terminated if they are not
-    ** URIs with parameters.  Hence, they can always be passed into
-    ** sqlite3_uri_parameter(). */
-    assert((flags & SQLITE_OPEN_URI) || zName[strlen(zName) + 1] == 0);
-  }
-  else if (!zName)
+  /* Register all VFSes defined in the aVfs[] array */
+  for (i = 0; i < (sizeof(aVfs) / sizeof(sqlite3_vfs)); i++)
   {
-    /* If zName is NULL, the upper layer is requesting a temp file. */
-    assert(isDelete && !isNewJrnl);
-    rc = unixGetTempname(pVfs->mxPathname, zTmpname);
-    if (rc != SQLITE_OK)
-    {
-      return rc;
-    }
-    zName = zTmpname;
-
-    /* Generated temporary filenames are always double-zero terminated
-    ** for use by sqlite3_uri_parameter(). */
-    assert(zName[strlen(zName) + 1] == 0);
+    sqlite3_vfs_register(&aVfs[i], i == 0);
   }
 
-  /* Determine the value of the flags parameter passed to POSIX function
-  ** open(). These must be calculated even if open() is not called, as
-  ** they may be stored as part of the file handle and used by the
-  ** 'conch file' locking functions later on.  */
-  if (isReadonly) openFlags |= O_RDONLY;
-  if (isReadWrite) openFlags |= O_RDWR;
-  if (isCreate) openFlags |= O_CREAT;
-  if (isExclusive) openFlags |= (O_EXCL | O_NOFOLLOW);
-  openFlags |= (O_LARGEFILE | O_BINARY);
+  /* Make the vfs_stat table available to every new connection */
+  return vfsstat_init();
+}
 
-  if (fd < 0)
+/*
+** Set process-wide defaults for the "wal_dir" and "shm_dir" URI parameters.
+** Either argument may be NULL or an empty string to keep the -wal or -shm
+** file next to the database.  Directories must be absolute paths.
+**
+** The defaults apply to databases opened after this call.  All processes
+** using a database must agree on where its -wal and -shm files are.
+*/
+int procvfs_set_directories(const char *zWalDir, const char *zShmDir)
+{
+  if ((zWalDir && zWalDir[0] && zWalDir[0] != '/') || (zShmDir && zShmDir[0] && zShmDir[0] != '/'))
   {
-    mode_t openMode; /* Permissions to create file with */
-    uid_t uid;       /* Userid for the file */
-    gid_t gid;       /* Groupid for the file */
-    rc = findCreateFileMode(zName, flags, &openMode, &uid, &gid);
-    if (rc != SQLITE_OK)
-    {
-      assert(!p->pPreallocatedUnused);
-      assert(eType == SQLITE_OPEN_WAL || eType == SQLITE_OPEN_MAIN_JOURNAL);
-      return rc;
-    }
-    fd = robust_open(zName, openFlags, openMode);
-    OSTRACE(("OPENX   %-3d %s 0%o\n", fd, zName, openFlags));
-    assert(!isExclusive || (openFlags & O_CREAT) != 0);
-    if (fd < 0)
-    {
-      if (isNewJrnl && errno == EACCES && osAccess(zName, F_OK))
-      {
-        /* If unable to create a journal because the directory is not
-        ** writable, change the error code to indicate that. */
-        rc = SQLITE_READONLY_DIRECTORY;
-      }
-      else if (errno != EISDIR && isReadWrite)
-      {
-        /* Failed to open the file for read/write access. Try read-only. */
-        flags &= ~(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
-        openFlags &= ~(O_RDWR | O_CREAT);
-        flags |= SQLITE_OPEN_READONLY;
-        openFlags |= O_RDONLY;
-        isReadonly = 1;
-        fd = robust_open(zName, openFlags, openMode);
-      }
-    }
-    if (fd < 0)
-    {
-      int rc2 = unixLogError(SQLITE_CANTOPEN, "open", zName);
-      if (rc == SQLITE_OK) rc = rc2;
-      goto open_finished;
-    }
-
-    /* If this process is running as root and if creating a new rollback
-    ** journal or WAL file, set the ownership of the journal or WAL to be
-    ** the same as the original database.
-    */
-    if (flags & (SQLITE_OPEN_WAL | SQLITE_OPEN_MAIN_JOURNAL))
-    {
-      robustFchown(fd, uid, gid);
-    }
+    return SQLITE_MISUSE;
   }
-  assert(fd >= 0);
-  if (pOutFlags)
+  if ((zWalDir && strlen(zWalDir) > MAX_PATHNAME - 64) || (zShmDir && strlen(zShmDir) > MAX_PATHNAME - 64))
   {
-    *pOutFlags = flags;
+    return SQLITE_TOOBIG;
   }
+  unixEnterMutex();
+  sqlite3_snprintf(sizeof(zDefaultWalDir), zDefaultWalDir, "%s", zWalDir ? zWalDir : "");
+  sqlite3_snprintf(sizeof(zDefaultShmDir), zDefaultShmDir, "%s", zShmDir ? zShmDir : "");
+  unixLeaveMutex();
+  return SQLITE_OK;
+}
 
-  if (p->pPreallocatedUnused)
+/*
+** Return the unixFile behind database zDbName of connection db, or NULL
+** if that database was not opened by this VFS.
+*/
+static unixFile *procvfsDbFile(sqlite3 *db, const char *zDbName)
+{
+  sqlite3_file *pFile = 0;
+  if (sqlite3_file_control(db, zDbName, SQLITE_FCNTL_FILE_POINTER, &pFile) != SQLITE_OK || pFile == 0 ||
+      pFile->pMethods == 0 || pFile->pMethods->xFileControl != unixFileControl)
   {
-    p->pPreallocatedUnused->fd = fd;
-    p->pPreallocatedUnused->flags = flags;
+    return 0;
   }
+  return (unixFile *)pFile;
+}
 
-  if (isDelete)
+/*
+** Stop every connection, in this process or any other, from changing the
+** database file zDbName of connection db until unixReleaseWriters() is
+** called.  A WAL database is protected by the checkpoint lock and any
+** other database by a SHARED lock.  A hot journal is rolled back first.
+**
+** The caller must hold the database connection mutex.  Return SQLITE_BUSY
+** if a checkpoint or write transaction is in progress.
+*/
+static int unixBlockWriters(sqlite3 *db, const char *zDbName, unixFile **ppFile, int *peHeld)
+{
+  unixFile *pFile;
+  char *zSql;
+  int rc;
+
+  *peHeld = 0;
+  zSql = sqlite3_mprintf("PRAGMA \"%w\".schema_version", zDbName ? zDbName : "main");
+  rc = zSql ? sqlite3_exec(db, zSql, 0, 0, 0) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) return rc;
+
+  pFile = procvfsDbFile(db, zDbName);
+  if (pFile == 0 || pFile->pInode == 0) return SQLITE_MISUSE;
+  if (pFile->pShm)
   {
-#if defined(SQLITE_UNLINK_AFTER_CLOSE)
-    zPath = sqlite3_mprintf("%s", zName);
-    if (zPath == 0)
-    {
-      robust_close(p, fd, __LINE__);
-      return SQLITE_NOMEM_BKPT;
-    }
-#else
-    osUnlink(zName);
-#endif
+    rc = unixShmLock((sqlite3_file *)pFile, WAL_CKPT_LOCK, 1, SQLITE_SHM_LOCK | SQLITE_SHM_EXCLUSIVE);
+    if (rc == SQLITE_OK) *peHeld = 1;
   }
-#if SQLITE_ENABLE_LOCKING_STYLE
-  else
+  else if (pFile->eFileLock == NO_LOCK)
   {
-    p->openFlags = openFlags;
+    rc = pFile->pMethod->xLock((sqlite3_file *)pFile, SHARED_LOCK);
+    if (rc == SQLITE_OK) *peHeld = 2;
   }
-#endif
-
-#if defined(__APPLE__) || SQLITE_ENABLE_LOCKING_STYLE
-  if (fstatfs(fd, &fsInfo) == -1)
+  else if (pFile->eFileLock > SHARED_LOCK)
   {
-    storeLastErrno(p, errno);
-    robust_close(p, fd, __LINE__);
-    return SQLITE_IOERR_ACCESS;
+    rc = SQLITE_BUSY;
   }
-  if (0 == strncmp("msdos", fsInfo.f_fstypename, 5))
+  *ppFile = pFile;
+  return rc;
+}
+
+/*
+** Release the lock taken by unixBlockWriters().
+*/
+static void unixReleaseWriters(unixFile *pFile, int eHeld)
+{
+  if (eHeld == 1)
   {
-    ((unixFile *)pFile)->fsFlags |= SQLITE_FSFLAGS_IS_MSDOS;
+    unixShmLock((sqlite3_file *)pFile, WAL_CKPT_LOCK, 1, SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE);
   }
-  if (0 == strncmp("exfat", fsInfo.f_fstypename, 5))
+  else if (eHeld == 2)
   {
-    ((unixFile *)pFile)->fsFlags |= SQLITE_FSFLAGS_IS_MSDOS;
+    pFile->pMethod->xUnlock((sqlite3_file *)pFile, NO_LOCK);
   }
-#endif
+}
 
-  /* Set up appropriate ctrlFlags */
-  if (isDelete) ctrlFlags |= UNIXFILE_DELETE;
-  if (isReadonly) ctrlFlags |= UNIXFILE_RDONLY;
-  noLock = eType != SQLITE_OPEN_MAIN_DB;
-  if (noLock) ctrlFlags |= UNIXFILE_NOLOCK;
-  if (isNewJrnl) ctrlFlags |= UNIXFILE_DIRSYNC;
-  if (flags & SQLITE_OPEN_URI) ctrlFlags |= UNIXFILE_URI;
+/*
+** Start tracking changed blocks of database zDbName ("main" if NULL) of
+** connection db, beginning a new epoch named zEpoch.  If tracking is
+** already on, the blocks recorded for the previous epoch are discarded.
+**
+** Processes that already have the database open notice the -cbt file at
+** their next write, which forces the following procvfs_cbt_backup() to
+** copy every block.  So that they do, writers stay blocked for
+** CBT_RECHECK_MS milliseconds after the file is created.
+*/
+int procvfs_cbt_start(sqlite3 *db, const char *zDbName, const char *zEpoch)
+{
+  char zCbt[MAX_PATHNAME + 5];
+  unixFile *pFile = 0;
+  int eHeld;
+  int rc;
+  int h;
 
-#if SQLITE_ENABLE_LOCKING_STYLE
-#if SQLITE_PREFER_PROXY_LOCKING
-  isAutoProxy = 1;
-#endif
-  if (isAutoProxy && (zPath != NULL) && (!noLock) && pVfs->xOpen)
+  if (zEpoch == 0 || strlen(zEpoch) >= sizeof(((CbtHeader *)0)->zEpoch)) return SQLITE_MISUSE;
+  sqlite3_mutex_enter(sqlite3_db_mutex(db));
+  rc = unixBlockWriters(db, zDbName, &pFile, &eHeld);
+  if (rc == SQLITE_OK)
   {
-    char *envforce = getenv("SQLITE_FORCE_PROXY_LOCKING");
-    int useProxy = 0;
-
-    /* SQLITE_FORCE_PROXY_LOCKING==1 means force always use proxy, 0 means
-    ** never use proxy, NULL means use proxy for non-local files only.  */
-    if (envforce != NULL)
+    sqlite3_snprintf(sizeof(zCbt), zCbt, "%s-cbt", pFile->zPath);
+    h = robust_open(zCbt, O_RDWR | O_CREAT | O_BINARY, 0);
+    if (h < 0)
     {
-      useProxy = atoi(envforce) > 0;
+      rc = unixLogError(SQLITE_CANTOPEN, "open", zCbt);
     }
     else
     {
-      useProxy = !(fsInfo.f_flags & MNT_LOCAL);
-    }
-    if (useProxy)
-    {
-      rc = fillInUnixFile(pVfs, fd, pFile, zPath, ctrlFlags);
+      int dirfd;
+      rc = cbtReset(h, zEpoch);
+      if (rc == SQLITE_OK && osOpenDirectory(zCbt, &dirfd) == SQLITE_OK)
+      {
+        full_fsync(dirfd, 0, 0);
+        robust_close(pFile, dirfd, __LINE__);
+      }
+      unixEnterInodeMutex(pFile->pInode);
+      cbtDetach(pFile);
       if (rc == SQLITE_OK)
       {
-        rc = proxyTransformUnixFile((unixFile *)pFile, ":auto:");
-        if (rc != SQLITE_OK)
-        {
-          /* Use unixClose to clean up the resources added in fillInUnixFile
-          ** and clear all the structure's references.  Specifically,
-          ** pFile->pMethods will be NULL so sqlite3OsClose will be a no-op
-          */
-          unixClose(pFile);
-          return rc;
-        }
+        pFile->pInode->hCbt = h;
       }
-      goto open_finished;
+      else
+      {
+        robust_close(pFile, h, __LINE__);
+      }
+      unixLeaveInodeMutex(pFile->pInode);
+      if (rc == SQLITE_OK) unixSleep(0, CBT_RECHECK_MS * 1000);
     }
   }
-#endif
-
-  assert(zPath == 0 || zPath[0] == '/' || eType == SQLITE_OPEN_MASTER_JOURNAL || eType == SQLITE_OPEN_MAIN_JOURNAL);
-  rc = fillInUnixFile(pVfs, fd, pFile, zPath, ctrlFlags);
-
-open_finished:
-  if (rc != SQLITE_OK)
-  {
-    sqlite3_free(p->pPreallocatedUnused);
-  }
+  if (pFile) unixReleaseWriters(pFile, eHeld);
+  sqlite3_mutex_leave(sqlite3_db_mutex(db));
   return rc;
 }
 
 /*
-** Delete the file at zPath. If the dirSync argument is true, fsync()
-** the directory after deleting the file.
+** Stop tracking changed blocks of database zDbName of connection db and
+** delete its -cbt file.
 */
-static int unixDelete(sqlite3_vfs *NotUsed, /* VFS containing this as the xDelete method */
-                      const char *zPath,    /* Name of file to be deleted */
-                      int dirSync           /* If true, fsync() directory after deleting file */
-                      )
+int procvfs_cbt_stop(sqlite3 *db, const char *zDbName)
 {
-  int rc = SQLITE_OK;
-  UNUSED_PARAMETER(NotUsed);
-  SimulateIOError(return SQLITE_IOERR_DELETE);
-  if (osUnlink(zPath) == (-1))
-  {
-    if (errno == ENOENT
-        )
-    {
-      rc = SQLITE_IOERR_DELETE_NOENT;
-    }
-    else
-    {
-      rc = unixLogError(SQLITE_IOERR_DELETE, "unlink", zPath);
-    }
-    return rc;
-  }
-#ifndef SQLITE_DISABLE_DIRSYNC
-  if ((dirSync & 1) != 0)
-  {
-    int fd;
-    rc = osOpenDirectory(zPath, &fd);
-    if (rc == SQLITE_OK)
-    {
-      if (full_fsync(fd, 0, 0))
-      {
-        rc = unixLogError(SQLITE_IOERR_DIR_FSYNC, "fsync", zPath);
-      }
-      robust_close(0, fd, __LINE__);
-    }
-    else
-    {
-      assert(rc == SQLITE_CANTOPEN);
-      rc = SQLITE_OK;
-    }
+  char zCbt[MAX_PATHNAME + 5];
+  unixFile *pFile = 0;
+  int eHeld;
+  int rc;
+
+  sqlite3_mutex_enter(sqlite3_db_mutex(db));
+  rc = unixBlockWriters(db, zDbName, &pFile, &eHeld);
+  if (rc == SQLITE_OK)
+  {
+    sqlite3_snprintf(sizeof(zCbt), zCbt, "%s-cbt", pFile->zPath);
+    if (osUnlink(zCbt) && errno != ENOENT) rc = unixLogError(SQLITE_IOERR_DELETE, "unlink", zCbt);
+    unixEnterInodeMutex(pFile->pInode);
+    cbtDetach(pFile);
+    unixLeaveInodeMutex(pFile->pInode);
   }
-#endif
+  if (pFile) unixReleaseWriters(pFile, eHeld);
+  sqlite3_mutex_leave(sqlite3_db_mutex(db));
   return rc;
 }
 
 /*
-** Test the existence of or access permissions of file zPath. The
-** test performed depends on the value of flags:
+** Pass every block of database zDbName of connection db written since
+** epoch zEpoch began to xBlock(), in ascending order of offset.  Adjacent
+** blocks are passed together.  If zEpoch is NULL, the current epoch is
+** used whatever its name.  The size of the database file is written to
+** *pnSize so that the target can be truncated to match.
 **
-**     SQLITE_ACCESS_EXISTS: Return 1 if the file exists
-**     SQLITE_ACCESS_READWRITE: Return 1 if the file is read and writable.
-**     SQLITE_ACCESS_READONLY: Return 1 if the file is readable.
+** Writers are blocked while the blocks are read, so the blocks passed
+** form a consistent image when applied to the backup taken at the start
+** of the epoch.  For a WAL database only checkpointed pages are in the
+** database file, so run "PRAGMA wal_checkpoint(TRUNCATE)" first.
 **
-** Otherwise return 0.
+** If zNextEpoch is not NULL and every block was passed successfully, a
+** new epoch named zNextEpoch begins before writers are unblocked.
+**
+** Return SQLITE_NOTFOUND if tracking is off or the current epoch is not
+** zEpoch, and SQLITE_ABORT if xBlock() returns non-zero.
 */
-static int unixAccess(sqlite3_vfs *NotUsed, /* The VFS containing this xAccess method */
-                      const char *zPath,    /* Path of the file to examine */
-                      int flags,            /* What do we want to learn about the zPath file? */
-                      int *pResOut          /* Write result boolean here */
-                      )
+int procvfs_cbt_backup(sqlite3 *db, const char *zDbName, const char *zEpoch, const char *zNextEpoch,
+                       int (*xBlock)(void *pCtx, sqlite3_int64 iOfst, const void *pData, int nData), void *pCtx,
+                       sqlite3_int64 *pnSize)
 {
-  UNUSED_PARAMETER(NotUsed);
-  SimulateIOError(return SQLITE_IOERR_ACCESS;);
-  assert(pResOut != 0);
+  const int nMaxRun = 16; /* Most blocks passed to one xBlock() call */
+  unixFile *pFile = 0;
+  u8 *aBitmap = 0;
+  u8 *aBuf = 0;
+  CbtHeader hdr;
+  struct stat buf;
+  i64 nBlock;
+  i64 i;
+  int eHeld;
+  int rc;
+  int h;
 
-  /* The spec says there are three possible values for flags.  But only
-  ** two of them are actually used */
-  assert(flags == SQLITE_ACCESS_EXISTS || flags == SQLITE_ACCESS_READWRITE);
+  if (zNextEpoch && strlen(zNextEpoch) >= sizeof(hdr.zEpoch)) return SQLITE_MISUSE;
+  sqlite3_mutex_enter(sqlite3_db_mutex(db));
+  rc = unixBlockWriters(db, zDbName, &pFile, &eHeld);
+  if (rc != SQLITE_OK) goto backup_out;
 
-  if (flags == SQLITE_ACCESS_EXISTS)
+  unixEnterInodeMutex(pFile->pInode);
+  cbtAttach(pFile, 0);
+  h = pFile->pInode->hCbt;
+  unixLeaveInodeMutex(pFile->pInode);
+  if (h < 0 || seekAndReadFd(h, 0, &hdr, CBT_HDRSIZE, &pFile->lastErrno) != CBT_HDRSIZE)
   {
-    struct stat buf;
-    *pResOut = (0 == osStat(zPath, &buf) && buf.st_size > 0);
+    rc = SQLITE_NOTFOUND;
+    goto backup_out;
   }
-  else
+  hdr.zEpoch[sizeof(hdr.zEpoch) - 1] = 0;
+  if (zEpoch && strcmp(zEpoch, hdr.zEpoch) != 0)
   {
-    *pResOut = osAccess(zPath, W_OK | R_OK) == 0;
+    rc = SQLITE_NOTFOUND;
+    goto backup_out;
   }
-  return SQLITE_OK;
-}
+  if (osFstat(pFile->h, &buf))
+  {
+    storeLastErrno(pFile, errno);
+    rc = SQLITE_IOERR_FSTAT;
+    goto backup_out;
+  }
+  *pnSize = buf.st_size;
 
-/*
-**
-*/
-static int mkFullPathname(const char *zPath, /* Input path */
-                          char *zOut,        /* Output buffer */
-                          int nOut           /* Allocated size of buffer zOut */
-                          )
-{
-  int nPath = sqlite3Strlen30(zPath);
-  int iOff = 0;
-  if (zPath[0] != '/')
+  nBlock = (buf.st_size + SQLITE_CBT_BLOCK_SIZE - 1) / SQLITE_CBT_BLOCK_SIZE;
+  aBitmap = (u8 *)sqlite3_malloc64(nBlock / 8 + 1);
+  aBuf = (u8 *)sqlite3_malloc64(nMaxRun * SQLITE_CBT_BLOCK_SIZE);
+  if (aBitmap == 0 || aBuf == 0)
   {
-    if (osGetcwd(zOut, nOut - 2) == 0)
+    rc = SQLITE_NOMEM;
+    goto backup_out;
+  }
+  if (hdr.flags & CBT_FLAG_FULL)
+  {
+    memset(aBitmap, 0xff, nBlock / 8 + 1);
+  }
+  else
+  {
+    i64 iRead;
+    memset(aBitmap, 0, nBlock / 8 + 1);
+    for (iRead = 0; iRead < nBlock / 8 + 1; iRead += 0x10000)
     {
-      return unixLogError(SQLITE_CANTOPEN, "getcwd", zPath);
+      int nWant = (int)(nBlock / 8 + 1 - iRead < 0x10000 ? nBlock / 8 + 1 - iRead : 0x10000);
+      int nRead = seekAndReadFd(h, CBT_HDRSIZE + iRead, &aBitmap[iRead], nWant, &pFile->lastErrno);
+      if (nRead < 0)
+      {
+        rc = SQLITE_IOERR_READ;
+        goto backup_out;
+      }
+      if (nRead < nWant) break;
     }
-    iOff = sqlite3Strlen30(zOut);
-    zOut[iOff++] = '/';
   }
-  if ((iOff + nPath + 1) > nOut)
+
+  for (i = 0; i < nBlock && rc == SQLITE_OK; i++)
   {
-    /* SQLite assumes that xFullPathname() nul-terminates the output buffer
-    ** even if it returns an error.  */
-    zOut[iOff] = '\0';
-    return SQLITE_CANTOPEN;
+    i64 iOfst;
+    int nRun;
+    int nByte;
+
+    if ((aBitmap[i / 8] & (1 << (i & 7))) == 0) continue;
+    for (nRun = 1; nRun < nMaxRun && i + nRun < nBlock && (aBitmap[(i + nRun) / 8] & (1 << ((i + nRun) & 7))); nRun++)
+      ;
+    iOfst = i * SQLITE_CBT_BLOCK_SIZE;
+    nByte = nRun * SQLITE_CBT_BLOCK_SIZE;
+    if (iOfst + nByte > buf.st_size) nByte = (int)(buf.st_size - iOfst);
+    if (seekAndRead(pFile, iOfst, aBuf, nByte) != nByte)
+    {
+      rc = SQLITE_IOERR_READ;
+    }
+    else if (xBlock(pCtx, iOfst, aBuf, nByte))
+    {
+      rc = SQLITE_ABORT;
+    }
+    i += nRun - 1;
   }
-  sqlite3_snprintf(nOut - iOff, &zOut[iOff], "%s", zPath);
-  return SQLITE_OK;
+  if (rc == SQLITE_OK && zNextEpoch) rc = cbtReset(h, zNextEpoch);
+
+backup_out:
+  sqlite3_free(aBitmap);
+  sqlite3_free(aBuf);
+  if (pFile) unixReleaseWriters(pFile, eHeld);
+  sqlite3_mutex_leave(sqlite3_db_mutex(db));
+  return rc;
 }
 
 /*
-** Turn a relative pathname into a full pathname. The relative path
-** is stored as a nul-terminated string in the buffer pointed to by
-** zPath.
+** Copy the whole of file hFrom into the empty file hTo.  Share extents
+** with a reflink where the filesystem supports it (btrfs, XFS, bcachefs),
+** otherwise let the kernel copy the data with copy_file_range(), and
+** otherwise copy it through a buffer.
 **
-** zOut points to a buffer of at least sqlite3_vfs.mxPathname bytes
-** (in this case, MAX_PATHNAME bytes). The full-path is written to
-** this buffer before returning.
+** Return SQLITE_OK or an SQLite error code, setting *piErrno on error.
 */
-static int unixFullPathname(sqlite3_vfs *pVfs, /* Pointer to vfs object */
-                            const char *zPath, /* Possibly relative input path */
-                            int nOut,          /* Size of output buffer in bytes */
-                            char *zOut         /* Output buffer */
-                            )
+static int unixCloneFd(int hFrom, int hTo, int *piErrno)
 {
-#if !defined(HAVE_READLINK) || !defined(HAVE_LSTAT)
-  return mkFullPathname(zPath, zOut, nOut);
-#else
-  int rc = SQLITE_OK;
-  int nByte;
-  int nLink = 1;           /* Number of symbolic links followed so far */
-  const char *zIn = zPath; /* Input path for each iteration of loop */
-  char *zDel = 0;
-
-  assert(pVfs->mxPathname == MAX_PATHNAME);
-  UNUSED_PARAMETER(pVfs);
+  struct stat buf;
+  i64 iOfst = 0;
+  u8 *aBuf;
 
-  /* It's odd to simulate an io-error here, but really this is just
-  ** using the io-error infrastructure to test that SQLite handles this
-  ** function failing. This function could fail if, for example, the
-  ** current working directory has been unlinked.
-  */
-  SimulateIOError(return SQLITE_ERROR);
+#ifdef FICLONE
+  if (osIoctl && osIoctl(hTo, FICLONE, hFrom) == 0)
+  {
+    OSTRACE(("CLONE   %-3d %-3d reflink\n", hFrom, hTo));
+    return SQLITE_OK;
+  }
+#endif
+  if (osFstat(hFrom, &buf))
+  {
+    *piErrno = errno;
+    return SQLITE_IOERR_FSTAT;
+  }
 
-  do
+#if HAVE_COPY_FILE_RANGE
+  if (osCopyFileRange)
   {
-    /* Call stat() on path zIn. Set bLink to true if the path is a symbolic
-    ** link, or false otherwise.  */
-    int bLink = 0;
-    struct stat buf;
-    if (osLstat(zIn, &buf) != 0)
-    {
-      if (errno != ENOENT)
-      {
-        rc = unixLogError(SQLITE_CANTOPEN_BKPT, "lstat", zIn);
-      }
-    }
-    else
+    off_t iIn = 0;
+    off_t iOut = 0;
+    while (iIn < buf.st_size)
     {
-      bLink = S_ISLNK(buf.st_mode);
+      ssize_t n = osCopyFileRange(hFrom, &iIn, hTo, &iOut, (size_t)(buf.st_size - iIn), 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
     }
-
-    if (bLink)
+    if (iIn >= buf.st_size)
     {
-      if (zDel == 0)
-      {
-        zDel = sqlite3_malloc(nOut);
-        if (zDel == 0) rc = SQLITE_NOMEM_BKPT;
-      }
-      else if (++nLink > SQLITE_MAX_SYMLINKS)
-      {
-        rc = SQLITE_CANTOPEN_BKPT;
-      }
-
-      if (rc == SQLITE_OK)
-      {
-        nByte = osReadlink(zIn, zDel, nOut - 1);
-        if (nByte < 0)
-        {
-          rc = unixLogError(SQLITE_CANTOPEN_BKPT, "readlink", zIn);
-        }
-        else
-        {
-          if (zDel[0] != '/')
-          {
-            int n;
-            for (n = sqlite3Strlen30(zIn); n > 0 && zIn[n - 1] != '/'; n--)
-              ;
-            if (nByte + n + 1 > nOut)
-            {
-              rc = SQLITE_CANTOPEN_BKPT;
-            }
-            else
-            {
-              memmove(&zDel[n], zDel, nByte + 1);
-              memcpy(zDel, zIn, n);
-              nByte += n;
-            }
-          }
-          zDel[nByte] = '\0';
-        }
-      }
-
-      zIn = zDel;
+      OSTRACE(("CLONE   %-3d %-3d copy_file_range %lld\n", hFrom, hTo, (i64)iIn));
+      return SQLITE_OK;
     }
+    /* Not supported here (EXDEV, ENOSYS...).  Copy what is left below. */
+    iOfst = iIn;
+  }
+#endif
 
-    assert(rc != SQLITE_OK || zIn != zOut || zIn[0] == '/');
-    if (rc == SQLITE_OK && zIn != zOut)
+  aBuf = (u8 *)sqlite3_malloc(0x10000);
+  if (aBuf == 0) return SQLITE_NOMEM;
+  while (iOfst < buf.st_size)
+  {
+    int nRead = seekAndReadFd(hFrom, iOfst, aBuf, 0x10000, piErrno);
+    if (nRead <= 0 || seekAndWriteFd(hTo, iOfst, aBuf, nRead, piErrno) != nRead)
     {
-      rc = mkFullPathname(zIn, zOut, nOut);
+      sqlite3_free(aBuf);
+      return nRead < 0 ? SQLITE_IOERR_READ : SQLITE_IOERR_WRITE;
     }
-    if (bLink == 0) break;
-    zIn = zOut;
-  } while (rc == SQLITE_OK);
-
-  sqlite3_free(zDel);
-  return rc;
-#endif /* HAVE_READLINK && HAVE_LSTAT */
+    iOfst += nRead;
+  }
+  sqlite3_free(aBuf);
+  OSTRACE(("CLONE   %-3d %-3d copy %lld\n", hFrom, hTo, iOfst));
+  return SQLITE_OK;
 }
 
-#ifndef SQLITE_OMIT_LOAD_EXTENSION
 /*
-** Interfaces for opening a shared library, finding entry points
-** within the shared library, and closing the shared library.
+** Clone file zFrom to the new file zTo and sync it.  If bMissingOk is
+** set and zFrom does not exist, do nothing.
 */
-#include <dlfcn.h>
-static void *unixDlOpen(sqlite3_vfs *NotUsed, const char *zFilename)
+static int unixCloneFile(const char *zFrom, const char *zTo, int bMissingOk)
 {
-  UNUSED_PARAMETER(NotUsed);
-  return dlopen(zFilename, RTLD_NOW | RTLD_GLOBAL);
+  int iErrno = 0;
+  int hFrom;
+  int hTo;
+  int rc;
+
+  hFrom = robust_open(zFrom, O_RDONLY | O_BINARY, 0);
+  if (hFrom < 0)
+  {
+    if (bMissingOk && errno == ENOENT) return SQLITE_OK;
+    return unixLogError(SQLITE_CANTOPEN, "open", zFrom);
+  }
+  hTo = robust_open(zTo, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0);
+  if (hTo < 0)
+  {
+    robust_close(0, hFrom, __LINE__);
+    return unixLogError(SQLITE_CANTOPEN, "open", zTo);
+  }
+  rc = unixCloneFd(hFrom, hTo, &iErrno);
+  if (rc == SQLITE_OK && full_fsync(hTo, 0, 0))
+  {
+    iErrno = errno;
+    rc = SQLITE_IOERR_FSYNC;
+  }
+  robust_close(0, hTo, __LINE__);
+  robust_close(0, hFrom, __LINE__);
+  if (rc != SQLITE_OK)
+  {
+    errno = iErrno;
+    osUnlink(zTo);
+    return unixLogError(rc, "unixCloneFile", zTo);
+  }
+  return SQLITE_OK;
 }
 
 /*
-** SQLite calls this function immediately after a call to unixDlSym() or
-** unixDlOpen() fails (returns a null pointer). If a more detailed error
-** message is available, it is written to zBufOut. If no error message
-** is available, zBufOut is left unmodified and SQLite uses a default
-** error message.
+** Write a consistent snapshot of database zDbName ("main" if NULL) of
+** connection db to the new file zTarget.  For a WAL database the -wal
+** file is copied to zTarget-wal and the snapshot is recovered from it
+** when first opened.  zTarget must not exist.
+**
+** Checkpoints are blocked while the database file is copied and, in WAL
+** mode, write transactions are blocked while the -wal file is copied.  On
+** filesystems with reflinks both copies take a few milliseconds whatever
+** the size of the database.
+**
+** Return SQLITE_BUSY if a checkpoint or write transaction is in progress.
 */
-static void unixDlError(sqlite3_vfs *NotUsed, int nBuf, char *zBufOut)
+int procvfs_snapshot(sqlite3 *db, const char *zDbName, const char *zTarget)
 {
-  const char *zErr;
-  UNUSED_PARAMETER(NotUsed);
-  unixEnterMutex();
-  zErr = dlerror();
-  if (zErr)
+  char zFrom[MAX_PATHNAME + 9];
+  char zTo[MAX_PATHNAME + 9];
+  unixFile *pFile = 0;
+  int bWriteLock = 0;
+  int eHeld;
+  int rc;
+
+  if (zTarget == 0 || strlen(zTarget) > MAX_PATHNAME) return SQLITE_MISUSE;
+  sqlite3_mutex_enter(sqlite3_db_mutex(db));
+  rc = unixBlockWriters(db, zDbName, &pFile, &eHeld);
+  if (rc == SQLITE_OK)
   {
-    sqlite3_snprintf(nBuf, zBufOut, "%s", zErr);
+    rc = unixCloneFile(pFile->zPath, zTarget, 0);
   }
-  unixLeaveMutex();
+  if (rc == SQLITE_OK)
+  {
+    /* A stale -wal file would be replayed into the snapshot. */
+    sqlite3_snprintf(sizeof(zTo), zTo, "%s-wal-hdr", zTarget);
+    osUnlink(zTo);
+    sqlite3_snprintf(sizeof(zTo), zTo, "%s-wal", zTarget);
+    osUnlink(zTo);
+  }
+  if (rc == SQLITE_OK && eHeld == 1)
+  {
+    /* No checkpoint has run since the database file was copied, so any
+    ** WAL restart in the meantime only dropped frames already in the
+    ** copy.  Hold the writer lock so that the -wal file copy ends on a
+    ** transaction boundary. */
+    char *zRedirect;
+    rc = unixShmLock((sqlite3_file *)pFile, WAL_WRITE_LOCK, 1, SQLITE_SHM_LOCK | SQLITE_SHM_EXCLUSIVE);
+    bWriteLock = (rc == SQLITE_OK);
+    sqlite3_snprintf(sizeof(zFrom), zFrom, "%s-wal", pFile->zPath);
+    zRedirect = unixWalRedirect(zFrom);
+    if (rc == SQLITE_OK) rc = unixCloneFile(zRedirect ? zRedirect : zFrom, zTo, 1);
+    if (rc == SQLITE_OK && pFile->pInode->eWalLayout == UNIX_WAL_LAYOUT_SPLIT)
+    {
+      /* The snapshot keeps the direct I/O layout, frame headers included */
+      char zHdr[MAX_PATHNAME + 9];
+      sqlite3_snprintf(sizeof(zHdr), zHdr, "%s-hdr", zRedirect ? zRedirect : zFrom);
+      sqlite3_snprintf(sizeof(zTo), zTo, "%s-wal-hdr", zTarget);
+      rc = unixCloneFile(zHdr, zTo, 1);
+    }
+    sqlite3_free(zRedirect);
+    if (rc != SQLITE_OK) osUnlink(zTarget);
+  }
+  if (rc == SQLITE_OK)
+  {
+    int dirfd;
+    if (osOpenDirectory(zTarget, &dirfd) == SQLITE_OK)
+    {
+      full_fsync(dirfd, 0, 0);
+      robust_close(0, dirfd, __LINE__);
+    }
+  }
+  if (bWriteLock)
+  {
+    unixShmLock((sqlite3_file *)pFile, WAL_WRITE_LOCK, 1, SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE);
+  }
+  if (pFile) unixReleaseWriters(pFile, eHeld);
+  sqlite3_mutex_leave(sqlite3_db_mutex(db));
+  return rc;
 }
-static void (*unixDlSym(sqlite3_vfs *NotUsed, void *p, const char *zSym))(void)
+
+/*
+** Read the record at *piOfst of the ship log open on h into *pRec,
+** following a ShipSkip at offset 0, in which case *piOfst is advanced to
+** the record read.
+*/
+static int shipReadRecord(int h, i64 *piOfst, ShipRecord *pRec)
 {
-  /*
-  ** GCC with -pedantic-errors says that C90 does not allow a void* to be
-  ** cast into a pointer to a function.  And yet the library dlsym() routine
-  ** returns a void* which is really a pointer to a function.  So how do we
-  ** use dlsym() with -pedantic-errors?
-  **
-  ** Variable x below is defined to be a pointer to a function taking
-  ** parameters void* and const char* and returning a pointer to a function.
-  ** We initialize x by assigning it a pointer to the dlsym() function.
-  ** (That assignment requires a cast.)  Then we call the function that
-  ** x points to.
-  **
-  ** This work-around is unlikely to work correctly on any system where
-  ** you really cannot cast a function pointer into void*.  But then, on the
-  ** other hand, dlsym() will not work on such a system either, so we have
-  ** not really lost anything.
-  */
-  void (*(*x)(void *, const char *))(void);
-  UNUSED_PARAMETER(NotUsed);
-  x = (void (*(*)(void *, const char *))(void))dlsym;
-  return (*x)(p, zSym);
+  int iErrno = 0;
+  if (seekAndReadFd(h, *piOfst, pRec, sizeof(*pRec), &iErrno) != sizeof(*pRec)) return SQLITE_IOERR_READ;
+  if (pRec->magic == SHIP_SKIP && *piOfst == 0)
+  {
+    ShipSkip skip;
+    memcpy(&skip, pRec, sizeof(skip));
+    if (skip.iNext < (i64)sizeof(*pRec)) return SQLITE_CORRUPT;
+    *piOfst = skip.iNext;
+    if (seekAndReadFd(h, *piOfst, pRec, sizeof(*pRec), &iErrno) != sizeof(*pRec)) return SQLITE_IOERR_READ;
+  }
+  return pRec->magic == SHIP_MAGIC ? SQLITE_OK : SQLITE_CORRUPT;
 }
-static void unixDlClose(sqlite3_vfs *NotUsed, void *pHandle)
+
+static void shipPut32(u8 *a, u32 v)
 {
-  UNUSED_PARAMETER(NotUsed);
-  dlclose(pHandle);
+  a[0] = (u8)(v >> 24);
+  a[1] = (u8)(v >> 16);
+  a[2] = (u8)(v >> 8);
+  a[3] = (u8)v;
 }
-#else /* if SQLITE_OMIT_LOAD_EXTENSION is defined: */
-#define unixDlOpen 0
-#define unixDlError 0
-#define unixDlSym 0
-#define unixDlClose 0
-#endif
 
 /*
-** Write nBuf bytes of random data to the supplied buffer zBuf.
+** Append page pgno of the replica open as pFile, as it is now, to the
+** rollback journal open on hJrnl at *piJrnl, in the format of SQLite's
+** pager: the page number, the page and a checksum, so that SQLite itself
+** can roll the replica back.  aPage is a buffer of szPage bytes.
 */
-static int unixRandomness(sqlite3_vfs *NotUsed, int nBuf, char *zBuf)
+static int shipJournalPage(sqlite3_file *pFile, int hJrnl, i64 *piJrnl, u32 pgno, int szPage, u32 cksumInit,
+                           u8 *aPage)
 {
-  UNUSED_PARAMETER(NotUsed);
-  assert((size_t)nBuf >= (sizeof(time_t) + sizeof(int)));
+  u32 cksum = cksumInit;
+  u8 a[4];
+  int iErrno = 0;
+  int rc;
+  int i;
+
+  rc = pFile->pMethods->xRead(pFile, aPage, szPage, (i64)(pgno - 1) * szPage);
+  if (rc != SQLITE_OK) return rc;
+  for (i = szPage - 200; i > 0; i -= 200) cksum += aPage[i];
+  shipPut32(a, pgno);
+  if (seekAndWriteFd(hJrnl, *piJrnl, a, 4, &iErrno) != 4) return SQLITE_IOERR_WRITE;
+  if (seekAndWriteFd(hJrnl, *piJrnl + 4, aPage, szPage, &iErrno) != szPage) return SQLITE_IOERR_WRITE;
+  shipPut32(a, cksum);
+  if (seekAndWriteFd(hJrnl, *piJrnl + 4 + szPage, a, 4, &iErrno) != 4) return SQLITE_IOERR_WRITE;
+  *piJrnl += 8 + szPage;
+  return SQLITE_OK;
+}
 
-  /* We have to initialize zBuf to prevent valgrind from reporting
-  ** errors.  The reports issued by valgrind are incorrect - we would
-  ** prefer that the randomness be increased by making use of the
-  ** uninitialized space in zBuf - but valgrind errors tend to worry
-  ** some users.  Rather than argue, it seems easier just to initialize
-  ** the whole array and silence valgrind, even if that means less randomness
-  ** in the random seed.
-  **
-  ** When testing, initializing zBuf[] to zero is all we do.  That means
-  ** that we always use the same random number sequence.  This makes the
-  ** tests repeatable.
-  */
-  memset(zBuf, 0, nBuf);
-  randomnessPid = osGetpid(0);
-#if !defined(SQLITE_TEST) && !defined(SQLITE_OMIT_RANDOMNESS)
+/*
+** Apply the transactions in ship log zLog, starting at byte offset
+** *piOffset, to the replica database zReplica.  On success *piOffset is
+** set to the end of the last complete transaction applied, ready for the
+** next call.  A transaction still being appended is left for next time.
+**
+** The replica is an ordinary rollback-mode database.  Readers open it
+** read-only, with any VFS, and see whole transactions only, because the
+** replica is modified under an EXCLUSIVE lock.  To seed a replica, make
+** a procvfs_snapshot() of the primary after it starts shipping and replay
+** the log from offset 0.  Replaying transactions that the snapshot already
+** contains is harmless because every page image is replayed in order.
+**
+** The pages about to change are first copied to a rollback journal, which
+** is synced, and the journal is deleted once the replica is.  If the
+** follower dies part way, the next read-write connection to the replica,
+** such as the next call, rolls it back; a read-only one gets
+** SQLITE_READONLY_ROLLBACK until then.
+*/
+int procvfs_ship_apply(const char *zLog, const char *zReplica, sqlite3_int64 *piOffset)
+{
+  static const u8 aJournalMagic[] = {0xd9, 0xd5, 0x05, 0xf9, 0x20, 0xa1, 0x63, 0xd7};
+  sqlite3 *db = 0;
+  sqlite3_file *pFile = 0;
+  ShipRecord rec;
+  ShipRecord last;
+  struct stat buf;
+  char *zJournal = 0;
+  u8 *aPage = 0;
+  u8 *aSeen = 0; /* Pages already in the journal, one bit each */
+  u8 aHdr[100];
+  u8 aJrnl[512]; /* Journal header, one sector */
+  i64 iOfst;
+  i64 iEnd; /* End of the last complete transaction */
+  i64 iJrnl = sizeof(aJrnl);
+  i64 nOrig; /* Size of the replica before the transactions, in pages */
+  u32 iCounter;
+  u32 cksumInit;
+  u32 nRec = 0;
+  int szPage;
+  int hJrnl = -1;
+  int bKeep = 0; /* True once the journal is needed to roll back */
+  int bLocked = 0;
+  int iErrno = 0;
+  int rc = SQLITE_OK;
+  int h;
+
+  h = robust_open(zLog, O_RDONLY | O_BINARY, 0);
+  if (h < 0) return unixLogError(SQLITE_CANTOPEN, "open", zLog);
+  if (osFstat(h, &buf))
   {
-    int fd, got;
-    fd = robust_open("/dev/urandom", O_RDONLY, 0);
-    if (fd < 0)
+    rc = SQLITE_IOERR_FSTAT;
+    goto apply_out;
+  }
+
+  /* Find the end of the last complete transaction before locking. */
+  rc = shipScan(h, *piOffset, buf.st_size, &iEnd, &last);
+  if (rc != SQLITE_OK || iEnd == *piOffset) goto apply_out;
+  szPage = (int)last.szPage;
+
+  rc = sqlite3_open_v2(zReplica, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0);
+  if (rc == SQLITE_OK) rc = sqlite3_busy_timeout(db, 5000);
+  /* A replica seeded from a snapshot of a WAL database starts in WAL mode.
+  ** Taking the lock also rolls back what an earlier call left half done. */
+  if (rc == SQLITE_OK) rc = sqlite3_exec(db, "PRAGMA journal_mode=DELETE; BEGIN EXCLUSIVE;", 0, 0, 0);
+  if (rc != SQLITE_OK) goto apply_out;
+  bLocked = 1;
+  rc = sqlite3_file_control(db, "main", SQLITE_FCNTL_FILE_POINTER, &pFile);
+  if (rc != SQLITE_OK) goto apply_out;
+  memset(aHdr, 0, sizeof(aHdr));
+  rc = pFile->pMethods->xRead(pFile, aHdr, sizeof(aHdr), 0);
+  if (rc == SQLITE_IOERR_SHORT_READ) rc = SQLITE_OK;
+  if (rc == SQLITE_OK) rc = pFile->pMethods->xFileSize(pFile, &nOrig);
+  if (rc != SQLITE_OK) goto apply_out;
+  iCounter = ((u32)aHdr[24] << 24) | ((u32)aHdr[25] << 16) | ((u32)aHdr[26] << 8) | aHdr[27];
+  if (nOrig > 0 && (aHdr[16] << 8 | aHdr[17]) != (szPage == 65536 ? 1 : szPage))
+  {
+    rc = SQLITE_CORRUPT;
+    goto apply_out;
+  }
+  nOrig /= szPage;
+
+  zJournal = sqlite3_mprintf("%s-journal", zReplica);
+  aPage = (u8 *)sqlite3_malloc(szPage);
+  aSeen = (u8 *)sqlite3_malloc64(nOrig / 8 + 1);
+  if (zJournal == 0 || aPage == 0 || aSeen == 0)
+  {
+    rc = SQLITE_NOMEM;
+    goto apply_out;
+  }
+  memset(aSeen, 0, nOrig / 8 + 1);
+  hJrnl = robust_open(zJournal, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0);
+  if (hJrnl < 0)
+  {
+    rc = unixLogError(SQLITE_CANTOPEN, "open", zJournal);
+    goto apply_out;
+  }
+
+  /* Journal each page that exists and is about to change once, starting
+  ** with page 1, whose header is rewritten below. */
+  sqlite3_randomness(sizeof(cksumInit), &cksumInit);
+  if (nOrig > 0)
+  {
+    aSeen[0] = 1;
+    rc = shipJournalPage(pFile, hJrnl, &iJrnl, 1, szPage, cksumInit, aPage);
+    nRec++;
+  }
+  for (iOfst = *piOffset; rc == SQLITE_OK && iOfst < iEnd; iOfst += sizeof(rec) + rec.szPage)
+  {
+    rc = shipReadRecord(h, &iOfst, &rec);
+    if (rc == SQLITE_OK && ((int)rec.szPage != szPage || rec.pgno == 0)) rc = SQLITE_CORRUPT;
+    if (rc != SQLITE_OK || rec.pgno > nOrig || (aSeen[(rec.pgno - 1) / 8] & (1 << ((rec.pgno - 1) % 8)))) continue;
+    aSeen[(rec.pgno - 1) / 8] |= (u8)(1 << ((rec.pgno - 1) % 8));
+    rc = shipJournalPage(pFile, hJrnl, &iJrnl, rec.pgno, szPage, cksumInit, aPage);
+    nRec++;
+  }
+
+  /* The header goes last, so that a journal is either whole or empty. */
+  memset(aJrnl, 0, sizeof(aJrnl));
+  memcpy(aJrnl, aJournalMagic, sizeof(aJournalMagic));
+  shipPut32(&aJrnl[8], nRec);
+  shipPut32(&aJrnl[12], cksumInit);
+  shipPut32(&aJrnl[16], (u32)nOrig);
+  shipPut32(&aJrnl[20], sizeof(aJrnl));
+  shipPut32(&aJrnl[24], (u32)szPage);
+  if (rc == SQLITE_OK && seekAndWriteFd(hJrnl, 0, aJrnl, sizeof(aJrnl), &iErrno) != sizeof(aJrnl))
+  {
+    rc = SQLITE_IOERR_WRITE;
+  }
+  if (rc == SQLITE_OK && full_fsync(hJrnl, 0, 0)) rc = unixLogError(SQLITE_IOERR_FSYNC, "fsync", zJournal);
+  if (rc == SQLITE_OK)
+  {
+    int dirfd;
+    rc = osOpenDirectory(zJournal, &dirfd);
+    if (rc == SQLITE_OK)
     {
-      time_t t;
-      time(&t);
-      memcpy(zBuf, &t, sizeof(t));
-      memcpy(&zBuf[sizeof(t)], &randomnessPid, sizeof(randomnessPid));
-      assert(sizeof(t) + sizeof(randomnessPid) <= (size_t)nBuf);
-      nBuf = sizeof(t) + sizeof(randomnessPid);
+      if (full_fsync(dirfd, 0, 0)) rc = unixLogError(SQLITE_IOERR_DIR_FSYNC, "fsync", zJournal);
+      robust_close(0, dirfd, __LINE__);
     }
-    else
+  }
+  if (rc != SQLITE_OK) goto apply_out;
+  bKeep = 1;
+
+  for (iOfst = *piOffset; rc == SQLITE_OK && iOfst < iEnd; iOfst += sizeof(rec) + rec.szPage)
+  {
+    rc = shipReadRecord(h, &iOfst, &rec);
+    if (rc != SQLITE_OK) break;
+    if (seekAndReadFd(h, iOfst + sizeof(rec), aPage, rec.szPage, &iErrno) != (int)rec.szPage)
     {
-      do
-      {
-        got = osRead(fd, zBuf, nBuf);
-      } while (got < 0 && errno == EINTR);
-      robust_close(0, fd, __LINE__);
+      rc = SQLITE_IOERR_READ;
+      break;
+    }
+    rc = pFile->pMethods->xWrite(pFile, aPage, rec.szPage, (i64)(rec.pgno - 1) * rec.szPage);
+    if (rc == SQLITE_OK && rec.nTruncate)
+    {
+      rc = pFile->pMethods->xTruncate(pFile, (i64)rec.nTruncate * rec.szPage);
     }
   }
-#endif
-  return nBuf;
-}
 
-/*
-** Sleep for a little while.  Return the amount of time slept.
-** The argument is the number of microseconds we want to sleep.
-** The return value is the number of microseconds of sleep actually
-** requested from the underlying operating system, a number which
-** might be greater than or equal to the argument, but not less
-** than the argument.
-*/
-static int unixSleep(sqlite3_vfs *NotUsed, int microseconds)
-{
-#if defined(HAVE_USLEEP) && HAVE_USLEEP
-  usleep(microseconds);
-  UNUSED_PARAMETER(NotUsed);
-  return microseconds;
-#else
-  int seconds = (microseconds + 999999) / 1000000;
-  sleep(seconds);
-  UNUSED_PARAMETER(NotUsed);
-  return seconds * 1000000;
-#endif
+  /* Make page 1 describe a rollback-mode database and advance the change
+  ** counter, so that readers notice the new content. */
+  if (rc == SQLITE_OK) rc = pFile->pMethods->xRead(pFile, aHdr, sizeof(aHdr), 0);
+  if (rc == SQLITE_OK)
+  {
+    u32 iNew = ((u32)aHdr[24] << 24) | ((u32)aHdr[25] << 16) | ((u32)aHdr[26] << 8) | aHdr[27];
+    iNew = (iNew > iCounter ? iNew : iCounter) + 1;
+    aHdr[18] = aHdr[19] = 1;
+    shipPut32(&aHdr[24], iNew);
+    shipPut32(&aHdr[92], iNew);
+    rc = pFile->pMethods->xWrite(pFile, aHdr, sizeof(aHdr), 0);
+  }
+  if (rc == SQLITE_OK) rc = pFile->pMethods->xSync(pFile, SQLITE_SYNC_NORMAL);
+
+  /* Deleting the journal commits the transactions. */
+  if (rc == SQLITE_OK)
+  {
+    robust_close(0, hJrnl, __LINE__);
+    hJrnl = -1;
+    if (osUnlink(zJournal)) rc = unixLogError(SQLITE_IOERR_DELETE, "unlink", zJournal);
+  }
+  if (rc == SQLITE_OK)
+  {
+    int dirfd;
+    bKeep = 0;
+    *piOffset = iEnd;
+    if (osOpenDirectory(zJournal, &dirfd) == SQLITE_OK)
+    {
+      full_fsync(dirfd, 0, 0);
+      robust_close(0, dirfd, __LINE__);
+    }
+  }
+
+apply_out:
+  if (hJrnl >= 0)
+  {
+    robust_close(0, hJrnl, __LINE__);
+    if (!bKeep) osUnlink(zJournal);
+  }
+  if (bLocked) sqlite3_exec(db, "COMMIT", 0, 0, 0);
+  sqlite3_close(db);
+  sqlite3_free(aSeen);
+  sqlite3_free(aPage);
+  sqlite3_free(zJournal);
+  robust_close(0, h, __LINE__);
+  return rc;
 }
 
 /*
-** Find the current time (in Universal Coordinated Time).  Write into *piNow
-** the current time and date as a Julian Day number times 86_400_000.  In
-** other words, write into *piNow the number of milliseconds since the Julian
-** epoch of noon in Greenwich on November 24, 4714 B.C according to the
-** proleptic Gregorian calendar.
+** Release the disk space taken by the transactions of ship log zLog
+** before byte offset iOffset, once every follower has applied them.
+** iOffset must be the end of a transaction, as returned by
+** procvfs_ship_apply(), or SQLITE_MISUSE is returned.  Offsets in the log
+** do not change, so the primary keeps appending and followers carry on as
+** before.  A follower seeded afterwards from a new snapshot replays from
+** offset 0 as usual, which now starts at iOffset.
 **
-** On success, return SQLITE_OK.  Return SQLITE_ERROR if the time and date
-** cannot be found.
+** The first record is replaced by a ShipSkip to iOffset, and the blocks
+** between it and iOffset are punched out of the file.
 */
-static int unixCurrentTimeInt64(sqlite3_vfs *NotUsed, sqlite3_int64 *piNow)
+int procvfs_ship_truncate(const char *zLog, sqlite3_int64 iOffset)
 {
-  static const sqlite3_int64 unixEpoch = 24405875 * (sqlite3_int64)8640000;
+  ShipSkip skip;
+  struct stat buf;
+  i64 iEnd;
+  int iErrno = 0;
   int rc = SQLITE_OK;
-#if defined(NO_GETTOD)
-  time_t t;
-  time(&t);
-  *piNow = ((sqlite3_int64)t) * 1000 + unixEpoch;
-#else
-  struct timeval sNow;
-  (void)gettimeofday(&sNow, 0); /* Cannot fail given valid arguments */
-  *piNow = unixEpoch + 1000 * (sqlite3_int64)sNow.tv_sec + sNow.tv_usec / 1000;
-#endif
+  int h;
 
-  UNUSED_PARAMETER(NotUsed);
+  h = robust_open(zLog, O_RDWR | O_BINARY, 0);
+  if (h < 0) return unixLogError(SQLITE_CANTOPEN, "open", zLog);
+  if (osFstat(h, &buf)) rc = SQLITE_IOERR_FSTAT;
+  if (rc == SQLITE_OK && (iOffset < (i64)sizeof(ShipRecord) || iOffset > buf.st_size)) rc = SQLITE_MISUSE;
+  if (rc == SQLITE_OK) rc = shipScan(h, 0, iOffset, &iEnd, 0);
+  if (rc == SQLITE_OK && iEnd != iOffset) rc = iEnd > iOffset ? SQLITE_OK : SQLITE_MISUSE;
+  else if (rc == SQLITE_OK)
+  {
+    memset(&skip, 0, sizeof(skip));
+    skip.magic = SHIP_SKIP;
+    skip.iNext = iOffset;
+    if (seekAndWriteFd(h, 0, &skip, sizeof(skip), &iErrno) != sizeof(skip))
+    {
+      rc = unixLogError(SQLITE_IOERR_WRITE, "write", zLog);
+    }
+    else if (full_fsync(h, 0, 1))
+    {
+      rc = unixLogError(SQLITE_IOERR_FSYNC, "fsync", zLog);
+    }
+#if HAVE_LINUX_FALLOCATE
+    else if ((iOffset & ~(i64)4095) > 4096 &&
+             osLinuxFallocate(h, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 4096, (iOffset & ~(i64)4095) - 4096))
+    {
+      rc = unixLogError(SQLITE_IOERR_TRUNCATE, "fallocate", zLog);
+    }
+#endif
+  }
+  robust_close(0, h, __LINE__);
   return rc;
 }
 
-#ifndef SQLITE_OMIT_DEPRECATED
 /*
-** Find the current time (in Universal Coordinated Time).  Write the
-** current time and date as a Julian Day number into *prNow and
-** return 0.  Return 1 if the time and date cannot be found.
+** Report the background checkpoints run for database zDbName ("main" if
+** NULL) of connection db, and the write transactions held back by its
+** "wal_limit", since the database was first opened.  Either output
+** pointer may be NULL.  Return SQLITE_NOTFOUND if the database has no
+** background checkpoints.
 */
-static int unixCurrentTime(sqlite3_vfs *NotUsed, double *prNow)
+int procvfs_checkpoint_count(sqlite3 *db, const char *zDbName, sqlite3_uint64 *pnCheckpoint,
+                             sqlite3_uint64 *pnThrottle)
 {
-  sqlite3_int64 i = 0;
-  int rc;
-  UNUSED_PARAMETER(NotUsed);
-  rc = unixCurrentTimeInt64(0, &i);
-  *prNow = i / 86400000.0;
-  return rc;
+  unixFile *pFile = procvfsDbFile(db, zDbName);
+  unixCkpt *p = (pFile && pFile->pInode) ? pFile->pInode->pCkpt : 0;
+  if (p == 0) return SQLITE_NOTFOUND;
+  std::lock_guard<std::mutex> lock(ckptMutex);
+  if (pnCheckpoint) *pnCheckpoint = p->nCheckpoint;
+  if (pnThrottle) *pnThrottle = p->nThrottle;
+  return SQLITE_OK;
 }
-#else
-#define unixCurrentTime 0
-#endif
 
 /*
-** The xGetLastError() method is designed to return a better
-** low-level error message when operating-system problems come up
-** during SQLite operation.  Only the integer return code is currently
-** used.
+** Turn system call accounting on or off.  See "System call accounting"
+** above.  Return SQLITE_NOTFOUND if it cannot be turned on because this
+** is a PROCVFS_RELEASE build.
 */
-static int unixGetLastError(sqlite3_vfs *NotUsed, int NotUsed2, char *NotUsed3)
+int procvfs_syscall_accounting(int bEnable)
 {
-  UNUSED_PARAMETER(NotUsed);
-  UNUSED_PARAMETER(NotUsed2);
-  UNUSED_PARAMETER(NotUsed3);
-  return errno;
+#ifdef PROCVFS_RELEASE
+  return bEnable ? SQLITE_NOTFOUND : SQLITE_OK;
+#else
+  int i;
+  if (!bEnable == !bSyscallAcct) return SQLITE_OK;
+  for (i = 0; i < UNIX_NSYSCALL; i++)
+  {
+    if (bEnable && aSyscall[i].pCurrent)
+    {
+      aAcctNext[i] = aSyscall[i].pCurrent;
+      aSyscall[i].pCurrent = aAcctWrapper[i];
+    }
+    else if (!bEnable && aSyscall[i].pCurrent == aAcctWrapper[i])
+    {
+      aSyscall[i].pCurrent = aAcctNext[i];
+    }
+  }
+  bSyscallAcct = bEnable;
+  return SQLITE_OK;
+#endif
 }
 
 /*
-************************ End of sqlite3_vfs methods ***************************
-******************************************************************************/
-
-/*
-** Initialize the operating system interface.
-**
-** This routine registers all VFS implementations for unix-like operating
-** systems.  This routine, and the sqlite3_os_end() routine that follows,
-** should be the only routines in this file that are visible from other
-** files.
-**
-** This routine is called once during SQLite initialization and by a
-** single thread.  The memory allocation and mutex subsystems have not
-** necessarily been initialized when this routine is called, and so they
-** should not be used.
+** Zero the system call counters of the calling thread.
 */
-int procvfs_init(void)
+void procvfs_syscall_reset(void)
 {
+#ifndef PROCVFS_RELEASE
+  memset(aAcctCount, 0, sizeof(aAcctCount));
+#endif
+}
+
 /*
-** The following macro defines an initializer for an sqlite3_vfs object.
-** The name of the VFS is NAME.  The pAppData is a pointer to a pointer
-** to the "finder" function.  (pAppData is a pointer to a pointer because
-** silly C90 rules prohibit a void* from being cast to a function pointer
-** and so we have to go through the intermediate pointer to avoid problems
-** when compiling with -pedantic-errors on GCC.)
-**
-** The FINDER parameter to this macro is the name of the pointer to the
-** finder-function.  The finder-function returns a pointer to the
-** sqlite_io_methods object that implements the desired locking
-** behaviors.  See the division above that contains the IOMETHODS
-** macro for addition information on finder-functions.
-**
-** Most finders simply return a pointer to a fixed sqlite3_io_methods
-** object.  But the "autolockIoFinder" available on MacOSX does a little
-** more than that; it looks at the filesystem type that hosts the
-** database file and tries to choose an locking method appropriate for
-** that filesystem time.
+** Report the calls the calling thread made to the system call zName since
+** its counters were last reset, or to all system calls if zName is NULL.
+** Either output pointer may be NULL.  Return SQLITE_NOTFOUND if there is
+** no system call named zName.
 */
-#define UNIXVFS(VFSNAME, FINDER)                      \
-  {                                                   \
-    3,                        /* iVersion */          \
-        sizeof(unixFile),     /* szOsFile */          \
-        MAX_PATHNAME,         /* mxPathname */        \
-        0,                    /* pNext */             \
-        VFSNAME,              /* zName */             \
-        (void *)&FINDER,      /* pAppData */          \
-        unixOpen,             /* xOpen */             \
-        unixDelete,           /* xDelete */           \
-        unixAccess,           /* xAccess */           \
-        unixFullPathname,     /* xFullPathname */     \
-        unixDlOpen,           /* xDlOpen */           \
-        unixDlError,          /* xDlError */          \
-        unixDlSym,            /* xDlSym */            \
-        unixDlClose,          /* xDlClose */          \
-        unixRandomness,       /* xRandomness */       \
-        unixSleep,            /* xSleep */            \
-        unixCurrentTime,      /* xCurrentTime */      \
-        unixGetLastError,     /* xGetLastError */     \
-        unixCurrentTimeInt64, /* xCurrentTimeInt64 */ \
-        unixSetSystemCall,    /* xSetSystemCall */    \
-        unixGetSystemCall,    /* xGetSystemCall */    \
-        unixNextSystemCall,   /* xNextSystemCall */   \
-  }
-
-  /*
-  ** All default VFSes for unix are contained in the following array.
-  **
-  ** Note that the sqlite3_vfs.pNext field of the VFS object is modified
-  ** by the SQLite core when the VFS is registered.  So the following
-  ** array cannot be const.
-  */
-  static sqlite3_vfs aVfs[] = {
-      UNIXVFS("proc", posixIoFinder),
-  };
-  unsigned int i; /* Loop counter */
-
-  /* Double-check that the aSyscall[] array has been constructed
-  ** correctly.  See ticket [bb3a86e890c8e96ab] */
-  assert(ArraySize(aSyscall) == 29);
-
-  /* Register all VFSes defined in the aVfs[] array */
-  for (i = 0; i < (sizeof(aVfs) / sizeof(sqlite3_vfs)); i++)
-  {
-    sqlite3_vfs_register(&aVfs[i], i == 0);
+int procvfs_syscall_count(const char *zName, sqlite3_uint64 *pnCall, sqlite3_uint64 *pnNanosec)
+{
+  u64 nCall = 0;
+  u64 nNano = 0;
+  int bFound = zName == 0;
+  int i;
+  for (i = 0; i < UNIX_NSYSCALL; i++)
+  {
+    if (zName == 0 || strcmp(zName, aSyscall[i].zName) == 0)
+    {
+      bFound = 1;
+#ifndef PROCVFS_RELEASE
+      nCall += aAcctCount[i].nCall;
+      nNano += aAcctCount[i].nNano;
+#endif
+    }
   }
-  return SQLITE_OK;
+  if (pnCall) *pnCall = nCall;
+  if (pnNanosec) *pnNanosec = nNano;
+  return bFound ? SQLITE_OK : SQLITE_NOTFOUND;
 }
 
 /*
 ** Shutdown the operating system interface.
 **
-** Some operating systems might need to do some cleanup in this routine,
-** to release dynamically allocated objects.  But not on unix.
-** This routine is a no-op for unix.
+** Wait for the threads of the VFS to finish their work.  Return
+** SQLITE_BUSY, without waiting for any, if a database with background
+** checkpoints is still open.
 */
 int procvfs_close(void)
 {
+  int rc = unixCkptStop();
+  if (rc != SQLITE_OK) return rc;
+  unixWalSpareWait();
+  vfsprefetch_wait();
+  unixDirFdCloseAll();
   return SQLITE_OK;
 }
@@ -1,3 +1,32 @@
+#include "sqlite3.h"
+
+/* The "proc-ofd" VFS registered here claims SIGRTMIN+6 (PROCVFS_LOCK_SIGNAL)
+** to end lock waits under "lock_timeout", unless the application installed
+** a handler for it first.  The handler is installed without SA_RESTART, and
+** the signal is never left pending once a wait is over. */
 int procvfs_init(void);
 int procvfs_close(void); 
+int procvfs_set_directories(const char *zWalDir, const char *zShmDir);
+
+/* Changed-block tracking for incremental backups.  See procvfs.cpp. */
+int procvfs_cbt_start(sqlite3 *db, const char *zDbName, const char *zEpoch);
+int procvfs_cbt_stop(sqlite3 *db, const char *zDbName);
+int procvfs_cbt_backup(sqlite3 *db, const char *zDbName, const char *zEpoch, const char *zNextEpoch,
+                       int (*xBlock)(void *pCtx, sqlite3_int64 iOfst, const void *pData, int nData), void *pCtx,
+                       sqlite3_int64 *pnSize);
+
+/* Consistent copy of a database, using reflinks where available. */
+int procvfs_snapshot(sqlite3 *db, const char *zDbName, const char *zTarget);
+
+/* Follower side of the "ship_log" URI parameter. */
+int procvfs_ship_apply(const char *zLog, const char *zReplica, sqlite3_int64 *piOffset);
+int procvfs_ship_truncate(const char *zLog, sqlite3_int64 iOffset);
+
+/* Background checkpoints ("ckpt_wal" and related URI parameters). */
+int procvfs_checkpoint_count(sqlite3 *db, const char *zDbName, sqlite3_uint64 *pnCheckpoint,
+                             sqlite3_uint64 *pnThrottle);
 
+/* Per-thread system call accounting, for tests.  See procvfs.cpp. */
+int procvfs_syscall_accounting(int bEnable);
+void procvfs_syscall_reset(void);
+int procvfs_syscall_count(const char *zName, sqlite3_uint64 *pnCall, sqlite3_uint64 *pnNanosec);
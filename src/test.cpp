@@ -1,15 +1,31 @@
 #include "vfs.h"
 #include "procvfs.h"
 #include "ProxyVfs.h"
+#include "vfspool.h"
+#include "vfsprefetch.h"
 
 #include "sqlite3.h"
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdint>
+#include <cstdlib>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -93,6 +109,11 @@ TEST(MyTest, UnitTest)
     sqlite3_file* testFile = reinterpret_cast<sqlite3_file*>(fileBuffer.data());
     EXPECT_CALL(cppMockVfs, xOpen(&sqliteMockVfs, "zName", _, 2, nullptr)).WillOnce(Return(1));
     ASSERT_EQ(1, proxyVfs->xOpen(proxyVfs, "zName", testFile, 2, nullptr));
+    /* A failed open leaves nothing for xClose and returns its block */
+    EXPECT_EQ(nullptr, testFile->pMethods);
+    VfsPoolStatus status;
+    ASSERT_EQ(SQLITE_OK, vfspool_status("proxyvfs", &status));
+    EXPECT_EQ(0, status.nOut);
 }
 
 TEST(MyTest, IntegrationTest)
@@ -155,3 +176,1677 @@ TEST(MyTest, IntegrationTest)
   ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "SELECT * FROM COMPANY;", Mock::callback, &mock, nullptr));
 }
 
+
+TEST(ProcVfsTest, WalDirectory)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-waldir && mkdir -p /tmp/procvfs-waldir/db /tmp/procvfs-waldir/wal"));
+  const char *uri = "file:/tmp/procvfs-waldir/db/test.db?wal_dir=/tmp/procvfs-waldir/wal";
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(uri, &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; CREATE TABLE t(x); INSERT INTO t VALUES(1);",
+                                    nullptr, nullptr, nullptr));
+  struct stat st;
+  EXPECT_NE(0, stat("/tmp/procvfs-waldir/db/test.db-wal", &st));
+
+  sqlite3 *db2 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(uri, &db2, flags, "proc"));
+  Mock mock;
+  EXPECT_CALL(mock, cppCallback(_)).Times(1);
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "SELECT * FROM t;", Mock::callback, &mock, nullptr));
+  sqlite3_close(db2);
+  sqlite3_close(db);
+
+  /* The -wal file is named after the canonical path of the database, so
+  ** it is still found once the database is restored to a new inode, and
+  ** by a process that opens it through a symbolic link */
+  ASSERT_EQ(0, symlink("/tmp/procvfs-waldir/db", "/tmp/procvfs-waldir/link"));
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0)
+  {
+    sqlite3 *db = nullptr;
+    if (sqlite3_open_v2(uri, &db, flags, "proc") != SQLITE_OK ||
+        sqlite3_exec(db, "PRAGMA wal_autocheckpoint=0; INSERT INTO t VALUES(2);", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+      _exit(1);
+    }
+    _exit(0);
+  }
+  int status = 0;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  ASSERT_EQ(0, WEXITSTATUS(status));
+  ASSERT_EQ(0, system("cd /tmp/procvfs-waldir/db && cp test.db copy.db && mv copy.db test.db"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-waldir/link/test.db?wal_dir=/tmp/procvfs-waldir/wal", &db,
+                                       flags, "proc"));
+  Mock restored;
+  EXPECT_CALL(restored, cppCallback(_)).Times(2);
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "SELECT * FROM t;", Mock::callback, &restored, nullptr));
+  sqlite3_close(db);
+}
+
+TEST(ProcVfsTest, ChangedBlockTracking)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-cbt && mkdir -p /tmp/procvfs-cbt"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-cbt/test.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+                                    "CREATE TABLE t(x);"
+                                    "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<2000)"
+                                    "INSERT INTO t SELECT randomblob(200) FROM c;",
+                                    nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, procvfs_cbt_start(db, "main", "e1"));
+  ASSERT_EQ(0, system("cp /tmp/procvfs-cbt/test.db /tmp/procvfs-cbt/backup.db"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "UPDATE t SET x=zeroblob(200) WHERE rowid=1000;", nullptr, nullptr, nullptr));
+
+  FILE *backup = fopen("/tmp/procvfs-cbt/backup.db", "r+b");
+  ASSERT_NE(nullptr, backup);
+  struct Target
+  {
+    FILE *f;
+    sqlite3_int64 nByte;
+  } target = {backup, 0};
+  auto xBlock = [](void *pCtx, sqlite3_int64 iOfst, const void *pData, int nData) -> int {
+    Target *p = static_cast<Target *>(pCtx);
+    p->nByte += nData;
+    return fseek(p->f, iOfst, SEEK_SET) != 0 || fwrite(pData, 1, nData, p->f) != (size_t)nData;
+  };
+  sqlite3_int64 nSize = 0;
+  EXPECT_EQ(SQLITE_NOTFOUND, procvfs_cbt_backup(db, "main", "e0", nullptr, xBlock, &target, &nSize));
+  ASSERT_EQ(SQLITE_OK, procvfs_cbt_backup(db, "main", "e1", "e2", xBlock, &target, &nSize));
+  fclose(backup);
+  EXPECT_GT(target.nByte, 0);
+  EXPECT_LT(target.nByte, nSize / 4);
+  EXPECT_EQ(0, truncate("/tmp/procvfs-cbt/backup.db", nSize));
+  EXPECT_EQ(0, system("cmp -s /tmp/procvfs-cbt/test.db /tmp/procvfs-cbt/backup.db"));
+
+  ASSERT_EQ(SQLITE_OK, procvfs_cbt_stop(db, "main"));
+  struct stat st;
+  EXPECT_NE(0, stat("/tmp/procvfs-cbt/test.db-cbt", &st));
+  sqlite3_close(db);
+}
+
+TEST(ProcVfsTest, Snapshot)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-snap && mkdir -p /tmp/procvfs-snap"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-snap/test.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; CREATE TABLE t(x); INSERT INTO t VALUES(1);",
+                                    nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, procvfs_snapshot(db, nullptr, "/tmp/procvfs-snap/snap.db"));
+  EXPECT_NE(SQLITE_OK, procvfs_snapshot(db, nullptr, "/tmp/procvfs-snap/snap.db"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(2);", nullptr, nullptr, nullptr));
+
+  sqlite3 *snap = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-snap/snap.db", &snap, flags, "proc"));
+  Mock mock;
+  EXPECT_CALL(mock, cppCallback(_)).Times(1);
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(snap, "SELECT * FROM t;", Mock::callback, &mock, nullptr));
+  sqlite3_close(snap);
+  sqlite3_close(db);
+}
+
+static sqlite3_syscall_ptr xRealShipFdatasync = nullptr;
+static bool bFailFdatasync = false;
+static int failingFdatasync(int fd)
+{
+  if (bFailFdatasync)
+  {
+    errno = EIO;
+    return -1;
+  }
+  return ((int (*)(int))xRealShipFdatasync)(fd);
+}
+
+static sqlite3_syscall_ptr xRealShipWrite = nullptr;
+static int nReplicaWrite = 0;
+static ssize_t crashingWrite(int fd, const void *pBuf, size_t n)
+{
+  /* Die part way through the page images written to the replica */
+  char zLink[64], zPath[256] = {0};
+  ssize_t rc = ((ssize_t(*)(int, const void *, size_t))xRealShipWrite)(fd, pBuf, n);
+  snprintf(zLink, sizeof(zLink), "/proc/self/fd/%d", fd);
+  if (readlink(zLink, zPath, sizeof(zPath) - 1) > 0 && std::string(zPath) == "/tmp/procvfs-ship/replica.db" &&
+      ++nReplicaWrite == 4)
+  {
+    _exit(0);
+  }
+  return rc;
+}
+
+TEST(ProcVfsTest, ShipLog)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-ship && mkdir -p /tmp/procvfs-ship"));
+  const char *uri = "file:/tmp/procvfs-ship/primary.db?ship_log=/tmp/procvfs-ship/log&sync_wal=fdatasync";
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  auto sumRows = [](sqlite3 *db) {
+    std::string result;
+    sqlite3_exec(db, "SELECT count(*) || ',' || sum(x) FROM t;",
+                 [](void *pArg, int, char **azVal, char **) {
+                   *static_cast<std::string *>(pArg) = azVal[0];
+                   return 0;
+                 },
+                 &result, nullptr);
+    return result;
+  };
+
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(uri, &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL; CREATE TABLE t(x);"
+                                        "INSERT INTO t VALUES(1);",
+                                    nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, procvfs_snapshot(db, nullptr, "/tmp/procvfs-ship/replica.db"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+                                    "INSERT INTO t VALUES(2);"
+                                    "BEGIN; INSERT INTO t VALUES(100); ROLLBACK;",
+                                    nullptr, nullptr, nullptr));
+
+  /* A transaction whose -wal sync fails is not committed, so not shipped */
+  xRealShipFdatasync = pVfs->xGetSystemCall(pVfs, "fdatasync");
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "fdatasync", (sqlite3_syscall_ptr)failingFdatasync));
+  struct stat st;
+  ASSERT_EQ(0, stat("/tmp/procvfs-ship/log", &st));
+  bFailFdatasync = true;
+  EXPECT_NE(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(50);", nullptr, nullptr, nullptr));
+  bFailFdatasync = false;
+  struct stat stAfter;
+  ASSERT_EQ(0, stat("/tmp/procvfs-ship/log", &stAfter));
+  EXPECT_EQ(st.st_size, stAfter.st_size);
+  pVfs->xSetSystemCall(pVfs, "fdatasync", xRealShipFdatasync);
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(4);", nullptr, nullptr, nullptr));
+
+  /* A follower that dies while applying leaves the replica to be rolled
+  ** back, by the next connection that can write it */
+  sqlite3 *replica = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-ship/replica.db", &replica, SQLITE_OPEN_READWRITE, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(replica, "PRAGMA journal_mode=DELETE;", nullptr, nullptr, nullptr));
+  sqlite3_close(replica);
+  sqlite3_int64 offset = 0;
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0)
+  {
+    xRealShipWrite = pVfs->xGetSystemCall(pVfs, "write");
+    pVfs->xSetSystemCall(pVfs, "write", (sqlite3_syscall_ptr)crashingWrite);
+    procvfs_ship_apply("/tmp/procvfs-ship/log", "/tmp/procvfs-ship/replica.db", &offset);
+    _exit(1);
+  }
+  int status = 0;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  ASSERT_EQ(0, WEXITSTATUS(status));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-ship/replica.db", &replica, SQLITE_OPEN_READWRITE, "proc"));
+  EXPECT_EQ("1,1", sumRows(replica));
+  sqlite3_close(replica);
+
+  ASSERT_EQ(SQLITE_OK, procvfs_ship_apply("/tmp/procvfs-ship/log", "/tmp/procvfs-ship/replica.db", &offset));
+  EXPECT_GT(offset, 0);
+  sqlite3_int64 again = offset;
+  ASSERT_EQ(SQLITE_OK, procvfs_ship_apply("/tmp/procvfs-ship/log", "/tmp/procvfs-ship/replica.db", &again));
+  EXPECT_EQ(offset, again);
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-ship/replica.db", &replica, SQLITE_OPEN_READONLY, "proc"));
+  EXPECT_EQ("3,7", sumRows(replica));
+  sqlite3_close(replica);
+
+  /* Truncating the log releases its space, and offsets stay valid */
+  ASSERT_EQ(0, system("cp /tmp/procvfs-ship/replica.db /tmp/procvfs-ship/copy.db"));
+  ASSERT_EQ(0, stat("/tmp/procvfs-ship/log", &st));
+  EXPECT_EQ(SQLITE_MISUSE, procvfs_ship_truncate("/tmp/procvfs-ship/log", offset - 1));
+  ASSERT_EQ(SQLITE_OK, procvfs_ship_truncate("/tmp/procvfs-ship/log", offset));
+  ASSERT_EQ(0, stat("/tmp/procvfs-ship/log", &stAfter));
+  EXPECT_EQ(st.st_size, stAfter.st_size);
+  EXPECT_LT(stAfter.st_blocks, st.st_blocks);
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(5);", nullptr, nullptr, nullptr));
+  sqlite3_close(db);
+  ASSERT_EQ(SQLITE_OK, procvfs_ship_apply("/tmp/procvfs-ship/log", "/tmp/procvfs-ship/replica.db", &offset));
+  sqlite3_int64 fromStart = 0;
+  ASSERT_EQ(SQLITE_OK, procvfs_ship_apply("/tmp/procvfs-ship/log", "/tmp/procvfs-ship/copy.db", &fromStart));
+  EXPECT_EQ(offset, fromStart);
+  for (const char *zReplica : {"/tmp/procvfs-ship/replica.db", "/tmp/procvfs-ship/copy.db"})
+  {
+    ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zReplica, &replica, SQLITE_OPEN_READONLY, "proc"));
+    EXPECT_EQ("4,12", sumRows(replica)) << zReplica;
+    sqlite3_close(replica);
+  }
+
+  /* Without powersafe overwrite, copies of the commit frame pad each
+  ** commit out to a sector, and it is still shipped exactly once */
+  const char *padded = "file:/tmp/procvfs-ship/padded.db?ship_log=/tmp/procvfs-ship/padded-log&psow=0";
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(padded, &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL; PRAGMA cell_size_check=ON;"
+                                        "CREATE TABLE t(x);",
+                                    nullptr, nullptr, nullptr));
+  for (int i = 0; i < 10; i++)
+  {
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(1);", nullptr, nullptr, nullptr));
+  }
+  sqlite3_close(db);
+  FILE *log = fopen("/tmp/procvfs-ship/padded-log", "rb");
+  ASSERT_NE(nullptr, log);
+  std::uint32_t aRec[7]; /* magic, pgno, nTruncate, szPage, iFrame, aSalt[2] */
+  std::vector<std::uint32_t> commits;
+  while (fread(aRec, sizeof(aRec), 1, log) == 1 && fseek(log, aRec[3], SEEK_CUR) == 0)
+  {
+    if (aRec[2]) commits.push_back(aRec[4]);
+  }
+  fclose(log);
+  ASSERT_EQ(11u, commits.size());
+  EXPECT_TRUE(std::is_sorted(commits.begin(), commits.end()));
+  EXPECT_EQ(commits.end(), std::adjacent_find(commits.begin(), commits.end()));
+}
+
+TEST(ProcVfsTest, VfsStat)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-stat && mkdir -p /tmp/procvfs-stat"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-stat/test.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; CREATE TABLE t(x); INSERT INTO t VALUES(1);",
+                                    nullptr, nullptr, nullptr));
+
+  std::vector<std::string> rows;
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+                                    "SELECT type, writes > 0, syncs > 0, locks > 0, shm_maps > 0 FROM vfs_stat"
+                                    " WHERE vfs = 'proc' AND path LIKE '/tmp/procvfs-stat/%' ORDER BY type;",
+                                    [](void *pArg, int nCol, char **azVal, char **) {
+                                      std::string row;
+                                      for (int i = 0; i < nCol; i++) row += std::string(i ? "," : "") + azVal[i];
+                                      static_cast<std::vector<std::string> *>(pArg)->push_back(row);
+                                      return 0;
+                                    },
+                                    &rows, nullptr));
+  ASSERT_EQ(2u, rows.size());
+  EXPECT_EQ("main_db,1,1,1,1", rows[0]);
+  EXPECT_EQ("wal,1,1,0,0", rows[1]);
+
+  sqlite3_close(db);
+}
+
+TEST(ProcVfsTest, PooledAllocation)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-pool && mkdir -p /tmp/procvfs-pool"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+
+  for (int i = 0; i < 3; i++)
+  {
+    sqlite3 *db = nullptr;
+    ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-pool/test.db", &db, flags, "proc"));
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; CREATE TABLE IF NOT EXISTS t(x);"
+                                          "INSERT INTO t VALUES(1);",
+                                      nullptr, nullptr, nullptr));
+    sqlite3_close(db);
+  }
+
+  /* Each reopen reuses the blocks freed by the previous close */
+  for (const char *zPool : {"unixInodeInfo", "UnixUnusedFd", "unixShm", "unixShmNode", "unixShmNode.apRegion"})
+  {
+    VfsPoolStatus status;
+    ASSERT_EQ(SQLITE_OK, vfspool_status(zPool, &status)) << zPool;
+    EXPECT_GE(status.nHit, 2u) << zPool;
+    EXPECT_EQ(0, status.nOut) << zPool;
+    EXPECT_EQ(0u, status.nOversize) << zPool;
+  }
+  VfsPoolStatus status;
+  EXPECT_EQ(SQLITE_NOTFOUND, vfspool_status("no-such-pool", &status));
+
+  /* A pool is only torn down once every block is back */
+  VfsPool pool;
+  vfspool_init(&pool, "test-destroy", 64);
+  void *p = vfspool_alloc(&pool, 64);
+  ASSERT_NE(nullptr, p);
+  EXPECT_EQ(SQLITE_BUSY, vfspool_destroy(&pool));
+  ASSERT_EQ(SQLITE_OK, vfspool_status("test-destroy", &status));
+  EXPECT_EQ(1, status.nOut);
+  vfspool_free(p);
+  EXPECT_EQ(SQLITE_OK, vfspool_destroy(&pool));
+  EXPECT_EQ(SQLITE_NOTFOUND, vfspool_status("test-destroy", &status));
+}
+
+static int nUringEnter = 0;
+static sqlite3_syscall_ptr xRealUringEnter = nullptr;
+static int countingUringEnter(int fd, unsigned nSubmit, unsigned nComplete, unsigned flags)
+{
+  nUringEnter++;
+  return ((int (*)(int, unsigned, unsigned, unsigned))xRealUringEnter)(fd, nSubmit, nComplete, flags);
+}
+
+TEST(ProcVfsTest, IoUring)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-uring && mkdir -p /tmp/procvfs-uring"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc-uring");
+  ASSERT_NE(nullptr, pVfs);
+  xRealUringEnter = pVfs->xGetSystemCall(pVfs, "io_uring_enter");
+  if (xRealUringEnter)
+  {
+    ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "io_uring_enter", (sqlite3_syscall_ptr)countingUringEnter));
+  }
+
+  sqlite3 *db = nullptr;
+  sqlite3 *db2 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-uring/test.db", &db, flags, "proc-uring"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL; CREATE TABLE t(x);",
+                                    nullptr, nullptr, nullptr));
+  for (int i = 0; i < 20; i++)
+  {
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(randomblob(100));", nullptr, nullptr, nullptr));
+  }
+  /* Larger than the staging buffer, so it is submitted in batches */
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+                                    "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<200)"
+                                    " INSERT INTO t SELECT randomblob(4000) FROM c;",
+                                    nullptr, nullptr, nullptr));
+
+  auto count = [](sqlite3 *pDb) {
+    sqlite3_stmt *pStmt = nullptr;
+    int n = -1;
+    if (sqlite3_prepare_v2(pDb, "SELECT count(*) FROM t", -1, &pStmt, nullptr) == SQLITE_OK &&
+        sqlite3_step(pStmt) == SQLITE_ROW)
+    {
+      n = sqlite3_column_int(pStmt, 0);
+    }
+    sqlite3_finalize(pStmt);
+    return n;
+  };
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-uring/test.db", &db2, flags, "proc"));
+  EXPECT_EQ(220, count(db2));
+
+  /* Without xSync() calls, commits are submitted before they are published */
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA synchronous=NORMAL;", nullptr, nullptr, nullptr));
+  for (int i = 0; i < 5; i++)
+  {
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(randomblob(100));", nullptr, nullptr, nullptr));
+    EXPECT_EQ(221 + i, count(db2));
+  }
+  ASSERT_EQ(SQLITE_OK,
+            sqlite3_exec(db, "PRAGMA synchronous=FULL; INSERT INTO t VALUES(1);", nullptr, nullptr, nullptr));
+  EXPECT_EQ(226, count(db2));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "PRAGMA integrity_check;", nullptr, nullptr, nullptr));
+
+  sqlite3_close(db2);
+  sqlite3_close(db);
+  if (xRealUringEnter)
+  {
+    pVfs->xSetSystemCall(pVfs, "io_uring_enter", xRealUringEnter);
+    EXPECT_GT(nUringEnter, 0);
+  }
+}
+
+TEST(ProcVfsTest, InodeTableConcurrency)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-inode && mkdir -p /tmp/procvfs-inode"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
+  const int nThread = 8;
+  const int nDbPerThread = 8;
+  std::vector<int> aFail(nThread, 0);
+
+  /* Switch the shared database to WAL up front.  Threads racing to do it
+  ** can fail with SQLITE_BUSY without the busy handler being invoked. */
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-inode/shared.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; CREATE TABLE t(x);", nullptr, nullptr, nullptr));
+  sqlite3_close(db);
+
+  /* Each thread repeatedly opens its own databases and one shared by all */
+  std::vector<std::thread> aThread;
+  for (int t = 0; t < nThread; t++)
+  {
+    aThread.emplace_back([&, t]() {
+      for (int i = 0; i < nDbPerThread; i++)
+      {
+        for (const std::string &zName : {"/tmp/procvfs-inode/t" + std::to_string(t) + "-" + std::to_string(i) + ".db",
+                                         std::string("/tmp/procvfs-inode/shared.db")})
+        {
+          sqlite3 *db = nullptr;
+          int rc = sqlite3_open_v2(zName.c_str(), &db, flags, "proc");
+          if (rc == SQLITE_OK) rc = sqlite3_busy_timeout(db, 10000);
+          if (rc == SQLITE_OK)
+          {
+            rc = sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=OFF;"
+                              "CREATE TABLE IF NOT EXISTS t(x); INSERT INTO t VALUES(1);",
+                              nullptr, nullptr, nullptr);
+          }
+          if (rc != SQLITE_OK) aFail[t]++;
+          sqlite3_close(db);
+        }
+      }
+    });
+  }
+  for (std::thread &thread : aThread) thread.join();
+  for (int t = 0; t < nThread; t++) EXPECT_EQ(0, aFail[t]) << "thread " << t;
+
+  sqlite3_stmt *pStmt = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-inode/shared.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db, "SELECT count(*) FROM t", -1, &pStmt, nullptr));
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(pStmt));
+  EXPECT_EQ(nThread * nDbPerThread, sqlite3_column_int(pStmt, 0));
+  sqlite3_finalize(pStmt);
+  sqlite3_close(db);
+
+  /* Every unixInodeInfo was released */
+  VfsPoolStatus status;
+  ASSERT_EQ(SQLITE_OK, vfspool_status("unixInodeInfo", &status));
+  EXPECT_EQ(0, status.nOut);
+}
+
+TEST(ProcVfsTest, OfdLocking)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  if (sqlite3_vfs_find("proc-ofd") == nullptr) GTEST_SKIP() << "no OFD locks on this system";
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-ofd && mkdir -p /tmp/procvfs-ofd"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  const char *zDb = "/tmp/procvfs-ofd/test.db";
+  auto unusedFdAllocs = []() {
+    VfsPoolStatus status;
+    return vfspool_status("UnixUnusedFd", &status) == SQLITE_OK ? status.nAlloc : 0;
+  };
+  sqlite3_uint64 nUnusedFd = unusedFdAllocs();
+
+  /* Two connections in one process lock each other out, as two processes would */
+  sqlite3 *db1 = nullptr;
+  sqlite3 *db2 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zDb, &db1, flags, "proc-ofd"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zDb, &db2, flags, "proc-ofd"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "CREATE TABLE t(x); BEGIN IMMEDIATE; INSERT INTO t VALUES(1);", nullptr,
+                                    nullptr, nullptr));
+  EXPECT_EQ(SQLITE_BUSY, sqlite3_exec(db2, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr));
+
+  /* ... and conflict with the POSIX locks of the "proc" VFS */
+  sqlite3 *db3 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zDb, &db3, flags, "proc"));
+  EXPECT_EQ(SQLITE_BUSY, sqlite3_exec(db3, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "COMMIT;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db3, "BEGIN IMMEDIATE; INSERT INTO t VALUES(2);", nullptr, nullptr, nullptr));
+  EXPECT_EQ(SQLITE_BUSY, sqlite3_exec(db2, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr));
+
+  /* Closing a connection does not drop the locks of another on the same file */
+  sqlite3_close(db1);
+  EXPECT_EQ(SQLITE_BUSY, sqlite3_exec(db2, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db3, "COMMIT;", nullptr, nullptr, nullptr));
+
+  sqlite3_stmt *pStmt = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db2, "SELECT sum(x) FROM t", -1, &pStmt, nullptr));
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(pStmt));
+  EXPECT_EQ(3, sqlite3_column_int(pStmt, 0));
+  sqlite3_finalize(pStmt);
+  sqlite3_close(db3);
+
+  /* WAL mode uses the shared wal-index as usual */
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "PRAGMA journal_mode=WAL; INSERT INTO t VALUES(4);", nullptr, nullptr,
+                                    nullptr));
+  sqlite3_close(db2);
+
+  /* Only the "proc" open and the db1 close, deferred while db3 held its
+  ** POSIX locks, needed a deferred-close record */
+  EXPECT_EQ(nUnusedFd + 2, unusedFdAllocs());
+}
+
+static int nFcntl = 0;
+static sqlite3_syscall_ptr xRealFcntl = nullptr;
+static int countingFcntl(int fd, int op, void *pArg)
+{
+  nFcntl++;
+  return ((int (*)(int, int, ...))xRealFcntl)(fd, op, pArg);
+}
+
+TEST(ProcVfsTest, ShmAtomicLocks)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-shmlock && mkdir -p /tmp/procvfs-shmlock"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  const char *zUri = "file:/tmp/procvfs-shmlock/test.db?shm_lock=atomic";
+
+  /* A child process takes the write lock and then dies without releasing it */
+  int aToParent[2], aToChild[2];
+  ASSERT_EQ(0, pipe(aToParent));
+  ASSERT_EQ(0, pipe(aToChild));
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0)
+  {
+    sqlite3 *db = nullptr;
+    char c = 'x';
+    if (sqlite3_open_v2(zUri, &db, flags, "proc") == SQLITE_OK &&
+        sqlite3_exec(db, "PRAGMA journal_mode=WAL; CREATE TABLE t(x); BEGIN IMMEDIATE; INSERT INTO t VALUES(1);",
+                     nullptr, nullptr, nullptr) == SQLITE_OK)
+    {
+      c = 'y';
+    }
+    if (write(aToParent[1], &c, 1) != 1 || read(aToChild[0], &c, 1) != 1) _exit(1);
+    _exit(0);
+  }
+  char c = 0;
+  ASSERT_EQ(1, read(aToParent[0], &c, 1));
+  ASSERT_EQ('y', c);
+
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db, flags, "proc"));
+  EXPECT_EQ(SQLITE_BUSY, sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(1, write(aToChild[1], &c, 1));
+  int status = 0;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+  for (int fd : {aToParent[0], aToParent[1], aToChild[0], aToChild[1]}) close(fd);
+
+  /* The lock of the dead process no longer counts */
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "BEGIN IMMEDIATE; INSERT INTO t VALUES(2); COMMIT;", nullptr, nullptr,
+                                    nullptr));
+
+  /* Read transactions make no fcntl() calls */
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  xRealFcntl = pVfs->xGetSystemCall(pVfs, "fcntl");
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "fcntl", (sqlite3_syscall_ptr)countingFcntl));
+  int nRow = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    sqlite3_stmt *pStmt = nullptr;
+    ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db, "SELECT sum(x) FROM t", -1, &pStmt, nullptr));
+    ASSERT_EQ(SQLITE_ROW, sqlite3_step(pStmt));
+    nRow += sqlite3_column_int(pStmt, 0);
+    sqlite3_finalize(pStmt);
+  }
+  pVfs->xSetSystemCall(pVfs, "fcntl", xRealFcntl);
+  EXPECT_EQ(20, nRow);
+  EXPECT_EQ(0, nFcntl);
+
+  sqlite3_close(db);
+}
+
+TEST(ProcVfsTest, LockTimeout)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-wait && mkdir -p /tmp/procvfs-wait"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI | SQLITE_OPEN_NOMUTEX;
+  auto msSince = [](std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t).count();
+  };
+
+  /* A "proc-ofd" reader waits in the VFS for a writer's EXCLUSIVE lock */
+  if (sqlite3_vfs_find("proc-ofd"))
+  {
+    const char *zUri = "file:/tmp/procvfs-wait/rollback.db?lock_timeout=5000";
+    sqlite3 *db1 = nullptr;
+    sqlite3 *db2 = nullptr;
+    ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db1, flags, "proc-ofd"));
+    ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db2, flags, "proc-ofd"));
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "CREATE TABLE t(x); BEGIN EXCLUSIVE; INSERT INTO t VALUES(1);", nullptr,
+                                      nullptr, nullptr));
+    int rc = -1;
+    std::thread reader([&]() { rc = sqlite3_exec(db2, "SELECT * FROM t;", nullptr, nullptr, nullptr); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "COMMIT;", nullptr, nullptr, nullptr));
+    reader.join();
+    EXPECT_EQ(SQLITE_OK, rc);
+
+    /* The wait ends with SQLITE_BUSY at the deadline */
+    int iTimeout = 100;
+    ASSERT_EQ(SQLITE_OK, sqlite3_file_control(db2, "main", SQLITE_FCNTL_LOCK_TIMEOUT, &iTimeout));
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "BEGIN EXCLUSIVE;", nullptr, nullptr, nullptr));
+    auto tStart = std::chrono::steady_clock::now();
+    EXPECT_EQ(SQLITE_BUSY, sqlite3_exec(db2, "SELECT * FROM t;", nullptr, nullptr, nullptr));
+    EXPECT_GE(msSince(tStart), 90);
+
+    /* Once over, the wait leaves its signal neither pending nor blocked */
+    sigset_t pending, blocked;
+    ASSERT_EQ(0, sigpending(&pending));
+    ASSERT_EQ(0, pthread_sigmask(SIG_BLOCK, nullptr, &blocked));
+    EXPECT_FALSE(sigismember(&pending, SIGRTMIN + 6));
+    EXPECT_FALSE(sigismember(&blocked, SIGRTMIN + 6));
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "COMMIT;", nullptr, nullptr, nullptr));
+    sqlite3_close(db2);
+    sqlite3_close(db1);
+  }
+
+  /* With "shm_lock=atomic", a writer waits on a futex for the wal-index
+  ** write lock instead of going round the busy handler */
+  const char *zUri = "file:/tmp/procvfs-wait/wal.db?shm_lock=atomic&lock_timeout=5000";
+  sqlite3 *db1 = nullptr;
+  sqlite3 *db2 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db1, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db2, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "PRAGMA journal_mode=WAL; CREATE TABLE t(x);", nullptr, nullptr, nullptr));
+  int nBusy = 0;
+  ASSERT_EQ(SQLITE_OK, sqlite3_busy_handler(db2,
+                                            [](void *pArg, int) {
+                                              ++*static_cast<int *>(pArg);
+                                              std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                                              return 1;
+                                            },
+                                            &nBusy));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "BEGIN IMMEDIATE; INSERT INTO t VALUES(1);", nullptr, nullptr, nullptr));
+  int rc = -1;
+  std::thread writer([&]() { rc = sqlite3_exec(db2, "INSERT INTO t VALUES(2);", nullptr, nullptr, nullptr); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "COMMIT;", nullptr, nullptr, nullptr));
+  writer.join();
+  EXPECT_EQ(SQLITE_OK, rc);
+  /* Once, to retry with a fresh snapshot after the wait */
+  EXPECT_LE(nBusy, 2);
+
+  sqlite3_stmt *pStmt = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db1, "SELECT sum(x) FROM t", -1, &pStmt, nullptr));
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(pStmt));
+  EXPECT_EQ(3, sqlite3_column_int(pStmt, 0));
+  sqlite3_finalize(pStmt);
+
+  /* A new reader does not wait for a read mark held by another reader */
+  sqlite3 *db3 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db3, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "BEGIN; SELECT * FROM t;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "INSERT INTO t VALUES(3);", nullptr, nullptr, nullptr));
+  auto tStart = std::chrono::steady_clock::now();
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db3, "SELECT * FROM t;", nullptr, nullptr, nullptr));
+  EXPECT_LT(msSince(tStart), 1000);
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db1, "COMMIT;", nullptr, nullptr, nullptr));
+  sqlite3_close(db3);
+  sqlite3_close(db2);
+  sqlite3_close(db1);
+}
+
+TEST(ProcVfsTest, MemfdShm)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-memfd && mkdir -p /tmp/procvfs-memfd"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  const char *zUri = "file:/tmp/procvfs-memfd/test.db?shm_memfd=1";
+  auto count = [](sqlite3 *db) {
+    sqlite3_stmt *pStmt = nullptr;
+    int n = -1;
+    if (sqlite3_prepare_v2(db, "SELECT count(*) FROM t", -1, &pStmt, nullptr) == SQLITE_OK &&
+        sqlite3_step(pStmt) == SQLITE_ROW)
+    {
+      n = sqlite3_column_int(pStmt, 0);
+    }
+    sqlite3_finalize(pStmt);
+    return n;
+  };
+
+  /* A second process opens the memfd of the first, and adds a row */
+  int aToParent[2], aToChild[2];
+  ASSERT_EQ(0, pipe(aToParent));
+  ASSERT_EQ(0, pipe(aToChild));
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0)
+  {
+    sqlite3 *db = nullptr;
+    char c = 'x';
+    if (read(aToChild[0], &c, 1) != 1) _exit(1);
+    c = 'x';
+    if (sqlite3_open_v2(zUri, &db, flags, "proc") == SQLITE_OK && count(db) == 5000 &&
+        sqlite3_exec(db, "INSERT INTO t VALUES(0);", nullptr, nullptr, nullptr) == SQLITE_OK)
+    {
+      c = 'y';
+    }
+    sqlite3_close(db);
+    if (write(aToParent[1], &c, 1) != 1) _exit(1);
+    _exit(0);
+  }
+
+  /* Enough frames for the wal-index to need more than one region */
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+                                    "PRAGMA page_size=512; PRAGMA journal_mode=WAL; PRAGMA wal_autocheckpoint=0;"
+                                    " CREATE TABLE t(x); BEGIN;"
+                                    " WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<5000)"
+                                    " INSERT INTO t SELECT randomblob(300) FROM c; COMMIT;",
+                                    nullptr, nullptr, nullptr));
+  char c = 'y';
+  ASSERT_EQ(1, write(aToChild[1], &c, 1));
+  ASSERT_EQ(1, read(aToParent[0], &c, 1));
+  EXPECT_EQ('y', c);
+  int status = 0;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+  for (int fd : {aToParent[0], aToParent[1], aToChild[0], aToChild[1]}) close(fd);
+  EXPECT_EQ(5001, count(db));
+
+  /* The wal-index is not in the -shm file, which only holds the header */
+  struct stat sStat;
+  ASSERT_EQ(0, stat("/tmp/procvfs-memfd/test.db-shm", &sStat));
+  EXPECT_EQ(4096, sStat.st_size);
+  sqlite3_close(db);
+}
+
+static sqlite3_syscall_ptr xRealMadvise = nullptr;
+static int nSequentialAdvice = 0;
+static int recordingMadvise(void *p, size_t n, int eAdvice)
+{
+  if (eAdvice == MADV_SEQUENTIAL) nSequentialAdvice++;
+  return ((int (*)(void *, size_t, int))xRealMadvise)(p, n, eAdvice);
+}
+
+static sqlite3_syscall_ptr xRealMmap = nullptr;
+static size_t nLargestReserve = 0;
+static void *recordingMmap(void *p, size_t n, int prot, int flags, int fd, off_t iOff)
+{
+  if (prot == PROT_NONE && n > nLargestReserve) nLargestReserve = n;
+  return ((void *(*)(void *, size_t, int, int, int, off_t))xRealMmap)(p, n, prot, flags, fd, iOff);
+}
+
+static sqlite3_syscall_ptr xRealGetrusage = nullptr;
+static long nFakeFaults = 0;
+static int faultingGetrusage(int who, struct rusage *pUsage)
+{
+  int rc = ((int (*)(int, struct rusage *))xRealGetrusage)(who, pUsage);
+  nFakeFaults += 1000;
+  pUsage->ru_majflt += nFakeFaults;
+  return rc;
+}
+
+TEST(ProcVfsTest, MmapPolicy)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-mmap && mkdir -p /tmp/procvfs-mmap"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  auto scan = [&](const char *zSetup, sqlite3_int64 *pFallbacks) {
+    sqlite3 *db = nullptr;
+    sqlite3_int64 nRead = -1;
+    sqlite3_stmt *pStmt = nullptr;
+    ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-mmap/test.db", &db, flags, "proc"));
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zSetup, nullptr, nullptr, nullptr));
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "SELECT sum(length(x)) FROM t;", nullptr, nullptr, nullptr));
+    ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db,
+                                            "SELECT pread_fallbacks FROM vfs_stat"
+                                            " WHERE path = '/tmp/procvfs-mmap/test.db' AND type = 'main_db'",
+                                            -1, &pStmt, nullptr));
+    ASSERT_EQ(SQLITE_ROW, sqlite3_step(pStmt));
+    nRead = sqlite3_column_int64(pStmt, 0);
+    sqlite3_finalize(pStmt);
+    sqlite3_close(db);
+    *pFallbacks = nRead;
+  };
+
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-mmap/test.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+                                    "CREATE TABLE t(x);"
+                                    " WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<2000)"
+                                    " INSERT INTO t SELECT randomblob(1000) FROM c;",
+                                    nullptr, nullptr, nullptr));
+
+  /* Limits past 2GiB are accepted */
+  sqlite3_stmt *pStmt = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db, "PRAGMA mmap_size=34359738368", -1, &pStmt, nullptr));
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(pStmt));
+  EXPECT_EQ(34359738368LL, sqlite3_column_int64(pStmt, 0));
+  sqlite3_finalize(pStmt);
+  sqlite3_close(db);
+
+  /* A table scan reads the file in order, and the mapping is advised so.
+  ** The address space reserved is sized after the file, not the limit. */
+  xRealMadvise = pVfs->xGetSystemCall(pVfs, "madvise");
+  xRealMmap = pVfs->xGetSystemCall(pVfs, "mmap");
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "madvise", (sqlite3_syscall_ptr)recordingMadvise));
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "mmap", (sqlite3_syscall_ptr)recordingMmap));
+  sqlite3_int64 nFallback = 0;
+  scan("PRAGMA mmap_size=34359738368;", &nFallback);
+  pVfs->xSetSystemCall(pVfs, "mmap", xRealMmap);
+  pVfs->xSetSystemCall(pVfs, "madvise", xRealMadvise);
+  EXPECT_GT(nSequentialAdvice, 0);
+  EXPECT_LT(nFallback, 10);
+  EXPECT_GT(nLargestReserve, 0u);
+  EXPECT_LE(nLargestReserve, (size_t)512 << 20);
+
+  /* Accesses that keep faulting make the VFS fall back to pread() */
+  xRealGetrusage = pVfs->xGetSystemCall(pVfs, "getrusage");
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "getrusage", (sqlite3_syscall_ptr)faultingGetrusage));
+  scan("PRAGMA mmap_size=34359738368;", &nFallback);
+  pVfs->xSetSystemCall(pVfs, "getrusage", xRealGetrusage);
+  EXPECT_GT(nFallback, 200);
+}
+
+TEST(ProcVfsTest, DirectIo)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-direct && mkdir -p /tmp/procvfs-direct"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  const char *zUri = "file:/tmp/procvfs-direct/test.db?direct_io=1";
+  auto query = [](sqlite3 *db, const char *zSql) {
+    sqlite3_stmt *pStmt = nullptr;
+    std::string res;
+    if (sqlite3_prepare_v2(db, zSql, -1, &pStmt, nullptr) == SQLITE_OK && sqlite3_step(pStmt) == SQLITE_ROW)
+    {
+      res = (const char *)sqlite3_column_text(pStmt, 0);
+    }
+    sqlite3_finalize(pStmt);
+    return res;
+  };
+
+  auto commitAndExit = [&](const char *zOpen, const char *zSql) {
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      sqlite3 *db = nullptr;
+      _exit(sqlite3_open_v2(zOpen, &db, flags, "proc") != SQLITE_OK ||
+            sqlite3_exec(db, zSql, nullptr, nullptr, nullptr) != SQLITE_OK);
+    }
+    int status = 1;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  };
+
+  /* A process commits to the WAL and exits without checkpointing.  Pages
+  ** smaller than the O_DIRECT alignment are padded to a slot of their own. */
+  ASSERT_TRUE(commitAndExit(zUri, "PRAGMA page_size=1024; PRAGMA journal_mode=WAL; PRAGMA wal_autocheckpoint=0;"
+                                  " CREATE TABLE t(x); BEGIN;"
+                                  " WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<2000)"
+                                  " INSERT INTO t SELECT randomblob(300) FROM c; COMMIT;"));
+
+  /* Page images and frame headers are in separate files */
+  struct stat sWal, sHdr;
+  ASSERT_EQ(0, stat("/tmp/procvfs-direct/test.db-wal", &sWal));
+  ASSERT_EQ(0, stat("/tmp/procvfs-direct/test.db-wal-hdr", &sHdr));
+  EXPECT_GT(sWal.st_size, 0);
+  EXPECT_EQ(0, sWal.st_size % 4096);
+  EXPECT_EQ(32 + sWal.st_size / 4096 * 24, sHdr.st_size);
+
+  /* The WAL is recovered through the same layout, even by a connection
+  ** opened without direct_io */
+  sqlite3 *db = nullptr;
+  sqlite3 *db2 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-direct/test.db", &db, flags, "proc"));
+  EXPECT_EQ("2000", query(db, "SELECT count(*) FROM t"));
+  EXPECT_EQ("ok", query(db, "PRAGMA integrity_check"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db2, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, procvfs_syscall_accounting(1));
+  procvfs_syscall_reset();
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "INSERT INTO t SELECT x FROM t LIMIT 500;", nullptr, nullptr, nullptr));
+  sqlite3_uint64 nTruncate = 1;
+  ASSERT_EQ(SQLITE_OK, procvfs_syscall_count("ftruncate", &nTruncate, nullptr));
+  EXPECT_EQ(0u, nTruncate); /* Frames are appended whole, in blocks of their own */
+  ASSERT_EQ(SQLITE_OK, procvfs_syscall_accounting(0));
+  EXPECT_EQ("2500", query(db, "SELECT count(*) FROM t"));
+  sqlite3_close(db2);
+  sqlite3_close(db);
+  EXPECT_NE(0, access("/tmp/procvfs-direct/test.db-wal-hdr", F_OK));
+
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db, flags, "proc"));
+  EXPECT_EQ("2500", query(db, "SELECT count(*) FROM t"));
+  EXPECT_EQ("ok", query(db, "PRAGMA integrity_check"));
+  EXPECT_EQ("0", query(db, "PRAGMA mmap_size=1048576"));
+  sqlite3_close(db);
+
+  /* Nor does a -wal file in the usual layout look empty with direct_io */
+  ASSERT_TRUE(commitAndExit("/tmp/procvfs-direct/test.db",
+                            "PRAGMA wal_autocheckpoint=0; INSERT INTO t SELECT x FROM t LIMIT 100;"));
+  EXPECT_NE(0, access("/tmp/procvfs-direct/test.db-wal-hdr", F_OK));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db, flags, "proc"));
+  EXPECT_EQ("2600", query(db, "SELECT count(*) FROM t"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t SELECT x FROM t LIMIT 100;", nullptr, nullptr, nullptr));
+  EXPECT_NE(0, access("/tmp/procvfs-direct/test.db-wal-hdr", F_OK));
+  sqlite3_close(db);
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2(zUri, &db, flags, "proc"));
+  EXPECT_EQ("2700", query(db, "SELECT count(*) FROM t"));
+  EXPECT_EQ("ok", query(db, "PRAGMA integrity_check"));
+  sqlite3_close(db);
+}
+
+static sqlite3_syscall_ptr xRealFdatasync = nullptr;
+static sqlite3_syscall_ptr xRealSyncFileRange = nullptr;
+static sqlite3_syscall_ptr xRealSyncfs = nullptr;
+static int nFdatasync = 0, nSyncFileRange = 0, nSyncfs = 0;
+static int countingFdatasync(int fd)
+{
+  nFdatasync++;
+  return ((int (*)(int))xRealFdatasync)(fd);
+}
+static int countingSyncFileRange(int fd, off_t iOff, off_t nByte, unsigned int flags)
+{
+  nSyncFileRange++;
+  return ((int (*)(int, off_t, off_t, unsigned int))xRealSyncFileRange)(fd, iOff, nByte, flags);
+}
+static int countingSyncfs(int fd)
+{
+  nSyncfs++;
+  return ((int (*)(int))xRealSyncfs)(fd);
+}
+
+TEST(ProcVfsTest, SyncStrategy)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-sync && mkdir -p /tmp/procvfs-sync"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  xRealFdatasync = pVfs->xGetSystemCall(pVfs, "fdatasync");
+  xRealSyncFileRange = pVfs->xGetSystemCall(pVfs, "sync_file_range");
+  xRealSyncfs = pVfs->xGetSystemCall(pVfs, "syncfs");
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "fdatasync", (sqlite3_syscall_ptr)countingFdatasync));
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "sync_file_range", (sqlite3_syscall_ptr)countingSyncFileRange));
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "syncfs", (sqlite3_syscall_ptr)countingSyncfs));
+  const char *zInsert = "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<100)"
+                        " INSERT INTO t SELECT randomblob(500) FROM c;";
+
+  /* O_DSYNC -wal writes need no sync at commit.  A checkpoint starts
+  ** writeback as it writes the database, then syncs it with fdatasync(). */
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-sync/wal.db?sync_db=range&sync_wal=dsync", &db, flags,
+                                       "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL;"
+                                        " PRAGMA wal_autocheckpoint=0; CREATE TABLE t(x);",
+                                    nullptr, nullptr, nullptr));
+  nFdatasync = nSyncFileRange = 0;
+  for (int i = 0; i < 5; i++) ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+  EXPECT_EQ(0, nFdatasync);
+  EXPECT_EQ(0, nSyncFileRange);
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA wal_checkpoint;", nullptr, nullptr, nullptr));
+  EXPECT_GT(nSyncFileRange, 0);
+  EXPECT_GT(nFdatasync, 0);
+  sqlite3_close(db);
+
+  /* Rollback journal commits with syncfs() and fdatasync() */
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-sync/rollback.db?sync_db=syncfs&sync_journal=fdatasync",
+                                       &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "CREATE TABLE t(x);", nullptr, nullptr, nullptr));
+  nFdatasync = nSyncfs = 0;
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+  EXPECT_GT(nSyncfs, 0);
+  EXPECT_GT(nFdatasync, 0);
+  sqlite3_close(db);
+
+  /* "auto" measures the device and leaves nothing behind */
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-sync/auto.db?sync_db=auto&sync_wal=auto", &db, flags,
+                                       "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; CREATE TABLE t(x);", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+  sqlite3_close(db);
+  EXPECT_NE(0, access("/tmp/procvfs-sync/auto.db-synccal", F_OK));
+
+  pVfs->xSetSystemCall(pVfs, "fdatasync", xRealFdatasync);
+  pVfs->xSetSystemCall(pVfs, "sync_file_range", xRealSyncFileRange);
+  pVfs->xSetSystemCall(pVfs, "syncfs", xRealSyncfs);
+}
+
+TEST(ProcVfsTest, DirtyRanges)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-dirty && mkdir -p /tmp/procvfs-dirty"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  xRealSyncFileRange = pVfs->xGetSystemCall(pVfs, "sync_file_range");
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "sync_file_range", (sqlite3_syscall_ptr)countingSyncFileRange));
+
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-dirty/test.db?sync_db=range", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA wal_autocheckpoint=0; CREATE TABLE t(x);"
+                                        "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<1000)"
+                                        " INSERT INTO t SELECT randomblob(500) FROM c;",
+                                    nullptr, nullptr, nullptr));
+  nSyncFileRange = 0;
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA wal_checkpoint;", nullptr, nullptr, nullptr));
+
+  /* The checkpoint writes the database a page at a time.  Writeback of
+  ** those pages starts in batches of adjacent pages, and the sync that
+  ** ends the checkpoint covers every byte written. */
+  std::vector<std::string> rows;
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+                                    "SELECT type, writes, writebacks, bytes_synced = bytes_written,"
+                                    " bytes_synced > 0 FROM vfs_stat"
+                                    " WHERE vfs = 'proc' AND path LIKE '/tmp/procvfs-dirty/%' ORDER BY type;",
+                                    [](void *pArg, int nCol, char **azVal, char **) {
+                                      std::string row;
+                                      for (int i = 0; i < nCol; i++) row += std::string(i ? "," : "") + azVal[i];
+                                      static_cast<std::vector<std::string> *>(pArg)->push_back(row);
+                                      return 0;
+                                    },
+                                    &rows, nullptr));
+  ASSERT_EQ(2u, rows.size());
+  int nWrite = 0, nWriteback = 0;
+  ASSERT_EQ(2, sscanf(rows[0].c_str(), "main_db,%d,%d,1,1", &nWrite, &nWriteback));
+  EXPECT_GT(nWriteback, 0);
+  EXPECT_LT(nWriteback * 8, nWrite);
+  EXPECT_EQ(nWriteback, nSyncFileRange);
+  /* The -wal file is synced with fsync(), so nothing is started early */
+  ASSERT_EQ(2, sscanf(rows[1].c_str(), "wal,%d,%d,", &nWrite, &nWriteback)) << rows[1];
+  EXPECT_EQ(0, nWriteback);
+  EXPECT_EQ('1', rows[1].back());
+  sqlite3_close(db);
+
+  pVfs->xSetSystemCall(pVfs, "sync_file_range", xRealSyncFileRange);
+}
+
+static sqlite3_syscall_ptr xRealLinuxFallocate = nullptr;
+static int nKeepSizeFallocate = 0;
+static int countingLinuxFallocate(int fd, int mode, off_t iOff, off_t nByte)
+{
+  if (mode == FALLOC_FL_KEEP_SIZE) nKeepSizeFallocate++;
+  return ((int (*)(int, int, off_t, off_t))xRealLinuxFallocate)(fd, mode, iOff, nByte);
+}
+
+TEST(ProcVfsTest, Preallocate)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-prealloc && mkdir -p /tmp/procvfs-prealloc"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  const sqlite3_int64 mxPrealloc = 4 * 1024 * 1024;
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  xRealLinuxFallocate = pVfs->xGetSystemCall(pVfs, "linux_fallocate");
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "linux_fallocate", (sqlite3_syscall_ptr)countingLinuxFallocate));
+
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-prealloc/test.db?prealloc_wal=4194304&prealloc_db=4194304",
+                                       &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA wal_autocheckpoint=0; CREATE TABLE t(x);",
+                                    nullptr, nullptr, nullptr));
+
+  /* The WAL grows by 4MiB over 200 commits, but is extended a few times */
+  nKeepSizeFallocate = 0;
+  for (int i = 0; i < 200; i++)
+  {
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+                                      "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<20)"
+                                      " INSERT INTO t SELECT randomblob(500) FROM c;",
+                                      nullptr, nullptr, nullptr));
+  }
+  EXPECT_GT(nKeepSizeFallocate, 0);
+  EXPECT_LT(nKeepSizeFallocate, 20);
+  struct stat sStat;
+  ASSERT_EQ(0, stat("/tmp/procvfs-prealloc/test.db-wal", &sStat));
+  EXPECT_GT(sStat.st_size, 2 * 1024 * 1024);
+  EXPECT_GT((sqlite3_int64)sStat.st_blocks * 512, (sqlite3_int64)sStat.st_size);
+  EXPECT_LE((sqlite3_int64)sStat.st_blocks * 512, sStat.st_size + mxPrealloc + 128 * 1024);
+
+  /* Truncating the WAL gives the reservation back */
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", nullptr, nullptr, nullptr));
+  ASSERT_EQ(0, stat("/tmp/procvfs-prealloc/test.db-wal", &sStat));
+  EXPECT_EQ(0, sStat.st_size);
+  EXPECT_EQ(0, sStat.st_blocks);
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(1);", nullptr, nullptr, nullptr));
+  sqlite3_stmt *pStmt = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db, "PRAGMA integrity_check", -1, &pStmt, nullptr));
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(pStmt));
+  EXPECT_STREQ("ok", (const char *)sqlite3_column_text(pStmt, 0));
+  sqlite3_finalize(pStmt);
+
+  /* Another connection uses the space the first one reserved */
+  sqlite3 *db2 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-prealloc/test.db", &db2, flags, "proc"));
+  int nBefore = nKeepSizeFallocate;
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "INSERT INTO t VALUES(2);", nullptr, nullptr, nullptr));
+  EXPECT_EQ(nBefore, nKeepSizeFallocate);
+  sqlite3_close(db2);
+  sqlite3_close(db);
+  pVfs->xSetSystemCall(pVfs, "linux_fallocate", xRealLinuxFallocate);
+}
+
+static int countRows(sqlite3 *db)
+{
+  sqlite3_stmt *pStmt = nullptr;
+  int nRow = -1;
+  if (sqlite3_prepare_v2(db, "SELECT count(*) FROM t", -1, &pStmt, nullptr) == SQLITE_OK &&
+      sqlite3_step(pStmt) == SQLITE_ROW)
+  {
+    nRow = sqlite3_column_int(pStmt, 0);
+  }
+  sqlite3_finalize(pStmt);
+  return nRow;
+}
+
+TEST(ProcVfsTest, WalRecycle)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-recycle && mkdir -p /tmp/procvfs-recycle"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  const char *zInsert = "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<20)"
+                        " INSERT INTO t SELECT randomblob(500) FROM c;";
+  const char aZero[32] = {0};
+  char aHdr[32];
+  struct stat sStat, sWal;
+
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-recycle/test.db?wal_recycle=1", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA wal_autocheckpoint=0; CREATE TABLE t(x);",
+                                    nullptr, nullptr, nullptr));
+  for (int i = 0; i < 20; i++) ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+
+  /* A truncating checkpoint keeps the file, with an empty header */
+  ASSERT_EQ(0, stat("/tmp/procvfs-recycle/test.db-wal", &sWal));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", nullptr, nullptr, nullptr));
+  ASSERT_EQ(0, stat("/tmp/procvfs-recycle/test.db-wal", &sStat));
+  EXPECT_EQ(sWal.st_ino, sStat.st_ino);
+  EXPECT_EQ(sWal.st_size, sStat.st_size);
+  int fd = open("/tmp/procvfs-recycle/test.db-wal", O_RDONLY);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(32, pread(fd, aHdr, sizeof(aHdr), 0));
+  close(fd);
+  EXPECT_EQ(0, memcmp(aHdr, aZero, sizeof(aZero)));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+  EXPECT_EQ(420, countRows(db));
+
+  /* Closing keeps the -wal file as the spare of the next one */
+  sqlite3_close(db);
+  EXPECT_NE(0, access("/tmp/procvfs-recycle/test.db-wal", F_OK));
+  ASSERT_EQ(0, stat("/tmp/procvfs-recycle/test.db-wal-spare", &sStat));
+  EXPECT_EQ(sWal.st_ino, sStat.st_ino);
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-recycle/test.db?wal_recycle=1", &db, flags, "proc"));
+  EXPECT_EQ(420, countRows(db));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+  ASSERT_EQ(0, stat("/tmp/procvfs-recycle/test.db-wal", &sStat));
+  EXPECT_EQ(sWal.st_ino, sStat.st_ino);
+  EXPECT_NE(0, access("/tmp/procvfs-recycle/test.db-wal-spare", F_OK));
+  sqlite3_close(db);
+
+  /* "wal_spare" builds nothing for a database in rollback journal mode */
+  ASSERT_EQ(SQLITE_OK,
+            sqlite3_open_v2("file:/tmp/procvfs-recycle/spare.db?wal_spare=1048576", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "CREATE TABLE t(x);", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, procvfs_close());
+  EXPECT_NE(0, access("/tmp/procvfs-recycle/spare.db-wal-spare", F_OK));
+
+  /* Once the -wal file is first opened, a spare of written zeros is built
+  ** for the next one */
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr));
+  EXPECT_EQ(0, countRows(db));
+  ASSERT_EQ(SQLITE_OK, procvfs_close());
+  ASSERT_EQ(0, stat("/tmp/procvfs-recycle/spare.db-wal-spare", &sWal));
+  EXPECT_EQ(1048576, sWal.st_size);
+  EXPECT_GE((sqlite3_int64)sWal.st_blocks * 512, 1048576);
+  sqlite3_close(db);
+  ASSERT_EQ(SQLITE_OK,
+            sqlite3_open_v2("file:/tmp/procvfs-recycle/spare.db?wal_spare=1048576", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+  ASSERT_EQ(0, stat("/tmp/procvfs-recycle/spare.db-wal", &sStat));
+  EXPECT_EQ(sWal.st_ino, sStat.st_ino);
+  EXPECT_EQ(1048576, sStat.st_size);
+
+  /* Taking the spare starts building the next one */
+  ASSERT_EQ(SQLITE_OK, procvfs_close());
+  ASSERT_EQ(0, stat("/tmp/procvfs-recycle/spare.db-wal-spare", &sStat));
+  EXPECT_NE(sWal.st_ino, sStat.st_ino);
+  EXPECT_EQ(20, countRows(db));
+  sqlite3_close(db);
+}
+
+static sqlite3_syscall_ptr xRealWrite = nullptr;
+static sqlite3_syscall_ptr xRealPwritev = nullptr;
+static int nWrite = 0;
+static int nPwritev = 0;
+static ssize_t countingWrite(int fd, const void *pBuf, size_t nByte)
+{
+  nWrite++;
+  return ((ssize_t(*)(int, const void *, size_t))xRealWrite)(fd, pBuf, nByte);
+}
+static ssize_t countingPwritev(int fd, const struct iovec *aIov, int nIov, off_t iOff)
+{
+  nPwritev++;
+  return ((ssize_t(*)(int, const struct iovec *, int, off_t))xRealPwritev)(fd, aIov, nIov, iOff);
+}
+
+TEST(ProcVfsTest, WriteCombining)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-combine && mkdir -p /tmp/procvfs-combine"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  const char *zInsert = "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<200)"
+                        " INSERT INTO t SELECT randomblob(3000) FROM c;";
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  xRealWrite = pVfs->xGetSystemCall(pVfs, "write");
+  xRealPwritev = pVfs->xGetSystemCall(pVfs, "pwritev");
+  ASSERT_NE(nullptr, xRealPwritev);
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "write", (sqlite3_syscall_ptr)countingWrite));
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "pwritev", (sqlite3_syscall_ptr)countingPwritev));
+
+  /* Without "write_combine", each frame takes two write() calls */
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-combine/plain.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; CREATE TABLE t(x);", nullptr, nullptr, nullptr));
+  nWrite = nPwritev = 0;
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+  EXPECT_GT(nWrite, 400);
+  EXPECT_EQ(0, nPwritev);
+  sqlite3_close(db);
+
+  /* With it, the same commit is a few pwritev() calls */
+  ASSERT_EQ(SQLITE_OK,
+            sqlite3_open_v2("file:/tmp/procvfs-combine/test.db?write_combine=1048576", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; CREATE TABLE t(x);", nullptr, nullptr, nullptr));
+  nWrite = nPwritev = 0;
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+  EXPECT_EQ(0, nWrite);
+  EXPECT_GT(nPwritev, 0);
+  EXPECT_LE(nPwritev, 4);
+
+  /* Another connection sees each commit at once */
+  sqlite3 *db2 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-combine/test.db", &db2, flags, "proc"));
+  EXPECT_EQ(200, countRows(db2));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA synchronous=OFF;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+  EXPECT_EQ(400, countRows(db2));
+
+  /* Frames spilled by a transaction that rolls back, and then re-read */
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA cache_size=10; BEGIN;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zInsert, nullptr, nullptr, nullptr));
+  EXPECT_EQ(600, countRows(db));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "UPDATE t SET x = zeroblob(100) WHERE rowid % 2;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA wal_checkpoint;", nullptr, nullptr, nullptr));
+  EXPECT_EQ(400, countRows(db2));
+  sqlite3_stmt *pStmt = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_prepare_v2(db2, "PRAGMA integrity_check", -1, &pStmt, nullptr));
+  ASSERT_EQ(SQLITE_ROW, sqlite3_step(pStmt));
+  EXPECT_STREQ("ok", (const char *)sqlite3_column_text(pStmt, 0));
+  sqlite3_finalize(pStmt);
+  sqlite3_close(db2);
+  sqlite3_close(db);
+
+  pVfs->xSetSystemCall(pVfs, "write", xRealWrite);
+  pVfs->xSetSystemCall(pVfs, "pwritev", xRealPwritev);
+}
+
+/*
+** Run zSql on db with system call accounting on, and succeed if the
+** calling thread made at most nMax system calls through procvfs while it
+** ran.  On failure, the message breaks the calls down by name.
+*/
+static ::testing::AssertionResult SyscallsAtMost(sqlite3 *db, const char *zSql, int nMax)
+{
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  sqlite3_uint64 nCall = 0;
+  procvfs_syscall_accounting(1);
+  procvfs_syscall_reset();
+  int rc = sqlite3_exec(db, zSql, nullptr, nullptr, nullptr);
+  procvfs_syscall_count(nullptr, &nCall, nullptr);
+  std::string zDetail;
+  for (const char *zName = pVfs->xNextSystemCall(pVfs, nullptr); zName; zName = pVfs->xNextSystemCall(pVfs, zName))
+  {
+    sqlite3_uint64 n = 0;
+    procvfs_syscall_count(zName, &n, nullptr);
+    if (n) zDetail += " " + std::string(zName) + "=" + std::to_string(n);
+  }
+  procvfs_syscall_accounting(0);
+  if (rc != SQLITE_OK) return ::testing::AssertionFailure() << zSql << ": " << sqlite3_errmsg(db);
+  if (nCall > (sqlite3_uint64)nMax)
+  {
+    return ::testing::AssertionFailure() << zSql << ": " << nCall << " system calls, expected at most " << nMax
+                                         << ":" << zDetail;
+  }
+  return ::testing::AssertionSuccess() << nCall << " system calls:" << zDetail;
+}
+
+TEST(ProcVfsTest, SyscallBudget)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-acct && mkdir -p /tmp/procvfs-acct"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-acct/test.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+                                    "PRAGMA journal_mode=WAL; CREATE TABLE t(k INTEGER PRIMARY KEY, v);"
+                                    "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<1000)"
+                                    " INSERT INTO t SELECT i, randomblob(100) FROM c;",
+                                    nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "SELECT v FROM t WHERE k=1;", nullptr, nullptr, nullptr));
+
+  /* A warm read takes and drops the WAL read lock.  A commit also takes the
+  ** writer lock and writes its frame and the WAL index header. */
+  EXPECT_TRUE(SyscallsAtMost(db, "SELECT v FROM t WHERE k=500;", 4));
+  EXPECT_TRUE(SyscallsAtMost(db, "INSERT INTO t VALUES(NULL, 1);", 10));
+  EXPECT_TRUE(SyscallsAtMost(db, "BEGIN; UPDATE t SET v=2 WHERE k=1; UPDATE t SET v=3 WHERE k=2; COMMIT;", 12));
+
+  /* Hooks installed while accounting is on are called and counted */
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  ASSERT_EQ(SQLITE_OK, procvfs_syscall_accounting(1));
+  xRealWrite = pVfs->xGetSystemCall(pVfs, "write");
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "write", (sqlite3_syscall_ptr)countingWrite));
+  EXPECT_EQ((sqlite3_syscall_ptr)countingWrite, pVfs->xGetSystemCall(pVfs, "write"));
+  nWrite = 0;
+  procvfs_syscall_reset();
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(NULL, 1);", nullptr, nullptr, nullptr));
+  sqlite3_uint64 nCall = 0, nNano = 0;
+  ASSERT_EQ(SQLITE_OK, procvfs_syscall_count("write", &nCall, &nNano));
+  EXPECT_GT(nWrite, 0);
+  EXPECT_EQ((sqlite3_uint64)nWrite, nCall);
+  EXPECT_GT(nNano, 0u);
+  EXPECT_EQ(SQLITE_NOTFOUND, procvfs_syscall_count("no_such_call", &nCall, &nNano));
+  pVfs->xSetSystemCall(pVfs, "write", xRealWrite);
+  ASSERT_EQ(SQLITE_OK, procvfs_syscall_accounting(0));
+  EXPECT_EQ(xRealWrite, pVfs->xGetSystemCall(pVfs, "write"));
+  sqlite3_close(db);
+}
+
+/*
+** Return the number of calls the current thread made to system call zName
+** since its counters were last reset.
+*/
+static sqlite3_uint64 syscallCount(const char *zName)
+{
+  sqlite3_uint64 n = 0;
+  procvfs_syscall_count(zName, &n, nullptr);
+  return n;
+}
+
+TEST(ProcVfsTest, OpenPath)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-open /tmp/procvfs-open-old && mkdir -p /tmp/procvfs-open"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-open/test.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "CREATE TABLE t(x); INSERT INTO t VALUES(1);", nullptr, nullptr, nullptr));
+  sqlite3_close(db);
+
+  /* Opening the database opens and fstat()s it, and nothing else */
+  ASSERT_EQ(SQLITE_OK, procvfs_syscall_accounting(1));
+  procvfs_syscall_reset();
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-open/test.db", &db, flags, "proc"));
+  EXPECT_EQ(1u, syscallCount("open"));
+  EXPECT_EQ(1u, syscallCount("fstat"));
+  EXPECT_EQ(0u, syscallCount("stat"));
+
+  /* The directory opened to sync the first rollback journal is kept for the
+  ** next one */
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(2);", nullptr, nullptr, nullptr));
+  procvfs_syscall_reset();
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(3);", nullptr, nullptr, nullptr));
+  EXPECT_EQ(0u, syscallCount("openDirectory"));
+  EXPECT_EQ(1u, syscallCount("open")); /* The journal.  The missing -cbt file is not looked for again */
+  EXPECT_EQ(1u, syscallCount("fstatat"));
+  sqlite3_close(db);
+
+  /* A directory replaced since is opened again */
+  ASSERT_EQ(0, system("mv /tmp/procvfs-open /tmp/procvfs-open-old && mkdir -p /tmp/procvfs-open"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-open/test.db", &db, flags, "proc"));
+  procvfs_syscall_reset();
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "CREATE TABLE t(x); INSERT INTO t VALUES(4);", nullptr, nullptr, nullptr));
+  EXPECT_EQ(1u, syscallCount("openDirectory"));
+  EXPECT_EQ(2u, syscallCount("fstatat"));
+  ASSERT_EQ(SQLITE_OK, procvfs_syscall_accounting(0));
+  EXPECT_EQ(1, countRows(db));
+  sqlite3_close(db);
+}
+
+TEST(ProcVfsTest, Prefetch)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(SQLITE_OK, sqlite3_vfs_register(sqlite3_demovfs(), 0));
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-prefetch && mkdir -p /tmp/procvfs-prefetch"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-prefetch/test.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db,
+                                    "CREATE TABLE t(k INTEGER PRIMARY KEY, v);"
+                                    "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<500)"
+                                    "INSERT INTO t SELECT i, randomblob(200) FROM c;",
+                                    nullptr, nullptr, nullptr));
+
+  /* Pages 3, 4 and 5 are merged into one range, page 9 and the byte range
+  ** are queued on their own */
+  VfsPrefetchStatus s0, s1;
+  vfsprefetch_status(&s0);
+  const unsigned int aPage[] = {9, 4, 3, 5};
+  const VfsPrefetchRange aRange[] = {{0, 8192}};
+  VfsPrefetch req = {aPage, 4, 4096, aRange, 1};
+  ASSERT_EQ(SQLITE_OK, sqlite3_file_control(db, "main", VFS_FCNTL_PREFETCH, &req));
+  vfsprefetch_wait();
+  vfsprefetch_status(&s1);
+  EXPECT_EQ(3u, s1.nQueued - s0.nQueued);
+  EXPECT_EQ(3u, s1.nDone - s0.nDone);
+  EXPECT_EQ((3 + 1 + 2) * 4096u, s1.nByte - s0.nByte);
+  EXPECT_EQ(0u, s1.nDropped - s0.nDropped);
+
+  VfsPrefetch bad = {nullptr, 1, 4096, nullptr, 0};
+  EXPECT_EQ(SQLITE_MISUSE, sqlite3_file_control(db, "main", VFS_FCNTL_PREFETCH, &bad));
+  EXPECT_EQ(500, countRows(db));
+
+  /* Readahead uses the connection's own descriptor, so the SHARED lock of
+  ** a read transaction survives a prefetch, as another process sees it */
+  auto sharedLock = []() {
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      struct flock lock = {};
+      lock.l_type = F_WRLCK;
+      lock.l_whence = SEEK_SET;
+      lock.l_start = 0x40000002; /* SHARED_FIRST */
+      lock.l_len = 510;          /* SHARED_SIZE */
+      int fd = open("/tmp/procvfs-prefetch/test.db", O_RDWR);
+      _exit(fd >= 0 && fcntl(fd, F_GETLK, &lock) == 0 ? lock.l_type : 100);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WEXITSTATUS(status);
+  };
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "BEGIN; SELECT count(*) FROM t;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(F_RDLCK, sharedLock());
+  ASSERT_EQ(SQLITE_OK, sqlite3_file_control(db, "main", VFS_FCNTL_PREFETCH, &req));
+  vfsprefetch_wait();
+  EXPECT_EQ(F_RDLCK, sharedLock());
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr));
+  sqlite3_close(db);
+
+  /* The demo VFS takes the same hint */
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("/tmp/procvfs-prefetch/test.db", &db, SQLITE_OPEN_READWRITE, "demo"));
+  vfsprefetch_status(&s0);
+  ASSERT_EQ(SQLITE_OK, sqlite3_file_control(db, "main", VFS_FCNTL_PREFETCH, &req));
+  vfsprefetch_wait();
+  vfsprefetch_status(&s1);
+  EXPECT_EQ(3u, s1.nDone - s0.nDone);
+  EXPECT_EQ(500, countRows(db));
+  sqlite3_close(db);
+}
+
+static sqlite3_syscall_ptr xRealIoprioSet = nullptr;
+static sqlite3_syscall_ptr xRealIoprioGet = nullptr;
+static std::vector<int> aIoprio;
+static int oldKernelIoprioGet(int, int)
+{
+  return 4; /* IOPRIO_CLASS_NONE, IOPRIO_NORM */
+}
+static int recordingIoprioSet(int which, int who, int ioprio)
+{
+  aIoprio.push_back(ioprio);
+  return ((int (*)(int, int, int))xRealIoprioSet)(which, who, ioprio);
+}
+static std::vector<uint64_t> aWriteHint;
+static int recordingFcntl(int fd, int op, void *pArg)
+{
+  if (op == F_SET_RW_HINT) aWriteHint.push_back(*(uint64_t *)pArg);
+  return ((int (*)(int, int, ...))xRealFcntl)(fd, op, pArg);
+}
+
+TEST(ProcVfsTest, IoHints)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  xRealIoprioSet = pVfs->xGetSystemCall(pVfs, "ioprio_set");
+  xRealFcntl = pVfs->xGetSystemCall(pVfs, "fcntl");
+  ASSERT_NE(nullptr, xRealIoprioSet);
+  pVfs->xSetSystemCall(pVfs, "ioprio_set", (sqlite3_syscall_ptr)recordingIoprioSet);
+  pVfs->xSetSystemCall(pVfs, "fcntl", (sqlite3_syscall_ptr)recordingFcntl);
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-hints && mkdir -p /tmp/procvfs-hints"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  const uint64_t iShort = RWH_WRITE_LIFE_SHORT, iLong = RWH_WRITE_LIFE_LONG;
+
+  /* Without "io_hints", nothing is hinted and checkpoints keep their
+  ** priority */
+  sqlite3 *db = nullptr;
+  aIoprio.clear();
+  aWriteHint.clear();
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-hints/plain.db", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "PRAGMA journal_mode=WAL; CREATE TABLE t(x); INSERT INTO t VALUES(1);"
+                                        "PRAGMA wal_checkpoint;",
+                                    nullptr, nullptr, nullptr));
+  EXPECT_TRUE(aWriteHint.empty());
+  EXPECT_TRUE(aIoprio.empty());
+
+  /* The database is long-lived.  The rollback journal that switches it to
+  ** WAL mode, the -shm and the -wal file are short-lived */
+  sqlite3 *db2 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-hints/test.db?io_hints=1", &db2, flags, "proc"));
+  EXPECT_EQ(std::vector<uint64_t>({iLong}), aWriteHint);
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "PRAGMA journal_mode=WAL; CREATE TABLE t(x); INSERT INTO t VALUES(1);",
+                                    nullptr, nullptr, nullptr));
+  EXPECT_EQ(std::vector<uint64_t>({iLong, iShort, iShort, iShort}), aWriteHint);
+
+  /* A checkpoint runs at the lowest best-effort priority, then restores the
+  ** priority the thread had */
+  aIoprio.clear();
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "PRAGMA wal_checkpoint;", nullptr, nullptr, nullptr));
+  ASSERT_EQ(2u, aIoprio.size());
+  EXPECT_EQ((2 << 13) | 7, aIoprio[0]);
+  int iPrio = (int)syscall(SYS_ioprio_get, 1, 0);
+  EXPECT_EQ((iPrio >> 13) == 0 ? 0 : iPrio, aIoprio[1]);
+
+  /* A thread reported as class NONE, as older kernels do, gets class NONE
+  ** back rather than a value ioprio_set() refuses */
+  xRealIoprioGet = pVfs->xGetSystemCall(pVfs, "ioprio_get");
+  pVfs->xSetSystemCall(pVfs, "ioprio_get", (sqlite3_syscall_ptr)oldKernelIoprioGet);
+  aIoprio.clear();
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "INSERT INTO t VALUES(3); PRAGMA wal_checkpoint;", nullptr, nullptr, nullptr));
+  pVfs->xSetSystemCall(pVfs, "ioprio_get", xRealIoprioGet);
+  ASSERT_EQ(2u, aIoprio.size());
+  EXPECT_EQ(0, aIoprio[1]);
+
+  /* Commits and the other database are not affected */
+  aIoprio.clear();
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "INSERT INTO t VALUES(2);", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(2); PRAGMA wal_checkpoint;", nullptr, nullptr, nullptr));
+  EXPECT_TRUE(aIoprio.empty());
+  EXPECT_EQ(3, countRows(db2));
+  sqlite3_close(db);
+  sqlite3_close(db2);
+
+  pVfs->xSetSystemCall(pVfs, "fcntl", xRealFcntl);
+  pVfs->xSetSystemCall(pVfs, "ioprio_set", xRealIoprioSet);
+}
+
+/*
+** Wait up to five seconds for xDone() to return true.
+*/
+template <typename F> static bool eventually(F xDone)
+{
+  for (int i = 0; i < 500 && !xDone(); i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  return xDone();
+}
+
+static sqlite3_int64 fileSize(const char *zPath)
+{
+  struct stat sStat;
+  return stat(zPath, &sStat) ? -1 : (sqlite3_int64)sStat.st_size;
+}
+
+static sqlite3_syscall_ptr xRealOpen = nullptr;
+static std::thread::id idTestThread;
+static std::atomic<int> eSchedulerOpen(0); /* 1 while the scheduler is held back, 2 once released */
+static std::vector<std::string> aSchedulerOpen;
+static int schedulerHoldingOpen(const char *zPath, int f, int m)
+{
+  if (std::this_thread::get_id() != idTestThread)
+  {
+    aSchedulerOpen.push_back(zPath);
+    if (eSchedulerOpen == 0 && std::string(zPath) == "/tmp/procvfs-ckpt/pin.db")
+    {
+      eSchedulerOpen = 1;
+      while (eSchedulerOpen == 1) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  return ((int (*)(const char *, int, int))xRealOpen)(zPath, f, m);
+}
+
+TEST(ProcVfsTest, BackgroundCheckpoint)
+{
+  ASSERT_EQ(SQLITE_OK, procvfs_init());
+  ASSERT_EQ(0, system("rm -rf /tmp/procvfs-ckpt && mkdir -p /tmp/procvfs-ckpt"));
+  const int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI;
+  const char *zSetup = "PRAGMA journal_mode=WAL; PRAGMA wal_autocheckpoint=0; CREATE TABLE t(x);";
+  sqlite3_uint64 nCkpt = 0, nThrottle = 0;
+
+  /* Logging ckpt_wal bytes wakes the scheduler, and an idle database gets
+  ** its -wal file truncated */
+  sqlite3 *db = nullptr;
+  ASSERT_EQ(SQLITE_OK,
+            sqlite3_open_v2("file:/tmp/procvfs-ckpt/test.db?ckpt_wal=65536&ckpt_idle=200", &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zSetup, nullptr, nullptr, nullptr));
+  EXPECT_EQ(SQLITE_OK, procvfs_checkpoint_count(db, "main", &nCkpt, &nThrottle));
+  EXPECT_EQ(0u, nCkpt);
+  for (int i = 0; i < 100; i++)
+  {
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(randomblob(1000));", nullptr, nullptr, nullptr));
+  }
+  EXPECT_TRUE(eventually([&] { return procvfs_checkpoint_count(db, "main", &nCkpt, nullptr) == SQLITE_OK && nCkpt > 0; }));
+  EXPECT_TRUE(eventually([] { return fileSize("/tmp/procvfs-ckpt/test.db-wal") == 0; }));
+  EXPECT_EQ(100, countRows(db));
+  EXPECT_EQ(0u, nThrottle);
+
+  /* Without the parameters, there is nothing to report */
+  sqlite3 *db2 = nullptr;
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-ckpt/plain.db", &db2, flags, "proc"));
+  EXPECT_EQ(SQLITE_NOTFOUND, procvfs_checkpoint_count(db2, "main", &nCkpt, &nThrottle));
+  sqlite3_close(db2);
+  sqlite3_close(db);
+
+  /* A reader pins the log, so it grows past wal_limit.  Writers are held
+  ** back, but not for longer than wal_limit_wait */
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-ckpt/limit.db?wal_limit=65536&wal_limit_wait=20", &db,
+                                       flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zSetup, nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-ckpt/limit.db", &db2, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "BEGIN; SELECT count(*) FROM t;", nullptr, nullptr, nullptr));
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < 100; i++)
+  {
+    ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(randomblob(1000));", nullptr, nullptr, nullptr));
+  }
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+  ASSERT_EQ(SQLITE_OK, procvfs_checkpoint_count(db, "main", &nCkpt, &nThrottle));
+  EXPECT_GT(nThrottle, 0u);
+  EXPECT_GT(nCkpt, 0u);
+  EXPECT_LT(ms, 100 * 20 + 1000);
+  EXPECT_GT(fileSize("/tmp/procvfs-ckpt/limit.db-wal"), 65536);
+
+  /* Once the reader is done, the log restarts and writers run freely */
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db2, "COMMIT;", nullptr, nullptr, nullptr));
+  sqlite3_close(db2);
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(1);", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(2);", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, procvfs_checkpoint_count(db, "main", nullptr, &nThrottle));
+  sqlite3_uint64 nThrottle2 = 0;
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, "INSERT INTO t VALUES(3);", nullptr, nullptr, nullptr));
+  ASSERT_EQ(SQLITE_OK, procvfs_checkpoint_count(db, "main", nullptr, &nThrottle2));
+  EXPECT_EQ(nThrottle, nThrottle2);
+  EXPECT_EQ(103, countRows(db));
+
+  /* procvfs_close() refuses to stop the scheduler of an open database */
+  EXPECT_EQ(SQLITE_BUSY, procvfs_close());
+  sqlite3_close(db);
+  EXPECT_TRUE(eventually([] { return procvfs_close() == SQLITE_OK; }));
+
+  /* A database closed while the scheduler opens it stays pinned, so the
+  ** connection of the scheduler keeps the "wal_dir" of the application */
+  ASSERT_EQ(0, system("mkdir -p /tmp/procvfs-ckpt/wal"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_open_v2("file:/tmp/procvfs-ckpt/pin.db?ckpt_interval=50&wal_dir=/tmp/procvfs-ckpt/wal",
+                                       &db, flags, "proc"));
+  ASSERT_EQ(SQLITE_OK, sqlite3_exec(db, zSetup, nullptr, nullptr, nullptr));
+  sqlite3_vfs *pVfs = sqlite3_vfs_find("proc");
+  xRealOpen = pVfs->xGetSystemCall(pVfs, "open");
+  idTestThread = std::this_thread::get_id();
+  ASSERT_EQ(SQLITE_OK, pVfs->xSetSystemCall(pVfs, "open", (sqlite3_syscall_ptr)schedulerHoldingOpen));
+  EXPECT_TRUE(eventually([] { return eSchedulerOpen == 1; }));
+  sqlite3_close(db);
+  eSchedulerOpen = 2;
+  EXPECT_TRUE(eventually([] { return procvfs_close() == SQLITE_OK; }));
+  pVfs->xSetSystemCall(pVfs, "open", xRealOpen);
+  bool bWalDir = false;
+  for (const std::string &zPath : aSchedulerOpen)
+  {
+    EXPECT_NE("/tmp/procvfs-ckpt/pin.db-wal", zPath);
+    if (zPath.compare(0, 22, "/tmp/procvfs-ckpt/wal/") == 0) bWalDir = true;
+  }
+  EXPECT_TRUE(bWalDir);
+}
@@ -1,4 +1,7 @@
 #include "sqlite3.h"
+#include "vfspool.h"
+#include "vfsprefetch.h"
+#include "vfsstat.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -33,6 +36,12 @@ struct memNode {
   int szMem;
 };
 
+/*
+** DemoFile.pMemNode arrays of up to this many entries come from a pool.
+*/
+#define MEMNODE_POOL_ENTRIES 16
+static VfsPool memNodePool = VFSPOOL_INIT("memNode", MEMNODE_POOL_ENTRIES*sizeof(memNode));
+
 /*
 ** When using this VFS, the sqlite3_file* handles that SQLite uses are
 ** actually pointers to instances of type DemoFile.
@@ -51,6 +60,9 @@ struct DemoFile {
   char *aBuffer;                  /* Pointer to malloc'd buffer */
   int nBuffer;                    /* Valid bytes of data in zBuffer */
   sqlite3_int64 iBufferOfst;      /* Offset in file of zBuffer[0] */
+
+  VfsStat *pStat;                 /* Counters reported by vfs_stat */
+  sqlite3_int64 nDirty;           /* Bytes written since the last sync */
 };
 
 static int theFd = -1;
@@ -112,7 +124,10 @@ static int demoClose(sqlite3_file *pFile){
   DemoFile *p = (DemoFile*)pFile;
   rc = demoFlushBuffer(p);
   sqlite3_free(p->aBuffer);
+  vfsstat_close(p->pStat);
+  p->pStat = 0;
   if (verbose) printf("close(fd=%d)\n", theFd);
+  vfsprefetch_cancel(theFd);
   close(theFd);
   theFd = -1;
   return rc;
@@ -132,6 +147,9 @@ static int demoRead(
   int nRead;                      /* Return value from read() */
   int rc;                         /* Return code from demoFlushBuffer() */
 
+  vfsstatAdd(p->pStat, VFSSTAT_READ, 1);
+  vfsstatAdd(p->pStat, VFSSTAT_READ_BYTES, iAmt);
+
   /* Flush any data in the write buffer to disk in case this operation
   ** is trying to read data the file-region currently cached in the buffer.
   ** It would be possible to detect this case and possibly save an 
@@ -170,7 +188,10 @@ static int demoWrite(
   sqlite_int64 iOfst
 ){
   DemoFile *p = (DemoFile*)pFile;
-  
+
+  vfsstatAdd(p->pStat, VFSSTAT_WRITE, 1);
+  vfsstatAdd(p->pStat, VFSSTAT_WRITE_BYTES, iAmt);
+  p->nDirty += iAmt;
   if( p->aBuffer ){
     char *z = (char *)zBuf;       /* Pointer to remaining data to write */
     int n = iAmt;                 /* Number of bytes at z */
@@ -229,6 +250,7 @@ static int demoSync(sqlite3_file *pFile, int flags){
   DemoFile *p = (DemoFile*)pFile;
   int rc;
 
+  vfsstatAdd(p->pStat, VFSSTAT_SYNC, 1);
   rc = demoFlushBuffer(p);
   if( rc!=SQLITE_OK ){
     return rc;
@@ -237,6 +259,10 @@ static int demoSync(sqlite3_file *pFile, int flags){
   int fd = p->getFd(p);
   if (verbose) printf("fsync(fd=%d)\n", fd);
   rc = fsync(fd);
+  if( rc==0 ){
+    vfsstatAdd(p->pStat, VFSSTAT_SYNC_BYTES, p->nDirty);
+    p->nDirty = 0;
+  }
   return (rc==0 ? SQLITE_OK : SQLITE_IOERR_FSYNC);
 }
 
@@ -273,6 +299,7 @@ static int demoFileSize(sqlite3_file *pFile, sqlite_int64 *pSize){
 ** file is found in the file-system it is rolled back.
 */
 static int demoLock(sqlite3_file *pFile, int eLock){
+  vfsstatAdd(((DemoFile*)pFile)->pStat, VFSSTAT_LOCK, 1);
   return SQLITE_OK;
 }
 static int demoUnlock(sqlite3_file *pFile, int eLock){
@@ -284,9 +311,16 @@ static int demoCheckReservedLock(sqlite3_file *pFile, int *pResOut){
 }
 
 /*
-** No xFileControl() verbs are implemented by this VFS.
+** The only xFileControl() verb implemented by this VFS is
+** VFS_FCNTL_PREFETCH.  See vfsprefetch.h.
 */
 static int demoFileControl(sqlite3_file *pFile, int op, void *pArg){
+  if( op==VFS_FCNTL_PREFETCH ){
+    DemoFile *p = (DemoFile*)pFile;
+    int fd = p->getFd(p);
+    if( fd<0 ) return SQLITE_IOERR;
+    return vfsprefetch_queue(fd, (const VfsPrefetch*)pArg);
+  }
   return SQLITE_NOTFOUND;
 }
 
@@ -312,17 +346,19 @@ static int memShmMap(
   if (verbose) printf("memShmMap\n");
   int rc = SQLITE_OK, newSize = (iRegion+1)*sizeof(memNode);
   DemoFile *pFile = (DemoFile*)fd;
+  vfsstatAdd(pFile->pStat, VFSSTAT_SHM_MAP, 1);
   *pp = 0;
   if( pFile->szMemNode < newSize ){
     if( !isWrite ){
       goto Exit;
     }
-    pFile->pMemNode = realloc(pFile->pMemNode, newSize);
-    if( !pFile->pMemNode ){
+    memNode *pNew = vfspool_realloc(&memNodePool, pFile->pMemNode, newSize);
+    if( !pNew ){
       rc = SQLITE_NOMEM;
       goto Exit;
     }
-    memset(pFile->pMemNode + pFile->szMemNode, 0, newSize - pFile->szMemNode);
+    pFile->pMemNode = pNew;
+    memset((char*)pFile->pMemNode + pFile->szMemNode, 0, newSize - pFile->szMemNode);
     pFile->szMemNode = newSize;
   }
   if( !pFile->pMemNode[iRegion].mem ){
@@ -349,7 +385,8 @@ static int memShmUnmap(
   for(i=0; i < pFile->szMemNode / sizeof(memNode); i++ ){
       free((void *)pFile->pMemNode[i].mem);
   }
-  free(pFile->pMemNode);
+  vfspool_free(pFile->pMemNode);
+  pFile->pMemNode = 0;
   pFile->szMemNode = 0;
   return SQLITE_OK;
 }
@@ -361,6 +398,9 @@ static int memShmLock(
   int flags                  /* What to do with the lock */
 ){
   if (verbose) printf("memShmLock\n");
+  if( flags & SQLITE_SHM_LOCK ){
+    vfsstatAdd(((DemoFile*)fd)->pStat, VFSSTAT_LOCK, 1);
+  }
   return SQLITE_OK;
 }
 
@@ -433,6 +473,7 @@ static int demoOpen(
     return SQLITE_CANTOPEN;
   }
   p->aBuffer = aBuf;
+  p->pStat = vfsstat_open(pVfs->zName, zName, flags);
 
   if( pOutFlags ){
     *pOutFlags = flags;
@@ -0,0 +1,226 @@
+/*
+** Free-list pools for per-open VFS objects.  See vfspool.h.
+**
+** Every block, pooled or not, is preceded by a VfsPoolHdr recording the
+** pool it came from (NULL for blocks passed to malloc()) and its usable
+** size.  While a pooled block is on the free list, its first word links
+** to the next free block.
+*/
+#include "vfspool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef union VfsPoolHdr VfsPoolHdr;
+union VfsPoolHdr {
+  struct {
+    VfsPool *pPool;               /* Owning pool, or NULL if from malloc() */
+    size_t nByte;                 /* Usable size of the block */
+  } s;
+  long double rAlign;             /* Keep the block maximally aligned */
+  sqlite3_uint64 iAlign;
+};
+
+static pthread_mutex_t poolListMutex = PTHREAD_MUTEX_INITIALIZER;
+static VfsPool *pPoolList = 0;    /* Pools that have been used */
+
+/*
+** Distance in bytes between consecutive blocks of pPool in a slab.
+*/
+static size_t vfspoolStride(VfsPool *pPool){
+  size_t sz = pPool->szObj<sizeof(void*) ? sizeof(void*) : pPool->szObj;
+  sz = (sz + sizeof(VfsPoolHdr) - 1) / sizeof(VfsPoolHdr) * sizeof(VfsPoolHdr);
+  return sizeof(VfsPoolHdr) + sz;
+}
+
+/*
+** Link pPool into the list searched by vfspool_status(), if it is not
+** there already.  Called without pPool->mutex held, so that the lock
+** order is always poolListMutex before a pool mutex.
+*/
+static void vfspoolList(VfsPool *pPool){
+  pthread_mutex_lock(&poolListMutex);
+  if( !pPool->isListed ){
+    pPool->pNext = pPoolList;
+    pPoolList = pPool;
+    __atomic_store_n(&pPool->isListed, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&poolListMutex);
+}
+
+/*
+** Initialize a pool that cannot use VFSPOOL_INIT, for example because
+** its block size is only known at run time.
+*/
+void vfspool_init(VfsPool *pPool, const char *zName, size_t szObj){
+  memset(pPool, 0, sizeof(*pPool));
+  pPool->zName = zName;
+  pPool->szObj = szObj;
+  pthread_mutex_init(&pPool->mutex, 0);
+}
+
+/*
+** Release the slabs of a pool that will not be used again.  If blocks
+** are still allocated, return SQLITE_BUSY and leave the pool as it is, as
+** vfspool_free() of those blocks still needs its mutex and free list.
+*/
+int vfspool_destroy(VfsPool *pPool){
+  VfsPool **pp;
+  void *pSlab;
+  pthread_mutex_lock(&poolListMutex);
+  pthread_mutex_lock(&pPool->mutex);
+  if( pPool->nOut>0 ){
+    pthread_mutex_unlock(&pPool->mutex);
+    pthread_mutex_unlock(&poolListMutex);
+    return SQLITE_BUSY;
+  }
+  for(pp=&pPoolList; *pp; pp=&(*pp)->pNext){
+    if( *pp==pPool ){
+      *pp = pPool->pNext;
+      break;
+    }
+  }
+  pSlab = pPool->pSlab;
+  while( pSlab ){
+    void *pNext = *(void**)pSlab;
+    free(pSlab);
+    pSlab = pNext;
+  }
+  pPool->pSlab = 0;
+  pPool->pFree = 0;
+  pPool->nFree = 0;
+  pPool->nSlab = 0;
+  pPool->isListed = 0;
+  pthread_mutex_unlock(&pPool->mutex);
+  pthread_mutex_unlock(&poolListMutex);
+  pthread_mutex_destroy(&pPool->mutex);
+  return SQLITE_OK;
+}
+
+/*
+** Carve a new slab into blocks and put all of them on the free list.
+** Return non-zero if out of memory.  pPool->mutex must be held.
+*/
+static int vfspoolGrow(VfsPool *pPool){
+  size_t nStride = vfspoolStride(pPool);
+  char *pSlab = (char*)malloc(sizeof(VfsPoolHdr) + nStride*VFSPOOL_SLAB_OBJECTS);
+  int i;
+  if( pSlab==0 ) return 1;
+  *(void**)pSlab = pPool->pSlab;
+  pPool->pSlab = pSlab;
+  pPool->nSlab++;
+  for(i=VFSPOOL_SLAB_OBJECTS-1; i>=0; i--){
+    VfsPoolHdr *pHdr = (VfsPoolHdr*)&pSlab[sizeof(VfsPoolHdr) + nStride*i];
+    pHdr->s.pPool = pPool;
+    pHdr->s.nByte = nStride - sizeof(VfsPoolHdr);
+    *(void**)&pHdr[1] = pPool->pFree;
+    pPool->pFree = (void*)&pHdr[1];
+  }
+  pPool->nFree += VFSPOOL_SLAB_OBJECTS;
+  return 0;
+}
+
+/*
+** Allocate nByte bytes from pPool.  The memory is not zeroed.  Return
+** NULL if out of memory.
+*/
+void *vfspool_alloc(VfsPool *pPool, size_t nByte){
+  void *p;
+  if( !__atomic_load_n(&pPool->isListed, __ATOMIC_ACQUIRE) ) vfspoolList(pPool);
+
+  if( nByte>pPool->szObj ){
+    VfsPoolHdr *pHdr = (VfsPoolHdr*)malloc(sizeof(VfsPoolHdr) + nByte);
+    if( pHdr==0 ) return 0;
+    pHdr->s.pPool = 0;
+    pHdr->s.nByte = nByte;
+    pthread_mutex_lock(&pPool->mutex);
+    pPool->nAlloc++;
+    pPool->nOversize++;
+    pthread_mutex_unlock(&pPool->mutex);
+    return (void*)&pHdr[1];
+  }
+
+  pthread_mutex_lock(&pPool->mutex);
+  if( pPool->pFree ){
+    pPool->nHit++;
+  }else if( vfspoolGrow(pPool) ){
+    pthread_mutex_unlock(&pPool->mutex);
+    return 0;
+  }
+  p = pPool->pFree;
+  pPool->pFree = *(void**)p;
+  pPool->nFree--;
+  pPool->nAlloc++;
+  pPool->nOut++;
+  if( pPool->nOut>pPool->mxOut ) pPool->mxOut = pPool->nOut;
+  pthread_mutex_unlock(&pPool->mutex);
+  return p;
+}
+
+/*
+** Resize a block obtained from vfspool_alloc() or vfspool_realloc().
+** The contents are preserved up to the smaller of the two sizes.  On
+** failure NULL is returned and pOld is left allocated.
+*/
+void *vfspool_realloc(VfsPool *pPool, void *pOld, size_t nByte){
+  VfsPoolHdr *pHdr;
+  void *pNew;
+  if( pOld==0 ) return vfspool_alloc(pPool, nByte);
+  pHdr = &((VfsPoolHdr*)pOld)[-1];
+  if( nByte<=pHdr->s.nByte ) return pOld;
+  if( pHdr->s.pPool==0 ){
+    pHdr = (VfsPoolHdr*)realloc(pHdr, sizeof(VfsPoolHdr) + nByte);
+    if( pHdr==0 ) return 0;
+    pHdr->s.nByte = nByte;
+    return (void*)&pHdr[1];
+  }
+  pNew = vfspool_alloc(pPool, nByte);
+  if( pNew ){
+    memcpy(pNew, pOld, pHdr->s.nByte);
+    vfspool_free(pOld);
+  }
+  return pNew;
+}
+
+/*
+** Return a block to the pool it came from.  A no-op if p is NULL.
+*/
+void vfspool_free(void *p){
+  VfsPoolHdr *pHdr;
+  VfsPool *pPool;
+  if( p==0 ) return;
+  pHdr = &((VfsPoolHdr*)p)[-1];
+  pPool = pHdr->s.pPool;
+  if( pPool==0 ){
+    free(pHdr);
+    return;
+  }
+  pthread_mutex_lock(&pPool->mutex);
+  *(void**)p = pPool->pFree;
+  pPool->pFree = p;
+  pPool->nFree++;
+  pPool->nOut--;
+  pthread_mutex_unlock(&pPool->mutex);
+}
+
+int vfspool_status(const char *zName, VfsPoolStatus *pOut){
+  VfsPool *pPool;
+  pthread_mutex_lock(&poolListMutex);
+  for(pPool=pPoolList; pPool; pPool=pPool->pNext){
+    if( strcmp(pPool->zName, zName)==0 ) break;
+  }
+  if( pPool ){
+    pthread_mutex_lock(&pPool->mutex);
+    pOut->szObj = pPool->szObj;
+    pOut->nOut = pPool->nOut;
+    pOut->mxOut = pPool->mxOut;
+    pOut->nFree = pPool->nFree;
+    pOut->nSlab = pPool->nSlab;
+    pOut->nAlloc = pPool->nAlloc;
+    pOut->nHit = pPool->nHit;
+    pOut->nOversize = pPool->nOversize;
+    pthread_mutex_unlock(&pPool->mutex);
+  }
+  pthread_mutex_unlock(&poolListMutex);
+  return pPool ? SQLITE_OK : SQLITE_NOTFOUND;
+}
@@ -0,0 +1,93 @@
+/*
+** Free-list pools for the small objects the VFSes in this directory
+** allocate every time a file or shared-memory segment is opened.
+**
+** Each pool hands out blocks of one size, carved from slabs of
+** VFSPOOL_SLAB_OBJECTS blocks.  Freed blocks go back on the pool's free list
+** and are reused by the next open, so opening and closing connections at a
+** high rate does not churn the general-purpose allocator.  Slabs are only
+** returned to the system by vfspool_destroy(), once every block is free.
+**
+** A request larger than the pool's block size is passed to malloc() and
+** counted as oversize.  vfspool_free() and vfspool_realloc() work on blocks
+** from either source, so callers do not need to remember which it was.
+*/
+#ifndef VFSPOOL_H
+#define VFSPOOL_H
+
+#include "sqlite3.h"
+
+#include <pthread.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VFSPOOL_SLAB_OBJECTS 16
+
+typedef struct VfsPool VfsPool;
+struct VfsPool {
+  const char *zName;              /* Name reported by vfspool_status() */
+  size_t szObj;                   /* Usable size of each block in bytes */
+  /* Fields below are private to vfspool.c */
+  pthread_mutex_t mutex;          /* Protects all fields below */
+  void *pFree;                    /* Free blocks */
+  void *pSlab;                    /* Slabs allocated by this pool */
+  VfsPool *pNext;                 /* Next pool in vfspool_status() list */
+  int isListed;                   /* True once linked into that list */
+  int nOut;                       /* Blocks currently allocated */
+  int mxOut;                      /* Largest value nOut has had */
+  int nFree;                      /* Blocks on the free list */
+  int nSlab;                      /* Slabs allocated */
+  sqlite3_uint64 nAlloc;          /* Successful vfspool_alloc() calls */
+  sqlite3_uint64 nHit;            /* Allocations served from the free list */
+  sqlite3_uint64 nOversize;       /* Allocations passed to malloc() */
+};
+
+/*
+** Initializer for a pool with static storage duration:
+**
+**   static VfsPool inodePool = VFSPOOL_INIT("unixInodeInfo", sizeof(unixInodeInfo));
+*/
+#define VFSPOOL_INIT(NAME, SIZE) \
+  { NAME, SIZE, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+
+/*
+** A snapshot of the statistics of one pool.
+*/
+typedef struct VfsPoolStatus VfsPoolStatus;
+struct VfsPoolStatus {
+  size_t szObj;                   /* Usable size of each block */
+  int nOut;                       /* Blocks currently allocated */
+  int mxOut;                      /* High-water mark of nOut */
+  int nFree;                      /* Blocks ready for reuse */
+  int nSlab;                      /* Slabs allocated */
+  sqlite3_uint64 nAlloc;          /* Total allocations */
+  sqlite3_uint64 nHit;            /* Allocations that did not call malloc() */
+  sqlite3_uint64 nOversize;       /* Allocations too large for the pool */
+};
+
+void vfspool_init(VfsPool *pPool, const char *zName, size_t szObj);
+
+/*
+** Free the slabs of pPool.  Return SQLITE_BUSY, and change nothing, if
+** blocks of the pool are still allocated.
+*/
+int vfspool_destroy(VfsPool *pPool);
+
+void *vfspool_alloc(VfsPool *pPool, size_t nByte);
+void *vfspool_realloc(VfsPool *pPool, void *pOld, size_t nByte);
+void vfspool_free(void *p);
+
+/*
+** Copy the statistics of the pool named zName into *pOut.  Return
+** SQLITE_NOTFOUND if no pool of that name has been used yet.
+*/
+int vfspool_status(const char *zName, VfsPoolStatus *pOut);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VFSPOOL_H */
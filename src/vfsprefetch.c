@@ -0,0 +1,211 @@
+/*
+** Asynchronous prefetch for the VFSes in this directory.  See
+** vfsprefetch.h.
+**
+** Queued ranges live in a fixed ring of VFSPREFETCH_MAXQUEUE entries, so
+** queueing allocates nothing.  The worker threads are started by the first
+** request made by a process and are never stopped.
+**
+** Ranges are read ahead through the caller's own file descriptor.  A
+** duplicate would have to be closed by a worker, and closing any
+** descriptor of a file releases every POSIX advisory lock the process
+** holds on it, such as the SHARED lock of a connection in a read
+** transaction.  The VFS calls vfsprefetch_cancel() before it closes the
+** descriptor instead.
+*/
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE              /* For readahead() */
+#endif
+#include "vfsprefetch.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct VfsPrefetchJob VfsPrefetchJob;
+struct VfsPrefetchJob {
+  int fd;
+  sqlite3_int64 iOfst;
+  sqlite3_int64 nByte;
+};
+
+static pthread_mutex_t prefetchMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetchWork = PTHREAD_COND_INITIALIZER;  /* Queue not empty */
+static pthread_cond_t prefetchIdle = PTHREAD_COND_INITIALIZER;  /* All work done */
+static pthread_cond_t prefetchDone = PTHREAD_COND_INITIALIZER;  /* A job finished */
+static VfsPrefetchJob aJob[VFSPREFETCH_MAXQUEUE];
+static int iHead = 0;             /* Next job to run */
+static int nJob = 0;              /* Jobs queued */
+static int nActive = 0;           /* Jobs being run by a worker */
+static int nThread = 0;           /* Workers started by process poolPid */
+static int aRunning[VFSPREFETCH_NTHREAD];  /* File descriptor each worker reads, or -1 */
+static pid_t poolPid = 0;
+static VfsPrefetchStatus prefetchStat;
+
+static void vfsprefetchRun(VfsPrefetchJob *pJob){
+#if defined(__linux__)
+  readahead(pJob->fd, pJob->iOfst, (size_t)pJob->nByte);
+#else
+  posix_fadvise(pJob->fd, pJob->iOfst, pJob->nByte, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+** The body of worker number (int)pArg.
+*/
+static void *vfsprefetchWorker(void *pArg){
+  int iWorker = (int)(size_t)pArg;
+  pthread_mutex_lock(&prefetchMutex);
+  for(;;){
+    VfsPrefetchJob job;
+    while( nJob==0 ) pthread_cond_wait(&prefetchWork, &prefetchMutex);
+    job = aJob[iHead];
+    iHead = (iHead + 1) % VFSPREFETCH_MAXQUEUE;
+    nJob--;
+    nActive++;
+    aRunning[iWorker] = job.fd;
+    pthread_mutex_unlock(&prefetchMutex);
+
+    vfsprefetchRun(&job);
+
+    pthread_mutex_lock(&prefetchMutex);
+    nActive--;
+    prefetchStat.nDone++;
+    prefetchStat.nByte += job.nByte;
+    aRunning[iWorker] = -1;
+    pthread_cond_broadcast(&prefetchDone);
+    if( nJob==0 && nActive==0 ) pthread_cond_broadcast(&prefetchIdle);
+  }
+  return 0;
+}
+
+/*
+** Start the workers if this process has none yet.  Return the number
+** running.  prefetchMutex is held.
+*/
+static int vfsprefetchStart(void){
+  if( poolPid!=getpid() ){
+    /* A child process does not inherit the workers of its parent */
+    poolPid = getpid();
+    nThread = 0;
+    nActive = 0;
+  }
+  while( nThread<VFSPREFETCH_NTHREAD ){
+    pthread_t tid;
+    aRunning[nThread] = -1;
+    if( pthread_create(&tid, 0, vfsprefetchWorker, (void*)(size_t)nThread) ) break;
+    pthread_detach(tid);
+    nThread++;
+  }
+  return nThread;
+}
+
+/*
+** Queue one range.  prefetchMutex is held.
+*/
+static void vfsprefetchPush(int fd, sqlite3_int64 iOfst, sqlite3_int64 nByte){
+  VfsPrefetchJob *pJob;
+  if( nByte<=0 ) return;
+  if( nJob>=VFSPREFETCH_MAXQUEUE ){
+    prefetchStat.nDropped++;
+    return;
+  }
+  pJob = &aJob[(iHead + nJob) % VFSPREFETCH_MAXQUEUE];
+  pJob->fd = fd;
+  pJob->iOfst = iOfst;
+  pJob->nByte = nByte;
+  nJob++;
+  prefetchStat.nQueued++;
+}
+
+static int vfsprefetchCompare(const void *a, const void *b){
+  unsigned int x = *(const unsigned int*)a;
+  unsigned int y = *(const unsigned int*)b;
+  return x<y ? -1 : x>y;
+}
+
+int vfsprefetch_queue(int fd, const VfsPrefetch *pReq){
+  unsigned int *aPage = 0;
+  int i;
+
+  if( pReq==0 || pReq->nPage<0 || pReq->nRange<0
+   || (pReq->nPage>0 && (pReq->aPage==0 || pReq->szPage<=0))
+   || (pReq->nRange>0 && pReq->aRange==0)
+  ){
+    return SQLITE_MISUSE;
+  }
+  if( pReq->nPage==0 && pReq->nRange==0 ) return SQLITE_OK;
+
+  if( pReq->nPage>0 ){
+    aPage = (unsigned int*)malloc(sizeof(unsigned int)*pReq->nPage);
+    if( aPage==0 ) return SQLITE_NOMEM;
+    memcpy(aPage, pReq->aPage, sizeof(unsigned int)*pReq->nPage);
+    qsort(aPage, pReq->nPage, sizeof(unsigned int), vfsprefetchCompare);
+  }
+  pthread_mutex_lock(&prefetchMutex);
+  if( vfsprefetchStart()==0 ){
+    /* No worker could be started.  Give up quietly, as for a full queue. */
+    prefetchStat.nDropped += pReq->nPage + pReq->nRange;
+  }else{
+    for(i=0; i<pReq->nPage; ){
+      int j;
+      if( aPage[i]==0 ){ i++; continue; }
+      for(j=i+1; j<pReq->nPage && aPage[j]<=aPage[j-1]+1; j++);
+      vfsprefetchPush(fd, (sqlite3_int64)(aPage[i]-1)*pReq->szPage,
+                      (sqlite3_int64)(aPage[j-1]-aPage[i]+1)*pReq->szPage);
+      i = j;
+    }
+    for(i=0; i<pReq->nRange; i++){
+      vfsprefetchPush(fd, pReq->aRange[i].iOfst, pReq->aRange[i].nByte);
+    }
+    if( nJob>0 ) pthread_cond_broadcast(&prefetchWork);
+  }
+  pthread_mutex_unlock(&prefetchMutex);
+  free(aPage);
+  return SQLITE_OK;
+}
+
+void vfsprefetch_wait(void){
+  pthread_mutex_lock(&prefetchMutex);
+  while( (nJob>0 || nActive>0) && poolPid==getpid() ){
+    pthread_cond_wait(&prefetchIdle, &prefetchMutex);
+  }
+  pthread_mutex_unlock(&prefetchMutex);
+}
+
+/*
+** Return true if a worker is reading ahead on fd.  prefetchMutex is held.
+*/
+static int vfsprefetchRunning(int fd){
+  int i;
+  for(i=0; i<nThread; i++){
+    if( aRunning[i]==fd ) return 1;
+  }
+  return 0;
+}
+
+void vfsprefetch_cancel(int fd){
+  int i, n = 0;
+  pthread_mutex_lock(&prefetchMutex);
+  if( poolPid==getpid() ){
+    /* Drop the queued ranges of fd, keeping the others in order */
+    for(i=0; i<nJob; i++){
+      VfsPrefetchJob *pJob = &aJob[(iHead + i) % VFSPREFETCH_MAXQUEUE];
+      if( pJob->fd!=fd ) aJob[(iHead + n++) % VFSPREFETCH_MAXQUEUE] = *pJob;
+    }
+    nJob = n;
+    while( vfsprefetchRunning(fd) ){
+      pthread_cond_wait(&prefetchDone, &prefetchMutex);
+    }
+    if( nJob==0 && nActive==0 ) pthread_cond_broadcast(&prefetchIdle);
+  }
+  pthread_mutex_unlock(&prefetchMutex);
+}
+
+void vfsprefetch_status(VfsPrefetchStatus *pOut){
+  pthread_mutex_lock(&prefetchMutex);
+  *pOut = prefetchStat;
+  pthread_mutex_unlock(&prefetchMutex);
+}
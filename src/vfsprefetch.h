@@ -0,0 +1,90 @@
+/*
+** Asynchronous prefetch for the VFSes in this directory.
+**
+** SQLite reads a database one page at a time, when it needs the page, so
+** a lookup that misses the OS page cache waits for each read in turn.  An
+** application that knows which pages it is about to need, such as a batch
+** of lookups by key, can ask the VFS to start reading them first:
+**
+**   VfsPrefetch req = {aPage, nPage, szPage, 0, 0};
+**   sqlite3_file_control(db, "main", VFS_FCNTL_PREFETCH, &req);
+**
+** The call queues the pages and returns.  A small pool of worker threads
+** calls readahead() on them, so that they are already in the page cache,
+** or on their way there, when SQLite asks for them.  Pages are given as
+** page numbers (the first page of a database is page 1) of szPage bytes,
+** byte ranges as VfsPrefetchRange entries, or both.
+**
+** Prefetching is a hint.  Requests beyond VFSPREFETCH_MAXQUEUE queued
+** ranges are dropped, and errors are ignored.
+*/
+#ifndef VFSPREFETCH_H
+#define VFSPREFETCH_H
+
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VFS_FCNTL_PREFETCH 0x70726566
+
+#define VFSPREFETCH_NTHREAD 4
+#define VFSPREFETCH_MAXQUEUE 1024
+
+typedef struct VfsPrefetchRange VfsPrefetchRange;
+struct VfsPrefetchRange {
+  sqlite3_int64 iOfst;            /* First byte */
+  sqlite3_int64 nByte;            /* Number of bytes */
+};
+
+/*
+** The argument of VFS_FCNTL_PREFETCH.
+*/
+typedef struct VfsPrefetch VfsPrefetch;
+struct VfsPrefetch {
+  const unsigned int *aPage;      /* Page numbers to prefetch */
+  int nPage;                      /* Entries in aPage[] */
+  int szPage;                     /* Page size in bytes, if nPage>0 */
+  const VfsPrefetchRange *aRange; /* Byte ranges to prefetch */
+  int nRange;                     /* Entries in aRange[] */
+};
+
+/*
+** Statistics of all prefetches since the process started.
+*/
+typedef struct VfsPrefetchStatus VfsPrefetchStatus;
+struct VfsPrefetchStatus {
+  sqlite3_uint64 nQueued;         /* Ranges queued, after merging pages */
+  sqlite3_uint64 nDone;           /* Ranges read ahead by a worker */
+  sqlite3_uint64 nDropped;        /* Ranges or pages dropped, the queue being full */
+  sqlite3_uint64 nByte;           /* Bytes read ahead */
+};
+
+/*
+** Queue the pages and ranges of pReq for readahead on file descriptor fd.
+** The workers use fd itself, so the caller must pass it to
+** vfsprefetch_cancel() before closing it.  Adjacent pages are merged into
+** one range.  Return SQLITE_MISUSE if pReq is malformed, SQLITE_NOMEM if
+** out of memory, or SQLITE_OK.
+*/
+int vfsprefetch_queue(int fd, const VfsPrefetch *pReq);
+
+/*
+** Drop the ranges still queued for fd and wait for any being read ahead.
+** Once this returns, no worker uses fd until it is queued again.
+*/
+void vfsprefetch_cancel(int fd);
+
+/*
+** Wait until every queued range has been read ahead.
+*/
+void vfsprefetch_wait(void);
+
+void vfsprefetch_status(VfsPrefetchStatus *pOut);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VFSPREFETCH_H */
@@ -0,0 +1,286 @@
+/*
+** Per-file I/O counters and the "vfs_stat" eponymous virtual table.  See
+** vfsstat.h for how a VFS uses them.
+**
+** The I/O path only ever touches VfsStat.aCount[].  The list of open files
+** is protected by a mutex that is taken when a file is opened or closed
+** and while a vfs_stat query copies the counters out.
+*/
+#include "vfsstat.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_mutex_t statMutex = PTHREAD_MUTEX_INITIALIZER;
+static VfsStat *pStatList = 0;    /* All open files, most recent first */
+
+/*
+** Allocate a counter block for a file that zVfs has just opened.  Return
+** NULL if out of memory, in which case the file is simply not counted.
+*/
+VfsStat *vfsstat_open(const char *zVfs, const char *zPath, int flags){
+  VfsStat *p;
+  size_t nPath = zPath ? strlen(zPath) : 0;
+  void *pMem = 0;
+
+  if( posix_memalign(&pMem, VFSSTAT_CACHELINE, sizeof(VfsStat)+nPath) ){
+    return 0;
+  }
+  p = (VfsStat*)pMem;
+  memset(p, 0, sizeof(VfsStat));
+  p->zVfs = zVfs;
+  p->flags = flags;
+  if( nPath ) memcpy(p->zPath, zPath, nPath);
+  p->zPath[nPath] = '\0';
+
+  pthread_mutex_lock(&statMutex);
+  p->pNext = pStatList;
+  if( pStatList ) pStatList->pPrev = p;
+  pStatList = p;
+  pthread_mutex_unlock(&statMutex);
+  return p;
+}
+
+/*
+** Remove p from the list of open files and free it.  A no-op if p is NULL.
+*/
+void vfsstat_close(VfsStat *p){
+  if( p==0 ) return;
+  pthread_mutex_lock(&statMutex);
+  if( p->pPrev ){
+    p->pPrev->pNext = p->pNext;
+  }else{
+    pStatList = p->pNext;
+  }
+  if( p->pNext ) p->pNext->pPrev = p->pPrev;
+  pthread_mutex_unlock(&statMutex);
+  free(p);
+}
+
+/*
+** Return the name reported in the "type" column for a file opened with
+** SQLITE_OPEN_* flags.
+*/
+static const char *vfsstatTypeName(int flags){
+  switch( flags & 0x0FFF00 ){
+    case SQLITE_OPEN_MAIN_DB:        return "main_db";
+    case SQLITE_OPEN_TEMP_DB:        return "temp_db";
+    case SQLITE_OPEN_TRANSIENT_DB:   return "transient_db";
+    case SQLITE_OPEN_MAIN_JOURNAL:   return "main_journal";
+    case SQLITE_OPEN_TEMP_JOURNAL:   return "temp_journal";
+    case SQLITE_OPEN_SUBJOURNAL:     return "subjournal";
+    case SQLITE_OPEN_MASTER_JOURNAL: return "master_journal";
+    case SQLITE_OPEN_WAL:            return "wal";
+  }
+  return "other";
+}
+
+/*
+** Columns of the vfs_stat table.  The counter columns follow VFSSTAT_COL_TYPE
+** in VfsStat.aCount[] order.
+*/
+#define VFSSTAT_COL_VFS   0
+#define VFSSTAT_COL_PATH  1
+#define VFSSTAT_COL_TYPE  2
+#define VFSSTAT_NCOL      (3 + VFSSTAT_NCOUNTER)
+
+/*
+** A copy of one VfsStat, taken by xFilter so that the rows stay valid if
+** the file is closed while the query is running.
+*/
+typedef struct VfsStatRow VfsStatRow;
+struct VfsStatRow {
+  char *zVfs;
+  char *zPath;
+  int flags;
+  sqlite3_uint64 aCount[VFSSTAT_NCOUNTER];
+};
+
+typedef struct VfsStatCursor VfsStatCursor;
+struct VfsStatCursor {
+  sqlite3_vtab_cursor base;       /* Base class.  Must be first */
+  VfsStatRow *aRow;               /* Snapshot of open files */
+  int nRow;                       /* Number of entries in aRow[] */
+  int iRow;                       /* Current row, also the rowid */
+};
+
+static int vfsstatConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  sqlite3_vtab *pNew;
+  int rc;
+
+  rc = sqlite3_declare_vtab(db,
+      "CREATE TABLE x(vfs, path, type, reads, bytes_read, writes, bytes_written,"
+      " syncs, locks, lock_failures, shm_maps, mmap_hits, pread_fallbacks,"
+      " bytes_synced, writebacks)"
+  );
+  if( rc!=SQLITE_OK ) return rc;
+  pNew = (sqlite3_vtab*)sqlite3_malloc(sizeof(*pNew));
+  if( pNew==0 ) return SQLITE_NOMEM;
+  memset(pNew, 0, sizeof(*pNew));
+  *ppVtab = pNew;
+  return SQLITE_OK;
+}
+
+static int vfsstatDisconnect(sqlite3_vtab *pVtab){
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+static void vfsstatClearRows(VfsStatCursor *pCur){
+  int i;
+  for(i=0; i<pCur->nRow; i++){
+    sqlite3_free(pCur->aRow[i].zVfs);
+    sqlite3_free(pCur->aRow[i].zPath);
+  }
+  sqlite3_free(pCur->aRow);
+  pCur->aRow = 0;
+  pCur->nRow = 0;
+  pCur->iRow = 0;
+}
+
+static int vfsstatOpen(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor){
+  VfsStatCursor *pCur;
+  pCur = (VfsStatCursor*)sqlite3_malloc(sizeof(*pCur));
+  if( pCur==0 ) return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static int vfsstatClose(sqlite3_vtab_cursor *cur){
+  VfsStatCursor *pCur = (VfsStatCursor*)cur;
+  vfsstatClearRows(pCur);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int vfsstatFilter(
+  sqlite3_vtab_cursor *cur,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  VfsStatCursor *pCur = (VfsStatCursor*)cur;
+  VfsStat *p;
+  int nAlloc = 0;
+  int rc = SQLITE_OK;
+
+  vfsstatClearRows(pCur);
+  pthread_mutex_lock(&statMutex);
+  for(p=pStatList; p; p=p->pNext) nAlloc++;
+  if( nAlloc ){
+    pCur->aRow = (VfsStatRow*)sqlite3_malloc64(sizeof(VfsStatRow)*nAlloc);
+    if( pCur->aRow==0 ) rc = SQLITE_NOMEM;
+  }
+  for(p=pStatList; p && rc==SQLITE_OK; p=p->pNext){
+    VfsStatRow *pRow = &pCur->aRow[pCur->nRow++];
+    int i;
+    pRow->zVfs = sqlite3_mprintf("%s", p->zVfs ? p->zVfs : "");
+    pRow->zPath = p->zPath[0] ? sqlite3_mprintf("%s", p->zPath) : 0;
+    pRow->flags = p->flags;
+    for(i=0; i<VFSSTAT_NCOUNTER; i++){
+      pRow->aCount[i] = __atomic_load_n(&p->aCount[i], __ATOMIC_RELAXED);
+    }
+    if( pRow->zVfs==0 || (p->zPath[0] && pRow->zPath==0) ) rc = SQLITE_NOMEM;
+  }
+  pthread_mutex_unlock(&statMutex);
+  return rc;
+}
+
+static int vfsstatNext(sqlite3_vtab_cursor *cur){
+  VfsStatCursor *pCur = (VfsStatCursor*)cur;
+  pCur->iRow++;
+  return SQLITE_OK;
+}
+
+static int vfsstatEof(sqlite3_vtab_cursor *cur){
+  VfsStatCursor *pCur = (VfsStatCursor*)cur;
+  return pCur->iRow>=pCur->nRow;
+}
+
+static int vfsstatColumn(
+  sqlite3_vtab_cursor *cur,
+  sqlite3_context *ctx,
+  int i
+){
+  VfsStatCursor *pCur = (VfsStatCursor*)cur;
+  VfsStatRow *pRow = &pCur->aRow[pCur->iRow];
+  switch( i ){
+    case VFSSTAT_COL_VFS:
+      sqlite3_result_text(ctx, pRow->zVfs, -1, SQLITE_TRANSIENT);
+      break;
+    case VFSSTAT_COL_PATH:
+      if( pRow->zPath ) sqlite3_result_text(ctx, pRow->zPath, -1, SQLITE_TRANSIENT);
+      break;
+    case VFSSTAT_COL_TYPE:
+      sqlite3_result_text(ctx, vfsstatTypeName(pRow->flags), -1, SQLITE_STATIC);
+      break;
+    default:
+      sqlite3_result_int64(ctx, (sqlite3_int64)pRow->aCount[i-VFSSTAT_COL_TYPE-1]);
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int vfsstatRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid){
+  VfsStatCursor *pCur = (VfsStatCursor*)cur;
+  *pRowid = pCur->iRow;
+  return SQLITE_OK;
+}
+
+/*
+** There are no indexes; every query is a full scan of the open files.
+*/
+static int vfsstatBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo){
+  pIdxInfo->estimatedCost = 10.0;
+  pIdxInfo->estimatedRows = 10;
+  return SQLITE_OK;
+}
+
+static sqlite3_module vfsstatModule = {
+  0,                              /* iVersion */
+  0,                              /* xCreate - eponymous-only */
+  vfsstatConnect,                 /* xConnect */
+  vfsstatBestIndex,               /* xBestIndex */
+  vfsstatDisconnect,              /* xDisconnect */
+  0,                              /* xDestroy */
+  vfsstatOpen,                    /* xOpen */
+  vfsstatClose,                   /* xClose */
+  vfsstatFilter,                  /* xFilter */
+  vfsstatNext,                    /* xNext */
+  vfsstatEof,                     /* xEof */
+  vfsstatColumn,                  /* xColumn */
+  vfsstatRowid,                   /* xRowid */
+  0,                              /* xUpdate */
+  0,                              /* xBegin */
+  0,                              /* xSync */
+  0,                              /* xCommit */
+  0,                              /* xRollback */
+  0,                              /* xFindFunction */
+  0,                              /* xRename */
+  0,                              /* xSavepoint */
+  0,                              /* xRelease */
+  0,                              /* xRollbackTo */
+};
+
+int vfsstat_register(sqlite3 *db){
+  return sqlite3_create_module(db, "vfs_stat", &vfsstatModule, 0);
+}
+
+static int vfsstatAutoExtension(
+  sqlite3 *db,
+  char **pzErrMsg,
+  const sqlite3_api_routines *pApi
+){
+  return vfsstat_register(db);
+}
+
+int vfsstat_init(void){
+  return sqlite3_auto_extension((void(*)(void))vfsstatAutoExtension);
+}
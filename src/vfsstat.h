@@ -0,0 +1,76 @@
+/*
+** Per-file I/O counters shared by the VFSes in this directory, and the
+** "vfs_stat" eponymous virtual table that reports them:
+**
+**   SELECT path, type, reads, writes, syncs FROM vfs_stat;
+**
+** bytes_synced/syncs is the mean number of bytes written between syncs of
+** a file, which each sync had to make durable.
+**
+** A VFS calls vfsstat_open() when it opens a file, bumps the counters of
+** the returned object with vfsstatAdd() and calls vfsstat_close() when the
+** file is closed.  Counters are updated with relaxed atomic adds, so the
+** I/O path never takes a lock.  Each VfsStat is allocated on its own
+** cache lines, so files used by different threads never share a line.
+*/
+#ifndef VFSSTAT_H
+#define VFSSTAT_H
+
+#include "sqlite3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Indexes into VfsStat.aCount[].  The order matches the columns of the
+** vfs_stat table.
+*/
+#define VFSSTAT_READ           0  /* xRead calls */
+#define VFSSTAT_READ_BYTES     1  /* Bytes requested by xRead */
+#define VFSSTAT_WRITE          2  /* xWrite calls */
+#define VFSSTAT_WRITE_BYTES    3  /* Bytes written by xWrite */
+#define VFSSTAT_SYNC           4  /* xSync calls */
+#define VFSSTAT_LOCK           5  /* xLock and xShmLock calls that succeeded */
+#define VFSSTAT_LOCK_FAIL      6  /* xLock and xShmLock calls that failed */
+#define VFSSTAT_SHM_MAP        7  /* xShmMap calls */
+#define VFSSTAT_MMAP_HIT       8  /* Reads served from a memory mapping */
+#define VFSSTAT_PREAD_FALLBACK 9  /* Reads that missed an enabled mapping */
+#define VFSSTAT_SYNC_BYTES    10  /* Bytes written before each xSync, summed */
+#define VFSSTAT_WRITEBACK     11  /* Ranges whose writeback was started early */
+#define VFSSTAT_NCOUNTER      12
+
+#define VFSSTAT_CACHELINE 64
+
+typedef struct VfsStat VfsStat;
+struct VfsStat {
+  sqlite3_uint64 aCount[VFSSTAT_NCOUNTER];
+  char aPad[(VFSSTAT_NCOUNTER*8 + VFSSTAT_CACHELINE-1) / VFSSTAT_CACHELINE
+            * VFSSTAT_CACHELINE - VFSSTAT_NCOUNTER*8];
+  /* Fields below are not written on the I/O path */
+  VfsStat *pNext;                 /* Next open file */
+  VfsStat *pPrev;                 /* Previous open file */
+  const char *zVfs;               /* Name of the VFS that opened the file */
+  int flags;                      /* SQLITE_OPEN_* flags passed to xOpen */
+  char zPath[1];                  /* Name of the file, or "" (over-allocated) */
+};
+
+#define vfsstatAdd(p, iCounter, n) do{ \
+  if( p ) __atomic_fetch_add(&(p)->aCount[iCounter], (sqlite3_uint64)(n), __ATOMIC_RELAXED); \
+}while(0)
+
+VfsStat *vfsstat_open(const char *zVfs, const char *zPath, int flags);
+void vfsstat_close(VfsStat *p);
+
+/*
+** Make the vfs_stat table available to connection db, or to every
+** connection opened after vfsstat_init() is called.
+*/
+int vfsstat_register(sqlite3 *db);
+int vfsstat_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* VFSSTAT_H */